@@ -0,0 +1,940 @@
+// Microbenchmarks for cantcoap.
+// Build with "make bench" and run ./bench, results are printed to stdout.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <map>
+#include <vector>
+#include "cantcoap.h"
+#include "coapslab.h"
+#include "coaprouter.h"
+#include "coapstaticroutes.h"
+#include "coapobserve.h"
+#include "coapreliable.h"
+#include "coapdedup.h"
+#include "coapexchange.h"
+#include "coapmid.h"
+#include "benchlegacy.h"
+#include "uthash.h"
+#include "sysdep.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_UNIT "cycles"
+static inline uint64_t benchClock() {
+	return __rdtsc();
+}
+#else
+#define BENCH_UNIT "ns"
+static inline uint64_t benchClock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+#endif
+
+// stops the compiler optimising away results
+static volatile int gSink = 0;
+
+static void report(const char *name, uint64_t elapsed, long operations, const char *per) {
+	printf("%-48s %10.2f %s/%s\r\n",name,(double)elapsed/operations,BENCH_UNIT,per);
+}
+
+// builds a corpus of option-heavy PDUs with varied option numbers and lengths, so branch predictors
+// can't learn a single option layout, returns the number of PDUs built
+#define CORPUS_SIZE 512
+#define CORPUS_PDU_LEN 512
+static uint8_t gCorpus[CORPUS_SIZE][CORPUS_PDU_LEN];
+static int gCorpusLength[CORPUS_SIZE];
+
+static long buildCorpus() {
+	uint8_t value[400];
+	memset(value,'v',sizeof(value));
+	long totalOptions = 0;
+	srand(42);
+	for(int i=0; i<CORPUS_SIZE; i++) {
+		CoapPDU *pdu = new CoapPDU(gCorpus[i],CORPUS_PDU_LEN,0);
+		pdu->setType(CoapPDU::COAP_CONFIRMABLE);
+		pdu->setCode(CoapPDU::COAP_GET);
+		pdu->setToken((uint8_t*)"\1\2\3\4",4);
+		int numOptions = 8+rand()%8;
+		uint16_t optionNumber = 0;
+		for(int j=0; j<numOptions; j++) {
+			// mostly small deltas, some needing one or two extended bytes
+			int r = rand()%16;
+			optionNumber += r<10 ? rand()%13 : (r<15 ? 13+rand()%100 : 269+rand()%300);
+			r = rand()%16;
+			int len = r<10 ? rand()%13 : (r<15 ? 13+rand()%20 : 269+rand()%10);
+			if(pdu->getPDULength()+len+5>CORPUS_PDU_LEN-8) {
+				break;
+			}
+			pdu->addOption(optionNumber,len,value);
+		}
+		pdu->setPayload((uint8_t*)"payload",7);
+		gCorpusLength[i] = pdu->getPDULength();
+		totalOptions += pdu->getNumOptions();
+		delete pdu;
+	}
+	return totalOptions;
+}
+
+static void benchOptionDecoding() {
+	const long rounds = 4000;
+	long corpusOptions = buildCorpus();
+	long options = rounds*corpusOptions;
+	printf("Option decoding, %d option-heavy PDUs, %.1f options each\r\n",CORPUS_SIZE,(double)corpusOptions/CORPUS_SIZE);
+
+	// before and after the header lookup table, each without and then with an option index to fill in
+	LegacyCoapPDU *legacy[CORPUS_SIZE];
+	CoapPDU *pdus[CORPUS_SIZE];
+	for(int i=0; i<CORPUS_SIZE; i++) {
+		legacy[i] = new LegacyCoapPDU(gCorpus[i],gCorpusLength[i]);
+		pdus[i] = new CoapPDU(gCorpus[i],gCorpusLength[i]);
+		pdus[i]->setOptionIndexStorage(NULL,0);
+	}
+	uint64_t start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		for(int i=0; i<CORPUS_SIZE; i++) {
+			gSink += legacy[i]->validate();
+		}
+	}
+	report("   validate(), before",benchClock()-start,options,"option");
+
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		for(int i=0; i<CORPUS_SIZE; i++) {
+			gSink += pdus[i]->validate();
+		}
+	}
+	report("   validate(), table-driven",benchClock()-start,options,"option");
+
+	CoapPDU::CoapOptionIndexEntry index[32];
+	for(int i=0; i<CORPUS_SIZE; i++) {
+		legacy[i]->setOptionIndexStorage(index,32);
+		pdus[i]->setOptionIndexStorage(index,32);
+	}
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		for(int i=0; i<CORPUS_SIZE; i++) {
+			gSink += legacy[i]->validate();
+		}
+	}
+	report("   validate(), before, with option index",benchClock()-start,options,"option");
+
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		for(int i=0; i<CORPUS_SIZE; i++) {
+			gSink += pdus[i]->validate();
+		}
+	}
+	report("   validate(), table-driven, with option index",benchClock()-start,options,"option");
+
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		for(int i=0; i<CORPUS_SIZE; i++) {
+			for(const CoapPDU::CoapOption &o : pdus[i]->options()) {
+				gSink += o.optionValueLength;
+			}
+		}
+	}
+	report("   options() iteration",benchClock()-start,options,"option");
+
+	for(int i=0; i<CORPUS_SIZE; i++) {
+		delete legacy[i];
+		delete pdus[i];
+	}
+}
+
+// a recvmmsg sized batch of small requests, every other packet garbage
+static void benchValidateBatch() {
+	const long rounds = 200000;
+	static uint8_t packets[COAP_VALIDATE_BATCH_SIZE][64];
+	const uint8_t *pdus[COAP_VALIDATE_BATCH_SIZE];
+	int lengths[COAP_VALIDATE_BATCH_SIZE];
+	srand(7);
+	for(int i=0; i<COAP_VALIDATE_BATCH_SIZE; i++) {
+		if(i&1) {
+			for(int j=0; j<32; j++) {
+				packets[i][j] = rand();
+			}
+			lengths[i] = 32;
+		} else {
+			CoapPDU *pdu = new CoapPDU(packets[i],64,0);
+			pdu->setType(CoapPDU::COAP_CONFIRMABLE);
+			pdu->setCode(CoapPDU::COAP_GET);
+			pdu->setMessageID(i);
+			pdu->setToken((uint8_t*)"\1\2\3\4",4);
+			pdu->setURI((char*)"/sensors/temp",13);
+			lengths[i] = pdu->getPDULength();
+			delete pdu;
+		}
+		pdus[i] = packets[i];
+	}
+	printf("Validation, batches of %d packets, half malformed\r\n",COAP_VALIDATE_BATCH_SIZE);
+
+	uint64_t start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		for(int i=0; i<COAP_VALIDATE_BATCH_SIZE; i++) {
+			CoapPDU *pdu = new CoapPDU(packets[i],lengths[i]);
+			gSink += pdu->validate();
+			delete pdu;
+		}
+	}
+	report("   new CoapPDU() and validate() per packet",benchClock()-start,rounds*COAP_VALIDATE_BATCH_SIZE,"packet");
+
+	CoapPDU::ValidateBatchResult result;
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		gSink += CoapPDU::validateBatch(pdus,lengths,COAP_VALIDATE_BATCH_SIZE,&result);
+	}
+	report("   validateBatch()",benchClock()-start,rounds*COAP_VALIDATE_BATCH_SIZE,"packet");
+}
+
+// the header, token and five options of a typical response
+static void buildResponseOptions(CoapPDU *pdu) {
+	pdu->setType(CoapPDU::COAP_ACKNOWLEDGEMENT);
+	pdu->setCode(CoapPDU::COAP_CONTENT);
+	pdu->setMessageID(0x1234);
+	pdu->setToken((uint8_t*)"\1\2\3\4",4);
+	pdu->addOption(CoapPDU::COAP_OPTION_ETAG,4,(uint8_t*)"\5\6\7\10");
+	pdu->addOption(CoapPDU::COAP_OPTION_LOCATION_PATH,7,(uint8_t*)"sensors");
+	pdu->addOption(CoapPDU::COAP_OPTION_LOCATION_PATH,4,(uint8_t*)"temp");
+	pdu->setContentFormat(CoapPDU::COAP_CONTENT_FORMAT_APP_JSON);
+	pdu->addOption(CoapPDU::COAP_OPTION_MAX_AGE,1,(uint8_t*)"\74");
+}
+
+// builds a typical response: token, five options and a payload
+static void buildResponse(CoapPDU *pdu, const uint8_t *payload, int payloadLength) {
+	buildResponseOptions(pdu);
+	pdu->setPayload((uint8_t*)payload,payloadLength);
+}
+
+static void benchResponseBuilding() {
+	const long rounds = 200000;
+	uint8_t payload[64];
+	memset(payload,'p',sizeof(payload));
+	printf("Building a response with a token, five options and a %d byte payload\r\n",(int)sizeof(payload));
+
+	uint64_t start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		CoapPDU *pdu = new CoapPDU();
+		buildResponse(pdu,payload,sizeof(payload));
+		gSink += pdu->getPDULength();
+		delete pdu;
+	}
+	report("   managed memory",benchClock()-start,rounds,"response");
+
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		CoapPDU *pdu = new CoapPDU();
+		pdu->reserve(128);
+		buildResponse(pdu,payload,sizeof(payload));
+		gSink += pdu->getPDULength();
+		delete pdu;
+	}
+	report("   managed memory, reserve(128)",benchClock()-start,rounds,"response");
+
+	CoapSlabAllocator slab;
+	CoapAllocator::setDefault(&slab);
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		CoapPDU *pdu = new CoapPDU();
+		buildResponse(pdu,payload,sizeof(payload));
+		gSink += pdu->getPDULength();
+		delete pdu;
+	}
+	report("   managed memory, slab allocator",benchClock()-start,rounds,"response");
+	CoapAllocator::setDefault(NULL);
+
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		CoapInlinePDU<128> pdu;
+		buildResponse(&pdu,payload,sizeof(payload));
+		gSink += pdu.getPDULength();
+	}
+	report("   CoapInlinePDU<128> on the stack",benchClock()-start,rounds,"response");
+}
+
+// one 1500 byte buffer reused for every response, as in examples/plain/server.cpp
+static void benchBufferReuse() {
+	const long rounds = 200000;
+	static uint8_t buffer[1500];
+	uint8_t payload[64];
+	memset(payload,'p',sizeof(payload));
+	CoapPDU pdu(buffer,sizeof(buffer),0);
+	printf("Reusing a %d byte buffer for each response\r\n",(int)sizeof(buffer));
+
+	uint64_t start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		pdu.reset();
+		buildResponse(&pdu,payload,sizeof(payload));
+		gSink += pdu.getPDULength();
+	}
+	report("   reset()",benchClock()-start,rounds,"response");
+
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		pdu.resetHeader();
+		buildResponse(&pdu,payload,sizeof(payload));
+		gSink += pdu.getPDULength();
+	}
+	report("   resetHeader()",benchClock()-start,rounds,"response");
+}
+
+// the typical response stamped from a template instead of encoded option by option
+static void benchTemplate() {
+	const long rounds = 200000;
+	static uint8_t buffer[1500];
+	uint8_t payload[64];
+	memset(payload,'p',sizeof(payload));
+	CoapPDU pdu(buffer,sizeof(buffer),0);
+	printf("Building the same response from a template\r\n");
+
+	uint64_t start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		pdu.resetHeader();
+		buildResponse(&pdu,payload,sizeof(payload));
+		gSink += pdu.getPDULength();
+	}
+	report("   encoding options",benchClock()-start,rounds,"response");
+
+	CoapPDU prototype;
+	buildResponseOptions(&prototype);
+	CoapPDUTemplate responseTemplate;
+	responseTemplate.freeze(&prototype);
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		responseTemplate.stamp(&pdu,r,(uint8_t*)"\1\2\3\4",4,payload,sizeof(payload));
+		gSink += pdu.getPDULength();
+	}
+	report("   CoapPDUTemplate::stamp()",benchClock()-start,rounds,"response");
+}
+
+// answering a GET the way examples/plain/server.cpp did, and with CoapPDU::makeResponse()
+static void benchMakeResponse() {
+	const long rounds = 200000;
+	const char *payload = "This is a mundanely worded test payload.";
+	int payloadLength = strlen(payload);
+	CoapPDU request;
+	request.setType(CoapPDU::COAP_CONFIRMABLE);
+	request.setCode(CoapPDU::COAP_GET);
+	request.setMessageID(0x1234);
+	request.setToken((uint8_t*)"\1\2\3\4",4);
+	request.setURI((char*)"/test",5);
+	printf("Answering a GET with a %d byte payload\r\n",payloadLength);
+
+	uint64_t start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		CoapPDU *response = new CoapPDU();
+		response->setVersion(1);
+		response->setMessageID(request.getMessageID());
+		response->setToken(request.getTokenPointer(),request.getTokenLength());
+		response->setCode(CoapPDU::COAP_CONTENT);
+		response->setContentFormat(CoapPDU::COAP_CONTENT_FORMAT_TEXT_PLAIN);
+		response->setPayload((uint8_t*)payload,payloadLength);
+		response->setType(CoapPDU::COAP_ACKNOWLEDGEMENT);
+		gSink += response->getPDULength();
+		delete response;
+	}
+	report("   field by field",benchClock()-start,rounds,"response");
+
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		CoapPDU *response = new CoapPDU();
+		response->makeResponse(&request,CoapPDU::COAP_CONTENT,0,2+1+payloadLength);
+		response->setContentFormat(CoapPDU::COAP_CONTENT_FORMAT_TEXT_PLAIN);
+		response->setPayload((uint8_t*)payload,payloadLength);
+		gSink += response->getPDULength();
+		delete response;
+	}
+	report("   makeResponse()",benchClock()-start,rounds,"response");
+
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		CoapInlinePDU<128> response;
+		response.makeResponse(&request,CoapPDU::COAP_CONTENT,0,2+1+payloadLength);
+		response.setContentFormat(CoapPDU::COAP_CONTENT_FORMAT_TEXT_PLAIN);
+		response.setPayload((uint8_t*)payload,payloadLength);
+		gSink += response.getPDULength();
+	}
+	report("   makeResponse() into CoapInlinePDU<128>",benchClock()-start,rounds,"response");
+}
+
+// a dispatcher checking Observe, Block1, Block2, Accept and If-None-Match on each request
+static void benchOptionPresence() {
+	const long rounds = 200000;
+	const uint16_t wanted[5] = {
+		CoapPDU::COAP_OPTION_OBSERVE, CoapPDU::COAP_OPTION_BLOCK1, CoapPDU::COAP_OPTION_BLOCK2,
+		CoapPDU::COAP_OPTION_ACCEPT, CoapPDU::COAP_OPTION_IF_NONE_MATCH
+	};
+	static uint8_t buffer[128];
+	CoapPDU request(buffer,sizeof(buffer),0);
+	request.setType(CoapPDU::COAP_CONFIRMABLE);
+	request.setCode(CoapPDU::COAP_GET);
+	request.setToken((uint8_t*)"\1\2\3\4",4);
+	request.setURI((char*)"/sensors/temp?unit=c",20);
+	request.addOption(CoapPDU::COAP_OPTION_BLOCK2,1,(uint8_t*)"\x02");
+	int pduLength = request.getPDULength();
+	printf("Checking 5 options on a request with %d options\r\n",request.getNumOptions());
+
+	uint64_t start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		request.setPDULength(pduLength);
+		request.validate();
+		CoapPDU::CoapOption *options = request.getOptions();
+		for(int w=0; w<5; w++) {
+			for(int i=0; i<request.getNumOptions(); i++) {
+				if(options[i].optionNumber==wanted[w]) {
+					gSink++;
+					break;
+				}
+			}
+		}
+		free(options);
+	}
+	report("   validate(), getOptions() and scan",benchClock()-start,rounds,"request");
+
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		request.setPDULength(pduLength);
+		request.validate();
+		for(int w=0; w<5; w++) {
+			gSink += request.hasOption(wanted[w]);
+		}
+	}
+	report("   validate() and hasOption()",benchClock()-start,rounds,"request");
+}
+
+struct BenchURIEntry {
+	char uri[32];
+	int id;
+	UT_hash_handle hh;
+};
+
+static int benchRouteHandler(CoapPDU *request, CoapRouteMatch *match, void *arg) {
+	return 0;
+}
+
+// 2000 resources, looked up the way examples/plain/server.cpp did and with CoapRouter
+static void benchRouting() {
+	const long rounds = 100000;
+	const int numResources = 2000;
+	const int numRequests = 64;
+	BenchURIEntry *entries = (BenchURIEntry*)calloc(numResources,sizeof(BenchURIEntry));
+	BenchURIEntry *directory = NULL, *found = NULL;
+	CoapRouter router;
+	for(int i=0; i<numResources; i++) {
+		sprintf(entries[i].uri,"/gw/dev%d/sensor/%d",i/8,i%8);
+		entries[i].id = i;
+		BenchURIEntry *entry = &entries[i];
+		HASH_ADD_STR(directory,uri,entry);
+		router.addRoute(entries[i].uri,CoapPDU::COAP_GET,benchRouteHandler,&entries[i]);
+	}
+	CoapPDU *requests[numRequests];
+	for(int i=0; i<numRequests; i++) {
+		requests[i] = new CoapPDU();
+		requests[i]->setType(CoapPDU::COAP_CONFIRMABLE);
+		requests[i]->setCode(CoapPDU::COAP_GET);
+		requests[i]->setToken((uint8_t*)"\1\2\3\4",4);
+		requests[i]->setURI(entries[(i*631)%numResources].uri);
+		requests[i]->addOption(CoapPDU::COAP_OPTION_ACCEPT,1,(uint8_t*)"\x32");
+		// as a server would have done on receiving it
+		requests[i]->validate();
+	}
+	printf("Routing requests among %d resources\r\n",numResources);
+
+	char uriBuffer[64];
+	int uriLength = 0;
+	uint64_t start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		CoapPDU *request = requests[r%numRequests];
+		request->getURI(uriBuffer,sizeof(uriBuffer),&uriLength);
+		HASH_FIND_STR(directory,uriBuffer,found);
+		gSink += found->id;
+	}
+	report("   getURI() and uthash",benchClock()-start,rounds,"request");
+
+	CoapRouteMatch match;
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		CoapPDU *request = requests[r%numRequests];
+		router.route(request,&match);
+		gSink += ((BenchURIEntry*)match.context)->id;
+	}
+	report("   CoapRouter",benchClock()-start,rounds,"request");
+
+	HASH_CLEAR(hh,directory);
+	for(int i=0; i<numRequests; i++) {
+		delete requests[i];
+	}
+	free(entries);
+}
+
+#define BENCH_DEVICE_ROUTES(d) \
+	{"/gw/dev" #d "/sensor/0",d*8+0}, {"/gw/dev" #d "/sensor/1",d*8+1}, {"/gw/dev" #d "/sensor/2",d*8+2}, \
+	{"/gw/dev" #d "/sensor/3",d*8+3}, {"/gw/dev" #d "/sensor/4",d*8+4}, {"/gw/dev" #d "/sensor/5",d*8+5}, \
+	{"/gw/dev" #d "/sensor/6",d*8+6}, {"/gw/dev" #d "/sensor/7",d*8+7}
+
+// the handler is just the resource id here
+static constexpr CoapStaticRoute<int> gBenchStaticRoutes[] = {
+	BENCH_DEVICE_ROUTES(0), BENCH_DEVICE_ROUTES(1), BENCH_DEVICE_ROUTES(2), BENCH_DEVICE_ROUTES(3),
+	BENCH_DEVICE_ROUTES(4), BENCH_DEVICE_ROUTES(5), BENCH_DEVICE_ROUTES(6), BENCH_DEVICE_ROUTES(7)
+};
+static constexpr auto gBenchStaticRouteTable = coapMakeStaticRouteTable(gBenchStaticRoutes);
+
+// a resource set fixed at build time: a uthash table filled at startup against the compiler built table
+static void benchStaticRoutes() {
+	const long rounds = 200000;
+	const int numResources = sizeof(gBenchStaticRoutes)/sizeof(gBenchStaticRoutes[0]);
+	const int numRequests = 64;
+	struct StaticURIEntry {
+		const char *uri;
+		int id;
+		UT_hash_handle hh;
+	};
+	StaticURIEntry *entries = (StaticURIEntry*)calloc(numResources,sizeof(StaticURIEntry));
+	StaticURIEntry *directory = NULL, *found = NULL;
+	for(int i=0; i<numResources; i++) {
+		StaticURIEntry *entry = &entries[i];
+		entry->uri = gBenchStaticRoutes[i].uri;
+		entry->id = gBenchStaticRoutes[i].handler;
+		HASH_ADD_KEYPTR(hh,directory,entry->uri,strlen(entry->uri),entry);
+	}
+	CoapPDU *requests[numRequests];
+	for(int i=0; i<numRequests; i++) {
+		requests[i] = new CoapPDU();
+		requests[i]->setType(CoapPDU::COAP_CONFIRMABLE);
+		requests[i]->setCode(CoapPDU::COAP_GET);
+		requests[i]->setToken((uint8_t*)"\1\2\3\4",4);
+		requests[i]->setURI((char*)gBenchStaticRoutes[(i*37)%numResources].uri);
+		requests[i]->addOption(CoapPDU::COAP_OPTION_ACCEPT,1,(uint8_t*)"\x32");
+	}
+	printf("Routing requests among %d resources known at build time\r\n",numResources);
+
+	char uriBuffer[64];
+	int uriLength = 0;
+	uint64_t start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		CoapPDU *request = requests[r%numRequests];
+		request->getURI(uriBuffer,sizeof(uriBuffer),&uriLength);
+		HASH_FIND_STR(directory,uriBuffer,found);
+		gSink += found->id;
+	}
+	report("   getURI() and uthash",benchClock()-start,rounds,"request");
+
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		gSink += gBenchStaticRouteTable.find(requests[r%numRequests])->handler;
+	}
+	report("   CoapStaticRouteTable",benchClock()-start,rounds,"request");
+
+	HASH_CLEAR(hh,directory);
+	for(int i=0; i<numRequests; i++) {
+		delete requests[i];
+	}
+	free(entries);
+}
+
+// a 1024 byte block copied into the PDU or referenced from where it is
+static void benchLargePayload() {
+	const long rounds = 200000;
+	static uint8_t buffer[1500];
+	static uint8_t block[1024];
+	memset(block,'b',sizeof(block));
+	CoapPDU pdu(buffer,sizeof(buffer),0);
+	struct iovec iov[2];
+	int iovcnt;
+	printf("Preparing a response with a %d byte payload for sendmsg()\r\n",(int)sizeof(block));
+
+	uint64_t start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		pdu.resetHeader();
+		buildResponse(&pdu,block,sizeof(block));
+		pdu.getIOVec(iov,&iovcnt);
+		gSink += iov[0].iov_len;
+	}
+	report("   setPayload()",benchClock()-start,rounds,"response");
+
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		pdu.resetHeader();
+		buildResponseOptions(&pdu);
+		pdu.setPayloadReference(block,sizeof(block));
+		pdu.getIOVec(iov,&iovcnt);
+		gSink += iov[0].iov_len+iov[1].iov_len;
+	}
+	report("   setPayloadReference()",benchClock()-start,rounds,"response");
+}
+
+// copy of CoapPDU::setURI() before the one pass tokenizer: strchr() for each segment and an addOption() each
+static int legacySetURI(CoapPDU *pdu, char *uri, int urilen) {
+	if(urilen<=0||uri==NULL) {
+		return 1;
+	}
+	if(urilen==1) {
+		pdu->addOption(CoapPDU::COAP_OPTION_URI_PATH,1,(uint8_t*)uri);
+		return 0;
+	}
+	char *startP=uri,*endP=NULL;
+	int oLen = 0;
+	char splitChar = '/';
+	int queryStageTriggered = 0;
+	uint16_t optionType = CoapPDU::COAP_OPTION_URI_PATH;
+	while(1) {
+		if(*startP==0x00||*(startP+1)==0x00) {
+			break;
+		}
+		if(*startP==splitChar) {
+			startP++;
+		}
+		endP = strchr(startP,splitChar);
+		if(endP==NULL) {
+			endP = strchr(startP,'?');
+			if(endP==NULL) {
+				endP = uri+urilen;
+			} else {
+				queryStageTriggered = 1;
+			}
+		}
+		oLen = endP-startP;
+		if(pdu->addOption(optionType,oLen,(uint8_t*)startP)!=0) {
+			return 1;
+		}
+		startP = endP;
+		if(queryStageTriggered) {
+			splitChar = '&';
+			optionType = CoapPDU::COAP_OPTION_URI_QUERY;
+			startP++;
+			queryStageTriggered = false;
+		}
+	}
+	return 0;
+}
+
+// a client building the options of a request from a URI, into a reused buffer
+static void benchSetURI() {
+	const long rounds = 200000;
+	static uint8_t buffer[256];
+	CoapPDU pdu(buffer,sizeof(buffer),0);
+	char uri[] = "/building/3/floor/2/room/12/sensors/temperature?unit=c&fmt=json";
+	int uriLength = strlen(uri);
+	printf("Setting a %d byte URI with 8 segments and 2 query arguments\r\n",uriLength);
+
+	uint64_t start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		pdu.resetHeader();
+		legacySetURI(&pdu,uri,uriLength);
+		gSink += pdu.getPDULength();
+	}
+	report("   strchr() and addOption() per segment",benchClock()-start,rounds,"URI");
+
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		pdu.resetHeader();
+		pdu.setURI(uri,uriLength);
+		gSink += pdu.getPDULength();
+	}
+	report("   CoapPDU::setURI()",benchClock()-start,rounds,"URI");
+}
+
+// options added in descending number order, the worst case for CoapPDU::addOption()
+static void benchOutOfOrderOptions() {
+	const long rounds = 20000;
+	const int numOptions = 24;
+	uint8_t value[16];
+	memset(value,'v',sizeof(value));
+	printf("Adding %d options in reverse order\r\n",numOptions);
+
+	uint64_t start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		CoapPDU *pdu = new CoapPDU();
+		pdu->reserve(1024);
+		for(int i=numOptions; i>0; i--) {
+			pdu->addOption(i*20,sizeof(value),value);
+		}
+		gSink += pdu->getPDULength();
+		delete pdu;
+	}
+	report("   CoapPDU::addOption()",benchClock()-start,rounds,"PDU");
+
+	CoapPDUBuilder builder;
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		CoapPDU *pdu = new CoapPDU();
+		pdu->reserve(1024);
+		builder.reset();
+		for(int i=numOptions; i>0; i--) {
+			builder.addOption(i*20,sizeof(value),value);
+		}
+		builder.build(pdu);
+		gSink += pdu->getPDULength();
+		delete pdu;
+	}
+	report("   CoapPDUBuilder",benchClock()-start,rounds,"PDU");
+}
+
+static int benchNotifyBatch(CoapNotifyBatch *batch, void *arg) {
+	(void)arg;
+	for(int i=0; i<batch->count; i++) {
+		gSink += batch->msg[i].msg_iov[0].iov_len;
+	}
+	return 0;
+}
+
+// one change to a resource sent to every observer, each notification encoded in full or stamped from a shared part
+static void benchNotify() {
+	const int numObservers = 10000;
+	const long rounds = 50;
+	uint8_t payload[64];
+	memset(payload,'p',sizeof(payload));
+	uint8_t maxAge = 60;
+	printf("Notifying %d observers of a %d byte representation\r\n",numObservers,(int)sizeof(payload));
+
+	CoapObserveRegistry registry;
+	for(int i=0; i<numObservers; i++) {
+		struct sockaddr_in address;
+		memset(&address,0x00,sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_port = htons(10000+i%50000);
+		address.sin_addr.s_addr = htonl(0x0A000000+i);
+		uint8_t token[4] = {(uint8_t)(i>>24),(uint8_t)(i>>16),(uint8_t)(i>>8),(uint8_t)i};
+		registry.add(1,(struct sockaddr*)&address,sizeof(address),token,sizeof(token));
+	}
+	CoapPDU prototype;
+	prototype.setCode(CoapPDU::COAP_CONTENT);
+	prototype.setContentFormat(CoapPDU::COAP_CONTENT_FORMAT_APP_JSON);
+	prototype.addOption(CoapPDU::COAP_OPTION_MAX_AGE,1,&maxAge);
+
+	static uint8_t buffer[256];
+	CoapPDU pdu(buffer,sizeof(buffer),0);
+	struct iovec iov[2];
+	int iovcnt;
+	uint16_t messageID = 0;
+	uint8_t token[4] = {0,0,0,0};
+	uint64_t start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		for(int i=0; i<numObservers; i++) {
+			token[3] = i;
+			pdu.resetHeader();
+			pdu.setVersion(1);
+			pdu.setType(CoapPDU::COAP_NON_CONFIRMABLE);
+			pdu.setCode(CoapPDU::COAP_CONTENT);
+			pdu.setToken(token,sizeof(token));
+			pdu.setMessageID(messageID++);
+			registry.addObserveOption(1,&pdu);
+			pdu.setContentFormat(CoapPDU::COAP_CONTENT_FORMAT_APP_JSON);
+			pdu.addOption(CoapPDU::COAP_OPTION_MAX_AGE,1,&maxAge);
+			pdu.setPayload(payload,sizeof(payload));
+			pdu.getIOVec(iov,&iovcnt);
+			gSink += iov[0].iov_len;
+		}
+	}
+	report("   full PDU per observer",benchClock()-start,rounds*numObservers,"observer");
+
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		registry.notify(1,&prototype,payload,sizeof(payload),CoapPDU::COAP_NON_CONFIRMABLE,&messageID,benchNotifyBatch,NULL);
+	}
+	report("   CoapObserveRegistry::notify()",benchClock()-start,rounds*numObservers,"observer");
+}
+
+static int benchReliableSend(const uint8_t *pdu, int pduLength, const CoapEndpoint *endpoint, void *arg) {
+	(void)endpoint;
+	(void)arg;
+	gSink += pdu[pduLength-1];
+	return 0;
+}
+
+// confirmable messages sent and acknowledged while many others wait, and the retransmissions of all of them
+static void benchReliable() {
+	const int numPending = 100000;
+	const long rounds = 1000000;
+	printf("Confirmable messages with %d others pending\r\n",numPending);
+
+	CoapReliableLayer reliable(numPending+1,benchReliableSend,NULL,NULL);
+	struct sockaddr_in address;
+	memset(&address,0x00,sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(0x0A000001);
+	CoapPDU pdu;
+	pdu.setVersion(1);
+	pdu.setType(CoapPDU::COAP_CONFIRMABLE);
+	pdu.setCode(CoapPDU::COAP_CONTENT);
+	pdu.setToken((uint8_t*)"\x01\x02\x03\x04",4);
+	pdu.setPayload((uint8_t*)"21.5",4);
+	uint32_t now = 0;
+	for(int i=0; i<numPending; i++) {
+		address.sin_port = htons(10000+i/65536);
+		pdu.setMessageID(i);
+		reliable.send(&pdu,(struct sockaddr*)&address,sizeof(address),now+i%3000,NULL);
+	}
+
+	CoapPDU ack;
+	ack.setVersion(1);
+	ack.setType(CoapPDU::COAP_ACKNOWLEDGEMENT);
+	address.sin_port = htons(9999);
+	void *context;
+	uint64_t start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		pdu.setMessageID(r);
+		reliable.send(&pdu,(struct sockaddr*)&address,sizeof(address),now,NULL);
+		ack.setMessageID(r);
+		gSink += reliable.receive(&ack,(struct sockaddr*)&address,sizeof(address),&context);
+	}
+	report("   CoapReliableLayer send() and receive()",benchClock()-start,rounds,"message");
+
+	start = benchClock();
+	int handled = 0;
+	for(uint32_t t=1; t<=200000; t++) {
+		handled += reliable.advance(now+t);
+	}
+	report("   CoapReliableLayer::advance()",benchClock()-start,handled,"timer");
+}
+
+// a storm of messages from many peers, each checked for duplicates and its response kept, in a std::map that
+// keeps everything and in a CoapDedupCache of fixed size
+static void benchDedup() {
+	const int numPeers = 10000;
+	const long rounds = 1000000;
+	printf("Duplicate detection of %ld messages from %d peers\r\n",rounds,numPeers);
+
+	static uint8_t buffer[64];
+	CoapPDU request(buffer,sizeof(buffer),0);
+	request.setVersion(1);
+	request.setType(CoapPDU::COAP_CONFIRMABLE);
+	request.setCode(CoapPDU::COAP_GET);
+	CoapPDU response;
+	response.setVersion(1);
+	response.setType(CoapPDU::COAP_ACKNOWLEDGEMENT);
+	response.setCode(CoapPDU::COAP_CONTENT);
+	response.setPayload((uint8_t*)"21.5",4);
+	struct sockaddr_in address;
+	memset(&address,0x00,sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(5683);
+
+	std::map<std::pair<uint64_t,uint16_t>,std::vector<uint8_t> > seen;
+	uint64_t start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		// every fourth message is a retransmission
+		long message = r-(r%4==3);
+		uint64_t peer = 0x0A000000+message%numPeers;
+		std::pair<uint64_t,uint16_t> key(peer,(uint16_t)(message/numPeers));
+		std::map<std::pair<uint64_t,uint16_t>,std::vector<uint8_t> >::iterator it = seen.find(key);
+		if(it!=seen.end()) {
+			gSink += it->second.size();
+			continue;
+		}
+		seen[key] = std::vector<uint8_t>(response.getPDUPointer(),response.getPDUPointer()+response.getPDULength());
+	}
+	report("   std::map",benchClock()-start,rounds,"message");
+
+	CoapDedupCache dedup(4*1024*1024,64);
+	const uint8_t *cached;
+	int cachedLength;
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		long message = r-(r%4==3);
+		address.sin_addr.s_addr = htonl(0x0A000000+message%numPeers);
+		request.setMessageID(message/numPeers);
+		if(dedup.check(&request,(struct sockaddr*)&address,sizeof(address),r/10,&cached,&cachedLength)) {
+			gSink += cachedLength;
+			continue;
+		}
+		dedup.store(message/numPeers,(struct sockaddr*)&address,sizeof(address),&response);
+	}
+	report("   CoapDedupCache",benchClock()-start,rounds,"message");
+}
+
+// requests started and answered while a million others are outstanding
+static void benchExchange() {
+	const int numOutstanding = 1000000;
+	const long rounds = 1000000;
+	printf("Client exchanges with %d others outstanding\r\n",numOutstanding);
+
+	CoapExchangeTable exchanges(numOutstanding+COAP_EXCHANGE_SHARDS*64,60000);
+	struct sockaddr_in address;
+	memset(&address,0x00,sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(5683);
+	address.sin_addr.s_addr = htonl(0x0A000001);
+	static uint8_t buffer[64];
+	CoapPDU request(buffer,sizeof(buffer),0);
+	request.setVersion(1);
+	request.setType(CoapPDU::COAP_CONFIRMABLE);
+	request.setCode(CoapPDU::COAP_GET);
+	for(int i=0; i<numOutstanding; i++) {
+		exchanges.begin(&request,(struct sockaddr*)&address,sizeof(address),0,NULL,NULL);
+	}
+
+	CoapPDU response;
+	response.setVersion(1);
+	response.setType(CoapPDU::COAP_ACKNOWLEDGEMENT);
+	response.setCode(CoapPDU::COAP_CONTENT);
+	uint64_t start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		exchanges.begin(&request,(struct sockaddr*)&address,sizeof(address),0,NULL,NULL);
+		response.setToken(request.getTokenPointer(),request.getTokenLength());
+		gSink += exchanges.complete(&response,(struct sockaddr*)&address,sizeof(address));
+	}
+	report("   CoapExchangeTable begin() and complete()",benchClock()-start,rounds,"request");
+}
+
+// message IDs for messages spread over millions of peers, from a std::map of plain counters that never checks
+// for reuse, and from a CoapMessageIDAllocator
+static void benchMessageIDs() {
+	const int numPeers = 2000000;
+	const long rounds = 10000000;
+	printf("Message IDs for %d peers\r\n",numPeers);
+
+	struct sockaddr_in address;
+	memset(&address,0x00,sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(5683);
+	uint32_t peer = 0;
+
+	std::map<uint32_t,uint16_t> counters;
+	uint64_t start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		peer = (peer+7919)%numPeers;
+		gSink += counters[0x0A000000+peer]++;
+	}
+	report("   std::map counter per peer",benchClock()-start,rounds,"message ID");
+
+	CoapMessageIDAllocator messageIDs(247000);
+	uint16_t messageID;
+	start = benchClock();
+	for(long r=0; r<rounds; r++) {
+		peer = (peer+7919)%numPeers;
+		address.sin_addr.s_addr = htonl(0x0A000000+peer);
+		messageIDs.next((struct sockaddr*)&address,sizeof(address),r/1000,&messageID);
+		gSink += messageID;
+	}
+	report("   CoapMessageIDAllocator",benchClock()-start,rounds,"message ID");
+}
+
+int main(int argc, char **argv) {
+	(void)argc;
+	(void)argv;
+	benchOptionDecoding();
+	benchValidateBatch();
+	benchResponseBuilding();
+	benchBufferReuse();
+	benchLargePayload();
+	benchTemplate();
+	benchMakeResponse();
+	benchOptionPresence();
+	benchRouting();
+	benchStaticRoutes();
+	benchOutOfOrderOptions();
+	benchSetURI();
+	benchNotify();
+	benchReliable();
+	benchDedup();
+	benchExchange();
+	benchMessageIDs();
+	return 0;
+}
@@ -0,0 +1,278 @@
+// CoapPDU::validate() and the helpers it called, from cantcoap.cpp before the option header lookup table, see
+// benchlegacy.h. Left as they were apart from the class name and qualifying CoapPDU::COAP_EMPTY.
+#include "benchlegacy.h"
+#include "sysdep.h"
+#include "dbg.h"
+
+LegacyCoapPDU::LegacyCoapPDU(uint8_t *pdu, int pduLength) {
+	_pdu = pdu;
+	_pduLength = pduLength;
+	_payloadPointer = NULL;
+	_payloadLength = 0;
+	_numOptions = 0;
+	_optionIndex = NULL;
+	_optionIndexCapacity = 0;
+	_optionIndexLength = -1;
+}
+
+void LegacyCoapPDU::setOptionIndexStorage(CoapPDU::CoapOptionIndexEntry *storage, int capacity) {
+	_optionIndex = storage;
+	_optionIndexCapacity = capacity;
+	_optionIndexLength = -1;
+}
+
+int LegacyCoapPDU::validate() {
+	if(_pduLength<4) {
+		DBG("PDU has to be a minimum of 4 bytes. This: %d bytes",_pduLength);
+		return 0;
+	}
+
+	// check header
+	//   0                   1                   2                   3
+   //  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+   // +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+   // |Ver| T |  TKL  |      Code     |          Message ID           |
+   // +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+   // |   Token (if any, TKL bytes) ...
+   // +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+   // |   Options (if any) ...
+   // +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+   // |1 1 1 1 1 1 1 1|    Payload (if any) ...
+   // +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+
+	// version must be 1
+	int version = getVersion();
+	if (version != 1) {
+		DBG("Invalid version: %d", version);
+		return 0;
+	}
+	DBG("Version: %d", version);
+	DBG("Type: %d", getType());
+
+	// token length must be between 0 and 8
+	int tokenLength = getTokenLength();
+	if(tokenLength<0||tokenLength>8) {
+		DBG("Invalid token length: %d",tokenLength);
+		return 0;
+	}
+	DBG("Token length: %d",tokenLength);
+	// check total length
+	if((COAP_HDR_SIZE+tokenLength)>_pduLength) {
+		DBG("Token length would make pdu longer than actual length.");
+		return 0;
+	}
+
+	// check that code is valid
+	CoapPDU::Code code = getCode();
+	uint8_t cclass=((unsigned)code)>>5;
+	
+	if(code<CoapPDU::COAP_EMPTY || cclass>5) {
+		DBG("Invalid CoAP code: %d",code);
+		return 0;
+	}
+	DBG("CoAP code: %d",code);
+
+	// token can be anything so nothing to check
+
+	// check that options all make sense
+	uint16_t optionDelta =0, optionNumber = 0, optionValueLength = 0;
+	int totalLength = 0;
+
+	// first option occurs after token
+	int optionPos = COAP_HDR_SIZE + getTokenLength();
+
+	// index is rebuilt below
+	_optionIndexLength = -1;
+	int indexing = _optionIndexCapacity>0;
+
+	// may be 0 options
+	if(optionPos==_pduLength) {
+		DBG("No options. No payload.");
+		_numOptions = 0;
+		_payloadLength = 0;
+		if(indexing) {
+			_optionIndexLength = 0;
+		}
+		return 1;
+	}
+
+	int bytesRemaining = _pduLength-optionPos;
+	int numOptions = 0;
+	uint8_t upperNibble = 0x00, lowerNibble = 0x00;
+
+	// walk over options and record information
+	while(1) {
+		// check for payload marker
+		if(bytesRemaining>0) {
+			uint8_t optionHeader = _pdu[optionPos];
+			if(optionHeader==0xFF) {
+				// payload
+				if(bytesRemaining>1) {
+					_payloadPointer = &_pdu[optionPos+1];
+					_payloadLength = (bytesRemaining-1);
+					_numOptions = numOptions;
+					if(indexing) {
+						_optionIndexLength = numOptions;
+					}
+					DBG("Payload found, length: %d",_payloadLength);
+					return 1;
+				}
+				// payload marker but no payload
+				_payloadPointer = NULL;
+				_payloadLength = 0;
+				DBG("Payload marker but no payload.");
+				return 0;
+			}
+
+			// check that option delta and option length are valid values
+			upperNibble = (optionHeader & 0xF0) >> 4;
+			lowerNibble = (optionHeader & 0x0F);
+			if(upperNibble==0x0F||lowerNibble==0x0F) {
+				DBG("Expected option header or payload marker, got: 0x%x%x",upperNibble,lowerNibble);
+				return 0;
+			}
+			DBG("Option header byte appears sane: 0x%x%x",upperNibble,lowerNibble);
+		} else {
+			DBG("No more data. No payload.");
+			_payloadPointer = NULL;
+			_payloadLength = 0;
+			_numOptions = numOptions;
+			if(indexing) {
+				_optionIndexLength = numOptions;
+			}
+			return 1;
+		}
+
+		// skip over option header byte
+		bytesRemaining--;
+
+		// check that there is enough space for the extended delta and length bytes (if any)
+		int headerBytesNeeded = computeExtraBytes(upperNibble);
+		DBG("%d extra bytes needed for extended delta",headerBytesNeeded);
+		if(headerBytesNeeded>bytesRemaining) {
+			DBG("Not enough space for extended option delta, needed %d, have %d.",headerBytesNeeded,bytesRemaining);
+			return 0;
+		}
+		headerBytesNeeded += computeExtraBytes(lowerNibble);
+		if(headerBytesNeeded>bytesRemaining) {
+			DBG("Not enough space for extended option length, needed %d, have %d.",
+				(headerBytesNeeded-computeExtraBytes(upperNibble)),bytesRemaining);
+			return 0;
+		}
+		DBG("Enough space for extended delta and length: %d, continuing.",headerBytesNeeded);
+
+		// extract option details
+		optionDelta = getOptionDelta(&_pdu[optionPos]);
+		optionNumber += optionDelta;
+		optionValueLength = getOptionValueLength(&_pdu[optionPos]);
+		DBG("Got option: %d with length %d",optionNumber,optionValueLength);
+		// compute total length
+		totalLength = 1; // mandatory header
+		totalLength += computeExtraBytes(optionDelta);
+		totalLength += computeExtraBytes(optionValueLength);
+		totalLength += optionValueLength;
+		// check there is enough space
+		if(optionPos+totalLength>_pduLength) {
+			DBG("Not enough space for option payload, needed %d, have %d.",(totalLength-headerBytesNeeded-1),_pduLength-optionPos);
+			return 0;
+		}
+		DBG("Enough space for option payload: %d %d",optionValueLength,(totalLength-headerBytesNeeded-1));
+
+		// record option in index, giving up if it doesn't fit or offsets overflow
+		if(indexing) {
+			if(numOptions<_optionIndexCapacity && optionPos+totalLength<=0xFFFF) {
+				_optionIndex[numOptions].optionNumber = optionNumber;
+				_optionIndex[numOptions].valueOffset = optionPos+totalLength-optionValueLength;
+				_optionIndex[numOptions].valueLength = optionValueLength;
+			} else {
+				DBG("Option index too small, not indexing this PDU");
+				indexing = 0;
+			}
+		}
+
+		// recompute bytesRemaining
+		bytesRemaining -= totalLength;
+		bytesRemaining++; // correct for previous --
+
+		// move to next option
+		optionPos += totalLength;
+
+		// inc number of options XXX
+		numOptions++;
+	}
+
+	return 1;
+}
+
+uint8_t LegacyCoapPDU::getVersion() {
+	return (_pdu[0]&0xC0)>>6;
+}
+
+CoapPDU::Type LegacyCoapPDU::getType() {
+	return (CoapPDU::Type)(_pdu[0]&0x30);
+}
+
+int LegacyCoapPDU::getTokenLength() {
+	return _pdu[0] & 0x0F;
+}
+
+CoapPDU::Code LegacyCoapPDU::getCode() {
+	return (CoapPDU::Code)_pdu[1];
+}
+
+int LegacyCoapPDU::computeExtraBytes(uint16_t n) {
+	if(n<13) {
+		return 0;
+	}
+
+	if(n<269) {
+		return 1;
+	}
+
+	return 2;
+}
+
+uint16_t LegacyCoapPDU::getOptionDelta(uint8_t *option) {
+	uint16_t delta = (option[0] & 0xF0) >> 4;
+	if(delta<13) {
+		return delta;
+	} else if(delta==13) {
+		// single byte option delta
+		return (option[1]+13);
+	} else if(delta==14) {
+		uint8_t *from = &option[1];
+		uint16_t value = endian_load16(uint16_t, from);
+		return value+269;
+	} else {
+		// should only ever occur in payload marker
+		return delta;
+	}
+}
+
+uint16_t LegacyCoapPDU::getOptionValueLength(uint8_t *option) {
+	uint16_t delta = (option[0] & 0xF0) >> 4;
+	uint16_t length = (option[0] & 0x0F);
+	// no extra bytes
+	if(length<13) {
+		return length;
+	}
+
+	// extra bytes skip header
+	int offset = 1;
+	// skip extra option delta bytes
+	if(delta==13) {
+		offset++;
+	} else if(delta==14) {
+		offset+=2;
+	}
+
+	// process length
+	if(length==13) {
+		return (option[offset]+13);
+	} else {
+		uint8_t *from = &option[offset];
+		uint16_t value = endian_load16(uint16_t, from);
+		return value+269;
+	}
+
+}
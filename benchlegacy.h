@@ -0,0 +1,34 @@
+#pragma once
+#include "cantcoap.h"
+
+/// The option decoding of CoapPDU::validate() as it was before the option header lookup table, for bench.cpp.
+/**
+ * The members are copied unchanged from cantcoap.cpp at that point, and live in their own translation unit as
+ * they did in cantcoap.cpp, so the compiler treats them as it treated the originals. Only the parts of CoapPDU they
+ * touch are kept.
+ */
+class LegacyCoapPDU {
+	public:
+		LegacyCoapPDU(uint8_t *pdu, int pduLength);
+		void setOptionIndexStorage(CoapPDU::CoapOptionIndexEntry *storage, int capacity);
+		int validate();
+
+		uint8_t getVersion();
+		CoapPDU::Type getType();
+		int getTokenLength();
+		CoapPDU::Code getCode();
+
+	private:
+		uint8_t *_pdu;
+		int _pduLength;
+		uint8_t *_payloadPointer;
+		int _payloadLength;
+		int _numOptions;
+		CoapPDU::CoapOptionIndexEntry *_optionIndex;
+		int _optionIndexCapacity;
+		int _optionIndexLength;
+
+		static int computeExtraBytes(uint16_t n);
+		static uint16_t getOptionDelta(uint8_t *option);
+		static uint16_t getOptionValueLength(uint8_t *option);
+};
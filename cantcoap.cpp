@@ -37,10 +37,100 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/uio.h>
 #include "cantcoap.h"
 #include "arpa/inet.h"
 #include "sysdep.h"
 
+// Option header byte lookup table, indexed by the first byte of an option:
+//    bits 0-1: number of extended option delta bytes
+//    bits 2-3: number of extended option length bytes
+//    bit 7:    a nibble holds the reserved value 15 (so this is not a valid option header)
+#define COAP_OPTION_NIBBLE_EXTRA_BYTES(n) ((n)==13 ? 1 : ((n)==14 ? 2 : 0))
+#define COAP_OPTION_HEADER_INVALID 0x80
+
+static constexpr uint8_t optionHeaderInfo(unsigned b) {
+	return ((b>>4)==15||(b&0x0F)==15) ? COAP_OPTION_HEADER_INVALID :
+		(COAP_OPTION_NIBBLE_EXTRA_BYTES(b>>4) | (COAP_OPTION_NIBBLE_EXTRA_BYTES(b&0x0F)<<2));
+}
+
+#define COAP_OHI4(n)   optionHeaderInfo(n), optionHeaderInfo((n)+1), optionHeaderInfo((n)+2), optionHeaderInfo((n)+3)
+#define COAP_OHI16(n)  COAP_OHI4(n), COAP_OHI4((n)+4), COAP_OHI4((n)+8), COAP_OHI4((n)+12)
+#define COAP_OHI64(n)  COAP_OHI16(n), COAP_OHI16((n)+16), COAP_OHI16((n)+32), COAP_OHI16((n)+48)
+
+static constexpr uint8_t gOptionHeaderTable[256] = {
+	COAP_OHI64(0), COAP_OHI64(64), COAP_OHI64(128), COAP_OHI64(192)
+};
+
+static_assert(gOptionHeaderTable[0x00]==0x00, "option header table");
+static_assert(gOptionHeaderTable[0xD1]==0x01, "option header table");
+static_assert(gOptionHeaderTable[0x1E]==0x08, "option header table");
+static_assert(gOptionHeaderTable[0xED]==0x06, "option header table");
+static_assert(gOptionHeaderTable[0xF0]==COAP_OPTION_HEADER_INVALID, "option header table");
+static_assert(gOptionHeaderTable[0x0F]==COAP_OPTION_HEADER_INVALID, "option header table");
+
+// classes of the characters CoapPDU::setURI() looks for
+#define COAP_URI_PATH_SEPARATOR 0x01
+#define COAP_URI_QUERY 0x02
+#define COAP_URI_QUERY_SEPARATOR 0x04
+#define COAP_URI_FRAGMENT 0x08
+#define COAP_URI_PORT 0x10
+#define COAP_URI_ESCAPE 0x20
+// characters that end a host, a path segment and a query argument
+#define COAP_URI_HOST_END (COAP_URI_PORT|COAP_URI_PATH_SEPARATOR|COAP_URI_QUERY|COAP_URI_FRAGMENT)
+#define COAP_URI_PATH_END (COAP_URI_PATH_SEPARATOR|COAP_URI_QUERY|COAP_URI_FRAGMENT)
+#define COAP_URI_QUERY_END (COAP_URI_QUERY_SEPARATOR|COAP_URI_FRAGMENT)
+
+static constexpr uint8_t uriCharClass(unsigned c) {
+	return c=='/' ? COAP_URI_PATH_SEPARATOR :
+		c=='?' ? COAP_URI_QUERY :
+		c=='&' ? COAP_URI_QUERY_SEPARATOR :
+		c=='#' ? COAP_URI_FRAGMENT :
+		c==':' ? COAP_URI_PORT :
+		c=='%' ? COAP_URI_ESCAPE : 0;
+}
+
+#define URI_CLASS4(n) uriCharClass(n),uriCharClass(n+1),uriCharClass(n+2),uriCharClass(n+3)
+#define URI_CLASS16(n) URI_CLASS4(n),URI_CLASS4(n+4),URI_CLASS4(n+8),URI_CLASS4(n+12)
+#define URI_CLASS64(n) URI_CLASS16(n),URI_CLASS16(n+16),URI_CLASS16(n+32),URI_CLASS16(n+48)
+static constexpr uint8_t gURICharClass[256] = {
+	URI_CLASS64(0),URI_CLASS64(64),URI_CLASS64(128),URI_CLASS64(192)
+};
+static_assert(gURICharClass['?']==COAP_URI_QUERY&&gURICharClass['%']==COAP_URI_ESCAPE&&gURICharClass['a']==0,
+	"URI character classes");
+
+// length of the "coap://" or "coaps://" starting uri, or 0 if there isn't one, and the default port for it
+static inline int uriSchemeLength(const char *uri, int urilen, int *defaultPort) {
+	*defaultPort = 5683;
+	if((uri[0]|0x20)!='c') {
+		// no scheme, most URIs
+		return 0;
+	}
+	if(urilen>=7&&strncasecmp(uri,"coap://",7)==0) {
+		return 7;
+	}
+	if(urilen>=8&&strncasecmp(uri,"coaps://",8)==0) {
+		*defaultPort = 5684;
+		return 8;
+	}
+	return 0;
+}
+
+// value of a hex digit, or -1
+static inline int hexDigit(char c) {
+	if(c>='0'&&c<='9') {
+		return c-'0';
+	}
+	if(c>='a'&&c<='f') {
+		return c-'a'+10;
+	}
+	if(c>='A'&&c<='F') {
+		return c-'A'+10;
+	}
+	return -1;
+}
+
 /// Memory-managed constructor. Buffer for PDU is dynamically sized and allocated by the object.
 /**
  * When using this constructor, the CoapPDU class will allocate space for the PDU.
@@ -53,6 +143,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  *
  * \note It would have been nice to use something like UDP_CORK or MSG_MORE, to allow separate buffers
  * for token, options, and payload but these FLAGS aren't implemented for UDP in LwIP so stuck with one buffer for now.
+ * Where sendmsg() is available a payload can be kept out of the buffer, see CoapPDU::setPayloadReference().
  *
  * CoAP version defaults to 1.
  *
@@ -60,21 +151,42 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  * CoapPDU:CoapPDU()~
  *
  */
-CoapPDU::CoapPDU() {
+CoapPDU::CoapPDU() : CoapPDU(CoapAllocator::getDefault()) {
+	// delegated to CoapPDU::CoapPDU(CoapAllocator *allocator)
+}
+
+/// Construct a memory-managed PDU whose buffer comes from \b allocator.
+/**
+ * Behaves exactly like CoapPDU::CoapPDU() except that memory is allocated, grown and freed through
+ * \b allocator rather than the calling thread's default. The allocator must outlive the PDU.
+ *
+ * \param allocator The allocator to use for the PDU buffer.
+ *
+ * \sa CoapPDU::CoapPDU(), CoapAllocator
+ */
+CoapPDU::CoapPDU(CoapAllocator *allocator) {
 	// pdu
-	_pdu = (uint8_t*)calloc(4,sizeof(uint8_t));
+	_allocator = allocator;
 	_pduLength = 4;
-	_bufferLength = _pduLength;
+	_pdu = _allocator->allocate(_pduLength,&_bufferLength);
+	_pdu[0] = 0x00; _pdu[1] = 0x00; _pdu[2] = 0x00; _pdu[3] = 0x00;
 
 	//options
 	_numOptions = 0;
 	_maxAddedOptionNumber = 0;
+	_optionBitmap = 0;
+	_optionBitmapValid = 1;
+	initOptionIndex();
 
 	// payload
 	_payloadPointer = NULL;
 	_payloadLength = 0;
+	_payloadReference = NULL;
+	_payloadReferenceLength = 0;
 
 	_constructedFromBuffer = 0;
+	_bufferInObject = 0;
+	_deleter = NULL;
 
 	setVersion(1);
 }
@@ -138,28 +250,34 @@ CoapPDU::CoapPDU(uint8_t *buffer, int bufferLength, int pduLength) {
 		DBG("PDU cannot have a length less than 4");
 	}
 
-	// pdu
-	_pdu = buffer;
-	_bufferLength = bufferLength;
-	if(pduLength==0) {
-		// this is actually a fresh pdu, header always exists
-		_pduLength = 4;
-		// make sure header is zeroed
-		_pdu[0] = 0x00; _pdu[1] = 0x00; _pdu[2] = 0x00; _pdu[3] = 0x00;
-		setVersion(1);
-	} else {
-		_pduLength = pduLength;
-	}
-
 	_constructedFromBuffer = 1;
+	_bufferInObject = 0;
+	_deleter = NULL;
+	_allocator = CoapAllocator::getDefault();
+	initBuffer(buffer,bufferLength,pduLength);
+}
 
-	// options
-	_numOptions = 0;
-	_maxAddedOptionNumber = 0;
+/// Move constructor, takes over the buffer (and ownership of it, if any) of \b other.
+/**
+ * No PDU bytes are copied, so a CoapPDU can be passed between threads or stored by value in containers cheaply.
+ * \b other is left without a buffer, it can be destroyed, assigned to, or given a new buffer with CoapPDU::adopt().
+ *
+ * \param other The PDU to move from.
+ */
+CoapPDU::CoapPDU(CoapPDU &&other) noexcept {
+	moveFrom(other);
+}
 
-	// payload
-	_payloadPointer = NULL;
-	_payloadLength = 0;
+/// Move assignment, frees any buffer owned by this PDU then takes over the buffer of \b other.
+/**
+ * \sa CoapPDU::CoapPDU(CoapPDU &&other)
+ */
+CoapPDU& CoapPDU::operator=(CoapPDU &&other) noexcept {
+	if(this!=&other) {
+		freeBuffer();
+		moveFrom(other);
+	}
+	return *this;
 }
 
 /// Reset CoapPDU container so it can be reused to build a new PDU.
@@ -186,18 +304,95 @@ CoapPDU::CoapPDU(uint8_t *buffer, int bufferLength, int pduLength) {
 int CoapPDU::reset() {
 	// pdu
 	memset(_pdu,0x00,_bufferLength);
+	return resetHeader();
+}
+
+/// Reset CoapPDU container without clearing the whole buffer.
+/**
+ * Behaves like CoapPDU::reset() except that only the 4 byte header is zeroed, everything after it is left as it
+ * was. Nothing in the PDU depends on the rest of the buffer being zero, so this is the cheaper way to reuse a
+ * large buffer for building a new PDU.
+ *
+ * To receive into a reused buffer there is no need to reset at all, CoapPDU::setPDULength() followed by
+ * CoapPDU::validate() reinitialises everything.
+ *
+ * \return 0 on success, 1 on failure.
+ */
+int CoapPDU::resetHeader() {
+	if(_pdu==NULL||_bufferLength<COAP_HDR_SIZE) {
+		DBG("No buffer to reset");
+		return 1;
+	}
 	// packet always has at least a header
+	_pdu[0] = 0x00; _pdu[1] = 0x00; _pdu[2] = 0x00; _pdu[3] = 0x00;
 	_pduLength = 4;
 
 	// options
 	_numOptions = 0;
 	_maxAddedOptionNumber = 0;
+	_optionIndexLength = -1;
+	_optionBitmap = 0;
+	_optionBitmapValid = 1;
 	// payload
 	_payloadPointer = NULL;
 	_payloadLength = 0;
+	_payloadReference = NULL;
+	_payloadReferenceLength = 0;
 	return 0;
 }
 
+/// Turns this PDU into a response to \b request, ready for options and a payload to be added.
+/**
+ * The response type follows from the request type: a confirmable request gets a piggybacked acknowledgement
+ * carrying the request's message ID, a non-confirmable request gets a non-confirmable response with \b messageID.
+ * The token is copied from the request together with the header.
+ *
+ * This replaces the usual sequence of CoapPDU::reset(), CoapPDU::setVersion(), CoapPDU::setType(),
+ * CoapPDU::setCode(), CoapPDU::setMessageID() and CoapPDU::setToken(), and reserves room up front so that
+ * adding the options and payload doesn't allocate again.
+ *
+ * \param request The validated request being answered, which must not be this PDU.
+ * \param code The response code.
+ * \param messageID Message ID for a non-confirmable response, unused for a piggybacked acknowledgement.
+ * \param reserveBytes Number of bytes to reserve after the token for options and payload.
+ * \return 0 on success, 1 if the request is not a CON or NON request or there is not enough space.
+ *
+ * \sa CoapPDU::makeSeparateResponse()
+ */
+int CoapPDU::makeResponse(CoapPDU *request, CoapPDU::Code code, uint16_t messageID, int reserveBytes) {
+	switch(request->getType()) {
+		case COAP_CONFIRMABLE:
+			return initResponse(request,COAP_ACKNOWLEDGEMENT,code,request->getMessageID(),reserveBytes);
+		case COAP_NON_CONFIRMABLE:
+			return initResponse(request,COAP_NON_CONFIRMABLE,code,messageID,reserveBytes);
+		default:
+			DBG("Cannot respond to a message of type %d",request->getType());
+			return 1;
+	}
+}
+
+/// Turns this PDU into a separate response to \b request, sent after an empty acknowledgement.
+/**
+ * Behaves like CoapPDU::makeResponse() except that the response is never piggybacked: a confirmable request gets
+ * a confirmable response and a non-confirmable request a non-confirmable one, both with \b messageID.
+ *
+ * \param request The validated request being answered, which must not be this PDU.
+ * \param code The response code.
+ * \param messageID Message ID of the response.
+ * \param reserveBytes Number of bytes to reserve after the token for options and payload.
+ * \return 0 on success, 1 if the request is not a CON or NON request or there is not enough space.
+ */
+int CoapPDU::makeSeparateResponse(CoapPDU *request, CoapPDU::Code code, uint16_t messageID, int reserveBytes) {
+	switch(request->getType()) {
+		case COAP_CONFIRMABLE:
+		case COAP_NON_CONFIRMABLE:
+			return initResponse(request,request->getType(),code,messageID,reserveBytes);
+		default:
+			DBG("Cannot respond to a message of type %d",request->getType());
+			return 1;
+	}
+}
+
 /// Validates a PDU constructed using an external buffer.
 /**
  * When a CoapPDU is constructed using an external buffer, the programmer must call this function to
@@ -206,9 +401,23 @@ int CoapPDU::reset() {
  * \warning The validation call parses the PDU structure to set some internal parameters. If you do
  * not validate the PDU, then the behaviour of member access functions will be undefined.
  *
+ * All of those parameters are reinitialised on every call, so a PDU object and its buffer can be reused for
+ * each received packet without calling CoapPDU::reset() in between.
+ *
  * \return 1 if the PDU validates correctly, 0 if not. XXX maybe add some error codes
  */
 int CoapPDU::validate() {
+	// forget anything from the previous PDU in this buffer
+	_numOptions = 0;
+	_maxAddedOptionNumber = 0;
+	_optionIndexLength = -1;
+	_optionBitmap = 0;
+	_optionBitmapValid = 0;
+	_payloadPointer = NULL;
+	_payloadLength = 0;
+	_payloadReference = NULL;
+	_payloadReferenceLength = 0;
+
 	if(_pduLength<4) {
 		DBG("PDU has to be a minimum of 4 bytes. This: %d bytes",_pduLength);
 		return 0;
@@ -268,104 +477,178 @@ int CoapPDU::validate() {
 	// first option occurs after token
 	int optionPos = COAP_HDR_SIZE + getTokenLength();
 
+	// index is rebuilt below
+	int indexing = _optionIndexCapacity>0;
+
 	// may be 0 options
 	if(optionPos==_pduLength) {
 		DBG("No options. No payload.");
-		_numOptions = 0;
-		_payloadLength = 0;
+		_optionBitmapValid = 1;
+		if(indexing) {
+			_optionIndexLength = 0;
+		}
 		return 1;
 	}
 
 	int bytesRemaining = _pduLength-optionPos;
 	int numOptions = 0;
-	uint8_t upperNibble = 0x00, lowerNibble = 0x00;
+	uint64_t optionBitmap = 0;
+	uint8_t *pdu = _pdu;
+	CoapOptionIndexEntry *index = _optionIndex;
+	int indexCapacity = _optionIndexCapacity;
 
 	// walk over options and record information
 	while(1) {
 		// check for payload marker
 		if(bytesRemaining>0) {
-			uint8_t optionHeader = _pdu[optionPos];
+			uint8_t optionHeader = pdu[optionPos];
 			if(optionHeader==0xFF) {
 				// payload
 				if(bytesRemaining>1) {
 					_payloadPointer = &_pdu[optionPos+1];
 					_payloadLength = (bytesRemaining-1);
 					_numOptions = numOptions;
+					_maxAddedOptionNumber = optionNumber;
+					_optionBitmap = optionBitmap;
+					_optionBitmapValid = 1;
+					if(indexing) {
+						_optionIndexLength = numOptions;
+					}
 					DBG("Payload found, length: %d",_payloadLength);
 					return 1;
 				}
 				// payload marker but no payload
-				_payloadPointer = NULL;
-				_payloadLength = 0;
 				DBG("Payload marker but no payload.");
 				return 0;
 			}
-
-			// check that option delta and option length are valid values
-			upperNibble = (optionHeader & 0xF0) >> 4;
-			lowerNibble = (optionHeader & 0x0F);
-			if(upperNibble==0x0F||lowerNibble==0x0F) {
-				DBG("Expected option header or payload marker, got: 0x%x%x",upperNibble,lowerNibble);
-				return 0;
-			}
-			DBG("Option header byte appears sane: 0x%x%x",upperNibble,lowerNibble);
 		} else {
 			DBG("No more data. No payload.");
-			_payloadPointer = NULL;
-			_payloadLength = 0;
 			_numOptions = numOptions;
+			_maxAddedOptionNumber = optionNumber;
+			_optionBitmap = optionBitmap;
+			_optionBitmapValid = 1;
+			if(indexing) {
+				_optionIndexLength = numOptions;
+			}
 			return 1;
 		}
 
-		// skip over option header byte
-		bytesRemaining--;
-
-		// check that there is enough space for the extended delta and length bytes (if any)
-		int headerBytesNeeded = computeExtraBytes(upperNibble);
-		DBG("%d extra bytes needed for extended delta",headerBytesNeeded);
-		if(headerBytesNeeded>bytesRemaining) {
-			DBG("Not enough space for extended option delta, needed %d, have %d.",headerBytesNeeded,bytesRemaining);
+		// decode option header, checking for reserved nibbles and that the extended delta and length bytes (if any) fit
+		int headerLength = decodeOptionHeader(&pdu[optionPos],bytesRemaining,&optionDelta,&optionValueLength);
+		if(headerLength==0) {
+			DBG("Invalid or truncated option header: 0x%.2x",pdu[optionPos]);
 			return 0;
 		}
-		headerBytesNeeded += computeExtraBytes(lowerNibble);
-		if(headerBytesNeeded>bytesRemaining) {
-			DBG("Not enough space for extended option length, needed %d, have %d.",
-				(headerBytesNeeded-computeExtraBytes(upperNibble)),bytesRemaining);
+		if(optionNumber+optionDelta>0xFFFF) {
+			DBG("Option number overflow");
 			return 0;
 		}
-		DBG("Enough space for extended delta and length: %d, continuing.",headerBytesNeeded);
-
-		// extract option details
-		optionDelta = getOptionDelta(&_pdu[optionPos]);
 		optionNumber += optionDelta;
-		optionValueLength = getOptionValueLength(&_pdu[optionPos]);
 		DBG("Got option: %d with length %d",optionNumber,optionValueLength);
 		// compute total length
-		totalLength = 1; // mandatory header
-		totalLength += computeExtraBytes(optionDelta);
-		totalLength += computeExtraBytes(optionValueLength);
-		totalLength += optionValueLength;
+		totalLength = headerLength+optionValueLength;
 		// check there is enough space
-		if(optionPos+totalLength>_pduLength) {
-			DBG("Not enough space for option payload, needed %d, have %d.",(totalLength-headerBytesNeeded-1),_pduLength-optionPos);
+		if(totalLength>bytesRemaining) {
+			DBG("Not enough space for option payload, needed %d, have %d.",optionValueLength,bytesRemaining-headerLength);
 			return 0;
 		}
-		DBG("Enough space for option payload: %d %d",optionValueLength,(totalLength-headerBytesNeeded-1));
+		DBG("Enough space for option payload: %d",optionValueLength);
+
+		// record option in index, giving up if it doesn't fit or offsets overflow
+		if(indexing) {
+			if(numOptions<indexCapacity && optionPos+totalLength<=0xFFFF) {
+				index[numOptions].optionNumber = optionNumber;
+				index[numOptions].valueOffset = optionPos+totalLength-optionValueLength;
+				index[numOptions].valueLength = optionValueLength;
+			} else {
+				DBG("Option index too small, not indexing this PDU");
+				indexing = 0;
+			}
+		}
 
 		// recompute bytesRemaining
 		bytesRemaining -= totalLength;
-		bytesRemaining++; // correct for previous --
 
 		// move to next option
 		optionPos += totalLength;
 
 		// inc number of options XXX
 		numOptions++;
+		optionBitmap |= getOptionBit(optionNumber);
 	}
 
 	return 1;
 }
 
+/// Validates a batch of received packets without constructing a CoapPDU for each.
+/**
+ * Performs the same checks as CoapPDU::validate(). The fixed header of every packet is checked first,
+ * in a branch-free loop over one array per header field so the compiler can vectorise it, then the options
+ * of packets which passed are walked. Malformed traffic can therefore be dropped before any per-packet
+ * object exists, valid packets can be wrapped with CoapPDU(uint8_t *pdu, int pduLength) as needed.
+ *
+ * \param pdus Array of \b count pointers to received packets.
+ * \param pduLengths Array of \b count packet lengths.
+ * \param count Number of packets, at most COAP_VALIDATE_BATCH_SIZE.
+ * \param result Structure filled in with one entry per packet.
+ * \return The number of packets which validated, or -1 if \b count is out of range.
+ */
+int CoapPDU::validateBatch(const uint8_t *const *pdus, const int *pduLengths, int count, ValidateBatchResult *result) {
+	if(count<0||count>COAP_VALIDATE_BATCH_SIZE) {
+		DBG("Batch of %d packets, maximum is %d",count,COAP_VALIDATE_BATCH_SIZE);
+		return -1;
+	}
+
+	// gather the first two header bytes, packets too short to have a header read as version 0
+	uint8_t first[COAP_VALIDATE_BATCH_SIZE];
+	uint8_t second[COAP_VALIDATE_BATCH_SIZE];
+	int length[COAP_VALIDATE_BATCH_SIZE];
+	for(int i=0; i<count; i++) {
+		int ok = pduLengths[i]>=COAP_HDR_SIZE;
+		length[i] = pduLengths[i];
+		first[i] = ok ? pdus[i][0] : 0;
+		second[i] = ok ? pdus[i][1] : 0;
+	}
+
+	// version must be 1, token length at most 8 and fit, code class at most 5,
+	// packets larger than 64KiB can't be described by the 16 bit offsets
+	for(int i=0; i<count; i++) {
+		int tokenLength = first[i]&0x0F;
+		result->valid[i] = ((first[i]>>6)==1) & (tokenLength<=8) & (COAP_HDR_SIZE+tokenLength<=length[i]) &
+			((second[i]>>5)<=5) & (length[i]<=0xFFFF);
+		result->type[i] = first[i]&0x30;
+		result->code[i] = second[i];
+		result->tokenLength[i] = tokenLength;
+	}
+
+	// options are variable length so are walked one packet at a time
+	int numValid = 0;
+	for(int i=0; i<count; i++) {
+		result->numOptions[i] = 0;
+		result->payloadOffset[i] = 0;
+		result->payloadLength[i] = 0;
+		result->messageID[i] = 0;
+		if(!result->valid[i]) {
+			continue;
+		}
+		const uint8_t *pdu = pdus[i];
+		int optionPos = COAP_HDR_SIZE+result->tokenLength[i];
+		int payloadOffset = 0;
+		int numOptions = walkOptions(&pdu[optionPos],length[i]-optionPos,&payloadOffset);
+		if(numOptions<0) {
+			DBG("Packet %d has malformed options",i);
+			result->valid[i] = 0;
+			continue;
+		}
+		result->messageID[i] = endian_load16(uint16_t, &pdu[2]);
+		result->numOptions[i] = numOptions;
+		result->payloadOffset[i] = optionPos+payloadOffset;
+		result->payloadLength[i] = length[i]-(optionPos+payloadOffset);
+		numValid++;
+	}
+	return numValid;
+}
+
 /// Destructor. Does not free buffer if constructor passed an external buffer.
 /**
  * The destructor acts differently, depending on how the object was initially constructed (from buffer or not):
@@ -384,9 +667,7 @@ int CoapPDU::validate() {
  *
  */
 CoapPDU::~CoapPDU() {
-	if(!_constructedFromBuffer) {
-		free(_pdu);
-	}
+	freeBuffer();
 }
 
 /// Returns a pointer to the internal buffer.
@@ -394,6 +675,47 @@ uint8_t* CoapPDU::getPDUPointer() {
 	return _pdu;
 }
 
+/// Describes the whole PDU as a scatter-gather list, for sending with sendmsg() or sendmmsg().
+/**
+ * The first entry is the PDU buffer. If the payload was set with CoapPDU::setPayloadReference() the payload
+ * marker is written to the buffer just after the options, the first entry covers it, and the second entry is
+ * the referenced payload. Otherwise the payload (if any) is already in the buffer and there is only one entry.
+ *
+ * ~~~{.cpp}
+ * struct iovec iov[2];
+ * struct msghdr msg = {};
+ * msg.msg_iov = iov;
+ * int iovcnt;
+ * pdu->getIOVec(iov,&iovcnt);
+ * msg.msg_iovlen = iovcnt;
+ * ~~~
+ *
+ * \param iov Array of at least 2 entries to fill in.
+ * \param iovcnt Set to the number of entries used.
+ * \return 0 on success, 1 on failure (there is no space for the payload marker).
+ */
+int CoapPDU::getIOVec(struct iovec *iov, int *iovcnt) {
+	iov[0].iov_base = _pdu;
+	iov[0].iov_len = _pduLength;
+	if(_payloadReference==NULL) {
+		*iovcnt = 1;
+		return 0;
+	}
+
+	// options may have been added since the reference was set
+	if(ensureCapacity(_pduLength+1)) {
+		DBG("No space for payload marker");
+		return 1;
+	}
+	_pdu[_pduLength] = 0xFF;
+	iov[0].iov_base = _pdu;
+	iov[0].iov_len = _pduLength+1;
+	iov[1].iov_base = (void*)_payloadReference;
+	iov[1].iov_len = _payloadReferenceLength;
+	*iovcnt = 2;
+	return 0;
+}
+
 /// Set the PDU length to the length specified.
 /**
  * This is used when re-using a PDU container before calling CoapPDU::validate() as it
@@ -414,14 +736,13 @@ int CoapPDU::setURI(char *uri) {
 
 /// Shorthand function for setting a resource URI.
 /**
- * This will parse the supplied \b uri and construct enough URI_PATH and URI_QUERY options to encode it.
- * The options are added to the PDU.
- *
- * At present only simple URI formatting is handled, only '/','?', and '&' separators, and no port or protocol specificaiton.
+ * This will parse the supplied \b uri and construct the URI_HOST, URI_PORT, URI_PATH and URI_QUERY options
+ * that encode it, following RFC 7252 section 6.4. The options are added to the PDU.
  *
- * The function will split on '/' and create URI_PATH elements until it either reaches the end of the string
- * in which case it will stop or if it reaches '?' it will start splitting on '&' and create URI_QUERY elements
- * until it reaches the end of the string.
+ * The URI can be absolute, "coap://host:port/path?query" or "coaps://...", or just a path and query. The host
+ * becomes a URI_HOST option unless it is an IP address, and the port a URI_PORT option unless it is the default
+ * for the scheme. The path is split on '/' into URI_PATH options and the query on '&' into URI_QUERY options,
+ * with any percent-encoding decoded.
  *
  * Here is an example:
  *
@@ -429,93 +750,252 @@ int CoapPDU::setURI(char *uri) {
  *
  * Will be broken into four URI_PATH elements "a", "b", "c", "d", and three URI_QUERY elements "x=1", "y=2", "z=3"
  *
- * TODO: Add protocol extraction, port extraction, and some malformity checking.
+ * Exactly \b urilen bytes are read, so \b uri need not be NUL terminated. The URI is read once, each component
+ * being decoded straight into place in the PDU. As before, the leading '/' is optional, a trailing '/' is
+ * ignored, and a URI of just "/" gives a single URI_PATH of "/".
  *
  * \param uri The uri to parse.
  * \param urilen The length of the uri to parse.
  *
- * \return 1 on success, 0 on failure.
+ * \return 0 on success, 1 on failure: bad percent-encoding, a bad port or IP literal, a fragment (which CoAP
+ * can't carry), or no space for the options. On failure the PDU is left as it was.
  */
 int CoapPDU::setURI(char *uri, int urilen) {
-	// only '/', '?', '&' and ascii chars allowed
-
 	// sanitation
 	if(urilen<=0||uri==NULL) {
 		DBG("Null or zero-length uri passed.");
 		return 1;
 	}
 
-	// single character URI path (including '/' case)
-	if(urilen==1) {
-		addOption(COAP_OPTION_URI_PATH,1,(uint8_t*)uri);
+	// single '/' case, kept as the one URI_PATH it has always been
+	if(urilen==1&&uri[0]=='/') {
+		return addOption(COAP_OPTION_URI_PATH,1,(uint8_t*)uri);
+	}
+
+	// the options go straight onto the end, unless options with higher numbers are already there. In that case
+	// encode them separately and insert them one by one.
+	int defaultPort;
+	uint16_t firstOptionNumber = uriSchemeLength(uri,urilen,&defaultPort)>0 ? COAP_OPTION_URI_HOST : COAP_OPTION_URI_PATH;
+	uint16_t prevOptionNumber = 0;
+	if(findInsertionPosition(firstOptionNumber,&prevOptionNumber)!=_pduLength) {
+		CoapPDU uriOptions;
+		if(uriOptions.appendURI(uri,urilen)) {
+			return 1;
+		}
+		// work out exactly how much the PDU grows once the options are merged in, changed deltas included, so that
+		// making room up front means the additions below can't fail part way through
+		int growth = 0;
+		uint16_t prevMerged = 0, prevExisting = 0;
+		OptionRange existing = options(), added = uriOptions.options();
+		OptionIterator e = existing.begin(), a = added.begin();
+		while(e!=existing.end()||a!=added.end()) {
+			uint16_t optionNumber;
+			if(a==added.end()||(e!=existing.end()&&e->optionNumber<=a->optionNumber)) {
+				optionNumber = e->optionNumber;
+				growth -= computeExtraBytes(optionNumber-prevExisting);
+				prevExisting = optionNumber;
+				++e;
+			} else {
+				optionNumber = a->optionNumber;
+				growth += COAP_OPTION_HDR_BYTE+computeExtraBytes(a->optionValueLength)+a->optionValueLength;
+				++a;
+			}
+			growth += computeExtraBytes(optionNumber-prevMerged);
+			prevMerged = optionNumber;
+		}
+		if(ensureCapacity(_pduLength+growth)) {
+			return 1;
+		}
+		for(const CoapOption &o : uriOptions.options()) {
+			if(addOption(o.optionNumber,o.optionValueLength,o.optionValuePointer)) {
+				return 1;
+			}
+		}
 		return 0;
 	}
 
-	// TODO, queries
-	// extract ? to mark where to stop processing path components
-	// and then process the query params
+	int pduLength = _pduLength, numOptions = _numOptions;
+	uint16_t maxAddedOptionNumber = _maxAddedOptionNumber;
+	uint64_t optionBitmap = _optionBitmap;
+	_maxAddedOptionNumber = prevOptionNumber;
+	if(appendURI(uri,urilen)) {
+		_pduLength = pduLength;
+		_numOptions = numOptions;
+		_maxAddedOptionNumber = maxAddedOptionNumber;
+		_optionBitmap = optionBitmap;
+		return 1;
+	}
+	return 0;
+}
 
-	// local vars
-	char *startP=uri,*endP=NULL;
-	int oLen = 0;
-	char splitChar = '/';
-	int queryStageTriggered = 0;
-	uint16_t optionType = COAP_OPTION_URI_PATH;
-	while(1) {
-		// stop at end of string or query
-		if(*startP==0x00||*(startP+1)==0x00) {
-			break;
+/// Appends the options for \b uri to the end of the PDU, see CoapPDU::setURI().
+/**
+ * The options must be able to go at the end, with _maxAddedOptionNumber as the number of the last one.
+ * \return 0 on success, 1 on failure, leaving any options appended so far.
+ */
+int CoapPDU::appendURI(const char *uri, int urilen) {
+	const char *p = uri, *end = uri+urilen;
+
+	// option positions are about to change
+	_optionIndexLength = -1;
+
+	// scheme, host and port
+	int defaultPort;
+	int schemeLength = uriSchemeLength(uri,urilen,&defaultPort);
+	if(schemeLength>0) {
+		p += schemeLength;
+		if(p<end&&*p=='[') {
+			// IP literal, never sent as URI_HOST
+			while(p<end&&*p!=']') {
+				p++;
+			}
+			if(p==end) {
+				DBG("Unterminated IP literal");
+				return 1;
+			}
+			p++;
+		} else {
+			const char *host = p;
+			int isAddress = 1;
+			for(; p<end&&!(gURICharClass[(uint8_t)*p]&COAP_URI_HOST_END); p++) {
+				isAddress &= (*p>='0'&&*p<='9')||*p=='.';
+			}
+			// RFC 7252 wants the host lowercased
+			if(p>host&&!isAddress&&appendURIComponent(host,p,COAP_URI_HOST_END,COAP_OPTION_URI_HOST,1)==NULL) {
+				return 1;
+			}
+		}
+		if(p<end&&*p==':') {
+			int port = 0, digits = 0;
+			for(p++; p<end&&*p>='0'&&*p<='9'; p++) {
+				port = port*10+(*p-'0');
+				if(++digits>5||port>65535) {
+					DBG("Port out of range");
+					return 1;
+				}
+			}
+			if(p<end&&!(gURICharClass[(uint8_t)*p]&COAP_URI_HOST_END)) {
+				DBG("Malformed port");
+				return 1;
+			}
+			// an empty port means the default, as does the default itself
+			if(digits>0&&port!=defaultPort) {
+				uint8_t portValue[2] = {(uint8_t)(port>>8),(uint8_t)port};
+				int portLength = port>0xFF ? 2 : (port>0 ? 1 : 0);
+				if(addOption(COAP_OPTION_URI_PORT,portLength,&portValue[2-portLength])) {
+					return 1;
+				}
+			}
 		}
+	}
 
-		// ignore leading slash
-		if(*startP==splitChar) {
-			DBG("Skipping leading slash");
-			startP++;
+	// path segments, an empty or "/" path has none
+	if(p<end&&*p=='/') {
+		p++;
+	}
+	while(p<end&&!(gURICharClass[(uint8_t)*p]&(COAP_URI_QUERY|COAP_URI_FRAGMENT))) {
+		p = appendURIComponent(p,end,COAP_URI_PATH_END,COAP_OPTION_URI_PATH,0);
+		if(p==NULL) {
+			return 1;
 		}
+		// skipping the separator here means a trailing '/' adds no empty segment
+		if(p<end&&*p=='/') {
+			p++;
+		}
+	}
 
-		// find next split point
-		endP = strchr(startP,splitChar);
-
-		// might not be another slash
-		if(endP==NULL) {
-			DBG("Ending out of slash");
-			// check if there is a ?
-			endP = strchr(startP,'?');
-			// done if no queries
-			if(endP==NULL) {
-				endP = uri+urilen;
-			} else {
-				queryStageTriggered = 1;
+	// query arguments
+	if(p<end&&*p=='?') {
+		p++;
+		while(p<end&&*p!='#') {
+			p = appendURIComponent(p,end,COAP_URI_QUERY_END,COAP_OPTION_URI_QUERY,0);
+			if(p==NULL) {
+				return 1;
+			}
+			if(p<end&&*p=='&') {
+				p++;
 			}
 		}
+	}
 
-		// get length of segment
-		oLen = endP-startP;
-
-		#ifdef DEBUG
-		char *b = (char*)malloc(oLen+1);
-		memcpy(b,startP,oLen);
-		b[oLen] = 0x00;
-		DBG("Adding URI_PATH %s",b);
-		free(b);
-		#endif
+	if(p<end) {
+		DBG("URI has a fragment, which can't be sent in CoAP");
+		return 1;
+	}
+	return 0;
+}
 
-		// add option
-		if(addOption(optionType,oLen,(uint8_t*)startP)!=0) {
-			DBG("Error adding option");
-			return 1;
+/// Appends the URI component at \b p, up to \b end or the first character in class \b stop, as an option.
+/**
+ * The component is scanned, percent-decoded and copied in one go, straight into the PDU after the space for a
+ * one byte option header. The rare component that needs a longer header is moved up afterwards.
+ *
+ * \return Where the component ended, or NULL on bad percent-encoding or no space.
+ */
+const char* CoapPDU::appendURIComponent(const char *p, const char *end, uint8_t stop, uint16_t optionNumber,
+	int lowercase) {
+	// decoding only shortens a component, so the rest of the URI plus the longest header is always enough
+	int needed = _pduLength+5+(end-p);
+	if(needed>_bufferLength&&(_constructedFromBuffer||ensureCapacity(needed))) {
+		// work out what this component needs exactly
+		int length = 0;
+		for(const char *q=p; q<end&&!(gURICharClass[(uint8_t)*q]&stop); q++, length++) {
+			if(*q=='%') {
+				if(end-q<3||hexDigit(q[1])<0||hexDigit(q[2])<0) {
+					DBG("Bad percent-encoding in URI");
+					return NULL;
+				}
+				q += 2;
+			}
+		}
+		if(ensureCapacity(_pduLength+COAP_OPTION_HDR_BYTE+
+			computeExtraBytes(optionNumber-_maxAddedOptionNumber)+computeExtraBytes(length)+length)) {
+			DBG("No space for URI component");
+			return NULL;
 		}
-		startP = endP;
+	}
 
-		if(queryStageTriggered) {
-			splitChar = '&';
-			optionType = COAP_OPTION_URI_QUERY;
-			startP++;
-			queryStageTriggered = false;
+	uint8_t *value = &_pdu[_pduLength+COAP_OPTION_HDR_BYTE];
+	uint8_t *out = value;
+	for(; p<end; p++) {
+		uint8_t c = *p;
+		uint8_t charClass = gURICharClass[c];
+		if(charClass&stop) {
+			break;
+		}
+		if(charClass&COAP_URI_ESCAPE) {
+			if(end-p<3||hexDigit(p[1])<0||hexDigit(p[2])<0) {
+				DBG("Bad percent-encoding in URI");
+				return NULL;
+			}
+			c = hexDigit(p[1])<<4|hexDigit(p[2]);
+			p += 2;
+		} else if(lowercase&&c>='A'&&c<='Z') {
+			c += 'a'-'A';
 		}
+		*out++ = c;
 	}
 
-	return 0;
+	int length = out-value;
+	if(length>0xFFFF) {
+		DBG("URI component too long for an option");
+		return NULL;
+	}
+	uint16_t optionDelta = optionNumber-_maxAddedOptionNumber;
+	if(optionDelta<13&&length<13) {
+		// nearly always, as URI options are close together and short
+		_pdu[_pduLength] = optionDelta<<4|length;
+	} else {
+		int extraBytes = computeExtraBytes(optionDelta)+computeExtraBytes(length);
+		memmove(value+extraBytes,value,length);
+		insertOption(_pduLength,optionDelta,length,NULL);
+		_pduLength += extraBytes;
+	}
+	_pduLength += COAP_OPTION_HDR_BYTE+length;
+	_numOptions++;
+	_optionBitmap |= getOptionBit(optionNumber);
+	_maxAddedOptionNumber = optionNumber;
+	return p;
 }
 
 /// Shorthand for adding a URI QUERY to the option list.
@@ -567,15 +1047,7 @@ int CoapPDU::getURI(char *dst, int dstlen, int *outLen) {
 		*outLen = 0;
 		return 0;
 	}
-	// get options
-	CoapPDU::CoapOption *options = getOptions();
-	if(options==NULL) {
-		*dst = 0x00;
-		*outLen = 0;
-		return 0;
-	}
 	// iterate over options to construct URI
-	CoapOption *o = NULL;
 	int bytesLeft = dstlen-1; // space for 0x00
 	int oLen = 0;
 	// add slash at beggining
@@ -585,19 +1057,17 @@ int CoapPDU::getURI(char *dst, int dstlen, int *outLen) {
 		bytesLeft--;
 	} else {
 		DBG("No space for initial slash needed 1, got %d",bytesLeft);
-		free(options);
 		return 1;
 	}
 
 	char separator = '/';
 	int firstQuery = 1;
 
-	for(int i=0; i<_numOptions; i++) {
-		o = &options[i];
-		oLen = o->optionValueLength;
-		if(o->optionNumber==COAP_OPTION_URI_PATH||o->optionNumber==COAP_OPTION_URI_QUERY) {
+	for(const CoapOption &o : options()) {
+		oLen = o.optionValueLength;
+		if(o.optionNumber==COAP_OPTION_URI_PATH||o.optionNumber==COAP_OPTION_URI_QUERY) {
 			// if the option is a query, change the separator to &
-			if(o->optionNumber==COAP_OPTION_URI_QUERY) {
+			if(o.optionNumber==COAP_OPTION_URI_QUERY) {
 				if(firstQuery) {
 					// change previous '/' to a '?'
 					*(dst-1) = '?';
@@ -609,20 +1079,18 @@ int CoapPDU::getURI(char *dst, int dstlen, int *outLen) {
 			// check space
 			if(oLen>bytesLeft) {
 				DBG("Destination buffer too small, needed %d, got %d",oLen,bytesLeft);
-				free(options);
 				return 1;
 			}
 
 			// case where single '/' exists
-			if(oLen==1&&o->optionValuePointer[0]=='/') {
+			if(oLen==1&&o.optionValuePointer[0]=='/') {
 				*dst = 0x00;
 				*outLen = 1;
-				free(options);
 				return 0;
 			}
 
 			// copy URI path or query component
-			memcpy(dst,o->optionValuePointer,oLen);
+			memcpy(dst,o.optionValuePointer,oLen);
 
 			// adjust counters
 			dst += oLen;
@@ -635,9 +1103,11 @@ int CoapPDU::getURI(char *dst, int dstlen, int *outLen) {
 				bytesLeft--;
 			} else {
 				DBG("Ran out of space after processing option");
-				free(options);
 				return 1;
 			}
+		} else if(o.optionNumber>COAP_OPTION_URI_QUERY) {
+			// options are sorted, nothing more to find
+			break;
 		}
 	}
 
@@ -647,7 +1117,6 @@ int CoapPDU::getURI(char *dst, int dstlen, int *outLen) {
 	// add null terminating byte (always space since reserved)
 	*dst = 0x00;
 	*outLen = (dstlen-1)-bytesLeft;
-	free(options);
 	return 0;
 }
 
@@ -746,6 +1215,9 @@ int CoapPDU::setToken(uint8_t *token, uint8_t tokenLength) {
 		return 0;
 	}
 
+	// options are about to move
+	_optionIndexLength = -1;
+
 	// otherwise compute new length of PDU
 	uint8_t oldPDULength = _pduLength;
 	_pduLength -= oldTokenLength;
@@ -754,24 +1226,11 @@ int CoapPDU::setToken(uint8_t *token, uint8_t tokenLength) {
 	// now, have to shift old memory around, but shift direction depends
 	// whether pdu is now bigger or smaller
 	if(_pduLength>oldPDULength) {
-		// new PDU is bigger, need to allocate space for new PDU
-		if(!_constructedFromBuffer) {
-			uint8_t *newMemory = (uint8_t*)realloc(_pdu,_pduLength);
-			if(newMemory==NULL) {
-				// malloc failed
-				DBG("Failed to allocate memory for token");
-				_pduLength = oldPDULength;
-				return 1;
-			}
-			_pdu = newMemory;
-			_bufferLength = _pduLength;
-		} else {
-			// constructed from buffer, check space
-			if(_pduLength>_bufferLength) {
-				DBG("Buffer too small to contain token, needed %d, got %d.",_pduLength-oldPDULength,_bufferLength-oldPDULength);
-				_pduLength = oldPDULength;
-				return 1;
-			}
+		// new PDU is bigger, need space for new PDU
+		if(ensureCapacity(_pduLength)) {
+			DBG("No space for token, needed %d, got %d.",_pduLength-oldPDULength,_bufferLength-oldPDULength);
+			_pduLength = oldPDULength;
+			return 1;
 		}
 
 		// and then shift everything after token up to end of new PDU
@@ -795,17 +1254,7 @@ int CoapPDU::setToken(uint8_t *token, uint8_t tokenLength) {
 	int shiftOffset = oldPDULength-_pduLength;
 	int shiftAmount = oldPDULength-oldTokenLength-COAP_HDR_SIZE;
 	shiftPDUDown(startLocation,shiftOffset,shiftAmount);
-	// then reduce size of buffer
-	if(!_constructedFromBuffer) {
-		uint8_t *newMemory = (uint8_t*)realloc(_pdu,_pduLength);
-		if(newMemory==NULL) {
-			// malloc failed, PDU in inconsistent state
-			DBG("Failed to shrink PDU for new token. PDU probably broken");
-			return 1;
-		}
-		_pdu = newMemory;
-		_bufferLength = _pduLength;
-	}
+	// buffer capacity is kept, see CoapPDU::shrinkToFit()
 
 	// and officially set the new tokenLength
 	setTokenLength(tokenLength);
@@ -840,6 +1289,8 @@ CoapPDU::Code CoapPDU::httpStatusToCode(int httpStatus) {
 			return CoapPDU::COAP_PUT;
 		case 4:
 			return CoapPDU::COAP_DELETE;
+		case 5:
+			return CoapPDU::COAP_FETCH;
 		case 201:
 			return CoapPDU::COAP_CREATED;
 		case 202:
@@ -912,63 +1363,327 @@ int CoapPDU::getPDULength() {
 	return _pduLength;
 }
 
-/// Return the number of options that the PDU has.
-int CoapPDU::getNumOptions() {
-	return _numOptions;
+/// Returns the number of bytes the PDU can grow to without allocating.
+/**
+ * For a PDU constructed with an external buffer this is the length of that buffer. For a memory-managed
+ * PDU it is the currently allocated capacity, which is usually larger than CoapPDU::getPDULength().
+ */
+int CoapPDU::getBufferLength() {
+	return _bufferLength;
 }
 
-
+/// Makes sure the PDU can grow to \b bytes without further allocation.
 /**
- * This returns the options as a sequence of structs.
+ * Building a response typically adds a token, a few options and a payload. Reserving space for all of them
+ * up front means a memory-managed PDU allocates once rather than on each addition.
+ *
+ * For a PDU constructed with an external buffer nothing is allocated, this just checks the buffer is large enough.
+ *
+ * \param bytes Total PDU length to reserve space for.
+ * \return 0 on success, 1 if memory couldn't be allocated or the external buffer is too small.
  */
-CoapPDU::CoapOption* CoapPDU::getOptions() {
-	DBG("getOptions() called, %d options.",_numOptions);
-
-	uint16_t optionDelta =0, optionNumber = 0, optionValueLength = 0;
-	int totalLength = 0;
-
-	if(_numOptions==0) {
-		return NULL;
+int CoapPDU::reserve(int bytes) {
+	if(bytes<=_bufferLength) {
+		return 0;
 	}
-
-	// malloc space for options
-	CoapOption *options = (CoapOption*)malloc(_numOptions*sizeof(CoapOption));
-	if(options==NULL) {
-		DBG("Failed to allocate memory for options.");
-		return NULL;
+	if(_constructedFromBuffer) {
+		DBG("Cannot reserve %d bytes in external buffer of %d bytes",bytes,_bufferLength);
+		return 1;
 	}
+	return reallocBuffer(bytes);
+}
 
-	// first option occurs after token
-	int optionPos = COAP_HDR_SIZE + getTokenLength();
-
-	// walk over options and record information
-	for(int i=0; i<_numOptions; i++) {
-		// extract option details
-		optionDelta = getOptionDelta(&_pdu[optionPos]);
-		optionNumber += optionDelta;
-		optionValueLength = getOptionValueLength(&_pdu[optionPos]);
-		// compute total length
-		totalLength = 1; // mandatory header
-		totalLength += computeExtraBytes(optionDelta);
-		totalLength += computeExtraBytes(optionValueLength);
-		totalLength += optionValueLength;
-		// record option details
-		options[i].optionNumber = optionNumber;
-		options[i].optionDelta = optionDelta;
-		options[i].optionValueLength = optionValueLength;
-		options[i].totalLength = totalLength;
-		options[i].optionPointer = &_pdu[optionPos];
-		options[i].optionValuePointer = &_pdu[optionPos+totalLength-optionValueLength];
-		// move to next option
-		optionPos += totalLength;
+/// Releases any capacity in a memory-managed PDU beyond its current length.
+/**
+ * Memory-managed PDUs grow geometrically and never give memory back on their own, this trims the allocation
+ * to CoapPDU::getPDULength(). Does nothing for a PDU constructed with an external buffer.
+ *
+ * \return 0 on success, 1 on failure.
+ */
+int CoapPDU::shrinkToFit() {
+	if(_constructedFromBuffer||_bufferLength==_pduLength) {
+		return 0;
 	}
-
-	return options;
+	return reallocBuffer(_pduLength);
 }
 
-/// Add an option to the PDU.
+/// Hands a buffer to the PDU, which takes ownership of it.
 /**
- * Unlike other implementations, options can be added in any order, and in-memory manipulation will be
+ * Any buffer the PDU owned beforehand is freed. This is the counterpart of CoapPDU::release(), for example a
+ * receive thread can release() a PDU's buffer into a queue and a worker can adopt() it without copying.
+ *
+ * If \b deleter is NULL the buffer must have come from the PDU's allocator (see CoapPDU::getAllocator(), this is
+ * malloc() unless changed) with a capacity of \b bufferLength, and the PDU treats it like its own memory-managed
+ * buffer, growing it as needed and freeing it when destroyed. Otherwise the buffer has a fixed
+ * size, as with CoapPDU::CoapPDU(uint8_t *buffer, int bufferLength, int pduLength), and \b deleter is called
+ * on it when the PDU is destroyed or adopts another buffer.
+ *
+ * As with the buffer constructors, if \b pduLength isn't 0 CoapPDU::validate() must be called before the
+ * PDU is accessed.
+ *
+ * \param buffer The buffer, either containing a PDU or to build one in.
+ * \param pduLength Length of the PDU in the buffer, or 0 to start a new PDU.
+ * \param bufferLength The length of the buffer.
+ * \param deleter Function which frees the buffer, or NULL if it came from the PDU's allocator.
+ * \return 0 on success, 1 if the lengths don't make sense, in which case the PDU is unchanged.
+ */
+int CoapPDU::adopt(uint8_t *buffer, int pduLength, int bufferLength, CoapBufferDeleter deleter) {
+	if(buffer==NULL||pduLength<0||pduLength>bufferLength||bufferLength<COAP_HDR_SIZE) {
+		DBG("Cannot adopt buffer of %d bytes with PDU of %d bytes",bufferLength,pduLength);
+		return 1;
+	}
+	if(buffer!=_pdu) {
+		freeBuffer();
+	}
+	_constructedFromBuffer = deleter!=NULL;
+	_bufferInObject = 0;
+	_deleter = deleter;
+	initBuffer(buffer,bufferLength,pduLength);
+	return 0;
+}
+
+/// Gives up the PDU's buffer to the caller.
+/**
+ * The caller becomes responsible for the buffer: a memory-managed buffer must be returned to CoapPDU::getAllocator()
+ * (or adopted by a PDU using the same allocator), one passed to CoapPDU::adopt() with a deleter must be passed to
+ * that deleter, and one passed to a buffer constructor is the caller's anyway. Read CoapPDU::getPDULength() and
+ * CoapPDU::getBufferLength() first if they are needed, for example to send or free the buffer.
+ *
+ * Afterwards the PDU is left without a buffer, as if it had been moved from.
+ *
+ * \return The PDU buffer.
+ */
+uint8_t* CoapPDU::release() {
+	uint8_t *buffer = _pdu;
+	detach();
+	return buffer;
+}
+
+/// Returns the allocator used for memory-managed buffers of this PDU.
+CoapAllocator* CoapPDU::getAllocator() {
+	return _allocator;
+}
+
+/// Return the number of options that the PDU has.
+int CoapPDU::getNumOptions() {
+	return _numOptions;
+}
+
+
+/// Returns the options as a dynamically allocated sequence of structs.
+/**
+ * The caller must free() the returned array. Prefer CoapPDU::options() which walks the options in place
+ * without allocating.
+ *
+ * \return An array of CoapPDU::getNumOptions() options, or NULL if there are no options or allocation failed.
+ */
+CoapPDU::CoapOption* CoapPDU::getOptions() {
+	DBG("getOptions() called, %d options.",_numOptions);
+
+	if(_numOptions==0) {
+		return NULL;
+	}
+
+	// malloc space for options
+	CoapOption *options = (CoapOption*)malloc(_numOptions*sizeof(CoapOption));
+	if(options==NULL) {
+		DBG("Failed to allocate memory for options.");
+		return NULL;
+	}
+
+	// walk over options and record information
+	int i = 0;
+	OptionRange range = this->options();
+	for(OptionIterator it=range.begin(); it!=range.end() && i<_numOptions; ++it) {
+		options[i++] = *it;
+	}
+
+	return options;
+}
+
+/// Returns a range over the options of the PDU which can be used in a range-based for loop.
+/**
+ * Options are decoded lazily from the PDU buffer as the range is iterated, so this never touches the heap:
+ *
+ * ~~~{.cpp}
+ * for(const CoapPDU::CoapOption &o : pdu->options()) {
+ *    if(o.optionNumber==CoapPDU::COAP_OPTION_URI_PATH) ...
+ * }
+ * ~~~
+ *
+ * The PDU must have been validated with CoapPDU::validate() (or constructed locally). Iterators are
+ * invalidated by anything that modifies the PDU, such as CoapPDU::addOption().
+ */
+CoapPDU::OptionRange CoapPDU::options() {
+	return OptionRange(&_pdu[COAP_HDR_SIZE+getTokenLength()],&_pdu[_pduLength]);
+}
+
+/// Sets the storage that CoapPDU::validate() records the option index into.
+/**
+ * By default each CoapPDU indexes up to COAP_OPTION_INDEX_SIZE options using storage inside the object.
+ * PDUs with more options than the storage can hold are simply not indexed, lookups then fall back
+ * to walking the options. Use this to supply bigger storage, or pass NULL and 0 to disable indexing.
+ *
+ * The storage must outlive the CoapPDU (or until it is replaced). Takes effect from the next CoapPDU::validate().
+ *
+ * \param storage Array of at least \b capacity entries, or NULL to disable indexing.
+ * \param capacity Number of entries in \b storage.
+ */
+void CoapPDU::setOptionIndexStorage(CoapOptionIndexEntry *storage, int capacity) {
+	if(storage==NULL||capacity<0) {
+		capacity = 0;
+	}
+	_optionIndex = storage;
+	_optionIndexCapacity = capacity;
+	_optionIndexLength = -1;
+}
+
+/// Returns the option index recorded by the last CoapPDU::validate().
+/**
+ * The index holds one entry per option, in the order the options appear in the PDU (so sorted by option number).
+ * Any call that moves options around (such as CoapPDU::addOption() or CoapPDU::setToken()) discards the index.
+ *
+ * \param numEntries Pointer to an integer into which the number of entries is placed.
+ * \return Pointer to the first index entry, or NULL if there is no valid index.
+ */
+const CoapPDU::CoapOptionIndexEntry* CoapPDU::getOptionIndex(int *numEntries) {
+	if(_optionIndexLength<0) {
+		*numEntries = 0;
+		return NULL;
+	}
+	*numEntries = _optionIndexLength;
+	return _optionIndex;
+}
+
+/// Looks up all occurences of an option using the option index.
+/**
+ * Since options are sorted, repeated options such as URI_PATH segments are adjacent in the index,
+ * so this is a binary search followed by a count of matching entries. The option value for each entry
+ * is at getPDUPointer()+valueOffset.
+ *
+ * \param optionNumber The option number to look for.
+ * \param first Pointer into which the address of the first matching entry is placed (NULL if none match).
+ * \return The number of matching options, or -1 if the PDU has no valid option index.
+ */
+int CoapPDU::findIndexedOptions(uint16_t optionNumber, const CoapOptionIndexEntry **first) {
+	*first = NULL;
+	if(_optionIndexLength<0) {
+		return -1;
+	}
+
+	// lower bound
+	int lo = 0, hi = _optionIndexLength;
+	while(lo<hi) {
+		int mid = (lo+hi)/2;
+		if(_optionIndex[mid].optionNumber<optionNumber) {
+			lo = mid+1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	int count = 0;
+	while(lo+count<_optionIndexLength && _optionIndex[lo+count].optionNumber==optionNumber) {
+		count++;
+	}
+	if(count) {
+		*first = &_optionIndex[lo];
+	}
+	return count;
+}
+
+/// Returns the bit representing \b optionNumber in the bitmap returned by CoapPDU::getOptionBitmap().
+uint64_t CoapPDU::getOptionBit(uint16_t optionNumber) {
+	return 1ULL<<(optionNumber<63 ? optionNumber : 63);
+}
+
+/// Returns a bitmap of the options present in the PDU.
+/**
+ * Bit \b n is set if option \b n is present, for option numbers up to 62. Bit 63 is set if any option
+ * numbered 63 or above is present. Use CoapPDU::getOptionBit() to build masks, for example to check for
+ * several options in one go:
+ *
+ * ~~~{.cpp}
+ * if(pdu->getOptionBitmap()&(CoapPDU::getOptionBit(CoapPDU::COAP_OPTION_BLOCK1)|CoapPDU::getOptionBit(CoapPDU::COAP_OPTION_BLOCK2))) {
+ * ~~~
+ *
+ * The bitmap is recorded by CoapPDU::validate() and kept up to date by CoapPDU::addOption(). If it isn't
+ * known, for example after the buffer was changed directly, it is computed by walking the options once.
+ */
+uint64_t CoapPDU::getOptionBitmap() {
+	if(!_optionBitmapValid) {
+		uint64_t optionBitmap = 0;
+		for(const CoapOption &o : options()) {
+			optionBitmap |= getOptionBit(o.optionNumber);
+		}
+		_optionBitmap = optionBitmap;
+		_optionBitmapValid = 1;
+	}
+	return _optionBitmap;
+}
+
+/// Returns 1 if the PDU carries at least one option numbered \b optionNumber, 0 otherwise.
+/**
+ * Options numbered below 63 are answered from the bitmap alone. For larger numbers the options are only
+ * walked if the bitmap shows that some option numbered 63 or above is present.
+ */
+int CoapPDU::hasOption(uint16_t optionNumber) {
+	if(!(getOptionBitmap()&getOptionBit(optionNumber))) {
+		return 0;
+	}
+	if(optionNumber<63) {
+		return 1;
+	}
+	return findOptions(optionNumber,NULL,0)>0;
+}
+
+/// Finds the first option numbered \b optionNumber.
+/**
+ * \param optionNumber The option number to look for.
+ * \param option Pointer into which the option is placed if found, the value points into the PDU buffer.
+ * \return 1 if the option was found, 0 if not.
+ */
+int CoapPDU::findOption(uint16_t optionNumber, CoapOption *option) {
+	return findOptions(optionNumber,option,1)>0;
+}
+
+/// Finds all options numbered \b optionNumber, such as each URI_PATH segment.
+/**
+ * Options are checked against the bitmap first, then the options are walked in order, stopping as soon as
+ * an option numbered above \b optionNumber is reached (or once \b maxOptions have been found).
+ *
+ * \param optionNumber The option number to look for.
+ * \param options Array into which up to \b maxOptions matching options are placed, may be NULL to just count.
+ * \param maxOptions Size of \b options.
+ * \return The number of matching options placed in \b options, or when \b options is NULL, the number present.
+ */
+int CoapPDU::findOptions(uint16_t optionNumber, CoapOption *options, int maxOptions) {
+	if(!(getOptionBitmap()&getOptionBit(optionNumber))) {
+		return 0;
+	}
+	int found = 0;
+	OptionRange range = this->options();
+	for(OptionIterator it=range.begin(); it!=range.end(); ++it) {
+		if(it->optionNumber<optionNumber) {
+			continue;
+		}
+		if(it->optionNumber>optionNumber) {
+			break;
+		}
+		if(options!=NULL) {
+			if(found==maxOptions) {
+				break;
+			}
+			options[found] = *it;
+		}
+		found++;
+	}
+	return found;
+}
+
+/// Add an option to the PDU.
+/**
+ * Unlike other implementations, options can be added in any order, and in-memory manipulation will be
  * performed to ensure the correct ordering of options (they use a delta encoding of option numbers).
  * Re-ordering memory like this incurs a small performance cost, so if you care about this, then you
  * might want to add options in ascending order of option number.
@@ -982,6 +1697,9 @@ int CoapPDU::addOption(uint16_t insertedOptionNumber, uint16_t optionValueLength
 	// prevOption <-- insertionPosition
 	// nextOption
 
+	// option positions are about to change
+	_optionIndexLength = -1;
+
 	// find insertion location and previous option number
 	uint16_t prevOptionNumber = 0; // option number of option before insertion point
 	int insertionPosition = findInsertionPosition(insertedOptionNumber,&prevOptionNumber);
@@ -1006,28 +1724,16 @@ int CoapPDU::addOption(uint16_t insertedOptionNumber, uint16_t optionValueLength
 		// set new PDU length and allocate space for extra option
 		int oldPDULength = _pduLength;
 		_pduLength += optionLength;
-		if(!_constructedFromBuffer) {
-			uint8_t *newMemory = (uint8_t*)realloc(_pdu,_pduLength);
-			if(newMemory==NULL) {
-				DBG("Failed to allocate memory for option.");
-				_pduLength = oldPDULength;
-				// malloc failed
-				return 1;
-			}
-			_pdu = newMemory;
-			_bufferLength = _pduLength;
-		} else {
-			// constructed from buffer, check space
-			if(_pduLength>_bufferLength) {
-				DBG("Buffer too small for new option: needed %d, got %d.",_pduLength-oldPDULength,_bufferLength-oldPDULength);
-				_pduLength = oldPDULength;
-				return 1;
-			}
+		if(ensureCapacity(_pduLength)) {
+			DBG("No space for new option: needed %d, got %d.",_pduLength-oldPDULength,_bufferLength-oldPDULength);
+			_pduLength = oldPDULength;
+			return 1;
 		}
 
 		// insert option at position
 		insertOption(insertionPosition,optionDelta,optionValueLength,optionValue);
 		_numOptions++;
+		_optionBitmap |= getOptionBit(insertedOptionNumber);
 		return 0;
 	}
 	// XXX could do 0xFF pdu payload case for changing of dynamically allocated application space SDUs < yeah, if you're insane
@@ -1053,22 +1759,10 @@ int CoapPDU::addOption(uint16_t insertedOptionNumber, uint16_t optionValueLength
 	int oldPDULength = _pduLength;
 	_pduLength += mallocLength;
 
-	if(!_constructedFromBuffer) {
-		uint8_t *newMemory = (uint8_t*)realloc(_pdu,_pduLength);
-		if(newMemory==NULL) {
-			DBG("Failed to allocate memory for option");
-			_pduLength = oldPDULength;
-			return 1;
-		}
-		_pdu = newMemory;
-		_bufferLength = _pduLength;
-	} else {
-		// constructed from buffer, check space
-		if(_pduLength>_bufferLength) {
-			DBG("Buffer too small to contain option, needed %d, got %d.",_pduLength-oldPDULength,_bufferLength-oldPDULength);
-			_pduLength = oldPDULength;
-			return 1;
-		}
+	if(ensureCapacity(_pduLength)) {
+		DBG("No space for option, needed %d, got %d.",_pduLength-oldPDULength,_bufferLength-oldPDULength);
+		_pduLength = oldPDULength;
+		return 1;
 	}
 
 	// move remainder of PDU data up to create hole for new option
@@ -1110,6 +1804,7 @@ int CoapPDU::addOption(uint16_t insertedOptionNumber, uint16_t optionValueLength
 
 	// done, mark it with B!
 	_numOptions++;
+	_optionBitmap |= getOptionBit(insertedOptionNumber);
 	return 0;
 }
 
@@ -1131,6 +1826,10 @@ uint8_t* CoapPDU::mallocPayload(int len) {
 		return NULL;
 	}
 
+	// the payload is now in the buffer
+	_payloadReference = NULL;
+	_payloadReferenceLength = 0;
+
 	// further sanity
 	if(len==_payloadLength) {
 		DBG("Space for payload of specified length already exists");
@@ -1158,34 +1857,10 @@ uint8_t* CoapPDU::mallocPayload(int len) {
 	// make space for payload (and payload marker if necessary)
 	int newLen = _pduLength+payloadSpace+markerSpace;
 	DBG("Allocating %d bytes:  _pduLength(%d), payloadSpace(%d), markerSpace(%d)",newLen,_pduLength,payloadSpace,markerSpace);
-	if(!_constructedFromBuffer) {
-		uint8_t* newPDU = (uint8_t*)realloc(_pdu,newLen);
-		if(newPDU==NULL) {
-			DBG("Cannot allocate (or shrink) space for payload");
-			return NULL;
-		}
-
-		// in the case of a realloc a few things are done differently to
-		// a new allocation
-		_bufferLength = newLen;
-		if(_pdu!=newPDU) {
-			_pdu = newPDU;
-			DBG("This is a new allocation");
-			// adjust payload pointer to point into the new memory
-			_payloadPointer = &_pdu[newLen-len];
-			// and also set the payload marker if it wasn't already set
-			if(markerSpace!=0) {
-				_pdu[newLen-len-1] = 0xFF;
-			}
-		}
-
-	} else {
-		// constructed from buffer, check space
-		DBG("newLen: %d, _bufferLength: %d",newLen,_bufferLength);
-		if(newLen>_bufferLength) {
-			DBG("Buffer too small to contain desired payload, needed %d, got %d.",newLen-_pduLength,_bufferLength-_pduLength);
-			return NULL;
-		}
+	DBG("newLen: %d, _bufferLength: %d",newLen,_bufferLength);
+	if(ensureCapacity(newLen)) {
+		DBG("No space for desired payload, needed %d, got %d.",newLen-_pduLength,_bufferLength-_pduLength);
+		return NULL;
 	}
 
 	_pduLength = newLen;
@@ -1237,33 +1912,95 @@ int CoapPDU::setPayload(uint8_t *payload, int len) {
 }
 
 /// Returns a pointer to the payload buffer.
+/**
+ * If the payload was set with CoapPDU::setPayloadReference() this is the referenced payload, which
+ * must not be written to.
+ */
 uint8_t* CoapPDU::getPayloadPointer() {
+	if(_payloadReference!=NULL) {
+		return (uint8_t*)_payloadReference;
+	}
 	return _payloadPointer;
 }
 
 /// Gets the length of the payload buffer.
 int CoapPDU::getPayloadLength() {
+	if(_payloadReference!=NULL) {
+		return _payloadReferenceLength;
+	}
 	return _payloadLength;
 }
 
 /// Returns a pointer to a buffer which is a copy of the payload buffer (dynamically allocated).
 uint8_t* CoapPDU::getPayloadCopy() {
-	if(_payloadLength==0) {
+	int payloadLength = getPayloadLength();
+	if(payloadLength==0) {
 		return NULL;
 	}
 
 	// malloc space for copy
-	uint8_t *payload = (uint8_t*)malloc(_payloadLength);
+	uint8_t *payload = (uint8_t*)malloc(payloadLength);
 	if(payload==NULL) {
 		DBG("Unable to allocate memory for payload");
 		return NULL;
 	}
 
 	// copy and return
-	memcpy(payload,_payloadPointer,_payloadLength);
+	memcpy(payload,getPayloadPointer(),payloadLength);
 	return payload;
 }
 
+/// Sets the payload to \b payload without copying it into the PDU buffer.
+/**
+ * The PDU buffer then only holds the header, token and options, and the payload is sent from where it
+ * already is using the scatter-gather list from CoapPDU::getIOVec(). This avoids copying large payloads,
+ * such as firmware blocks or cached representations, into every response.
+ *
+ * Any payload already in the buffer is removed. The referenced memory must stay valid and unchanged until
+ * the PDU has been sent. Setting a payload with CoapPDU::setPayload() or CoapPDU::mallocPayload(), or
+ * calling CoapPDU::reset(), drops the reference.
+ *
+ * \note CoapPDU::getPDUPointer() and CoapPDU::getPDULength() describe the buffer only, so a PDU with a payload
+ * reference must be sent with CoapPDU::getIOVec().
+ *
+ * \param payload Pointer to the payload, which is not copied.
+ * \param len Length of the payload, 0 removes any payload.
+ * \return 0 on success, 1 on failure.
+ */
+int CoapPDU::setPayloadReference(const uint8_t *payload, int len) {
+	if(len<0||(payload==NULL&&len>0)) {
+		DBG("Invalid payload reference");
+		return 1;
+	}
+
+	// a payload in the buffer always sits at the end, after its marker
+	if(_payloadLength>0) {
+		_pduLength -= _payloadLength+1;
+		_payloadPointer = NULL;
+		_payloadLength = 0;
+	}
+
+	if(len==0) {
+		_payloadReference = NULL;
+		_payloadReferenceLength = 0;
+		return 0;
+	}
+
+	// make sure there is room to write the payload marker when sending
+	if(ensureCapacity(_pduLength+1)) {
+		DBG("No space for payload marker");
+		return 1;
+	}
+	_payloadReference = payload;
+	_payloadReferenceLength = len;
+	return 0;
+}
+
+/// Returns 1 if the payload was set with CoapPDU::setPayloadReference(), 0 otherwise.
+int CoapPDU::hasPayloadReference() {
+	return _payloadReference!=NULL;
+}
+
 /// Shorthand for setting the content-format option.
 /**
  * Sets the content-format to the specified value (adds an option).
@@ -1309,9 +2046,261 @@ int CoapPDU::setContentFormat(CoapPDU::ContentFormat format) {
 	return 0;
 }
 
+/// Constructs an end iterator.
+CoapPDU::OptionIterator::OptionIterator() {
+	memset(&_option,0x00,sizeof(CoapOption));
+	_end = NULL;
+}
+
+/// Constructs an iterator positioned at the option starting at \b option.
+/**
+ * \param option Pointer to the first option header byte in the PDU.
+ * \param end Pointer to one past the last byte of the PDU.
+ */
+CoapPDU::OptionIterator::OptionIterator(uint8_t *option, uint8_t *end) {
+	memset(&_option,0x00,sizeof(CoapOption));
+	_option.optionPointer = option;
+	_end = end;
+	decode();
+}
+
+/// Advances to the next option, becoming the end iterator after the last one.
+CoapPDU::OptionIterator& CoapPDU::OptionIterator::operator++() {
+	_option.optionPointer += _option.totalLength;
+	decode();
+	return *this;
+}
+
+/// Decodes the option at the current position, or becomes the end iterator if there is none.
+void CoapPDU::OptionIterator::decode() {
+	uint8_t *option = _option.optionPointer;
+	// options end at the payload marker or the end of the PDU
+	if(option>=_end||*option==0xFF) {
+		_option.optionPointer = NULL;
+		return;
+	}
+	uint16_t optionDelta = 0, optionValueLength = 0;
+	int headerLength = decodeOptionHeader(option,_end-option,&optionDelta,&optionValueLength);
+	if(headerLength==0||option+headerLength+optionValueLength>_end) {
+		DBG("Option overruns PDU, stopping iteration");
+		_option.optionPointer = NULL;
+		return;
+	}
+	_option.optionDelta = optionDelta;
+	_option.optionNumber += optionDelta;
+	_option.optionValueLength = optionValueLength;
+	_option.totalLength = headerLength+optionValueLength;
+	_option.optionValuePointer = option+headerLength;
+}
+
+/// Constructs a range over the options lying between \b begin and \b end.
+CoapPDU::OptionRange::OptionRange(uint8_t *begin, uint8_t *end) {
+	_begin = begin;
+	_end = end;
+}
+
+/// Returns an iterator to the first option.
+CoapPDU::OptionIterator CoapPDU::OptionRange::begin() const {
+	return OptionIterator(_begin,_end);
+}
+
+/// Returns the end iterator.
+CoapPDU::OptionIterator CoapPDU::OptionRange::end() const {
+	return OptionIterator();
+}
+
 // PRIVATE PRIVATE PRIVATE PRIVATE PRIVATE PRIVATE PRIVATE
 // PRIVATE PRIVATE PRIVATE PRIVATE PRIVATE PRIVATE PRIVATE
 
+/// Points the option index at the inline storage and marks it empty.
+void CoapPDU::initOptionIndex() {
+	#if COAP_OPTION_INDEX_SIZE>0
+	_optionIndex = _inlineOptionIndex;
+	_optionIndexCapacity = COAP_OPTION_INDEX_SIZE;
+	#else
+	_optionIndex = NULL;
+	_optionIndexCapacity = 0;
+	#endif
+	_optionIndexLength = -1;
+}
+
+/// Points the PDU at \b buffer, either starting a new PDU in it (\b pduLength 0) or expecting one to be validated.
+void CoapPDU::initBuffer(uint8_t *buffer, int bufferLength, int pduLength) {
+	// pdu
+	_pdu = buffer;
+	_bufferLength = bufferLength;
+	if(pduLength==0) {
+		// this is actually a fresh pdu, header always exists
+		_pduLength = 4;
+		// make sure header is zeroed
+		_pdu[0] = 0x00; _pdu[1] = 0x00; _pdu[2] = 0x00; _pdu[3] = 0x00;
+		setVersion(1);
+	} else {
+		_pduLength = pduLength;
+	}
+
+	// options, only known to be absent if this is a fresh pdu
+	_numOptions = 0;
+	_maxAddedOptionNumber = 0;
+	_optionBitmap = 0;
+	_optionBitmapValid = pduLength==0;
+	initOptionIndex();
+
+	// payload
+	_payloadPointer = NULL;
+	_payloadLength = 0;
+	_payloadReference = NULL;
+	_payloadReferenceLength = 0;
+}
+
+/// Writes the header and token of a response to \b request, see CoapPDU::makeResponse().
+int CoapPDU::initResponse(CoapPDU *request, CoapPDU::Type type, CoapPDU::Code code, uint16_t messageID, int reserveBytes) {
+	int headerLength = COAP_HDR_SIZE+request->getTokenLength();
+	if(request==this||request->getTokenLength()>8||headerLength>request->_pduLength) {
+		DBG("Invalid request");
+		return 1;
+	}
+	if(resetHeader()||ensureCapacity(headerLength+reserveBytes)) {
+		DBG("No space for response");
+		return 1;
+	}
+
+	// header and token in one go, then fix up the fields that differ
+	memcpy(_pdu,request->_pdu,headerLength);
+	_pdu[0] = 0x40|type|(_pdu[0]&0x0F);
+	_pdu[1] = code;
+	uint8_t *to = &_pdu[2];
+	endian_store16(to, messageID);
+	_pduLength = headerLength;
+	return 0;
+}
+
+/// Frees the buffer if the PDU owns it.
+void CoapPDU::freeBuffer() {
+	if(!_constructedFromBuffer) {
+		_allocator->deallocate(_pdu,_bufferLength);
+	} else if(_deleter!=NULL) {
+		_deleter(_pdu);
+	}
+}
+
+/// Takes over the state of \b other, then detaches \b other from its buffer.
+void CoapPDU::moveFrom(CoapPDU &other) {
+	_pdu = other._pdu;
+	_pduLength = other._pduLength;
+	_constructedFromBuffer = other._constructedFromBuffer;
+	_bufferLength = other._bufferLength;
+	_deleter = other._deleter;
+	_allocator = other._allocator;
+	_payloadPointer = other._payloadPointer;
+	_payloadLength = other._payloadLength;
+	_payloadReference = other._payloadReference;
+	_payloadReferenceLength = other._payloadReferenceLength;
+	_numOptions = other._numOptions;
+	_maxAddedOptionNumber = other._maxAddedOptionNumber;
+	_optionBitmap = other._optionBitmap;
+	_optionBitmapValid = other._optionBitmapValid;
+
+	// an index in the other PDU's inline storage has to be copied, external storage is shared
+	#if COAP_OPTION_INDEX_SIZE>0
+	if(other._optionIndex==other._inlineOptionIndex) {
+		if(other._optionIndexLength>0) {
+			memcpy(_inlineOptionIndex,other._inlineOptionIndex,other._optionIndexLength*sizeof(CoapOptionIndexEntry));
+		}
+		_optionIndex = _inlineOptionIndex;
+	} else {
+		_optionIndex = other._optionIndex;
+	}
+	#else
+	_optionIndex = other._optionIndex;
+	#endif
+	_optionIndexCapacity = other._optionIndexCapacity;
+	_optionIndexLength = other._optionIndexLength;
+
+	// a buffer inside the other object goes away with it, so the PDU is copied into a buffer of our own
+	_bufferInObject = 0;
+	if(other._bufferInObject) {
+		int capacity = 0;
+		uint8_t *buffer = _allocator->allocate(_pduLength,&capacity);
+		if(buffer==NULL) {
+			DBG("Failed to allocate %d bytes for PDU",_pduLength);
+			detach();
+		} else {
+			memcpy(buffer,_pdu,_pduLength);
+			if(_payloadPointer!=NULL) {
+				_payloadPointer = &buffer[_payloadPointer-_pdu];
+			}
+			_pdu = buffer;
+			_bufferLength = capacity;
+			_constructedFromBuffer = 0;
+		}
+	}
+
+	other.detach();
+}
+
+/// Leaves the PDU without a buffer, without freeing it. Only destruction, assignment and CoapPDU::adopt() are then valid.
+void CoapPDU::detach() {
+	_pdu = NULL;
+	_pduLength = 0;
+	_bufferLength = 0;
+	_constructedFromBuffer = 1;
+	_bufferInObject = 0;
+	_deleter = NULL;
+	_payloadPointer = NULL;
+	_payloadLength = 0;
+	_payloadReference = NULL;
+	_payloadReferenceLength = 0;
+	_numOptions = 0;
+	_maxAddedOptionNumber = 0;
+	_optionBitmap = 0;
+	_optionBitmapValid = 1;
+	initOptionIndex();
+}
+
+/// Makes sure the buffer can hold \b needed bytes.
+/**
+ * A memory-managed buffer grows to at least twice its current capacity, so a PDU built up one option at a
+ * time only reallocates a logarithmic number of times. An external buffer cannot grow.
+ *
+ * \param needed Number of bytes the buffer must hold.
+ * \return 0 on success, 1 if memory couldn't be allocated or the external buffer is too small.
+ */
+int CoapPDU::ensureCapacity(int needed) {
+	if(needed<=_bufferLength) {
+		return 0;
+	}
+	if(_constructedFromBuffer) {
+		DBG("External buffer too small, needed %d, got %d.",needed,_bufferLength);
+		return 1;
+	}
+	int capacity = _bufferLength*2;
+	if(capacity<COAP_PDU_MIN_CAPACITY) {
+		capacity = COAP_PDU_MIN_CAPACITY;
+	}
+	if(capacity<needed) {
+		capacity = needed;
+	}
+	return reallocBuffer(capacity);
+}
+
+/// Reallocates a memory-managed buffer to \b capacity bytes (or more if the allocator rounds up), keeping the payload pointer valid.
+int CoapPDU::reallocBuffer(int capacity) {
+	int payloadOffset = _payloadPointer==NULL ? -1 : _payloadPointer-_pdu;
+	int newCapacity = 0;
+	uint8_t *newMemory = _allocator->reallocate(_pdu,_bufferLength,capacity,&newCapacity);
+	if(newMemory==NULL) {
+		DBG("Failed to allocate %d bytes for PDU",capacity);
+		return 1;
+	}
+	_pdu = newMemory;
+	_bufferLength = newCapacity;
+	if(payloadOffset>=0) {
+		_payloadPointer = &_pdu[payloadOffset];
+	}
+	return 0;
+}
+
 /// Moves a block of bytes to end of PDU from given offset.
 /**
  * This moves the block of bytes _pdu[_pduLength-1-shiftOffset-shiftAmount] ... _pdu[_pduLength-1-shiftOffset]
@@ -1356,37 +2345,104 @@ void CoapPDU::shiftPDUDown(int startLocation, int shiftOffset, int shiftAmount)
 	}
 }
 
-/// Gets the payload length of an option.
+/// Decodes an option header (the header byte plus any extended delta and length bytes).
 /**
+ * Uses a lookup table indexed by the header byte to find the number of extended bytes, so each option
+ * header is only branched on once. Headers without extended bytes (the common case) take an early exit
+ * which only depends on the header byte itself.
+ *
  * \param option Pointer to location of option in PDU.
- * \return The 16 bit option-payload length.
+ * \param bytesAvailable Number of bytes from \b option to the end of the PDU, must be at least 1.
+ * \param optionDelta Pointer into which the option delta is placed.
+ * \param optionValueLength Pointer into which the option value length is placed.
+ * \return The length of the option header in bytes (1 to 5), or 0 if the header is invalid
+ * (reserved nibble, truncated, or a value that doesn't fit in 16 bits).
  */
-uint16_t CoapPDU::getOptionValueLength(uint8_t *option) {
-	uint16_t delta = (option[0] & 0xF0) >> 4;
-	uint16_t length = (option[0] & 0x0F);
-	// no extra bytes
-	if(length<13) {
-		return length;
+inline int CoapPDU::decodeOptionHeader(const uint8_t *option, int bytesAvailable, uint16_t *optionDelta, uint16_t *optionValueLength) {
+	uint8_t info = gOptionHeaderTable[option[0]];
+	if(info==0) {
+		*optionDelta = option[0]>>4;
+		*optionValueLength = option[0]&0x0F;
+		return COAP_OPTION_HDR_BYTE;
+	}
+	int deltaBytes = info&0x03;
+	int lengthBytes = (info>>2)&0x03;
+	int headerLength = COAP_OPTION_HDR_BYTE+deltaBytes+lengthBytes;
+	if((info&COAP_OPTION_HEADER_INVALID)||headerLength>bytesAvailable) {
+		return 0;
 	}
 
-	// extra bytes skip header
-	int offset = 1;
-	// skip extra option delta bytes
-	if(delta==13) {
-		offset++;
-	} else if(delta==14) {
-		offset+=2;
+	const uint8_t *from = &option[1];
+	uint32_t delta = option[0]>>4;
+	if(deltaBytes==1) {
+		delta = from[0]+13;
+	} else if(deltaBytes==2) {
+		delta = endian_load16(uint32_t, from)+269;
 	}
+	from += deltaBytes;
 
-	// process length
-	if(length==13) {
-		return (option[offset]+13);
-	} else {
-		uint8_t *from = &option[offset];
-		uint16_t value = endian_load16(uint16_t, from);
-		return value+269;
+	uint32_t length = option[0]&0x0F;
+	if(lengthBytes==1) {
+		length = from[0]+13;
+	} else if(lengthBytes==2) {
+		length = endian_load16(uint32_t, from)+269;
 	}
 
+	if(delta>0xFFFF||length>0xFFFF) {
+		return 0;
+	}
+	*optionDelta = delta;
+	*optionValueLength = length;
+	return headerLength;
+}
+
+/// Walks over a sequence of options, checking that each is well formed.
+/**
+ * \param option Pointer to the first option.
+ * \param bytesRemaining Number of bytes from \b option to the end of the PDU.
+ * \param payloadOffset Pointer into which the offset of the payload, relative to \b option, is placed. This
+ * is \b bytesRemaining if there is no payload.
+ * \return The number of options, or -1 if the options are malformed or a payload marker isn't followed by a payload.
+ */
+int CoapPDU::walkOptions(const uint8_t *option, int bytesRemaining, int *payloadOffset) {
+	uint16_t optionDelta = 0, optionValueLength = 0;
+	uint32_t optionNumber = 0;
+	int optionPos = 0;
+	int numOptions = 0;
+	while(optionPos<bytesRemaining) {
+		if(option[optionPos]==0xFF) {
+			if(optionPos+1==bytesRemaining) {
+				return -1;
+			}
+			*payloadOffset = optionPos+1;
+			return numOptions;
+		}
+		int headerLength = decodeOptionHeader(&option[optionPos],bytesRemaining-optionPos,&optionDelta,&optionValueLength);
+		if(headerLength==0) {
+			return -1;
+		}
+		optionNumber += optionDelta;
+		optionPos += headerLength+optionValueLength;
+		if(optionNumber>0xFFFF||optionPos>bytesRemaining) {
+			return -1;
+		}
+		numOptions++;
+	}
+	*payloadOffset = bytesRemaining;
+	return numOptions;
+}
+
+/// Gets the payload length of an option.
+/**
+ * \param option Pointer to location of option in PDU.
+ * \return The 16 bit option-payload length.
+ */
+uint16_t CoapPDU::getOptionValueLength(uint8_t *option) {
+	uint16_t delta = 0, length = 0;
+	if(decodeOptionHeader(option,5,&delta,&length)==0) {
+		return option[0]&0x0F;
+	}
+	return length;
 }
 
 /// Gets the delta of an option.
@@ -1395,20 +2451,12 @@ uint16_t CoapPDU::getOptionValueLength(uint8_t *option) {
  * \return The 16 bit delta.
  */
 uint16_t CoapPDU::getOptionDelta(uint8_t *option) {
-	uint16_t delta = (option[0] & 0xF0) >> 4;
-	if(delta<13) {
-		return delta;
-	} else if(delta==13) {
-		// single byte option delta
-		return (option[1]+13);
-	} else if(delta==14) {
-		uint8_t *from = &option[1];
-		uint16_t value = endian_load16(uint16_t, from);
-		return value+269;
-	} else {
+	uint16_t delta = 0, length = 0;
+	if(decodeOptionHeader(option,5,&delta,&length)==0) {
 		// should only ever occur in payload marker
-		return delta;
+		return (option[0]&0xF0)>>4;
 	}
+	return delta;
 }
 
 /// Finds the insertion position in the current list of options for the specified option.
@@ -1437,9 +2485,12 @@ int CoapPDU::findInsertionPosition(uint16_t optionNumber, uint16_t *prevOptionNu
 	uint16_t optionDelta = 0, optionValueLength = 0;
 	uint16_t currentOptionNumber = 0;
 	while(optionPos<_pduLength && _pdu[optionPos]!=0xFF) {
-		optionDelta = getOptionDelta(&_pdu[optionPos]);
+		int headerLength = decodeOptionHeader(&_pdu[optionPos],_pduLength-optionPos,&optionDelta,&optionValueLength);
+		if(headerLength==0) {
+			DBG("Malformed option at %d",optionPos);
+			break;
+		}
 		currentOptionNumber += optionDelta;
-		optionValueLength = getOptionValueLength(&_pdu[optionPos]);
 		// test if this is insertion position
 		if(currentOptionNumber>optionNumber) {
 			return optionPos;
@@ -1447,10 +2498,7 @@ int CoapPDU::findInsertionPosition(uint16_t optionNumber, uint16_t *prevOptionNu
 		// keep track of the last valid option number
 		*prevOptionNumber = currentOptionNumber;
 		// move onto next option
-		optionPos += computeExtraBytes(optionDelta);
-		optionPos += computeExtraBytes(optionValueLength);
-		optionPos += optionValueLength;
-		optionPos++; // (for mandatory option header byte)
+		optionPos += headerLength+optionValueLength;
 	}
 	return optionPos;
 
@@ -1503,14 +2551,14 @@ void CoapPDU::setOptionDelta(int optionPosition, uint16_t optionDelta) {
  * \param insertionPosition Position in the PDU where the option should be placed.
  * \param optionDelta The delta value for the option.
  * \param optionValueLength The length of the option value.
- * \param optionValue A pointer to the sequence of bytes representing the option value.
+ * \param optionValue A pointer to the sequence of bytes representing the option value, or NULL to write only the header.
  * \return 0 on success, 1 on failure.
  */
 int CoapPDU::insertOption(
 	int insertionPosition,
 	uint16_t optionDelta,
 	uint16_t optionValueLength,
-	uint8_t *optionValue) {
+	const uint8_t *optionValue) {
 
 	int headerStart = insertionPosition;
 
@@ -1552,7 +2600,9 @@ int CoapPDU::insertOption(
 	}
 
 	// and finally copy the option value itself
-	memcpy(&_pdu[++insertionPosition],optionValue,optionValueLength);
+	if(optionValue!=NULL) {
+		memcpy(&_pdu[++insertionPosition],optionValue,optionValueLength);
+	}
 
 	return 0;
 }
@@ -1604,6 +2654,9 @@ void CoapPDU::printHuman() {
 		case COAP_DELETE:
 			INFO("0.04 DELETE");
 		break;
+		case COAP_FETCH:
+			INFO("0.05 FETCH");
+		break;
 		case COAP_CREATED:
 			INFO("2.01 Created");
 		break;
@@ -1619,6 +2672,9 @@ void CoapPDU::printHuman() {
 		case COAP_CONTENT:
 			INFO("2.05 Content");
 		break;
+		case COAP_CONTINUE:
+			INFO("2.31 Continue");
+		break;
 		case COAP_BAD_REQUEST:
 			INFO("4.00 Bad Request");
 		break;
@@ -1640,6 +2696,9 @@ void CoapPDU::printHuman() {
 		case COAP_NOT_ACCEPTABLE:
 			INFO("4.06 Not Acceptable");
 		break;
+		case COAP_REQUEST_ENTITY_INCOMPLETE:
+			INFO("4.08 Request Entity Incomplete");
+		break;
 		case COAP_PRECONDITION_FAILED:
 			INFO("4.12 Precondition Failed");
 		break;
@@ -1689,18 +2748,18 @@ void CoapPDU::printHuman() {
 	}
 
 	// print options
-	CoapPDU::CoapOption* options = getOptions();
-	if(options==NULL) {
+	if(_numOptions==0) {
 		INFO("NO options");
 	} else {
 		INFO("%d options:",_numOptions);
 	}
-	
-	for(int i=0; i<_numOptions; i++) {
-		INFO("OPTION (%d/%d)",i + 1,_numOptions);
-		INFO("   Option number (delta): %hu (%hu)",options[i].optionNumber,options[i].optionDelta);
+
+	int i = 0;
+	for(const CoapOption &option : options()) {
+		INFO("OPTION (%d/%d)",++i,_numOptions);
+		INFO("   Option number (delta): %hu (%hu)",option.optionNumber,option.optionDelta);
 		INFOX("   Name: ");
-		switch(options[i].optionNumber) {
+		switch(option.optionNumber) {
 			case COAP_OPTION_IF_MATCH:
 				INFO("IF_MATCH");
 			break;
@@ -1759,13 +2818,13 @@ void CoapPDU::printHuman() {
 				INFO("SIZE2");
 			break;
 			default:
-				INFO("Unknown option %u",(unsigned)options[i].optionNumber);
+				INFO("Unknown option %u",(unsigned)option.optionNumber);
 			break;
 		}
-		INFO("   Value length: %u",options[i].optionValueLength);
+		INFO("   Value length: %u",option.optionValueLength);
 		INFOX("   Value: \"");
-		for(int j=0; j<options[i].optionValueLength; j++) {
-			char c = options[i].optionValuePointer[j];
+		for(int j=0; j<option.optionValueLength; j++) {
+			char c = option.optionValuePointer[j];
 			if((c>='!'&&c<='~')||c==' ') {
 				INFOX("%c",c);
 			} else {
@@ -1791,7 +2850,6 @@ void CoapPDU::printHuman() {
 		}
 		INFO("\"");
 	}
-	free(options);
 	INFO("__________________");
 }
 
@@ -1922,3 +2980,442 @@ void CoapPDU::printBinary(uint8_t b) {
 void CoapPDU::print() {
 	fwrite(_pdu,1,_pduLength,stdout);
 }
+
+// ALLOCATOR ALLOCATOR ALLOCATOR ALLOCATOR ALLOCATOR ALLOCATOR
+// ALLOCATOR ALLOCATOR ALLOCATOR ALLOCATOR ALLOCATOR ALLOCATOR
+
+/// Allocator backed by malloc(), realloc() and free(), allocating exactly what is asked for.
+class CoapMallocAllocator : public CoapAllocator {
+	public:
+		uint8_t* allocate(int bytes, int *capacity) {
+			uint8_t *buffer = (uint8_t*)malloc(bytes);
+			*capacity = buffer==NULL ? 0 : bytes;
+			return buffer;
+		}
+
+		uint8_t* reallocate(uint8_t *buffer, int oldCapacity, int bytes, int *capacity) {
+			(void)oldCapacity;
+			uint8_t *newBuffer = (uint8_t*)realloc(buffer,bytes);
+			if(newBuffer!=NULL) {
+				*capacity = bytes;
+			}
+			return newBuffer;
+		}
+
+		void deallocate(uint8_t *buffer, int capacity) {
+			(void)capacity;
+			free(buffer);
+		}
+};
+
+static CoapMallocAllocator gMallocAllocator;
+static thread_local CoapAllocator *gDefaultAllocator = NULL;
+
+/// Returns the allocator used by CoapPDU::CoapPDU() on the calling thread.
+CoapAllocator* CoapAllocator::getDefault() {
+	return gDefaultAllocator==NULL ? &gMallocAllocator : gDefaultAllocator;
+}
+
+/// Sets the allocator used by CoapPDU::CoapPDU() on the calling thread, NULL restores malloc().
+/**
+ * Only PDUs constructed afterwards are affected, existing PDUs keep the allocator they were constructed with.
+ *
+ * \param allocator The allocator, which must outlive every PDU using it.
+ */
+void CoapAllocator::setDefault(CoapAllocator *allocator) {
+	gDefaultAllocator = allocator;
+}
+
+/// Returns the malloc() based allocator, which is the default unless CoapAllocator::setDefault() is called.
+CoapAllocator* CoapAllocator::getMallocAllocator() {
+	return &gMallocAllocator;
+}
+
+// BUILDER BUILDER BUILDER BUILDER BUILDER BUILDER BUILDER
+// BUILDER BUILDER BUILDER BUILDER BUILDER BUILDER BUILDER
+
+/// Constructs an empty builder, equivalent to a fresh CoapPDU (version 1, no token, options or payload).
+CoapPDUBuilder::CoapPDUBuilder() {
+	reset();
+}
+
+/// Clears the builder so it can be used for another PDU.
+void CoapPDUBuilder::reset() {
+	_header[0] = 0x40;
+	_header[1] = 0x00;
+	_header[2] = 0x00;
+	_header[3] = 0x00;
+	_numOptions = 0;
+	_sorted = 1;
+	_payload = NULL;
+	_payloadLength = 0;
+}
+
+/// Sets the message type.
+void CoapPDUBuilder::setType(CoapPDU::Type type) {
+	_header[0] &= 0xCF;
+	_header[0] |= type;
+}
+
+/// Sets the message code.
+void CoapPDUBuilder::setCode(CoapPDU::Code code) {
+	_header[1] = code;
+}
+
+/// Sets the message ID.
+void CoapPDUBuilder::setMessageID(uint16_t messageID) {
+	uint8_t *to = &_header[2];
+	endian_store16(to, messageID);
+}
+
+/// Sets the token, which is copied.
+/**
+ * \param token A sequence of bytes representing the token.
+ * \param tokenLength The length of the byte sequence, at most 8.
+ * \return 0 on success, 1 on failure.
+ */
+int CoapPDUBuilder::setToken(const uint8_t *token, uint8_t tokenLength) {
+	if(tokenLength>8||(token==NULL&&tokenLength!=0)) {
+		DBG("Invalid token");
+		return 1;
+	}
+	// token may be NULL to clear it
+	if(tokenLength>0) {
+		memcpy(_token,token,tokenLength);
+	}
+	_header[0] &= 0xF0;
+	_header[0] |= tokenLength;
+	return 0;
+}
+
+/// Adds an option. Options can be added in any order, options with the same number keep the order they were added in.
+/**
+ * \param optionNumber The number of the option, see the enum CoapPDU::Option for shorthand notations.
+ * \param optionLength The length of the option value in bytes.
+ * \param optionValue A pointer to the option value, which must stay valid until CoapPDUBuilder::build().
+ * \return 0 on success, 1 if COAP_BUILDER_MAX_OPTIONS options have already been added.
+ */
+int CoapPDUBuilder::addOption(uint16_t optionNumber, uint16_t optionLength, const uint8_t *optionValue) {
+	if(_numOptions==COAP_BUILDER_MAX_OPTIONS) {
+		DBG("Builder is full, cannot add option %d",optionNumber);
+		return 1;
+	}
+	if(_numOptions>0 && optionNumber<_options[_numOptions-1].optionNumber) {
+		_sorted = 0;
+	}
+	Entry *entry = &_options[_numOptions++];
+	entry->optionNumber = optionNumber;
+	entry->optionValueLength = optionLength;
+	entry->optionValue = optionValue;
+	return 0;
+}
+
+/// Adds every option of a validated PDU, for example to forward an upstream request or response.
+/**
+ * The option values are referenced in place, so \b pdu must not be modified or deleted, and must not be the
+ * PDU passed to CoapPDUBuilder::build(), until the PDU has been built.
+ *
+ * \param pdu The PDU to copy options from.
+ * \return 0 on success, 1 if the options don't all fit.
+ */
+int CoapPDUBuilder::addOptions(CoapPDU *pdu) {
+	for(const CoapPDU::CoapOption &o : pdu->options()) {
+		if(addOption(o.optionNumber,o.optionValueLength,o.optionValuePointer)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/// Removes all options with the specified number, for example hop-by-hop options when proxying.
+/**
+ * \param optionNumber The number of the options to remove.
+ * \return The number of options removed.
+ */
+int CoapPDUBuilder::removeOption(uint16_t optionNumber) {
+	int kept = 0;
+	for(int i=0; i<_numOptions; i++) {
+		if(_options[i].optionNumber!=optionNumber) {
+			_options[kept++] = _options[i];
+		}
+	}
+	int removed = _numOptions-kept;
+	_numOptions = kept;
+	return removed;
+}
+
+/// Returns the number of options added so far.
+int CoapPDUBuilder::getNumOptions() {
+	return _numOptions;
+}
+
+/// Sets the payload, which must stay valid until CoapPDUBuilder::build(). A NULL or zero length payload means none.
+void CoapPDUBuilder::setPayload(const uint8_t *payload, int len) {
+	_payload = payload;
+	_payloadLength = payload==NULL||len<0 ? 0 : len;
+}
+
+/// Returns the length of the PDU that CoapPDUBuilder::build() will produce.
+int CoapPDUBuilder::getPDULength() {
+	sortOptions();
+	int length = COAP_HDR_SIZE+(_header[0]&0x0F);
+	uint16_t prevOptionNumber = 0;
+	for(int i=0; i<_numOptions; i++) {
+		Entry *entry = &_options[i];
+		length += COAP_OPTION_HDR_BYTE+CoapPDU::computeExtraBytes(entry->optionNumber-prevOptionNumber)+
+			CoapPDU::computeExtraBytes(entry->optionValueLength)+entry->optionValueLength;
+		prevOptionNumber = entry->optionNumber;
+	}
+	if(_payloadLength>0) {
+		length += 1+_payloadLength;
+	}
+	return length;
+}
+
+/// Encodes the PDU into \b pdu, replacing its contents.
+/**
+ * Options are sorted once, then the header, token, options and payload are each written once, front to back.
+ * A memory-managed PDU is grown if necessary, a PDU using an external buffer must be large enough.
+ * On success \b pdu is ready to use as if it had been built with CoapPDU::addOption() and so on, there is
+ * no need to call CoapPDU::validate().
+ *
+ * \param pdu The PDU to build into.
+ * \return 0 on success, 1 if there wasn't enough space.
+ */
+int CoapPDUBuilder::build(CoapPDU *pdu) {
+	int pduLength = getPDULength();
+	if(pdu->ensureCapacity(pduLength)) {
+		DBG("No space to build PDU of %d bytes",pduLength);
+		return 1;
+	}
+
+	int tokenLength = _header[0]&0x0F;
+	memcpy(pdu->_pdu,_header,COAP_HDR_SIZE);
+	memcpy(&pdu->_pdu[COAP_HDR_SIZE],_token,tokenLength);
+	int optionPos = COAP_HDR_SIZE+tokenLength;
+	uint16_t prevOptionNumber = 0;
+	uint64_t optionBitmap = 0;
+	for(int i=0; i<_numOptions; i++) {
+		Entry *entry = &_options[i];
+		uint16_t optionDelta = entry->optionNumber-prevOptionNumber;
+		pdu->insertOption(optionPos,optionDelta,entry->optionValueLength,entry->optionValue);
+		optionPos += COAP_OPTION_HDR_BYTE+CoapPDU::computeExtraBytes(optionDelta)+
+			CoapPDU::computeExtraBytes(entry->optionValueLength)+entry->optionValueLength;
+		prevOptionNumber = entry->optionNumber;
+		optionBitmap |= CoapPDU::getOptionBit(entry->optionNumber);
+	}
+
+	pdu->_pduLength = pduLength;
+	pdu->_numOptions = _numOptions;
+	pdu->_maxAddedOptionNumber = prevOptionNumber;
+	pdu->_optionIndexLength = -1;
+	pdu->_optionBitmap = optionBitmap;
+	pdu->_optionBitmapValid = 1;
+	pdu->_payloadReference = NULL;
+	pdu->_payloadReferenceLength = 0;
+	if(_payloadLength>0) {
+		pdu->_pdu[optionPos] = 0xFF;
+		memcpy(&pdu->_pdu[optionPos+1],_payload,_payloadLength);
+		pdu->_payloadPointer = &pdu->_pdu[optionPos+1];
+		pdu->_payloadLength = _payloadLength;
+	} else {
+		pdu->_payloadPointer = NULL;
+		pdu->_payloadLength = 0;
+	}
+	return 0;
+}
+
+/// Sorts the collected options by number, keeping the order of options with the same number.
+/**
+ * Insertion sort, which is linear when options were added in order and cheap for the handful of
+ * options a PDU normally carries.
+ */
+void CoapPDUBuilder::sortOptions() {
+	if(_sorted) {
+		return;
+	}
+	for(int i=1; i<_numOptions; i++) {
+		Entry entry = _options[i];
+		int j = i;
+		while(j>0 && _options[j-1].optionNumber>entry.optionNumber) {
+			_options[j] = _options[j-1];
+			j--;
+		}
+		_options[j] = entry;
+	}
+	_sorted = 1;
+}
+
+// TEMPLATE TEMPLATE TEMPLATE TEMPLATE TEMPLATE TEMPLATE TEMPLATE
+// TEMPLATE TEMPLATE TEMPLATE TEMPLATE TEMPLATE TEMPLATE TEMPLATE
+
+/// Constructs an empty template, which stamps PDUs with version 1 and no options.
+CoapPDUTemplate::CoapPDUTemplate() {
+	_header0 = 0x40;
+	_code = 0x00;
+	_optionsLength = 0;
+	_numOptions = 0;
+	_lastOptionNumber = 0;
+	_optionBitmap = 0;
+}
+
+/// Takes the version, type, code and options of \b pdu, ignoring its message ID, token and payload.
+/**
+ * \b pdu can be any valid PDU, typically one built once at startup for each kind of response. It is not
+ * referenced after this returns.
+ *
+ * \param pdu The PDU to freeze.
+ * \return 0 on success, 1 if the options are malformed or longer than COAP_TEMPLATE_MAX_OPTIONS_LENGTH.
+ */
+int CoapPDUTemplate::freeze(CoapPDU *pdu) {
+	int optionsStart = COAP_HDR_SIZE+pdu->getTokenLength();
+	if(pdu->_pduLength<optionsStart) {
+		DBG("PDU is shorter than its header and token");
+		return 1;
+	}
+	int bytesRemaining = pdu->_pduLength-optionsStart;
+	int payloadOffset = 0;
+	int numOptions = CoapPDU::walkOptions(&pdu->_pdu[optionsStart],bytesRemaining,&payloadOffset);
+	if(numOptions<0) {
+		DBG("PDU options are malformed");
+		return 1;
+	}
+	// payloadOffset is just past the payload marker, if there is one
+	int optionsLength = payloadOffset==bytesRemaining ? bytesRemaining : payloadOffset-1;
+	if(optionsLength>COAP_TEMPLATE_MAX_OPTIONS_LENGTH) {
+		DBG("Options too long for template: %d bytes",optionsLength);
+		return 1;
+	}
+
+	// find the last option number, so options can still be added to stamped PDUs
+	uint16_t optionDelta = 0, optionValueLength = 0, optionNumber = 0;
+	const uint8_t *options = &pdu->_pdu[optionsStart];
+	int optionPos = 0;
+	uint64_t optionBitmap = 0;
+	while(optionPos<optionsLength) {
+		int headerLength = CoapPDU::decodeOptionHeader(&options[optionPos],optionsLength-optionPos,&optionDelta,&optionValueLength);
+		optionNumber += optionDelta;
+		optionPos += headerLength+optionValueLength;
+		optionBitmap |= CoapPDU::getOptionBit(optionNumber);
+	}
+
+	memcpy(_options,options,optionsLength);
+	_optionsLength = optionsLength;
+	_numOptions = numOptions;
+	_lastOptionNumber = optionNumber;
+	_optionBitmap = optionBitmap;
+	_header0 = pdu->_pdu[0]&0xF0;
+	_code = pdu->_pdu[1];
+	return 0;
+}
+
+/// Writes a PDU from the template, replacing anything \b pdu held before.
+/**
+ * Only the header, \b token and \b payload are written field by field, the options are copied from the
+ * template as they are. The result is the same as building the PDU with CoapPDU::setToken(),
+ * CoapPDU::addOption() and CoapPDU::setPayload(), and further options may still be added to it.
+ *
+ * \param pdu The PDU to write, managed PDUs grow as needed, external buffers must be large enough.
+ * \param messageID The message ID.
+ * \param token The token, may be NULL if \b tokenLength is 0.
+ * \param tokenLength The length of the token, at most 8.
+ * \param payload The payload, which is copied. May be NULL if \b payloadLength is 0.
+ * \param payloadLength The length of the payload.
+ * \return 0 on success, 1 on failure.
+ */
+int CoapPDUTemplate::stamp(CoapPDU *pdu, uint16_t messageID, const uint8_t *token, uint8_t tokenLength,
+	const uint8_t *payload, int payloadLength) {
+	if(tokenLength>8||(token==NULL&&tokenLength!=0)||payloadLength<0||(payload==NULL&&payloadLength!=0)) {
+		DBG("Invalid token or payload");
+		return 1;
+	}
+	int pduLength = getPDULength(tokenLength,payloadLength);
+	if(pdu->ensureCapacity(pduLength)) {
+		DBG("No space to stamp PDU, needed %d bytes",pduLength);
+		return 1;
+	}
+
+	uint8_t *out = pdu->_pdu;
+	out[0] = _header0|tokenLength;
+	out[1] = _code;
+	uint8_t *to = &out[2];
+	endian_store16(to, messageID);
+	// token may be NULL when there isn't one
+	if(tokenLength>0) {
+		memcpy(&out[COAP_HDR_SIZE],token,tokenLength);
+	}
+	int pos = COAP_HDR_SIZE+tokenLength;
+	if(_optionsLength>0) {
+		memcpy(&out[pos],_options,_optionsLength);
+	}
+	pos += _optionsLength;
+
+	if(payloadLength>0) {
+		out[pos] = 0xFF;
+		memcpy(&out[pos+1],payload,payloadLength);
+		pdu->_payloadPointer = &out[pos+1];
+	} else {
+		pdu->_payloadPointer = NULL;
+	}
+	pdu->_payloadLength = payloadLength;
+	pdu->_payloadReference = NULL;
+	pdu->_payloadReferenceLength = 0;
+	pdu->_pduLength = pduLength;
+	pdu->_numOptions = _numOptions;
+	pdu->_maxAddedOptionNumber = _lastOptionNumber;
+	pdu->_optionIndexLength = -1;
+	pdu->_optionBitmap = _optionBitmap;
+	pdu->_optionBitmapValid = 1;
+	return 0;
+}
+
+/// Overwrites the value of an option in a PDU stamped from this template, for example a per-resource ETag.
+/**
+ * The first option numbered \b optionNumber is patched, and it must have the same value length in the template
+ * as \b optionLength, so no other byte of the PDU moves. \b pdu must have been written by CoapPDUTemplate::stamp()
+ * from this template and not had options added since.
+ *
+ * \param pdu The stamped PDU.
+ * \param optionNumber The number of the option to patch.
+ * \param optionValue The new value.
+ * \param optionLength The length of the new value, which must match the template.
+ * \return 0 on success, 1 if there is no such option or its length differs.
+ */
+int CoapPDUTemplate::patchOption(CoapPDU *pdu, uint16_t optionNumber, const uint8_t *optionValue, uint16_t optionLength) {
+	uint16_t optionDelta = 0, optionValueLength = 0, currentNumber = 0;
+	int optionPos = 0;
+	while(optionPos<_optionsLength) {
+		int headerLength = CoapPDU::decodeOptionHeader(&_options[optionPos],_optionsLength-optionPos,&optionDelta,&optionValueLength);
+		currentNumber += optionDelta;
+		optionPos += headerLength;
+		if(currentNumber==optionNumber) {
+			if(optionValueLength!=optionLength) {
+				DBG("Option %d has length %d in template, not %d",optionNumber,optionValueLength,optionLength);
+				return 1;
+			}
+			memcpy(&pdu->_pdu[COAP_HDR_SIZE+pdu->getTokenLength()+optionPos],optionValue,optionLength);
+			return 0;
+		}
+		if(currentNumber>optionNumber) {
+			break;
+		}
+		optionPos += optionValueLength;
+	}
+	DBG("Option %d is not in template",optionNumber);
+	return 1;
+}
+
+/// Returns the number of options in the template.
+int CoapPDUTemplate::getNumOptions() {
+	return _numOptions;
+}
+
+/// Returns the length of the encoded options in the template.
+int CoapPDUTemplate::getOptionsLength() {
+	return _optionsLength;
+}
+
+/// Returns the length of a PDU stamped with a token of \b tokenLength bytes and a payload of \b payloadLength bytes.
+int CoapPDUTemplate::getPDULength(uint8_t tokenLength, int payloadLength) {
+	return COAP_HDR_SIZE+tokenLength+_optionsLength+(payloadLength>0 ? payloadLength+1 : 0);
+}
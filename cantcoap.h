@@ -5,9 +5,36 @@
 #include <stdint.h>
 #include "dbg.h"
 
+struct iovec;
+
 #define COAP_HDR_SIZE 4
 #define COAP_OPTION_HDR_BYTE 1
 
+// number of option index entries stored inside each CoapPDU, see CoapPDU::setOptionIndexStorage()
+#ifndef COAP_OPTION_INDEX_SIZE
+#define COAP_OPTION_INDEX_SIZE 16
+#endif
+
+// smallest capacity a memory-managed CoapPDU grows to when it first needs more space
+#ifndef COAP_PDU_MIN_CAPACITY
+#define COAP_PDU_MIN_CAPACITY 64
+#endif
+
+// maximum number of options a CoapPDUBuilder can collect
+#ifndef COAP_BUILDER_MAX_OPTIONS
+#define COAP_BUILDER_MAX_OPTIONS 32
+#endif
+
+// maximum length of the encoded options a CoapPDUTemplate can hold
+#ifndef COAP_TEMPLATE_MAX_OPTIONS_LENGTH
+#define COAP_TEMPLATE_MAX_OPTIONS_LENGTH 128
+#endif
+
+// maximum number of packets examined by one call to CoapPDU::validateBatch()
+#ifndef COAP_VALIDATE_BATCH_SIZE
+#define COAP_VALIDATE_BATCH_SIZE 64
+#endif
+
 // CoAP PDU format
 
 //   0                   1                   2                   3
@@ -22,7 +49,42 @@
 // |1 1 1 1 1 1 1 1|    Payload (if any) ...
 // +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
 
+class CoapPDUBuilder;
+class CoapPDUTemplate;
+
+/// Frees a buffer handed to a CoapPDU with CoapPDU::adopt(), called when the PDU is destroyed or adopts another buffer.
+typedef void (*CoapBufferDeleter)(uint8_t *buffer);
+
+/// Source of memory for the buffers of memory-managed CoapPDUs.
+/**
+ * An allocator may hand out more memory than asked for, it reports the usable size through \b capacity and
+ * the PDU makes use of it. The capacity is passed back when the buffer is reallocated or freed, so an allocator
+ * doesn't need to store block sizes itself.
+ *
+ * A PDU uses the allocator passed to CoapPDU::CoapPDU(CoapAllocator *allocator), or the calling thread's default
+ * (see CoapAllocator::setDefault()) when constructed with CoapPDU::CoapPDU(). The default is malloc().
+ */
+class CoapAllocator {
+	public:
+		virtual ~CoapAllocator() {}
+		/// Allocates at least \b bytes, placing the usable size in \b capacity. Returns NULL on failure.
+		virtual uint8_t* allocate(int bytes, int *capacity) = 0;
+		/// Resizes \b buffer of \b oldCapacity to at least \b bytes, preserving contents. Returns NULL on failure, leaving \b buffer intact.
+		virtual uint8_t* reallocate(uint8_t *buffer, int oldCapacity, int bytes, int *capacity) = 0;
+		/// Frees \b buffer, \b capacity is as returned when it was (re)allocated.
+		virtual void deallocate(uint8_t *buffer, int capacity) = 0;
+
+		static CoapAllocator* getDefault();
+		static void setDefault(CoapAllocator *allocator);
+		static CoapAllocator* getMallocAllocator();
+};
+
+template<int N> class CoapInlinePDU;
+
 class CoapPDU {
+	friend class CoapPDUBuilder;
+	friend class CoapPDUTemplate;
+	template<int N> friend class CoapInlinePDU;
 
 
 	public:
@@ -41,12 +103,14 @@ class CoapPDU {
 			COAP_POST,
 			COAP_PUT,
 			COAP_DELETE,
+			COAP_FETCH,
 			COAP_LASTMETHOD=0x1F,
 			COAP_CREATED=0x41,
 			COAP_DELETED,
 			COAP_VALID,
 			COAP_CHANGED,
 			COAP_CONTENT,
+			COAP_CONTINUE=0x5F,
 			COAP_BAD_REQUEST=0x80,
 			COAP_UNAUTHORIZED,
 			COAP_BAD_OPTION,
@@ -54,6 +118,7 @@ class CoapPDU {
 			COAP_NOT_FOUND,
 			COAP_METHOD_NOT_ALLOWED,
 			COAP_NOT_ACCEPTABLE,
+			COAP_REQUEST_ENTITY_INCOMPLETE=0x88,
 			COAP_PRECONDITION_FAILED=0x8C,
 			COAP_REQUEST_ENTITY_TOO_LARGE=0x8D,
 			COAP_UNSUPPORTED_CONTENT_FORMAT=0x8F,
@@ -183,13 +248,78 @@ class CoapPDU {
 			uint8_t *optionValuePointer;
 		};
 
+		/// Entry in the option index recorded by CoapPDU::validate(). Offsets are relative to the start of the PDU.
+		struct CoapOptionIndexEntry {
+			uint16_t optionNumber;
+			uint16_t valueOffset;
+			uint16_t valueLength;
+		};
+
+		/// Forward iterator over the options of a PDU, see CoapPDU::options()
+		/**
+		 * Each option is decoded in place from the PDU buffer as the iterator advances, nothing is allocated.
+		 */
+		class OptionIterator {
+			public:
+				OptionIterator();
+				OptionIterator(uint8_t *option, uint8_t *end);
+				const CoapOption& operator*() const { return _option; }
+				const CoapOption* operator->() const { return &_option; }
+				OptionIterator& operator++();
+				bool operator==(const OptionIterator &other) const { return _option.optionPointer==other._option.optionPointer; }
+				bool operator!=(const OptionIterator &other) const { return _option.optionPointer!=other._option.optionPointer; }
+
+			private:
+				void decode();
+				CoapOption _option;
+				uint8_t *_end;
+		};
+
+		/// Results of CoapPDU::validateBatch(), stored as one array per field where entry i describes packet i.
+		/**
+		 * Fields other than \b valid are only meaningful for packets which validated. The token of packet i
+		 * starts at COAP_HDR_SIZE and is \b tokenLength[i] bytes long, the payload starts at \b payloadOffset[i]
+		 * and is \b payloadLength[i] bytes long (0 if there is no payload).
+		 */
+		struct ValidateBatchResult {
+			uint8_t valid[COAP_VALIDATE_BATCH_SIZE];
+			uint8_t type[COAP_VALIDATE_BATCH_SIZE];
+			uint8_t code[COAP_VALIDATE_BATCH_SIZE];
+			uint8_t tokenLength[COAP_VALIDATE_BATCH_SIZE];
+			uint16_t messageID[COAP_VALIDATE_BATCH_SIZE];
+			uint16_t numOptions[COAP_VALIDATE_BATCH_SIZE];
+			uint16_t payloadOffset[COAP_VALIDATE_BATCH_SIZE];
+			uint16_t payloadLength[COAP_VALIDATE_BATCH_SIZE];
+		};
+
+		/// Range over the options of a PDU, returned by CoapPDU::options()
+		class OptionRange {
+			public:
+				OptionRange(uint8_t *begin, uint8_t *end);
+				OptionIterator begin() const;
+				OptionIterator end() const;
+
+			private:
+				uint8_t *_begin;
+				uint8_t *_end;
+		};
+
 		// construction and destruction
 		CoapPDU();
+		explicit CoapPDU(CoapAllocator *allocator);
 		CoapPDU(uint8_t *pdu, int pduLength);
 		CoapPDU(uint8_t *buffer, int bufferLength, int pduLength);
+		CoapPDU(CoapPDU &&other) noexcept;
+		CoapPDU& operator=(CoapPDU &&other) noexcept;
+		CoapPDU(const CoapPDU &other) = delete;
+		CoapPDU& operator=(const CoapPDU &other) = delete;
 		~CoapPDU();
 		int reset();
+		int resetHeader();
+		int makeResponse(CoapPDU *request, CoapPDU::Code code, uint16_t messageID, int reserveBytes);
+		int makeSeparateResponse(CoapPDU *request, CoapPDU::Code code, uint16_t messageID, int reserveBytes);
 		int validate();
+		static int validateBatch(const uint8_t *const *pdus, const int *pduLengths, int count, ValidateBatchResult *result);
 
 		// version
 		int setVersion(uint8_t version);
@@ -218,6 +348,16 @@ class CoapPDU {
 		int addOption(uint16_t optionNumber, uint16_t optionLength, uint8_t *optionValue);
 		// gets a list of all options
 		CoapOption* getOptions();
+		static uint64_t getOptionBit(uint16_t optionNumber);
+		OptionRange options();
+		// option index recorded by validate()
+		void setOptionIndexStorage(CoapOptionIndexEntry *storage, int capacity);
+		const CoapOptionIndexEntry* getOptionIndex(int *numEntries);
+		int findIndexedOptions(uint16_t optionNumber, const CoapOptionIndexEntry **first);
+		uint64_t getOptionBitmap();
+		int hasOption(uint16_t optionNumber);
+		int findOption(uint16_t optionNumber, CoapOption *option);
+		int findOptions(uint16_t optionNumber, CoapOption *options, int maxOptions);
 		int getNumOptions();
 		// shorthand helpers
 		int setURI(char *uri);
@@ -234,11 +374,20 @@ class CoapPDU {
 		uint8_t* getPayloadPointer();
 		int getPayloadLength();
 		uint8_t* getPayloadCopy();
+		int setPayloadReference(const uint8_t *payload, int len);
+		int hasPayloadReference();
 
 		// pdu
 		int getPDULength();
 		uint8_t* getPDUPointer();
+		int getIOVec(struct iovec *iov, int *iovcnt);
 		void setPDULength(int len);
+		int getBufferLength();
+		int reserve(int bytes);
+		int shrinkToFit();
+		int adopt(uint8_t *buffer, int pduLength, int bufferLength, CoapBufferDeleter deleter);
+		uint8_t* release();
+		CoapAllocator* getAllocator();
 
 		// debugging
 		static void printBinary(uint8_t b);
@@ -255,27 +404,181 @@ class CoapPDU {
 		int _pduLength;
 
 		int _constructedFromBuffer;
+		// the buffer is inside this object, see CoapInlinePDU, so moving from it has to copy
+		int _bufferInObject;
 		int _bufferLength;
+		CoapBufferDeleter _deleter;
+		CoapAllocator *_allocator;
 
 		uint8_t *_payloadPointer;
 		int _payloadLength;
+		// payload held outside the buffer, see CoapPDU::setPayloadReference()
+		const uint8_t *_payloadReference;
+		int _payloadReferenceLength;
 
 		int _numOptions;
 		uint16_t _maxAddedOptionNumber;
 
+		// bit n set if option n is present, bit 63 if any option numbered 63 or above is, see CoapPDU::getOptionBitmap()
+		uint64_t _optionBitmap;
+		int _optionBitmapValid;
+
+		// option index, _optionIndexLength is -1 when there is no valid index
+		#if COAP_OPTION_INDEX_SIZE>0
+		CoapOptionIndexEntry _inlineOptionIndex[COAP_OPTION_INDEX_SIZE];
+		#endif
+		CoapOptionIndexEntry *_optionIndex;
+		int _optionIndexCapacity;
+		int _optionIndexLength;
+
 		// functions
+		void initOptionIndex();
+		int initResponse(CoapPDU *request, CoapPDU::Type type, CoapPDU::Code code, uint16_t messageID, int reserveBytes);
+		void initBuffer(uint8_t *buffer, int bufferLength, int pduLength);
+		void freeBuffer();
+		void moveFrom(CoapPDU &other);
+		void detach();
+		int ensureCapacity(int needed);
+		int reallocBuffer(int capacity);
 		void shiftPDUUp(int shiftOffset, int shiftAmount);
 		void shiftPDUDown(int startLocation, int shiftOffset, int shiftAmount);
 		uint8_t codeToValue(CoapPDU::Code c);
 
 		// option stuff
+		int appendURI(const char *uri, int urilen);
+		const char* appendURIComponent(const char *p, const char *end, uint8_t stop, uint16_t optionNumber, int lowercase);
 		int findInsertionPosition(uint16_t optionNumber, uint16_t *prevOptionNumber);
-		int computeExtraBytes(uint16_t n);
-		int insertOption(int insertionPosition, uint16_t optionDelta, uint16_t optionValueLength, uint8_t *optionValue);
-		uint16_t getOptionDelta(uint8_t *option);
+		static int computeExtraBytes(uint16_t n);
+		int insertOption(int insertionPosition, uint16_t optionDelta, uint16_t optionValueLength, const uint8_t *optionValue);
+		static int decodeOptionHeader(const uint8_t *option, int bytesAvailable, uint16_t *optionDelta, uint16_t *optionValueLength);
+		static uint16_t getOptionDelta(uint8_t *option);
 		void setOptionDelta(int optionPosition, uint16_t optionDelta);
-		uint16_t getOptionValueLength(uint8_t *option);
+		static uint16_t getOptionValueLength(uint8_t *option);
+		static int walkOptions(const uint8_t *option, int bytesRemaining, int *payloadOffset);
+
+};
 
+/// Buffer of CoapInlinePDU, a separate base class so that it is constructed before the CoapPDU using it.
+template<int N>
+struct CoapInlineStorage {
+	uint8_t _inlineBuffer[N];
+};
+
+/// A CoapPDU which carries an \b N byte buffer inside the object, so it never allocates.
+/**
+ * Behaves exactly like a PDU constructed with CoapPDU::CoapPDU(uint8_t *buffer, int bufferLength, int pduLength):
+ * anything that would make the PDU longer than \b N bytes fails and returns an error. Memory use is fixed at
+ * compile time, so it suits firmware and per-request objects on the stack.
+ *
+ * ~~~{.cpp}
+ * CoapInlinePDU<256> response;
+ * response.setType(CoapPDU::COAP_ACKNOWLEDGEMENT);
+ * ~~~
+ *
+ * To receive into it, read into CoapPDU::getPDUPointer() (up to \b N bytes), then call CoapPDU::setPDULength()
+ * and CoapPDU::validate().
+ *
+ * It can't be copied. It can be moved into a plain CoapPDU, which then gets a copy of the PDU in a buffer from
+ * the default allocator, as the buffer of this one goes away with it.
+ */
+template<int N>
+class CoapInlinePDU : private CoapInlineStorage<N>, public CoapPDU {
+	static_assert(N>=COAP_HDR_SIZE, "CoapInlinePDU must be large enough for a CoAP header");
+
+	public:
+		/// Constructs an empty PDU, as CoapPDU::CoapPDU() does.
+		CoapInlinePDU() : CoapPDU(this->_inlineBuffer,N,0) {
+			_bufferInObject = 1;
+		}
+		CoapInlinePDU(const CoapInlinePDU &other) = delete;
+		CoapInlinePDU& operator=(const CoapInlinePDU &other) = delete;
+		CoapInlinePDU(CoapInlinePDU &&other) = delete;
+		CoapInlinePDU& operator=(CoapInlinePDU &&other) = delete;
+};
+
+/// Collects the parts of a PDU and encodes them in one pass, see CoapPDUBuilder::build().
+/**
+ * CoapPDU::addOption() keeps the PDU encoded at all times, so options added out of order cause the rest of
+ * the PDU to be shifted. The builder instead records each option's number, length and value pointer, sorts them
+ * once and writes the header, token, options and payload front to back.
+ *
+ * Values are referenced rather than copied, so they must stay valid until CoapPDUBuilder::build() is called.
+ */
+class CoapPDUBuilder {
+	public:
+		CoapPDUBuilder();
+		void reset();
+
+		void setType(CoapPDU::Type type);
+		void setCode(CoapPDU::Code code);
+		void setMessageID(uint16_t messageID);
+		int setToken(const uint8_t *token, uint8_t tokenLength);
+		int addOption(uint16_t optionNumber, uint16_t optionLength, const uint8_t *optionValue);
+		int addOptions(CoapPDU *pdu);
+		int removeOption(uint16_t optionNumber);
+		int getNumOptions();
+		void setPayload(const uint8_t *payload, int len);
+
+		int getPDULength();
+		int build(CoapPDU *pdu);
+
+	private:
+		struct Entry {
+			uint16_t optionNumber;
+			uint16_t optionValueLength;
+			const uint8_t *optionValue;
+		};
+
+		void sortOptions();
+
+		uint8_t _header[COAP_HDR_SIZE];
+		uint8_t _token[8];
+		Entry _options[COAP_BUILDER_MAX_OPTIONS];
+		int _numOptions;
+		int _sorted;
+		const uint8_t *_payload;
+		int _payloadLength;
+};
+
+/// A fully encoded PDU frozen so that many PDUs differing only in message ID, token and payload can be stamped from it.
+/**
+ * CoapPDUTemplate::freeze() keeps the type, code and encoded options of a PDU. CoapPDUTemplate::stamp() then writes
+ * the header, token, options and payload straight into another PDU, copying the option bytes rather than encoding
+ * them again. Since the token is written before the options are copied, stamps may use any token length.
+ *
+ * ~~~{.cpp}
+ * CoapPDU prototype;
+ * prototype.setType(CoapPDU::COAP_ACKNOWLEDGEMENT);
+ * prototype.setCode(CoapPDU::COAP_CONTENT);
+ * prototype.setContentFormat(CoapPDU::COAP_CONTENT_FORMAT_APP_JSON);
+ * prototype.addOption(CoapPDU::COAP_OPTION_MAX_AGE,1,(uint8_t*)"\74");
+ * CoapPDUTemplate json;
+ * json.freeze(&prototype);
+ * ...
+ * json.stamp(response,request->getMessageID(),request->getTokenPointer(),request->getTokenLength(),payload,payloadLength);
+ * ~~~
+ */
+class CoapPDUTemplate {
+	public:
+		CoapPDUTemplate();
+
+		int freeze(CoapPDU *pdu);
+		int stamp(CoapPDU *pdu, uint16_t messageID, const uint8_t *token, uint8_t tokenLength,
+			const uint8_t *payload, int payloadLength);
+		int patchOption(CoapPDU *pdu, uint16_t optionNumber, const uint8_t *optionValue, uint16_t optionLength);
+
+		int getNumOptions();
+		int getOptionsLength();
+		int getPDULength(uint8_t tokenLength, int payloadLength);
+
+	private:
+		uint8_t _header0;
+		uint8_t _code;
+		uint8_t _options[COAP_TEMPLATE_MAX_OPTIONS_LENGTH];
+		int _optionsLength;
+		int _numOptions;
+		uint16_t _lastOptionNumber;
+		uint64_t _optionBitmap;
 };
 
 /*
@@ -0,0 +1,680 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "coapblock.h"
+
+// minimal big-endian encoding of an unsigned option value such as Size1 or Size2, returns its length
+static int encodeUint(uint32_t value, uint8_t *dst) {
+	int length = 0;
+	for(uint32_t v=value; v!=0; v>>=8) {
+		length++;
+	}
+	for(int i=0; i<length; i++) {
+		dst[i] = value>>(8*(length-1-i));
+	}
+	return length;
+}
+
+static uint32_t decodeUint(const uint8_t *value, int length) {
+	uint32_t v = 0;
+	for(int i=0; i<length; i++) {
+		v = (v<<8)|value[i];
+	}
+	return v;
+}
+
+// the Size option that goes with a block option
+static uint16_t sizeOptionFor(uint16_t optionNumber) {
+	return optionNumber==CoapPDU::COAP_OPTION_BLOCK1 ? CoapPDU::COAP_OPTION_SIZE1 : CoapPDU::COAP_OPTION_SIZE2;
+}
+
+static inline int transferHash(uint64_t key, int mask) {
+	return (int)((key*0x9E3779B97F4A7C15ULL)>>32)&mask;
+}
+
+/// Encodes the option value into \b value, which must have room for 3 bytes.
+/**
+ * The value is always at least one byte long, even for block 0 of 16 byte blocks which could be empty, so that
+ * setting or clearing the more flag never changes its length.
+ *
+ * \return The length of the value, 1 to 3 bytes.
+ */
+int CoapBlockOption::encode(uint8_t *value) const {
+	uint32_t v = (num<<4)|(more ? 0x08 : 0x00)|(szx&0x07);
+	int length = v>0xFFFF ? 3 : v>0xFF ? 2 : 1;
+	for(int i=0; i<length; i++) {
+		value[i] = v>>(8*(length-1-i));
+	}
+	return length;
+}
+
+/// Decodes a Block1 or Block2 option value.
+/**
+ * \param value The option value.
+ * \param length Length of the option value, 0 to 3 bytes.
+ * \return 0 on success, 1 if the value is too long or uses the reserved size exponent 7.
+ */
+int CoapBlockOption::decode(const uint8_t *value, int length) {
+	if(length>3) {
+		DBG("Block option value of %d bytes is too long",length);
+		return 1;
+	}
+	uint32_t v = decodeUint(value,length);
+	if((v&0x07)==7) {
+		DBG("Block size exponent 7 is reserved");
+		return 1;
+	}
+	num = v>>4;
+	more = (v>>3)&0x01;
+	szx = v&0x07;
+	return 0;
+}
+
+/// Reads the block option numbered \b optionNumber from \b pdu.
+/**
+ * \param pdu The PDU to look in.
+ * \param optionNumber CoapPDU::COAP_OPTION_BLOCK1 or CoapPDU::COAP_OPTION_BLOCK2.
+ * \return 1 if the option was found and decoded, 0 if there is no such option, -1 if it is invalid.
+ */
+int CoapBlockOption::find(CoapPDU *pdu, uint16_t optionNumber) {
+	CoapPDU::CoapOption option;
+	if(!pdu->findOption(optionNumber,&option)) {
+		return 0;
+	}
+	return decode(option.optionValuePointer,option.optionValueLength)==0 ? 1 : -1;
+}
+
+/// Adds this block as option \b optionNumber of \b pdu.
+/**
+ * \return 0 on success, 1 if the block number or size is out of range or the option could not be added.
+ */
+int CoapBlockOption::add(CoapPDU *pdu, uint16_t optionNumber) const {
+	if(num>COAP_BLOCK_MAX_NUM||szx>COAP_BLOCK_MAX_SZX) {
+		DBG("Block %u with size exponent %d cannot be encoded",num,szx);
+		return 1;
+	}
+	uint8_t value[3];
+	return pdu->addOption(optionNumber,encode(value),value);
+}
+
+/// Moves on to the block after this one, in blocks of 16<<\b nextSZX bytes.
+/**
+ * The block size can only shrink part way through a transfer, so a \b nextSZX larger than the current
+ * exponent keeps the current size.
+ */
+void CoapBlockOption::next(uint8_t nextSZX) {
+	uint32_t offset = getOffset()+getSize();
+	if(nextSZX<szx) {
+		szx = nextSZX;
+	}
+	num = offset>>(szx+4);
+	more = 0;
+}
+
+/// Constructs an empty source.
+CoapMemoryBlockSource::CoapMemoryBlockSource() {
+	_data = NULL;
+	_length = 0;
+}
+
+/// Constructs a source serving the \b length bytes at \b data.
+CoapMemoryBlockSource::CoapMemoryBlockSource(const uint8_t *data, int length) {
+	_data = data;
+	_length = length;
+}
+
+int CoapMemoryBlockSource::getLength() {
+	return _length;
+}
+
+int CoapMemoryBlockSource::read(uint32_t offset, uint8_t *dst, int length, int *more) {
+	if(offset>(uint32_t)_length) {
+		DBG("Offset %u is past the end of %d bytes",offset,_length);
+		return -1;
+	}
+	int n = _length-(int)offset;
+	if(n>length) {
+		n = length;
+	}
+	// an empty body may have no data pointer at all
+	if(n>0) {
+		memcpy(dst,_data+offset,n);
+	}
+	*more = (int)offset+n<_length;
+	return n;
+}
+
+/// Constructs a source with no file, call CoapFileBlockSource::open() before using it.
+CoapFileBlockSource::CoapFileBlockSource() {
+	_mapping = NULL;
+	_mappingLength = 0;
+}
+
+CoapFileBlockSource::~CoapFileBlockSource() {
+	close();
+}
+
+/// Maps the file at \b path, closing any file mapped before.
+/**
+ * The file should not change while it is being served, the mapping shows whatever is in the file at the time a
+ * block is read.
+ *
+ * \param path Path of the file.
+ * \return 0 on success, 1 if the file could not be opened or mapped, or is larger than 2GB.
+ */
+int CoapFileBlockSource::open(const char *path) {
+	close();
+	int fd = ::open(path,O_RDONLY);
+	if(fd<0) {
+		DBG("Cannot open %s",path);
+		return 1;
+	}
+	struct stat st;
+	if(fstat(fd,&st)!=0||st.st_size>INT_MAX) {
+		DBG("Cannot serve %s",path);
+		::close(fd);
+		return 1;
+	}
+	// an empty file cannot be mapped, it is served as an empty body
+	if(st.st_size>0) {
+		void *mapping = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+		if(mapping==MAP_FAILED) {
+			DBG("Cannot map %s",path);
+			::close(fd);
+			return 1;
+		}
+		_mapping = mapping;
+		_mappingLength = st.st_size;
+	}
+	// the mapping keeps the file open
+	::close(fd);
+	_data = (const uint8_t*)_mapping;
+	_length = st.st_size;
+	return 0;
+}
+
+/// Unmaps the file, leaving an empty source.
+void CoapFileBlockSource::close() {
+	if(_mapping!=NULL) {
+		munmap(_mapping,_mappingLength);
+	}
+	_mapping = NULL;
+	_mappingLength = 0;
+	_data = NULL;
+	_length = 0;
+}
+
+/// Constructs a source which calls \b generator for each block.
+/**
+ * \param generator The callback producing the body.
+ * \param arg Passed to each call of \b generator.
+ * \param length Length of the whole body if known, which lets the Size2 or Size1 option be sent, or -1.
+ */
+CoapGeneratorBlockSource::CoapGeneratorBlockSource(CoapBlockGenerator generator, void *arg, int length) {
+	_generator = generator;
+	_arg = arg;
+	_length = length;
+}
+
+int CoapGeneratorBlockSource::getLength() {
+	return _length;
+}
+
+int CoapGeneratorBlockSource::read(uint32_t offset, uint8_t *dst, int length, int *more) {
+	return _generator(offset,dst,length,more,_arg);
+}
+
+/// Works out which block of \b source a request asks for with its Block2 option.
+/**
+ * A request without a Block2 option asks for block 0. A request for blocks larger than 16<<\b maxSZX bytes
+ * gets the block at the same offset in blocks of that size instead, as RFC 7959 allows.
+ *
+ * \param request The request.
+ * \param source The body being served.
+ * \param maxSZX Size exponent of the largest block to send, 0 (16 bytes) to 6 (1024 bytes).
+ * \param block Set to the block to send.
+ * \return 0 on success, 1 if the Block2 option is invalid or asks for a block past the end of the body, which
+ * should be answered with 4.02 (Bad Option).
+ */
+int coapGetBlock2(CoapPDU *request, CoapBlockSource *source, int maxSZX, CoapBlockOption *block) {
+	if(maxSZX<0||maxSZX>COAP_BLOCK_MAX_SZX) {
+		maxSZX = COAP_BLOCK_MAX_SZX;
+	}
+	block->num = 0;
+	block->more = 0;
+	block->szx = maxSZX;
+	int found = block->find(request,CoapPDU::COAP_OPTION_BLOCK2);
+	if(found<0) {
+		return 1;
+	}
+	block->more = 0;
+	if(found&&block->szx>maxSZX) {
+		uint32_t offset = block->getOffset();
+		block->szx = maxSZX;
+		block->num = offset>>(maxSZX+4);
+	}
+	int length = source->getLength();
+	if(length>=0&&block->num>0&&block->getOffset()>=(uint32_t)length) {
+		DBG("Block %u is past the end of %d bytes",block->num,length);
+		return 1;
+	}
+	return 0;
+}
+
+/// Adds block \b block of \b source to \b pdu, as option \b optionNumber followed by the payload.
+/**
+ * The block is read from the source directly into the PDU buffer. The option is added after any options
+ * already in the PDU, which must not have a payload yet: add Content-Format, ETag and so on first.
+ *
+ * A server answers a Block2 request with the block from coapGetBlock2():
+ *
+ * ~~~{.cpp}
+ * CoapBlockOption block;
+ * if(coapGetBlock2(request,&firmware,COAP_BLOCK_MAX_SZX,&block)!=0) {
+ * 	// respond with 4.02
+ * }
+ * response.makeResponse(request,CoapPDU::COAP_CONTENT,nextMessageID++,1100);
+ * response.setContentFormat(CoapPDU::COAP_CONTENT_FORMAT_APP_OCTET_STREAM);
+ * coapWriteBlock(&response,CoapPDU::COAP_OPTION_BLOCK2,&firmware,&block,block.num==0);
+ * ~~~
+ *
+ * and a client sends a large request body with Block1 one block at a time, moving on with
+ * CoapBlockOption::next() as each block is acknowledged.
+ *
+ * \param pdu The PDU to add the block to.
+ * \param optionNumber CoapPDU::COAP_OPTION_BLOCK2 for a response, CoapPDU::COAP_OPTION_BLOCK1 for a request.
+ * \param source The body.
+ * \param block The block to add, its more flag is set from the source.
+ * \param addSize If non-zero and the length of the body is known, also add it as a Size2 or Size1 option.
+ * \return 0 on success, 1 on failure, after which the PDU may hold a partial block and should be rebuilt.
+ */
+int coapWriteBlock(CoapPDU *pdu, uint16_t optionNumber, CoapBlockSource *source, CoapBlockOption *block, int addSize) {
+	if(pdu->getPayloadLength()>0||pdu->hasPayloadReference()) {
+		DBG("PDU already has a payload");
+		return 1;
+	}
+	int size = block->getSize();
+	uint32_t offset = block->getOffset();
+	int length = source->getLength();
+	if(length>=0&&offset>0&&offset>=(uint32_t)length) {
+		DBG("Block %u is past the end of %d bytes",block->num,length);
+		return 1;
+	}
+
+	// whether more follows is not known until the source has been read, so the option goes in with the flag
+	// set and is patched afterwards. The encoded length doesn't depend on the flag.
+	block->more = 1;
+	if(block->add(pdu,optionNumber)) {
+		return 1;
+	}
+	if(addSize&&length>=0) {
+		uint8_t value[4];
+		if(pdu->addOption(sizeOptionFor(optionNumber),encodeUint(length,value),value)) {
+			return 1;
+		}
+	}
+
+	// the payload goes after the marker at the current end of the PDU
+	if(pdu->reserve(pdu->getPDULength()+1+size)) {
+		DBG("No room for a block of %d bytes",size);
+		return 1;
+	}
+	uint8_t *dst = pdu->getPDUPointer()+pdu->getPDULength()+1;
+	int more = 0;
+	int n = source->read(offset,dst,size,&more);
+	if(n<0||n>size||(more&&n!=size)) {
+		DBG("Source failed to read block %u",block->num);
+		return 1;
+	}
+	if(n>0&&pdu->mallocPayload(n)!=dst) {
+		return 1;
+	}
+	if(!more) {
+		CoapPDU::CoapOption option;
+		if(!pdu->findOption(optionNumber,&option)) {
+			return 1;
+		}
+		option.optionValuePointer[option.optionValueLength-1] &= ~0x08;
+	}
+	block->more = more ? 1 : 0;
+	return 0;
+}
+
+/// Constructs an assembler for transfers using block option \b optionNumber.
+/**
+ * \param optionNumber CoapPDU::COAP_OPTION_BLOCK1 to receive request bodies on a server, or
+ * CoapPDU::COAP_OPTION_BLOCK2 to receive response bodies on a client.
+ * \param maxTransfers Most transfers in progress at once.
+ * \param maxTransferSize Largest body accepted, in bytes.
+ * \param timeoutMs Time a transfer may go without receiving a block before it is dropped.
+ */
+CoapBlockAssembler::CoapBlockAssembler(uint16_t optionNumber, int maxTransfers, int maxTransferSize, uint32_t timeoutMs) {
+	_optionNumber = optionNumber;
+	_sizeOptionNumber = sizeOptionFor(optionNumber);
+	_maxTransferSize = maxTransferSize;
+	_timeoutMs = timeoutMs;
+	_numTransfers = 0;
+	_firstFree = -1;
+
+	// at least twice as many slots as transfers keeps probe sequences short
+	int numSlots = 2;
+	while(numSlots<2*maxTransfers) {
+		numSlots *= 2;
+	}
+	_transfers = (Transfer*)malloc(sizeof(Transfer)*(maxTransfers>0 ? maxTransfers : 1));
+	_slots = (int*)malloc(sizeof(int)*numSlots);
+	if(_transfers==NULL||_slots==NULL) {
+		DBG("Failed to allocate %d transfers",maxTransfers);
+		maxTransfers = 0;
+	}
+	_maxTransfers = maxTransfers;
+	_slotMask = numSlots-1;
+	if(_slots!=NULL) {
+		for(int i=0; i<numSlots; i++) {
+			_slots[i] = -1;
+		}
+	}
+	for(int i=_maxTransfers-1; i>=0; i--) {
+		_transfers[i].buffer = NULL;
+		_transfers[i].nextFree = _firstFree;
+		_firstFree = i;
+	}
+}
+
+CoapBlockAssembler::~CoapBlockAssembler() {
+	if(_slots!=NULL) {
+		for(int i=0; i<=_slotMask; i++) {
+			if(_slots[i]>=0) {
+				free(_transfers[_slots[i]].buffer);
+			}
+		}
+	}
+	free(_transfers);
+	free(_slots);
+}
+
+/// Adds the block in \b pdu to the transfer \b key.
+/**
+ * A transfer starts with block 0 and each further block must follow on from the last, apart from
+ * retransmissions of blocks already received, which are ignored. A body that fits in block 0 is returned
+ * straight from the PDU without being copied or taking up a transfer.
+ *
+ * \param key Identifies the transfer.
+ * \param pdu A validated request (Block1) or response (Block2).
+ * \param now The current time in milliseconds.
+ * \param body Set to the whole body when the result is COAP_BLOCK_COMPLETE, NULL otherwise. It stays valid
+ * until the transfer is released, or for a single block body, as long as \b pdu.
+ * \param bodyLength Set to the length of \b body.
+ * \return What to do next, see CoapBlockAssembler::Result.
+ */
+CoapBlockAssembler::Result CoapBlockAssembler::receive(uint64_t key, CoapPDU *pdu, uint32_t now, const uint8_t **body,
+	int *bodyLength) {
+	*body = NULL;
+	*bodyLength = 0;
+
+	CoapBlockOption block;
+	int found = block.find(pdu,_optionNumber);
+	if(found==0) {
+		return COAP_BLOCK_NOT_BLOCKWISE;
+	}
+	if(found<0) {
+		return COAP_BLOCK_BAD_BLOCK;
+	}
+	// every block but the last is full
+	int payloadLength = pdu->getPayloadLength();
+	if(payloadLength>block.getSize()||(block.more&&payloadLength!=block.getSize())) {
+		DBG("Block %u has %d bytes of payload for a block size of %d",block.num,payloadLength,block.getSize());
+		return COAP_BLOCK_BAD_BLOCK;
+	}
+	uint32_t offset = block.getOffset();
+
+	int slot = findSlot(key);
+	if(slot>=0&&now-_transfers[_slots[slot]].lastActivity>=_timeoutMs) {
+		DBG("Transfer timed out");
+		removeTransfer(slot);
+		slot = -1;
+	}
+
+	Transfer *transfer;
+	if(offset==0) {
+		if(slot>=0) {
+			removeTransfer(slot);
+		}
+		if(!block.more) {
+			if(payloadLength>_maxTransferSize) {
+				return COAP_BLOCK_TOO_LARGE;
+			}
+			*body = pdu->getPayloadPointer();
+			*bodyLength = payloadLength;
+			return COAP_BLOCK_COMPLETE;
+		}
+		// a Size option on the first block gives the whole size, so it can be refused or allocated up front
+		uint32_t totalSize = 0;
+		CoapPDU::CoapOption option;
+		if(pdu->findOption(_sizeOptionNumber,&option)&&option.optionValueLength<=4) {
+			totalSize = decodeUint(option.optionValuePointer,option.optionValueLength);
+			if(totalSize>(uint32_t)_maxTransferSize) {
+				DBG("Body of %u bytes is too large",totalSize);
+				return COAP_BLOCK_TOO_LARGE;
+			}
+		}
+		slot = addTransfer(key,now);
+		if(slot<0) {
+			return COAP_BLOCK_NO_SLOT;
+		}
+		transfer = &_transfers[_slots[slot]];
+		if(growTransfer(transfer,totalSize)) {
+			removeTransfer(slot);
+			return COAP_BLOCK_NO_SLOT;
+		}
+	} else {
+		if(slot<0) {
+			DBG("Block %u of a transfer which has not started",block.num);
+			return COAP_BLOCK_INCOMPLETE;
+		}
+		transfer = &_transfers[_slots[slot]];
+		if(block.more&&offset+payloadLength<=(uint32_t)transfer->length) {
+			// a retransmission of a block already stored
+			transfer->lastActivity = now;
+			return COAP_BLOCK_CONTINUE;
+		}
+		if(offset!=(uint32_t)transfer->length) {
+			DBG("Block at offset %u, expected %d",offset,transfer->length);
+			return COAP_BLOCK_INCOMPLETE;
+		}
+	}
+
+	if(offset+payloadLength>(uint32_t)_maxTransferSize) {
+		DBG("Body is more than %d bytes",_maxTransferSize);
+		removeTransfer(slot);
+		return COAP_BLOCK_TOO_LARGE;
+	}
+	if(growTransfer(transfer,offset+payloadLength)) {
+		removeTransfer(slot);
+		return COAP_BLOCK_NO_SLOT;
+	}
+	if(payloadLength>0) {
+		memcpy(transfer->buffer+offset,pdu->getPayloadPointer(),payloadLength);
+	}
+	transfer->length = offset+payloadLength;
+	transfer->lastActivity = now;
+	if(block.more) {
+		return COAP_BLOCK_CONTINUE;
+	}
+	*body = transfer->buffer;
+	*bodyLength = transfer->length;
+	return COAP_BLOCK_COMPLETE;
+}
+
+/// Makes \b response the answer to a Block1 \b request which CoapBlockAssembler::receive() returned \b result for.
+/**
+ * COAP_BLOCK_CONTINUE is answered with 2.31 (Continue) and COAP_BLOCK_COMPLETE or COAP_BLOCK_NOT_BLOCKWISE with
+ * \b code, echoing the Block1 option in both cases. The other results get the matching error code, with a Size1
+ * option giving the largest body accepted for COAP_BLOCK_TOO_LARGE. Further options and a payload can be added
+ * to the response afterwards.
+ *
+ * Only meaningful for an assembler of Block1 transfers.
+ *
+ * \return 0 on success, 1 on failure.
+ */
+int CoapBlockAssembler::respond(Result result, CoapPDU *request, CoapPDU *response, CoapPDU::Code code, uint16_t messageID) {
+	switch(result) {
+		case COAP_BLOCK_CONTINUE:
+			code = CoapPDU::COAP_CONTINUE;
+		break;
+		case COAP_BLOCK_INCOMPLETE:
+			code = CoapPDU::COAP_REQUEST_ENTITY_INCOMPLETE;
+		break;
+		case COAP_BLOCK_TOO_LARGE:
+			code = CoapPDU::COAP_REQUEST_ENTITY_TOO_LARGE;
+		break;
+		case COAP_BLOCK_NO_SLOT:
+			code = CoapPDU::COAP_SERVICE_UNAVAILABLE;
+		break;
+		case COAP_BLOCK_BAD_BLOCK:
+			code = CoapPDU::COAP_BAD_REQUEST;
+		break;
+		default:
+		break;
+	}
+	if(response->makeResponse(request,code,messageID,8)) {
+		return 1;
+	}
+	if(result==COAP_BLOCK_CONTINUE||result==COAP_BLOCK_COMPLETE) {
+		CoapBlockOption block;
+		if(block.find(request,_optionNumber)==1&&block.add(response,_optionNumber)) {
+			return 1;
+		}
+	}
+	if(result==COAP_BLOCK_TOO_LARGE) {
+		uint8_t value[4];
+		if(response->addOption(_sizeOptionNumber,encodeUint(_maxTransferSize,value),value)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/// Drops transfer \b key and frees its memory, once its body has been used. Does nothing if there is no such transfer.
+void CoapBlockAssembler::release(uint64_t key) {
+	int slot = findSlot(key);
+	if(slot>=0) {
+		removeTransfer(slot);
+	}
+}
+
+/// Drops every transfer which has received nothing for the timeout.
+/**
+ * \param now The current time in milliseconds.
+ * \return The number of transfers dropped.
+ */
+int CoapBlockAssembler::expire(uint32_t now) {
+	if(_numTransfers==0) {
+		return 0;
+	}
+	int expired = 0;
+	for(int slot=0; slot<=_slotMask; ) {
+		if(_slots[slot]>=0&&now-_transfers[_slots[slot]].lastActivity>=_timeoutMs) {
+			// removal may move a later transfer into this slot, so look at it again
+			removeTransfer(slot);
+			expired++;
+			continue;
+		}
+		slot++;
+	}
+	return expired;
+}
+
+/// Returns the number of transfers in progress.
+int CoapBlockAssembler::getNumTransfers() {
+	return _numTransfers;
+}
+
+// slot of transfer key in _slots, or -1
+int CoapBlockAssembler::findSlot(uint64_t key) {
+	if(_maxTransfers==0) {
+		return -1;
+	}
+	for(int slot=transferHash(key,_slotMask); _slots[slot]>=0; slot=(slot+1)&_slotMask) {
+		if(_transfers[_slots[slot]].key==key) {
+			return slot;
+		}
+	}
+	return -1;
+}
+
+// starts transfer key, which must not exist, returning its slot or -1 if all transfers are in use
+int CoapBlockAssembler::addTransfer(uint64_t key, uint32_t now) {
+	if(_firstFree<0) {
+		expire(now);
+		if(_firstFree<0) {
+			DBG("All %d transfers are in use",_maxTransfers);
+			return -1;
+		}
+	}
+	int index = _firstFree;
+	Transfer *transfer = &_transfers[index];
+	_firstFree = transfer->nextFree;
+	transfer->key = key;
+	transfer->buffer = NULL;
+	transfer->length = 0;
+	transfer->capacity = 0;
+	transfer->lastActivity = now;
+	transfer->nextFree = -1;
+
+	int slot = transferHash(key,_slotMask);
+	while(_slots[slot]>=0) {
+		slot = (slot+1)&_slotMask;
+	}
+	_slots[slot] = index;
+	_numTransfers++;
+	return slot;
+}
+
+// frees the transfer in slot, then closes the gap it leaves so that every probe sequence stays unbroken
+void CoapBlockAssembler::removeTransfer(int slot) {
+	int index = _slots[slot];
+	Transfer *transfer = &_transfers[index];
+	free(transfer->buffer);
+	transfer->buffer = NULL;
+	transfer->nextFree = _firstFree;
+	_firstFree = index;
+	_numTransfers--;
+
+	int gap = slot;
+	for(int next=(slot+1)&_slotMask; _slots[next]>=0; next=(next+1)&_slotMask) {
+		int home = transferHash(_transfers[_slots[next]].key,_slotMask);
+		// the entry can move back into the gap unless its home slot lies cyclically after the gap
+		if(((next-home)&_slotMask)>=((next-gap)&_slotMask)) {
+			_slots[gap] = _slots[next];
+			gap = next;
+		}
+	}
+	_slots[gap] = -1;
+}
+
+// makes room for needed bytes in the transfer's buffer, growing geometrically up to the transfer size limit
+int CoapBlockAssembler::growTransfer(Transfer *transfer, int needed) {
+	if(needed<=transfer->capacity) {
+		return 0;
+	}
+	int capacity = transfer->capacity*2;
+	if(capacity<needed) {
+		capacity = needed;
+	}
+	if(capacity>_maxTransferSize) {
+		capacity = _maxTransferSize;
+	}
+	uint8_t *buffer = (uint8_t*)realloc(transfer->buffer,capacity);
+	if(buffer==NULL) {
+		DBG("Failed to allocate %d bytes for a transfer",capacity);
+		return 1;
+	}
+	transfer->buffer = buffer;
+	transfer->capacity = capacity;
+	return 0;
+}
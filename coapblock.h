@@ -0,0 +1,190 @@
+#pragma once
+#include "cantcoap.h"
+
+// largest block size exponent, blocks are 16<<szx bytes so 6 is 1024 bytes (7 is reserved for BERT over TCP)
+#define COAP_BLOCK_MAX_SZX 6
+
+// largest block number that fits in a Block1 or Block2 option
+#define COAP_BLOCK_MAX_NUM 0xFFFFF
+
+// default time a Block1 or Block2 transfer may sit idle before it is dropped, EXCHANGE_LIFETIME of RFC 7252
+#ifndef COAP_BLOCK_TIMEOUT_MS
+#define COAP_BLOCK_TIMEOUT_MS 247000
+#endif
+
+/// Value of a Block1 or Block2 option (RFC 7959): block number, more flag and size exponent.
+struct CoapBlockOption {
+	uint32_t num;
+	uint8_t more;
+	uint8_t szx;
+
+	/// Size of a block, 16 to 1024 bytes.
+	int getSize() const { return 16<<szx; }
+	/// Offset of this block in the whole body.
+	uint32_t getOffset() const { return num<<(szx+4); }
+
+	int encode(uint8_t *value) const;
+	int decode(const uint8_t *value, int length);
+	int find(CoapPDU *pdu, uint16_t optionNumber);
+	int add(CoapPDU *pdu, uint16_t optionNumber) const;
+	void next(uint8_t nextSZX);
+};
+
+/// Where the body of a block-wise transfer comes from.
+/**
+ * CoapBlockSource::read() writes straight into the PDU being built, so a block goes from the source to the
+ * send buffer without an intermediate copy.
+ */
+class CoapBlockSource {
+	public:
+		virtual ~CoapBlockSource() {}
+
+		/// Length of the whole body in bytes, or -1 if it is not known in advance.
+		virtual int getLength() = 0;
+
+		/// Copies up to \b length bytes of the body starting at \b offset into \b dst.
+		/**
+		 * Every block except the last must be full, so a source may only return fewer than \b length bytes
+		 * when it has reached the end.
+		 *
+		 * \param offset Offset into the body.
+		 * \param dst Where to write the bytes.
+		 * \param length Number of bytes wanted, the block size.
+		 * \param more Set to 1 if there is more of the body after these bytes, 0 if not.
+		 * \return Number of bytes written, or -1 on failure.
+		 */
+		virtual int read(uint32_t offset, uint8_t *dst, int length, int *more) = 0;
+};
+
+/// A body held in memory. The memory is not copied, so it must stay valid as long as the source is used.
+class CoapMemoryBlockSource : public CoapBlockSource {
+	public:
+		CoapMemoryBlockSource();
+		CoapMemoryBlockSource(const uint8_t *data, int length);
+		int getLength();
+		int read(uint32_t offset, uint8_t *dst, int length, int *more);
+
+	protected:
+		const uint8_t *_data;
+		int _length;
+};
+
+/// A body read from a file mapped into memory, so blocks are served from the page cache.
+/**
+ * Any number of transfers can share one source, each block is copied once, from the mapping into the PDU.
+ */
+class CoapFileBlockSource : public CoapMemoryBlockSource {
+	public:
+		CoapFileBlockSource();
+		~CoapFileBlockSource();
+		CoapFileBlockSource(const CoapFileBlockSource &other) = delete;
+		CoapFileBlockSource& operator=(const CoapFileBlockSource &other) = delete;
+		int open(const char *path);
+		void close();
+
+	private:
+		void *_mapping;
+		size_t _mappingLength;
+};
+
+/// Called by CoapGeneratorBlockSource for each block, with the same contract as CoapBlockSource::read().
+typedef int (*CoapBlockGenerator)(uint32_t offset, uint8_t *dst, int length, int *more, void *arg);
+
+/// A body produced on demand by a callback, for representations that are never held in memory whole.
+class CoapGeneratorBlockSource : public CoapBlockSource {
+	public:
+		CoapGeneratorBlockSource(CoapBlockGenerator generator, void *arg, int length);
+		int getLength();
+		int read(uint32_t offset, uint8_t *dst, int length, int *more);
+
+	private:
+		CoapBlockGenerator _generator;
+		void *_arg;
+		int _length;
+};
+
+int coapGetBlock2(CoapPDU *request, CoapBlockSource *source, int maxSZX, CoapBlockOption *block);
+int coapWriteBlock(CoapPDU *pdu, uint16_t optionNumber, CoapBlockSource *source, CoapBlockOption *block, int addSize);
+
+/// Puts back together a body sent in blocks: Block1 requests on a server or Block2 responses on a client.
+/**
+ * Transfers are told apart by a key chosen by the caller, typically a hash of the peer address and the request
+ * URI (Block1) or of the token (Block2). Memory is bounded in two ways: there are at most \b maxTransfers
+ * transfers at once, and each body is at most \b maxTransferSize bytes. A transfer that receives nothing for
+ * \b timeoutMs is dropped by CoapBlockAssembler::expire(), or when its slot is needed for a new transfer.
+ *
+ * Times are passed in by the caller in milliseconds from any fixed point, wrapping is handled.
+ *
+ * ~~~{.cpp}
+ * CoapBlockAssembler uploads(CoapPDU::COAP_OPTION_BLOCK1,64,256*1024,COAP_BLOCK_TIMEOUT_MS);
+ * ...
+ * const uint8_t *body;
+ * int bodyLength;
+ * CoapBlockAssembler::Result result = uploads.receive(key,request,now,&body,&bodyLength);
+ * if(result==CoapBlockAssembler::COAP_BLOCK_COMPLETE) {
+ * 	// use body
+ * 	uploads.release(key);
+ * }
+ * uploads.respond(result,request,&response,CoapPDU::COAP_CHANGED,nextMessageID++);
+ * ~~~
+ */
+class CoapBlockAssembler {
+	public:
+		/// Result of CoapBlockAssembler::receive()
+		enum Result {
+			// no block option, handle the message as a whole
+			COAP_BLOCK_NOT_BLOCKWISE=0,
+			// block stored, more are to come
+			COAP_BLOCK_CONTINUE,
+			// last block stored, the body is complete
+			COAP_BLOCK_COMPLETE,
+			// block does not follow on from what has been received, 4.08
+			COAP_BLOCK_INCOMPLETE,
+			// body would exceed maxTransferSize, 4.13
+			COAP_BLOCK_TOO_LARGE,
+			// every transfer slot is in use, 5.03
+			COAP_BLOCK_NO_SLOT,
+			// block option or block length is invalid, 4.00
+			COAP_BLOCK_BAD_BLOCK
+		};
+
+		CoapBlockAssembler(uint16_t optionNumber, int maxTransfers, int maxTransferSize, uint32_t timeoutMs);
+		~CoapBlockAssembler();
+		CoapBlockAssembler(const CoapBlockAssembler &other) = delete;
+		CoapBlockAssembler& operator=(const CoapBlockAssembler &other) = delete;
+
+		Result receive(uint64_t key, CoapPDU *pdu, uint32_t now, const uint8_t **body, int *bodyLength);
+		int respond(Result result, CoapPDU *request, CoapPDU *response, CoapPDU::Code code, uint16_t messageID);
+		void release(uint64_t key);
+		int expire(uint32_t now);
+		int getNumTransfers();
+
+	private:
+		struct Transfer {
+			uint64_t key;
+			uint8_t *buffer;
+			int length;
+			int capacity;
+			uint32_t lastActivity;
+			// index into _transfers of the next free transfer, when this one is free
+			int nextFree;
+		};
+
+		int findSlot(uint64_t key);
+		int addTransfer(uint64_t key, uint32_t now);
+		void removeTransfer(int slot);
+		int growTransfer(Transfer *transfer, int needed);
+
+		uint16_t _optionNumber;
+		uint16_t _sizeOptionNumber;
+		int _maxTransferSize;
+		uint32_t _timeoutMs;
+
+		// transfers, and an open addressing hash table of indexes into them by key (-1 is empty)
+		Transfer *_transfers;
+		int _maxTransfers;
+		int _numTransfers;
+		int _firstFree;
+		int *_slots;
+		int _slotMask;
+};
@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <string.h>
+#include "coapcongestion.h"
+
+// K of RFC 6298 for each estimator
+#define STRONG_K 4
+#define WEAK_K 1
+
+// feeds a round trip time into an estimator and returns its RTO estimate
+static uint32_t estimate(uint32_t *srtt, uint32_t *rttvar, uint8_t *valid, uint32_t rtt, int k) {
+	if(!*valid) {
+		*srtt = rtt;
+		*rttvar = rtt/2;
+		*valid = 1;
+	} else {
+		uint32_t deviation = *srtt>rtt ? *srtt-rtt : rtt-*srtt;
+		*rttvar = (3*(*rttvar)+deviation)/4;
+		*srtt = (7*(*srtt)+rtt)/8;
+	}
+	return *srtt+k*(*rttvar);
+}
+
+CoapCongestionControl::CoapCongestionControl() {
+	_peers = NULL;
+	_numPeers = 0;
+	_peerCapacity = 0;
+	_slots = NULL;
+	_slotMask = -1;
+}
+
+CoapCongestionControl::~CoapCongestionControl() {
+	free(_peers);
+	free(_slots);
+}
+
+/// Starts an interaction with \b endpoint if fewer than COAP_NSTART are outstanding.
+/**
+ * \param endpoint The peer.
+ * \param now The current time in milliseconds.
+ * \param rto Set to the retransmission timeout to use for the first transmission, before the random factor.
+ * \return 0 if the interaction may start, 1 if it must wait for another to end, or memory ran out.
+ */
+int CoapCongestionControl::begin(const CoapEndpoint *endpoint, uint32_t now, uint32_t *rto) {
+	Peer *peer = getPeer(endpoint,now);
+	if(peer==NULL||peer->outstanding>=COAP_NSTART) {
+		return 1;
+	}
+	// an RTO that has not been updated for a while is aged towards the initial one
+	uint32_t idle = now-peer->updated;
+	if(peer->rto<1000&&idle>16*peer->rto) {
+		peer->rto *= 2;
+		peer->updated = now;
+	} else if(peer->rto>3000&&idle>4*peer->rto) {
+		peer->rto = (COAP_INITIAL_RTO_MS+peer->rto)/2;
+		peer->updated = now;
+	}
+	peer->outstanding++;
+	peer->active = now;
+	*rto = peer->rto;
+	return 0;
+}
+
+/// Returns the timeout to wait after a retransmission to \b endpoint, given the timeout before it.
+uint32_t CoapCongestionControl::backoff(const CoapEndpoint *endpoint, uint32_t timeout) {
+	uint32_t rto = getRTO(endpoint);
+	if(rto<1000) {
+		return 3*timeout;
+	}
+	if(rto>3000) {
+		return timeout+timeout/2;
+	}
+	return 2*timeout;
+}
+
+/// Ends an interaction with \b endpoint started by CoapCongestionControl::begin().
+/**
+ * \param endpoint The peer.
+ * \param now The current time in milliseconds.
+ * \param rtt Time from the first transmission to the response, or -1 if there was none.
+ * \param retransmissions How many times the message was retransmitted. Round trip times after more than two are
+ * ambiguous and not used.
+ */
+void CoapCongestionControl::end(const CoapEndpoint *endpoint, uint32_t now, int32_t rtt, int retransmissions) {
+	uint32_t hash = endpoint->hash(COAP_ENDPOINT_HASH_BASIS);
+	hash ^= hash>>16;
+	int slot = findPeer(endpoint,hash);
+	if(slot<0) {
+		return;
+	}
+	Peer *peer = &_peers[_slots[slot]];
+	if(peer->outstanding>0) {
+		peer->outstanding--;
+	}
+	peer->active = now;
+	if(rtt<0||retransmissions>2) {
+		return;
+	}
+	uint32_t sample = (uint32_t)rtt<COAP_MAX_RTO_MS ? rtt : COAP_MAX_RTO_MS;
+	uint32_t rto;
+	if(retransmissions==0) {
+		uint32_t strong = estimate(&peer->strong.srtt,&peer->strong.rttvar,&peer->strong.valid,sample,STRONG_K);
+		rto = (strong+peer->rto)/2;
+	} else {
+		uint32_t weak = estimate(&peer->weak.srtt,&peer->weak.rttvar,&peer->weak.valid,sample,WEAK_K);
+		rto = (weak+3*peer->rto)/4;
+	}
+	peer->rto = rto<1 ? 1 : rto>COAP_MAX_RTO_MS ? COAP_MAX_RTO_MS : rto;
+	peer->updated = now;
+}
+
+/// Returns the current retransmission timeout for \b endpoint, COAP_INITIAL_RTO_MS for a peer not seen before.
+uint32_t CoapCongestionControl::getRTO(const CoapEndpoint *endpoint) {
+	uint32_t hash = endpoint->hash(COAP_ENDPOINT_HASH_BASIS);
+	hash ^= hash>>16;
+	int slot = findPeer(endpoint,hash);
+	return slot<0 ? COAP_INITIAL_RTO_MS : _peers[_slots[slot]].rto;
+}
+
+/// Returns the number of interactions outstanding with \b endpoint.
+int CoapCongestionControl::getOutstanding(const CoapEndpoint *endpoint) {
+	uint32_t hash = endpoint->hash(COAP_ENDPOINT_HASH_BASIS);
+	hash ^= hash>>16;
+	int slot = findPeer(endpoint,hash);
+	return slot<0 ? 0 : _peers[_slots[slot]].outstanding;
+}
+
+/// Forgets peers with nothing outstanding that have been idle for more than \b idleMs, and what was learnt about them.
+/**
+ * \return The number of peers dropped.
+ */
+int CoapCongestionControl::expire(uint32_t now, uint32_t idleMs) {
+	int dropped = 0;
+	// backwards, as removing a peer moves the last one into its place
+	for(int i=_numPeers-1; i>=0; i--) {
+		Peer *peer = &_peers[i];
+		if(peer->outstanding==0&&now-peer->active>idleMs) {
+			removePeer(findPeer(&peer->endpoint,peer->hash));
+			dropped++;
+		}
+	}
+	return dropped;
+}
+
+/// Returns the number of peers being tracked.
+int CoapCongestionControl::getNumPeers() {
+	return _numPeers;
+}
+
+// the state of endpoint, created if it is new, or NULL if memory ran out
+CoapCongestionControl::Peer* CoapCongestionControl::getPeer(const CoapEndpoint *endpoint, uint32_t now) {
+	uint32_t hash = endpoint->hash(COAP_ENDPOINT_HASH_BASIS);
+	hash ^= hash>>16;
+	int slot = findPeer(endpoint,hash);
+	if(slot<0) {
+		slot = addPeer(endpoint,hash,now);
+		if(slot<0) {
+			return NULL;
+		}
+	}
+	return &_peers[_slots[slot]];
+}
+
+// slot of the peer in _slots, or -1
+int CoapCongestionControl::findPeer(const CoapEndpoint *endpoint, uint32_t hash) {
+	if(_slots==NULL) {
+		return -1;
+	}
+	for(int slot=hash&_slotMask; _slots[slot]>=0; slot=(slot+1)&_slotMask) {
+		Peer *peer = &_peers[_slots[slot]];
+		if(peer->hash==hash&&peer->endpoint.equals(*endpoint)) {
+			return slot;
+		}
+	}
+	return -1;
+}
+
+// adds a peer with the initial RTO, growing the table to keep it at most half full, and returns its slot or -1
+int CoapCongestionControl::addPeer(const CoapEndpoint *endpoint, uint32_t hash, uint32_t now) {
+	if(_numPeers==_peerCapacity) {
+		int capacity = _peerCapacity<8 ? 8 : _peerCapacity*2;
+		Peer *peers = (Peer*)realloc(_peers,sizeof(Peer)*capacity);
+		if(peers==NULL) {
+			DBG("Failed to allocate %d peers",capacity);
+			return -1;
+		}
+		_peers = peers;
+		_peerCapacity = capacity;
+	}
+	if(2*(_numPeers+1)>_slotMask+1) {
+		int numSlots = _slotMask<0 ? 16 : 2*(_slotMask+1);
+		int *slots = (int*)malloc(sizeof(int)*numSlots);
+		if(slots==NULL) {
+			DBG("Failed to allocate %d peer slots",numSlots);
+			return -1;
+		}
+		for(int i=0; i<numSlots; i++) {
+			slots[i] = -1;
+		}
+		for(int i=0; i<_numPeers; i++) {
+			int slot = _peers[i].hash&(numSlots-1);
+			while(slots[slot]>=0) {
+				slot = (slot+1)&(numSlots-1);
+			}
+			slots[slot] = i;
+		}
+		free(_slots);
+		_slots = slots;
+		_slotMask = numSlots-1;
+	}
+
+	Peer *peer = &_peers[_numPeers];
+	memset(peer,0x00,sizeof(Peer));
+	peer->endpoint = *endpoint;
+	peer->hash = hash;
+	peer->rto = COAP_INITIAL_RTO_MS;
+	peer->updated = now;
+	peer->active = now;
+	int slot = hash&_slotMask;
+	while(_slots[slot]>=0) {
+		slot = (slot+1)&_slotMask;
+	}
+	_slots[slot] = _numPeers++;
+	return slot;
+}
+
+// removes the peer in slot, moving the last peer into its place, and closes the gap it leaves in _slots
+void CoapCongestionControl::removePeer(int slot) {
+	int index = _slots[slot];
+	int last = _numPeers-1;
+	if(index!=last) {
+		_slots[findPeer(&_peers[last].endpoint,_peers[last].hash)] = index;
+		_peers[index] = _peers[last];
+	}
+	_numPeers--;
+
+	int gap = slot;
+	for(int next=(slot+1)&_slotMask; _slots[next]>=0; next=(next+1)&_slotMask) {
+		int home = _peers[_slots[next]].hash&_slotMask;
+		if(((next-home)&_slotMask)>=((next-gap)&_slotMask)) {
+			_slots[gap] = _slots[next];
+			gap = next;
+		}
+	}
+	_slots[gap] = -1;
+}
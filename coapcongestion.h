@@ -0,0 +1,85 @@
+#pragma once
+#include "cantcoap.h"
+#include "coapendpoint.h"
+
+// most interactions outstanding with a peer at once, NSTART of RFC 7252
+#ifndef COAP_NSTART
+#define COAP_NSTART 1
+#endif
+
+// retransmission timeout before anything is known about a peer, as ACK_TIMEOUT
+#ifndef COAP_INITIAL_RTO_MS
+#define COAP_INITIAL_RTO_MS 2000
+#endif
+
+#ifndef COAP_MAX_RTO_MS
+#define COAP_MAX_RTO_MS 60000
+#endif
+
+/// Per peer congestion control for confirmable messages: NSTART, and retransmission timeouts that follow the link.
+/**
+ * Implements the CoCoA algorithm (draft-ietf-core-cocoa). Round trip times are measured per peer by two
+ * estimators in the style of RFC 6298. The strong one takes acknowledgements of messages that were never
+ * retransmitted and uses K=4. The weak one takes acknowledgements after one or two retransmissions, timed from
+ * the first transmission, and uses K=1. Each measurement moves the overall RTO towards the estimator that took
+ * it, by half for a strong one and a quarter for a weak one. The RTO starts at COAP_INITIAL_RTO_MS. If it is not
+ * updated for a while, an RTO below 1 s is doubled and one above 3 s is pulled back towards the initial value.
+ *
+ * Retransmissions back off by a factor that depends on the RTO: 3 below 1 s, 1.5 above 3 s and 2 in between. A
+ * short RTO therefore still reaches a long wait quickly, and a long one does not grow out of hand.
+ *
+ * No more than COAP_NSTART interactions are outstanding with a peer at once. CoapCongestionControl::begin()
+ * refuses more until CoapCongestionControl::end() is called for one of them.
+ *
+ * A CoapReliableLayer uses this when given one with CoapReliableLayer::setCongestionControl(). It then holds back
+ * confirmable messages beyond NSTART and sends each when an earlier one to the same peer ends.
+ *
+ * Times are in milliseconds and must not go backwards between calls. Not thread safe.
+ */
+class CoapCongestionControl {
+	public:
+		CoapCongestionControl();
+		~CoapCongestionControl();
+		CoapCongestionControl(const CoapCongestionControl &other) = delete;
+		CoapCongestionControl& operator=(const CoapCongestionControl &other) = delete;
+
+		int begin(const CoapEndpoint *endpoint, uint32_t now, uint32_t *rto);
+		uint32_t backoff(const CoapEndpoint *endpoint, uint32_t timeout);
+		void end(const CoapEndpoint *endpoint, uint32_t now, int32_t rtt, int retransmissions);
+		uint32_t getRTO(const CoapEndpoint *endpoint);
+		int getOutstanding(const CoapEndpoint *endpoint);
+		int expire(uint32_t now, uint32_t idleMs);
+		int getNumPeers();
+
+	private:
+		// an RFC 6298 estimator, times in ms
+		struct Estimator {
+			uint32_t srtt;
+			uint32_t rttvar;
+			uint8_t valid;
+		};
+
+		struct Peer {
+			CoapEndpoint endpoint;
+			uint32_t hash;
+			uint32_t rto;
+			// when rto was last set, and when the peer last began or ended an interaction
+			uint32_t updated;
+			uint32_t active;
+			Estimator strong;
+			Estimator weak;
+			int outstanding;
+		};
+
+		Peer* getPeer(const CoapEndpoint *endpoint, uint32_t now);
+		int findPeer(const CoapEndpoint *endpoint, uint32_t hash);
+		int addPeer(const CoapEndpoint *endpoint, uint32_t hash, uint32_t now);
+		void removePeer(int slot);
+
+		// peers, and an open addressing hash table of indexes into them (-1 is empty)
+		Peer *_peers;
+		int _numPeers;
+		int _peerCapacity;
+		int *_slots;
+		int _slotMask;
+};
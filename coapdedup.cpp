@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "coapdedup.h"
+
+// a time is past once now has reached it, allowing for the clock wrapping
+static inline int expired(uint32_t expires, uint32_t now) {
+	return (int32_t)(expires-now)<=0;
+}
+
+/// Constructs a cache that uses about \b memoryBudget bytes, for responses of up to \b maxResponseLength bytes.
+/**
+ * The number of entries is the largest power of two times COAP_DEDUP_WAYS that fits in \b memoryBudget, and at
+ * least COAP_DEDUP_WAYS.
+ *
+ * \param memoryBudget Bytes to use for the entries and their responses.
+ * \param maxResponseLength Longest response kept to replay. Duplicates of a message with a longer response are
+ * still detected.
+ */
+CoapDedupCache::CoapDedupCache(int memoryBudget, int maxResponseLength) {
+	_maxResponseLength = maxResponseLength>0 ? maxResponseLength : 0;
+	_hits = 0;
+	_misses = 0;
+	_evictions = 0;
+
+	long bucketSize = sizeof(Bucket)+COAP_DEDUP_WAYS*(sizeof(Entry)+(long)_maxResponseLength);
+	int numBuckets = 1;
+	while((long)numBuckets*2*bucketSize<=memoryBudget) {
+		numBuckets *= 2;
+	}
+	_bucketMask = numBuckets-1;
+	void *buckets = NULL;
+	if(posix_memalign(&buckets,64,sizeof(Bucket)*numBuckets)!=0) {
+		buckets = NULL;
+	}
+	_buckets = (Bucket*)buckets;
+	_entries = (Entry*)malloc(sizeof(Entry)*COAP_DEDUP_WAYS*numBuckets);
+	_responses = (uint8_t*)malloc((size_t)_maxResponseLength*COAP_DEDUP_WAYS*numBuckets+1);
+	if(_buckets==NULL||_entries==NULL||_responses==NULL) {
+		DBG("Failed to allocate %d buckets",numBuckets);
+		free(_buckets);
+		free(_entries);
+		free(_responses);
+		_buckets = NULL;
+		_entries = NULL;
+		_responses = NULL;
+		_bucketMask = -1;
+		return;
+	}
+	memset(_buckets,0x00,sizeof(Bucket)*numBuckets);
+}
+
+CoapDedupCache::~CoapDedupCache() {
+	free(_buckets);
+	free(_entries);
+	free(_responses);
+}
+
+/// Checks whether \b pdu has been received from \b address before, and remembers it if not.
+/**
+ * Only confirmable and non-confirmable messages are remembered, acknowledgements and resets are always new.
+ *
+ * \param pdu The validated message received.
+ * \param address Where it came from.
+ * \param addressLength The length of \b address.
+ * \param now The current time in milliseconds.
+ * \param response For a duplicate, set to the response stored for the first copy, or NULL if there is none
+ * because it is still being handled or its response was too long to keep.
+ * \param responseLength Set to the length of \b response.
+ * \return 1 if \b pdu is a duplicate, which should not be handled again, 0 if it is new.
+ */
+int CoapDedupCache::check(CoapPDU *pdu, const struct sockaddr *address, socklen_t addressLength, uint32_t now,
+	const uint8_t **response, int *responseLength) {
+	*response = NULL;
+	*responseLength = 0;
+	CoapPDU::Type type = pdu->getType();
+	if(_buckets==NULL||(type!=CoapPDU::COAP_CONFIRMABLE&&type!=CoapPDU::COAP_NON_CONFIRMABLE)) {
+		return 0;
+	}
+	CoapEndpoint endpoint;
+	if(endpoint.set(address,addressLength)) {
+		return 0;
+	}
+	uint16_t messageID = pdu->getMessageID();
+	uint32_t hash = endpoint.hashMessage(messageID);
+	int bucketIndex = hash&_bucketMask;
+	Bucket *bucket = &_buckets[bucketIndex];
+	int way = find(&endpoint,messageID,hash);
+	if(way>=0&&!expired(bucket->expires[way],now)) {
+		_hits++;
+		Entry *entry = &_entries[bucketIndex*COAP_DEDUP_WAYS+way];
+		if(entry->responseLength>0) {
+			*response = &_responses[((size_t)bucketIndex*COAP_DEDUP_WAYS+way)*_maxResponseLength];
+			*responseLength = entry->responseLength;
+		}
+		return 1;
+	}
+	_misses++;
+
+	// the expired entry for this message, a free or expired entry, otherwise the one closest to expiring
+	for(int i=0; i<COAP_DEDUP_WAYS&&way<0; i++) {
+		if(!(bucket->used&(1<<i))||expired(bucket->expires[i],now)) {
+			way = i;
+		}
+	}
+	if(way<0) {
+		way = 0;
+		for(int i=1; i<COAP_DEDUP_WAYS; i++) {
+			if((int32_t)(bucket->expires[i]-bucket->expires[way])<0) {
+				way = i;
+			}
+		}
+		_evictions++;
+	}
+	bucket->hash[way] = hash;
+	bucket->messageID[way] = messageID;
+	bucket->expires[way] = now+(type==CoapPDU::COAP_CONFIRMABLE ? COAP_EXCHANGE_LIFETIME_MS : COAP_NON_LIFETIME_MS);
+	bucket->used |= 1<<way;
+	Entry *entry = &_entries[bucketIndex*COAP_DEDUP_WAYS+way];
+	entry->endpoint = endpoint;
+	entry->responseLength = 0;
+	return 0;
+}
+
+/// Stores \b response to replay for duplicates of message \b messageID from \b address.
+/**
+ * The response is copied, including any payload reference.
+ *
+ * \return 0 on success, 1 if the message is no longer remembered or the response is longer than the
+ * \b maxResponseLength the cache was constructed with. Duplicates are still detected in the second case.
+ */
+int CoapDedupCache::store(uint16_t messageID, const struct sockaddr *address, socklen_t addressLength, CoapPDU *response) {
+	CoapEndpoint endpoint;
+	if(_buckets==NULL||endpoint.set(address,addressLength)) {
+		return 1;
+	}
+	uint32_t hash = endpoint.hashMessage(messageID);
+	// an entry is kept until it is reused, so its response can be stored however long handling took
+	int way = find(&endpoint,messageID,hash);
+	if(way<0) {
+		return 1;
+	}
+	int index = (hash&_bucketMask)*COAP_DEDUP_WAYS+way;
+	struct iovec iov[2];
+	int iovcnt = 0;
+	if(response->getIOVec(iov,&iovcnt)) {
+		return 1;
+	}
+	int length = iov[0].iov_len+(iovcnt>1 ? iov[1].iov_len : 0);
+	if(length>_maxResponseLength) {
+		DBG("Response of %d bytes is too long to keep",length);
+		_entries[index].responseLength = -1;
+		return 1;
+	}
+	uint8_t *slot = &_responses[(size_t)index*_maxResponseLength];
+	memcpy(slot,iov[0].iov_base,iov[0].iov_len);
+	if(iovcnt>1) {
+		memcpy(slot+iov[0].iov_len,iov[1].iov_base,iov[1].iov_len);
+	}
+	_entries[index].responseLength = length;
+	return 0;
+}
+
+/// Returns the number of messages the cache can remember at once.
+int CoapDedupCache::getCapacity() {
+	return (_bucketMask+1)*COAP_DEDUP_WAYS;
+}
+
+/// Returns the number of messages remembered that have not expired by \b now, by looking at every bucket.
+int CoapDedupCache::getNumEntries(uint32_t now) {
+	int count = 0;
+	for(int b=0; b<=_bucketMask; b++) {
+		for(int i=0; i<COAP_DEDUP_WAYS; i++) {
+			if(_buckets[b].used&(1<<i)&&!expired(_buckets[b].expires[i],now)) {
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+/// Returns the number of duplicates detected.
+uint64_t CoapDedupCache::getHits() {
+	return _hits;
+}
+
+/// Returns the number of new messages seen.
+uint64_t CoapDedupCache::getMisses() {
+	return _misses;
+}
+
+/// Returns the number of messages forgotten before their lifetime was up, to make room in a full bucket.
+uint64_t CoapDedupCache::getEvictions() {
+	return _evictions;
+}
+
+// way of the bucket holding the entry for endpoint and messageID, expired or not, or -1
+int CoapDedupCache::find(const CoapEndpoint *endpoint, uint16_t messageID, uint32_t hash) {
+	int bucketIndex = hash&_bucketMask;
+	Bucket *bucket = &_buckets[bucketIndex];
+	for(int i=0; i<COAP_DEDUP_WAYS; i++) {
+		if(bucket->used&(1<<i)&&bucket->hash[i]==hash&&bucket->messageID[i]==messageID&&
+			_entries[bucketIndex*COAP_DEDUP_WAYS+i].endpoint.equals(*endpoint)) {
+			return i;
+		}
+	}
+	return -1;
+}
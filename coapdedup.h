@@ -0,0 +1,94 @@
+#pragma once
+#include "cantcoap.h"
+#include "coapendpoint.h"
+
+// how long a confirmable message is remembered, EXCHANGE_LIFETIME of RFC 7252
+#ifndef COAP_EXCHANGE_LIFETIME_MS
+#define COAP_EXCHANGE_LIFETIME_MS 247000
+#endif
+
+// how long a non-confirmable message is remembered, NON_LIFETIME of RFC 7252
+#ifndef COAP_NON_LIFETIME_MS
+#define COAP_NON_LIFETIME_MS 145000
+#endif
+
+// entries per bucket, as many as fit in a 64 byte cache line
+#define COAP_DEDUP_WAYS 6
+
+/// Detects duplicate confirmable and non-confirmable messages, and keeps the response to replay for them.
+/**
+ * RFC 7252 section 4.5 asks a server to act on a retransmitted message only once and to send the same response
+ * again. Messages are remembered by endpoint and message ID for EXCHANGE_LIFETIME if confirmable, NON_LIFETIME if
+ * not.
+ *
+ * The cache takes a fixed amount of memory, chosen when it is constructed, however many messages arrive. It is
+ * a set associative table: each message ID of each endpoint belongs to one bucket of COAP_DEDUP_WAYS entries,
+ * whose hashes, message IDs and expiry times fill one cache line, so a lookup reads a single line unless the
+ * hash matches. When every entry of a bucket is in use, a new message takes the place of the one that would
+ * expire first, which is counted as an eviction. Responses are copied into a slot of \b maxResponseLength bytes
+ * that belongs to the entry.
+ *
+ * ~~~{.cpp}
+ * CoapDedupCache dedup(4*1024*1024,256);
+ * ...
+ * const uint8_t *cached;
+ * int cachedLength;
+ * if(dedup.check(recvPDU,(struct sockaddr*)&recvAddr,recvAddrLen,nowMs(),&cached,&cachedLength)) {
+ * 	if(cached!=NULL) {
+ * 		sendto(sockfd,cached,cachedLength,0,(struct sockaddr*)&recvAddr,recvAddrLen);
+ * 	}
+ * 	// otherwise the first copy is still being handled
+ * 	return;
+ * }
+ * // handle recvPDU and build response
+ * dedup.store(recvPDU->getMessageID(),(struct sockaddr*)&recvAddr,recvAddrLen,&response);
+ * ~~~
+ *
+ * A cache is not thread safe.
+ */
+class CoapDedupCache {
+	public:
+		CoapDedupCache(int memoryBudget, int maxResponseLength);
+		~CoapDedupCache();
+		CoapDedupCache(const CoapDedupCache &other) = delete;
+		CoapDedupCache& operator=(const CoapDedupCache &other) = delete;
+
+		int check(CoapPDU *pdu, const struct sockaddr *address, socklen_t addressLength, uint32_t now,
+			const uint8_t **response, int *responseLength);
+		int store(uint16_t messageID, const struct sockaddr *address, socklen_t addressLength, CoapPDU *response);
+		int getCapacity();
+		int getNumEntries(uint32_t now);
+		uint64_t getHits();
+		uint64_t getMisses();
+		uint64_t getEvictions();
+
+	private:
+		// the keys of COAP_DEDUP_WAYS entries, in one cache line
+		struct Bucket {
+			uint32_t hash[COAP_DEDUP_WAYS];
+			uint32_t expires[COAP_DEDUP_WAYS];
+			uint16_t messageID[COAP_DEDUP_WAYS];
+			// a bit per entry in use
+			uint8_t used;
+			uint8_t padding[3];
+		};
+		static_assert(sizeof(Bucket)==64,"a bucket should fill one cache line");
+
+		struct Entry {
+			CoapEndpoint endpoint;
+			// length of the response in the entry's slot, 0 while there is none and -1 if it did not fit
+			int responseLength;
+		};
+
+		int find(const CoapEndpoint *endpoint, uint16_t messageID, uint32_t hash);
+
+		Bucket *_buckets;
+		int _bucketMask;
+		Entry *_entries;
+		uint8_t *_responses;
+		int _maxResponseLength;
+
+		uint64_t _hits;
+		uint64_t _misses;
+		uint64_t _evictions;
+};
@@ -0,0 +1,81 @@
+#pragma once
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "cantcoap.h"
+
+#define COAP_ENDPOINT_HASH_BASIS 2166136261u
+#define COAP_ENDPOINT_HASH_PRIME 16777619u
+
+/// The address of a peer, an IPv4 or IPv6 socket address.
+/**
+ * Only the fields that identify the peer are kept and the rest is zeroed, so two copies of the same address
+ * are equal byte for byte, whatever was in the padding of the address they were set from. The address can be
+ * passed straight to sendto() or used as the msg_name of a struct msghdr.
+ */
+struct CoapEndpoint {
+	union {
+		struct sockaddr sa;
+		struct sockaddr_in in;
+		struct sockaddr_in6 in6;
+	} address;
+	socklen_t addressLength;
+
+	int set(const struct sockaddr *address, socklen_t addressLength);
+	uint32_t hash(uint32_t hash) const;
+	uint32_t hashMessage(uint16_t messageID) const;
+	int equals(const CoapEndpoint &other) const;
+};
+
+/// Sets the endpoint from a socket address such as the one filled in by recvfrom().
+/**
+ * \return 0 on success, 1 if the address is not a complete IPv4 or IPv6 address.
+ */
+inline int CoapEndpoint::set(const struct sockaddr *addr, socklen_t addrLength) {
+	memset(&address,0x00,sizeof(address));
+	addressLength = 0;
+	if(addr==NULL) {
+		return 1;
+	}
+	if(addr->sa_family==AF_INET&&addrLength>=(socklen_t)sizeof(struct sockaddr_in)) {
+		const struct sockaddr_in *in = (const struct sockaddr_in*)addr;
+		address.in.sin_family = AF_INET;
+		address.in.sin_port = in->sin_port;
+		address.in.sin_addr = in->sin_addr;
+		addressLength = sizeof(struct sockaddr_in);
+		return 0;
+	}
+	if(addr->sa_family==AF_INET6&&addrLength>=(socklen_t)sizeof(struct sockaddr_in6)) {
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6*)addr;
+		address.in6.sin6_family = AF_INET6;
+		address.in6.sin6_port = in6->sin6_port;
+		address.in6.sin6_addr = in6->sin6_addr;
+		address.in6.sin6_scope_id = in6->sin6_scope_id;
+		addressLength = sizeof(struct sockaddr_in6);
+		return 0;
+	}
+	DBG("Unsupported address family %d",addr->sa_family);
+	return 1;
+}
+
+/// Continues the FNV-1a hash \b hash over the address, start with COAP_ENDPOINT_HASH_BASIS.
+inline uint32_t CoapEndpoint::hash(uint32_t hash) const {
+	const uint8_t *bytes = (const uint8_t*)&address;
+	for(int i=0; i<(int)addressLength; i++) {
+		hash = (hash^bytes[i])*COAP_ENDPOINT_HASH_PRIME;
+	}
+	return hash;
+}
+
+/// Returns a hash of the address and \b messageID, for tables of messages exchanged with peers.
+inline uint32_t CoapEndpoint::hashMessage(uint16_t messageID) const {
+	uint32_t h = hash(COAP_ENDPOINT_HASH_BASIS);
+	h = (h^(messageID&0xFF))*COAP_ENDPOINT_HASH_PRIME;
+	h = (h^(messageID>>8))*COAP_ENDPOINT_HASH_PRIME;
+	return h^(h>>16);
+}
+
+/// Returns 1 if \b other is the same address.
+inline int CoapEndpoint::equals(const CoapEndpoint &other) const {
+	return addressLength==other.addressLength&&memcmp(&address,&other.address,addressLength)==0;
+}
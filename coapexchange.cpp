@@ -0,0 +1,306 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <new>
+#include <sys/random.h>
+#include "coapexchange.h"
+
+#define SHARD_MASK (COAP_EXCHANGE_SHARDS-1)
+
+// exchanges expire() hands to their callbacks for each time it takes a shard's lock
+#define EXPIRE_BATCH 64
+
+static_assert((COAP_EXCHANGE_SHARDS&SHARD_MASK)==0,"COAP_EXCHANGE_SHARDS must be a power of two");
+
+static inline uint64_t rotl(uint64_t x, int b) {
+	return (x<<b)|(x>>(64-b));
+}
+
+#define SIPROUND \
+	do { \
+		v0 += v1; v1 = rotl(v1,13); v1 ^= v0; v0 = rotl(v0,32); \
+		v2 += v3; v3 = rotl(v3,16); v3 ^= v2; \
+		v0 += v3; v3 = rotl(v3,21); v3 ^= v0; \
+		v2 += v1; v1 = rotl(v1,17); v1 ^= v2; v2 = rotl(v2,32); \
+	} while(0)
+
+// SipHash-2-4 of the single 8 byte little endian word m
+static uint64_t sipHash(const uint64_t key[2], uint64_t m) {
+	uint64_t v0 = key[0]^0x736F6D6570736575ull;
+	uint64_t v1 = key[1]^0x646F72616E646F6Dull;
+	uint64_t v2 = key[0]^0x6C7967656E657261ull;
+	uint64_t v3 = key[1]^0x7465646279746573ull;
+	v3 ^= m;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= m;
+	// the final block holds only the message length, 8
+	uint64_t b = 8ull<<56;
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
+	v2 ^= 0xFF;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	return v0^v1^v2^v3;
+}
+
+static inline uint64_t readToken(const uint8_t *token) {
+	uint64_t value = 0;
+	for(int i=0; i<COAP_EXCHANGE_TOKEN_LENGTH; i++) {
+		value = (value<<8)|token[i];
+	}
+	return value;
+}
+
+/// Constructs a table for up to about \b maxExchanges requests in flight at once.
+/**
+ * \param maxExchanges Requests that can be outstanding. Tokens pick their shard, so the table may refuse a new
+ * exchange a little before it holds this many.
+ * \param timeoutMs How long a request waits for its response before CoapExchangeTable::expire() gives up on it.
+ */
+CoapExchangeTable::CoapExchangeTable(int maxExchanges, uint32_t timeoutMs) : _counter(0), _numExchanges(0) {
+	_timeoutMs = timeoutMs;
+	if(getrandom(_key,sizeof(_key),0)!=(ssize_t)sizeof(_key)) {
+		// kernels older than getrandom(), or a signal while waiting for the pool to be seeded
+		DBG("getrandom() failed, tokens will be predictable");
+		_key[0] = ((uint64_t)time(NULL)<<32)^(uint64_t)(uintptr_t)this;
+		_key[1] = (uint64_t)clock();
+	}
+
+	int perShard = (maxExchanges+COAP_EXCHANGE_SHARDS-1)/COAP_EXCHANGE_SHARDS;
+	int numSlots = 2;
+	while(numSlots<2*perShard) {
+		numSlots *= 2;
+	}
+	_slotMask = numSlots-1;
+	_maxPerShard = numSlots/2;
+
+	void *shards = NULL;
+	if(posix_memalign(&shards,64,sizeof(Shard)*COAP_EXCHANGE_SHARDS)!=0) {
+		shards = NULL;
+	}
+	_shards = (Shard*)shards;
+	if(_shards==NULL) {
+		DBG("Failed to allocate %d shards",COAP_EXCHANGE_SHARDS);
+		return;
+	}
+	for(int s=0; s<COAP_EXCHANGE_SHARDS; s++) {
+		Shard *shard = new(&_shards[s]) Shard;
+		shard->numExchanges = 0;
+		shard->slots = (Exchange*)calloc(numSlots,sizeof(Exchange));
+		if(shard->slots==NULL) {
+			DBG("Failed to allocate %d slots",numSlots);
+		}
+	}
+}
+
+CoapExchangeTable::~CoapExchangeTable() {
+	if(_shards==NULL) {
+		return;
+	}
+	for(int s=0; s<COAP_EXCHANGE_SHARDS; s++) {
+		free(_shards[s].slots);
+		_shards[s].~Shard();
+	}
+	free(_shards);
+}
+
+/// Gives \b request a new token and remembers it until the response arrives or the exchange times out.
+/**
+ * Tokens are COAP_EXCHANGE_TOKEN_LENGTH bytes, unique among the exchanges in the table and not guessable from
+ * the tokens this table has generated before. The token replaces any token \b request already has.
+ *
+ * \param request The request, before it is sent.
+ * \param address Where the request will be sent.
+ * \param addressLength The length of \b address.
+ * \param now The current time in milliseconds.
+ * \param callback Called with the response, or with NULL when the exchange expires.
+ * \param context Passed to \b callback.
+ * \return 0 on success, 1 if the address is invalid, the token could not be set or the table is full.
+ */
+int CoapExchangeTable::begin(CoapPDU *request, const struct sockaddr *address, socklen_t addressLength, uint32_t now,
+	CoapExchangeCallback callback, void *context) {
+	CoapEndpoint endpoint;
+	if(_shards==NULL||endpoint.set(address,addressLength)) {
+		return 1;
+	}
+	// a full shard only turns away the tokens that fall in it, so try a few more
+	for(int attempt=0; attempt<4*COAP_EXCHANGE_SHARDS; attempt++) {
+		uint64_t token = nextToken();
+		Shard *shard = &_shards[token&SHARD_MASK];
+		std::lock_guard<std::mutex> guard(shard->lock);
+		// a pseudorandom token may, very rarely, be one already in flight
+		if(shard->slots==NULL||shard->numExchanges>=_maxPerShard||findExchange(shard,token)>=0) {
+			continue;
+		}
+		uint8_t bytes[COAP_EXCHANGE_TOKEN_LENGTH];
+		for(int i=0; i<COAP_EXCHANGE_TOKEN_LENGTH; i++) {
+			bytes[i] = token>>(8*(COAP_EXCHANGE_TOKEN_LENGTH-1-i));
+		}
+		if(request->setToken(bytes,COAP_EXCHANGE_TOKEN_LENGTH)) {
+			return 1;
+		}
+		int slot = (token>>32)&_slotMask;
+		while(shard->slots[slot].used) {
+			slot = (slot+1)&_slotMask;
+		}
+		Exchange *exchange = &shard->slots[slot];
+		exchange->token = token;
+		exchange->endpoint = endpoint;
+		exchange->callback = callback;
+		exchange->context = context;
+		exchange->expires = now+_timeoutMs;
+		exchange->used = 1;
+		shard->numExchanges++;
+		_numExchanges.fetch_add(1,std::memory_order_relaxed);
+		return 0;
+	}
+	DBG("Exchange table is full");
+	return 1;
+}
+
+/// Ends the exchange \b response belongs to and calls its callback with \b response.
+/**
+ * Safe to call from several threads at once, the callback runs on the calling thread.
+ *
+ * \param response The validated response, which may be piggybacked on an ACK or sent separately.
+ * \param address Where the response came from.
+ * \param addressLength The length of \b address.
+ * \return 1 if \b response ended an exchange, 0 if its token is unknown or it came from another endpoint than
+ * the request was sent to.
+ */
+int CoapExchangeTable::complete(CoapPDU *response, const struct sockaddr *address, socklen_t addressLength) {
+	CoapEndpoint endpoint;
+	if(_shards==NULL||response->getTokenLength()!=COAP_EXCHANGE_TOKEN_LENGTH||endpoint.set(address,addressLength)) {
+		return 0;
+	}
+	uint64_t token = readToken(response->getTokenPointer());
+	Shard *shard = &_shards[token&SHARD_MASK];
+	CoapExchangeCallback callback;
+	void *context;
+	{
+		std::lock_guard<std::mutex> guard(shard->lock);
+		int slot = findExchange(shard,token);
+		if(slot<0||!shard->slots[slot].endpoint.equals(endpoint)) {
+			return 0;
+		}
+		callback = shard->slots[slot].callback;
+		context = shard->slots[slot].context;
+		removeExchange(shard,slot);
+	}
+	if(callback!=NULL) {
+		callback(response,&endpoint,context);
+	}
+	return 1;
+}
+
+/// Ends the exchange with token \b token without calling its callback.
+/**
+ * \param context Set to the context of the exchange, may be NULL.
+ * \return 1 if the exchange was in the table, 0 if not.
+ */
+int CoapExchangeTable::cancel(const uint8_t *token, int tokenLength, void **context) {
+	if(_shards==NULL||tokenLength!=COAP_EXCHANGE_TOKEN_LENGTH) {
+		return 0;
+	}
+	uint64_t value = readToken(token);
+	Shard *shard = &_shards[value&SHARD_MASK];
+	std::lock_guard<std::mutex> guard(shard->lock);
+	int slot = findExchange(shard,value);
+	if(slot<0) {
+		return 0;
+	}
+	if(context!=NULL) {
+		*context = shard->slots[slot].context;
+	}
+	removeExchange(shard,slot);
+	return 1;
+}
+
+/// Ends every exchange whose response has not arrived within the timeout, calling its callback with NULL.
+/**
+ * This looks at every slot, so call it every second or so rather than for each message.
+ *
+ * \param now The current time in milliseconds.
+ * \return The number of exchanges that expired.
+ */
+int CoapExchangeTable::expire(uint32_t now) {
+	if(_shards==NULL) {
+		return 0;
+	}
+	struct {
+		CoapEndpoint endpoint;
+		CoapExchangeCallback callback;
+		void *context;
+	} expired[EXPIRE_BATCH];
+	int total = 0;
+	for(int s=0; s<COAP_EXCHANGE_SHARDS; s++) {
+		Shard *shard = &_shards[s];
+		int slot = 0;
+		while(slot<=_slotMask&&shard->slots!=NULL) {
+			int count = 0;
+			{
+				std::lock_guard<std::mutex> guard(shard->lock);
+				while(slot<=_slotMask&&count<EXPIRE_BATCH) {
+					Exchange *exchange = &shard->slots[slot];
+					if(!exchange->used||(int32_t)(exchange->expires-now)>0) {
+						slot++;
+						continue;
+					}
+					expired[count].endpoint = exchange->endpoint;
+					expired[count].callback = exchange->callback;
+					expired[count].context = exchange->context;
+					count++;
+					// the slot may now hold a later exchange, so look at it again
+					removeExchange(shard,slot);
+				}
+			}
+			for(int i=0; i<count; i++) {
+				if(expired[i].callback!=NULL) {
+					expired[i].callback(NULL,&expired[i].endpoint,expired[i].context);
+				}
+			}
+			total += count;
+		}
+	}
+	return total;
+}
+
+/// Returns the number of exchanges in flight.
+int CoapExchangeTable::getNumExchanges() {
+	return _numExchanges.load(std::memory_order_relaxed);
+}
+
+// the next token, a pseudorandom function of a counter so nothing about it follows from earlier tokens
+uint64_t CoapExchangeTable::nextToken() {
+	return sipHash(_key,_counter.fetch_add(1,std::memory_order_relaxed));
+}
+
+// slot of the exchange with token in shard, or -1, with the shard locked
+int CoapExchangeTable::findExchange(Shard *shard, uint64_t token) {
+	for(int slot=(token>>32)&_slotMask; shard->slots[slot].used; slot=(slot+1)&_slotMask) {
+		if(shard->slots[slot].token==token) {
+			return slot;
+		}
+	}
+	return -1;
+}
+
+// removes the exchange in slot of shard and closes the gap it leaves, with the shard locked
+void CoapExchangeTable::removeExchange(Shard *shard, int slot) {
+	shard->numExchanges--;
+	_numExchanges.fetch_sub(1,std::memory_order_relaxed);
+	int gap = slot;
+	for(int next=(slot+1)&_slotMask; shard->slots[next].used; next=(next+1)&_slotMask) {
+		int home = (shard->slots[next].token>>32)&_slotMask;
+		if(((next-home)&_slotMask)>=((next-gap)&_slotMask)) {
+			shard->slots[gap] = shard->slots[next];
+			gap = next;
+		}
+	}
+	shard->slots[gap].used = 0;
+}
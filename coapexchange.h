@@ -0,0 +1,99 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include "cantcoap.h"
+#include "coapendpoint.h"
+
+// number of independently locked parts of a CoapExchangeTable, a power of two
+#ifndef COAP_EXCHANGE_SHARDS
+#define COAP_EXCHANGE_SHARDS 64
+#endif
+
+// length of the tokens generated by CoapExchangeTable
+#define COAP_EXCHANGE_TOKEN_LENGTH 8
+
+/// Called when an exchange started by CoapExchangeTable::begin() ends.
+/**
+ * \param response The response, or NULL if none came before the exchange timed out.
+ * \param endpoint Where the request was sent.
+ * \param context The context passed to CoapExchangeTable::begin().
+ */
+typedef void (*CoapExchangeCallback)(CoapPDU *response, const CoapEndpoint *endpoint, void *context);
+
+/// Matches responses to the requests a client has outstanding, by token, from several threads at once.
+/**
+ * CoapExchangeTable::begin() gives a request a token of COAP_EXCHANGE_TOKEN_LENGTH bytes that is unique among the
+ * requests in flight, and remembers a callback and context to continue with. When a response comes back,
+ * CoapExchangeTable::complete() finds the request by its token and calls the callback. A response is only accepted
+ * from the endpoint the request was sent to, as in RFC 7252 section 5.3.2.
+ *
+ * Tokens are a keyed pseudorandom function of a counter, SipHash-2-4 with a key from getrandom(). Seeing any
+ * number of them tells an off-path attacker nothing about the next, as RFC 7252 section 5.3.1 asks of a client
+ * that is exposed to spoofed responses.
+ *
+ * The table is split into COAP_EXCHANGE_SHARDS shards chosen by token, each an open addressing hash table with its
+ * own lock. Several threads receiving responses rarely wait for each other, and each lookup is constant time. The
+ * size is fixed by the constructor, begin() fails when the table is full. Callbacks are called without any lock
+ * held, so they may start new exchanges.
+ *
+ * An exchange ends with its first response, so this is not for Observe registrations.
+ *
+ * ~~~{.cpp}
+ * CoapExchangeTable exchanges(1000000,30000);
+ * ...
+ * exchanges.begin(request,(struct sockaddr*)&device,deviceLength,nowMs(),readingReceived,device);
+ * // send request
+ * ...
+ * // on each receive thread
+ * exchanges.complete(recvPDU,(struct sockaddr*)&recvAddr,recvAddrLen);
+ * ...
+ * // now and again
+ * exchanges.expire(nowMs());
+ * ~~~
+ */
+class CoapExchangeTable {
+	public:
+		CoapExchangeTable(int maxExchanges, uint32_t timeoutMs);
+		~CoapExchangeTable();
+		CoapExchangeTable(const CoapExchangeTable &other) = delete;
+		CoapExchangeTable& operator=(const CoapExchangeTable &other) = delete;
+
+		int begin(CoapPDU *request, const struct sockaddr *address, socklen_t addressLength, uint32_t now,
+			CoapExchangeCallback callback, void *context);
+		int complete(CoapPDU *response, const struct sockaddr *address, socklen_t addressLength);
+		int cancel(const uint8_t *token, int tokenLength, void **context);
+		int expire(uint32_t now);
+		int getNumExchanges();
+
+	private:
+		struct Exchange {
+			uint64_t token;
+			CoapEndpoint endpoint;
+			CoapExchangeCallback callback;
+			void *context;
+			uint32_t expires;
+			uint8_t used;
+		};
+
+		// a lock and the hash table it guards, a cache line apart from the next shard
+		struct alignas(64) Shard {
+			std::mutex lock;
+			Exchange *slots;
+			int numExchanges;
+		};
+
+		uint64_t nextToken();
+		int findExchange(Shard *shard, uint64_t token);
+		void removeExchange(Shard *shard, int slot);
+
+		Shard *_shards;
+		int _slotMask;
+		// most exchanges a shard holds, half its slots
+		int _maxPerShard;
+		uint32_t _timeoutMs;
+
+		// tokens are SipHash-2-4 of a counter, with a key from getrandom()
+		std::atomic<uint64_t> _counter;
+		uint64_t _key[2];
+		std::atomic<int> _numExchanges;
+};
@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "coapmid.h"
+
+#define BLOCK_MASK ((1<<COAP_MID_BLOCK_SHIFT)-1)
+
+static_assert((COAP_MID_BLOCKS<<COAP_MID_BLOCK_SHIFT)==65536,"the blocks must cover every message ID");
+
+/// Constructs an allocator that keeps message IDs from being reused with a peer within \b lifetimeMs.
+/**
+ * \param lifetimeMs The reuse window, normally EXCHANGE_LIFETIME (247 seconds).
+ */
+CoapMessageIDAllocator::CoapMessageIDAllocator(uint32_t lifetimeMs) {
+	_epochMs = (lifetimeMs+COAP_MID_EPOCHS-1)/COAP_MID_EPOCHS;
+	if(_epochMs==0) {
+		_epochMs = 1;
+	}
+	setSeed((uint32_t)time(NULL)^(uint32_t)(uintptr_t)this);
+	_elapsed = 0;
+	_lastNow = 0;
+	_started = 0;
+	_peers = NULL;
+	_numPeers = 0;
+	_peerCapacity = 0;
+	_slots = NULL;
+	_slotMask = -1;
+}
+
+CoapMessageIDAllocator::~CoapMessageIDAllocator() {
+	free(_peers);
+	free(_slots);
+}
+
+/// Gives the next message ID to use for a message to \b address.
+/**
+ * A peer seen for the first time starts at a random message ID.
+ *
+ * \param address Where the message will be sent.
+ * \param addressLength The length of \b address.
+ * \param now The current time in milliseconds.
+ * \param messageID Set to the message ID to use.
+ * \return 0 on success, 1 if the address is invalid, memory ran out, or every message ID that could come next was
+ * used with this peer within the lifetime. In the last case the peer is being sent too much and the message should
+ * wait.
+ */
+int CoapMessageIDAllocator::next(const struct sockaddr *address, socklen_t addressLength, uint32_t now,
+	uint16_t *messageID) {
+	CoapEndpoint endpoint;
+	if(endpoint.set(address,addressLength)) {
+		return 1;
+	}
+	uint16_t epoch = advanceClock(now);
+	uint32_t hash = endpoint.hash(COAP_ENDPOINT_HASH_BASIS);
+	hash ^= hash>>16;
+	int slot = findPeer(&endpoint,hash);
+	int entering = 0;
+	if(slot<0) {
+		slot = addPeer(&endpoint,hash,epoch);
+		if(slot<0) {
+			return 1;
+		}
+		entering = 1;
+	}
+	Peer *peer = &_peers[_slots[slot]];
+
+	// the window only slides when the epoch changes, so this runs at most once per epoch per peer
+	if(peer->lastEpoch!=epoch) {
+		uint16_t inWindow = peer->inWindow;
+		while(inWindow!=0) {
+			int block = __builtin_ctz(inWindow);
+			inWindow &= inWindow-1;
+			if((uint16_t)(epoch-peer->blockEpoch[block])>COAP_MID_EPOCHS) {
+				peer->inWindow &= ~(1<<block);
+			}
+		}
+		peer->lastEpoch = epoch;
+	}
+
+	uint16_t next = peer->nextMessageID;
+	int block = next>>COAP_MID_BLOCK_SHIFT;
+	if(entering||(next&BLOCK_MASK)==0) {
+		if(peer->inWindow&(1<<block)) {
+			DBG("Message IDs %d to %d were used too recently",block<<COAP_MID_BLOCK_SHIFT,
+				(block<<COAP_MID_BLOCK_SHIFT)+BLOCK_MASK);
+			return 1;
+		}
+	}
+	peer->inWindow |= 1<<block;
+	peer->blockEpoch[block] = epoch;
+	peer->nextMessageID = next+1;
+	*messageID = next;
+	return 0;
+}
+
+/// Forgets peers that have not been given a message ID for the lifetime, whose next one may start anywhere.
+/**
+ * This looks at every peer, so call it every few seconds or so rather than for each message.
+ *
+ * \param now The current time in milliseconds.
+ * \return The number of peers dropped.
+ */
+int CoapMessageIDAllocator::expire(uint32_t now) {
+	uint16_t epoch = advanceClock(now);
+	int dropped = 0;
+	// backwards, as removing a peer moves the last one into its place
+	for(int i=_numPeers-1; i>=0; i--) {
+		Peer *peer = &_peers[i];
+		if((uint16_t)(epoch-peer->lastEpoch)>COAP_MID_EPOCHS) {
+			removePeer(findPeer(&peer->endpoint,peer->hash));
+			dropped++;
+		}
+	}
+	return dropped;
+}
+
+/// Returns the number of peers being tracked.
+int CoapMessageIDAllocator::getNumPeers() {
+	return _numPeers;
+}
+
+/// Seeds the generator that picks the first message ID of each peer, for repeatable tests.
+void CoapMessageIDAllocator::setSeed(uint32_t seed) {
+	_random = seed!=0 ? seed : 0x9E3779B9u;
+}
+
+// moves the clock on to now and returns the current epoch
+uint16_t CoapMessageIDAllocator::advanceClock(uint32_t now) {
+	if(!_started) {
+		_lastNow = now;
+		_started = 1;
+	}
+	_elapsed += (uint32_t)(now-_lastNow);
+	_lastNow = now;
+	return _elapsed/_epochMs;
+}
+
+// slot of the peer in _slots, or -1
+int CoapMessageIDAllocator::findPeer(const CoapEndpoint *endpoint, uint32_t hash) {
+	if(_slots==NULL) {
+		return -1;
+	}
+	for(int slot=hash&_slotMask; _slots[slot]>=0; slot=(slot+1)&_slotMask) {
+		Peer *peer = &_peers[_slots[slot]];
+		if(peer->hash==hash&&peer->endpoint.equals(*endpoint)) {
+			return slot;
+		}
+	}
+	return -1;
+}
+
+// adds a peer starting at a random message ID, growing the table to keep it at most half full, and returns its
+// slot or -1
+int CoapMessageIDAllocator::addPeer(const CoapEndpoint *endpoint, uint32_t hash, uint16_t epoch) {
+	if(_numPeers==_peerCapacity) {
+		int capacity = _peerCapacity<8 ? 8 : _peerCapacity*2;
+		Peer *peers = (Peer*)realloc(_peers,sizeof(Peer)*capacity);
+		if(peers==NULL) {
+			DBG("Failed to allocate %d peers",capacity);
+			return -1;
+		}
+		_peers = peers;
+		_peerCapacity = capacity;
+	}
+	if(2*(_numPeers+1)>_slotMask+1) {
+		int numSlots = _slotMask<0 ? 16 : 2*(_slotMask+1);
+		int *slots = (int*)malloc(sizeof(int)*numSlots);
+		if(slots==NULL) {
+			DBG("Failed to allocate %d peer slots",numSlots);
+			return -1;
+		}
+		for(int i=0; i<numSlots; i++) {
+			slots[i] = -1;
+		}
+		for(int i=0; i<_numPeers; i++) {
+			int slot = _peers[i].hash&(numSlots-1);
+			while(slots[slot]>=0) {
+				slot = (slot+1)&(numSlots-1);
+			}
+			slots[slot] = i;
+		}
+		free(_slots);
+		_slots = slots;
+		_slotMask = numSlots-1;
+	}
+
+	Peer *peer = &_peers[_numPeers];
+	peer->endpoint = *endpoint;
+	peer->hash = hash;
+	peer->nextMessageID = random();
+	peer->inWindow = 0;
+	peer->lastEpoch = epoch;
+	int slot = hash&_slotMask;
+	while(_slots[slot]>=0) {
+		slot = (slot+1)&_slotMask;
+	}
+	_slots[slot] = _numPeers++;
+	return slot;
+}
+
+// removes the peer in slot, moving the last peer into its place, and closes the gap it leaves in _slots
+void CoapMessageIDAllocator::removePeer(int slot) {
+	int index = _slots[slot];
+	int last = _numPeers-1;
+	if(index!=last) {
+		_slots[findPeer(&_peers[last].endpoint,_peers[last].hash)] = index;
+		_peers[index] = _peers[last];
+	}
+	_numPeers--;
+
+	int gap = slot;
+	for(int next=(slot+1)&_slotMask; _slots[next]>=0; next=(next+1)&_slotMask) {
+		int home = _peers[_slots[next]].hash&_slotMask;
+		if(((next-home)&_slotMask)>=((next-gap)&_slotMask)) {
+			_slots[gap] = _slots[next];
+			gap = next;
+		}
+	}
+	_slots[gap] = -1;
+}
+
+// xorshift32
+uint32_t CoapMessageIDAllocator::random() {
+	uint32_t x = _random;
+	x ^= x<<13;
+	x ^= x>>17;
+	x ^= x<<5;
+	_random = x;
+	return x;
+}
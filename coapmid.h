@@ -0,0 +1,83 @@
+#pragma once
+#include "cantcoap.h"
+#include "coapendpoint.h"
+
+// the message ID space is split into this many blocks, each tracked as a whole
+#define COAP_MID_BLOCKS 16
+#define COAP_MID_BLOCK_SHIFT 12
+
+// the reuse window is tracked in epochs of this fraction of the lifetime
+#ifndef COAP_MID_EPOCHS
+#define COAP_MID_EPOCHS 8
+#endif
+
+/// Hands out message IDs per peer, never reusing one with the same peer within the lifetime of an exchange.
+/**
+ * RFC 7252 section 4.4 asks that a message ID is not reused with the same endpoint within EXCHANGE_LIFETIME.
+ * Each peer gets its own sequence, starting at a random message ID and counting up.
+ *
+ * Rather than remember when each message ID was used, the 65536 message IDs are split into COAP_MID_BLOCKS
+ * blocks, and time into epochs of 1/COAP_MID_EPOCHS of the lifetime. A peer keeps a bitmap of the blocks used
+ * within the window and the epoch each was last used in, 38 bytes in all. A block is cleared from the bitmap once
+ * more than COAP_MID_EPOCHS epochs have passed since its last use, which is always at least the lifetime, and the
+ * sequence only moves into a block that is clear. A peer sent more than about 61000 messages within the lifetime
+ * is therefore refused until the oldest block clears, rather than given a message ID it might confuse.
+ *
+ * Peers that have been idle for the lifetime hold no message IDs that matter, and are dropped by
+ * CoapMessageIDAllocator::expire().
+ *
+ * ~~~{.cpp}
+ * CoapMessageIDAllocator messageIDs(247000);
+ * ...
+ * uint16_t messageID;
+ * if(messageIDs.next((struct sockaddr*)&peer,peerLength,nowMs(),&messageID)) {
+ * 	// too many messages to this peer, try again later
+ * }
+ * pdu->setMessageID(messageID);
+ * ~~~
+ *
+ * Times must not go backwards between calls. An allocator is not thread safe.
+ */
+class CoapMessageIDAllocator {
+	public:
+		CoapMessageIDAllocator(uint32_t lifetimeMs);
+		~CoapMessageIDAllocator();
+		CoapMessageIDAllocator(const CoapMessageIDAllocator &other) = delete;
+		CoapMessageIDAllocator& operator=(const CoapMessageIDAllocator &other) = delete;
+
+		int next(const struct sockaddr *address, socklen_t addressLength, uint32_t now, uint16_t *messageID);
+		int expire(uint32_t now);
+		int getNumPeers();
+		void setSeed(uint32_t seed);
+
+	private:
+		struct Peer {
+			CoapEndpoint endpoint;
+			uint32_t hash;
+			uint16_t nextMessageID;
+			// a bit per block used within the window, and the epoch each block was last used in
+			uint16_t inWindow;
+			uint16_t blockEpoch[COAP_MID_BLOCKS];
+			uint16_t lastEpoch;
+		};
+
+		uint16_t advanceClock(uint32_t now);
+		int findPeer(const CoapEndpoint *endpoint, uint32_t hash);
+		int addPeer(const CoapEndpoint *endpoint, uint32_t hash, uint16_t epoch);
+		void removePeer(int slot);
+		uint32_t random();
+
+		uint32_t _epochMs;
+		uint32_t _random;
+		// milliseconds since the first call, kept in 64 bits so the epoch carries on across the wrap of now
+		uint64_t _elapsed;
+		uint32_t _lastNow;
+		int _started;
+
+		// peers, and an open addressing hash table of indexes into them (-1 is empty)
+		Peer *_peers;
+		int _numPeers;
+		int _peerCapacity;
+		int *_slots;
+		int _slotMask;
+};
@@ -0,0 +1,454 @@
+#include <stdlib.h>
+#include <string.h>
+#include "coapobserve.h"
+
+static int setObserver(CoapObserver *observer, const struct sockaddr *address, socklen_t addressLength,
+	const uint8_t *token, uint8_t tokenLength) {
+	if(tokenLength>8||(token==NULL&&tokenLength>0)) {
+		DBG("Invalid token");
+		return 1;
+	}
+	memset(observer->token,0x00,8);
+	if(tokenLength>0) {
+		memcpy(observer->token,token,tokenLength);
+	}
+	observer->tokenLength = tokenLength;
+	return observer->endpoint.set(address,addressLength);
+}
+
+// FNV-1a of the address and token
+static uint32_t observerHash(const CoapObserver *observer) {
+	uint32_t hash = observer->endpoint.hash(COAP_ENDPOINT_HASH_BASIS);
+	for(int i=0; i<observer->tokenLength; i++) {
+		hash = (hash^observer->token[i])*COAP_ENDPOINT_HASH_PRIME;
+	}
+	return hash;
+}
+
+static inline int sameObserver(const CoapObserver *a, const CoapObserver *b) {
+	return a->tokenLength==b->tokenLength&&a->endpoint.equals(b->endpoint)&&memcmp(a->token,b->token,a->tokenLength)==0;
+}
+
+static inline int resourceSlot(uint32_t id, int mask) {
+	return (int)((id*2654435761u)>>8)&mask;
+}
+
+/// Constructs a registry with no observers.
+CoapObserveRegistry::CoapObserveRegistry() {
+	_resources = NULL;
+	_numResources = 0;
+	_resourceCapacity = 0;
+	_resourceSlots = NULL;
+	_resourceSlotMask = -1;
+	_slots = NULL;
+	_slotMask = -1;
+	_numObservers = 0;
+	_batch.count = 0;
+}
+
+CoapObserveRegistry::~CoapObserveRegistry() {
+	for(int i=0; i<_numResources; i++) {
+		free(_resources[i].observers);
+	}
+	free(_resources);
+	free(_resourceSlots);
+	free(_slots);
+}
+
+/// Registers or deregisters the sender of \b request, according to its Observe option.
+/**
+ * A GET or FETCH with Observe 0 registers the sender as an observer of \b resource and Observe 1 deregisters it.
+ * Requests without an Observe option are left alone.
+ *
+ * \param resource The resource the request is for.
+ * \param request The validated request.
+ * \param address The address the request came from.
+ * \param addressLength The length of \b address.
+ * \return 1 if the sender is now observing \b resource, so the response should carry an Observe option (see
+ * CoapObserveRegistry::addObserveOption()), 0 if not.
+ */
+int CoapObserveRegistry::handleRequest(uint32_t resource, CoapPDU *request, const struct sockaddr *address,
+	socklen_t addressLength) {
+	CoapPDU::Code code = request->getCode();
+	if(code!=CoapPDU::COAP_GET&&code!=CoapPDU::COAP_FETCH) {
+		return 0;
+	}
+	CoapPDU::CoapOption option;
+	if(!request->findOption(CoapPDU::COAP_OPTION_OBSERVE,&option)||option.optionValueLength>3) {
+		return 0;
+	}
+	uint32_t value = 0;
+	for(int i=0; i<option.optionValueLength; i++) {
+		value = (value<<8)|option.optionValuePointer[i];
+	}
+	if(value==0) {
+		return add(resource,address,addressLength,request->getTokenPointer(),request->getTokenLength())==0;
+	}
+	if(value==1) {
+		remove(address,addressLength,request->getTokenPointer(),request->getTokenLength());
+	}
+	return 0;
+}
+
+/// Adds an observer of \b resource.
+/**
+ * If the same address and token are already registered, for this or another resource, the old registration
+ * is replaced.
+ *
+ * \param resource The resource being observed.
+ * \param address The address of the observer, an IPv4 or IPv6 socket address.
+ * \param addressLength The length of \b address.
+ * \param token The token of the registration, which all notifications carry.
+ * \param tokenLength The length of the token, at most 8.
+ * \return 0 on success, 1 on failure.
+ */
+int CoapObserveRegistry::add(uint32_t resource, const struct sockaddr *address, socklen_t addressLength,
+	const uint8_t *token, uint8_t tokenLength) {
+	CoapObserver observer;
+	if(setObserver(&observer,address,addressLength,token,tokenLength)) {
+		return 1;
+	}
+	uint32_t hash = observerHash(&observer);
+	int r = findResource(resource);
+	if(r<0) {
+		r = addResource(resource);
+		if(r<0) {
+			return 1;
+		}
+	}
+	int slot = findObserver(&observer,hash);
+	if(slot>=0) {
+		if(_slots[slot].resource==r) {
+			return 0;
+		}
+		removeObserver(slot);
+	}
+	if(growObserverSlots()) {
+		return 1;
+	}
+
+	Resource *res = &_resources[r];
+	if(res->numObservers==res->capacity) {
+		int capacity = res->capacity<4 ? 4 : res->capacity*2;
+		CoapObserver *observers = (CoapObserver*)realloc(res->observers,sizeof(CoapObserver)*capacity);
+		if(observers==NULL) {
+			DBG("Failed to allocate %d observers",capacity);
+			return 1;
+		}
+		res->observers = observers;
+		res->capacity = capacity;
+	}
+	res->observers[res->numObservers] = observer;
+
+	slot = hash&_slotMask;
+	while(_slots[slot].resource>=0) {
+		slot = (slot+1)&_slotMask;
+	}
+	_slots[slot].hash = hash;
+	_slots[slot].resource = r;
+	_slots[slot].position = res->numObservers;
+	res->numObservers++;
+	_numObservers++;
+	return 0;
+}
+
+/// Removes the observer with address \b address and token \b token, for example after it answered a notification with RST.
+/**
+ * \return 0 on success, 1 if there is no such observer.
+ */
+int CoapObserveRegistry::remove(const struct sockaddr *address, socklen_t addressLength, const uint8_t *token,
+	uint8_t tokenLength) {
+	CoapObserver observer;
+	if(setObserver(&observer,address,addressLength,token,tokenLength)) {
+		return 1;
+	}
+	int slot = findObserver(&observer,observerHash(&observer));
+	if(slot<0) {
+		return 1;
+	}
+	removeObserver(slot);
+	return 0;
+}
+
+/// Removes every observer of \b resource.
+/**
+ * \return 0 on success, 1 if the resource has never been observed.
+ */
+int CoapObserveRegistry::removeResource(uint32_t resource) {
+	int r = findResource(resource);
+	if(r<0) {
+		return 1;
+	}
+	// removing from the end moves nothing
+	Resource *res = &_resources[r];
+	while(res->numObservers>0) {
+		const CoapObserver *last = &res->observers[res->numObservers-1];
+		removeObserver(findObserver(last,observerHash(last)));
+	}
+	return 0;
+}
+
+/// Adds an Observe option with the current sequence number of \b resource, for the response to a registration.
+/**
+ * \return 0 on success, 1 on failure.
+ */
+int CoapObserveRegistry::addObserveOption(uint32_t resource, CoapPDU *response) {
+	uint32_t sequence = getSequence(resource);
+	uint8_t value[3];
+	int length = 0;
+	for(uint32_t v=sequence; v!=0; v>>=8) {
+		length++;
+	}
+	for(int i=0; i<length; i++) {
+		value[i] = sequence>>(8*(length-1-i));
+	}
+	return response->addOption(CoapPDU::COAP_OPTION_OBSERVE,length,value);
+}
+
+/// Sends a notification to every observer of \b resource.
+/**
+ * The sequence number of the resource goes up by one and the code and options of \b prototype (apart from any
+ * Observe option) are encoded together with the new sequence number, once. Each observer then gets a header with
+ * its own message ID and its token in front of them. The notifications are handed to \b callback in batches of up
+ * to COAP_NOTIFY_BATCH_SIZE, see CoapNotifyBatch. The callback must not add or remove observers.
+ *
+ * \param resource The resource that changed.
+ * \param prototype A PDU holding the code and options of the notification, typically 2.05 with a Content-Format.
+ * May be NULL for 2.05 with no options other than Observe.
+ * \param payload The new representation, which is not copied. It must stay valid until the callback has sent it.
+ * \param payloadLength The length of \b payload.
+ * \param type COAP_CONFIRMABLE or COAP_NON_CONFIRMABLE.
+ * \param messageID Message ID of the first notification, incremented for each notification.
+ * \param callback Sends each batch.
+ * \param arg Passed to \b callback.
+ * \return The number of notifications handed to \b callback, or -1 on failure.
+ */
+int CoapObserveRegistry::notify(uint32_t resource, CoapPDU *prototype, const uint8_t *payload, int payloadLength,
+	CoapPDU::Type type, uint16_t *messageID, CoapNotifyCallback callback, void *arg) {
+	int r = findResource(resource);
+	if(r<0||_resources[r].numObservers==0) {
+		return 0;
+	}
+	Resource *res = &_resources[r];
+	res->sequence = (res->sequence+1)&COAP_OBSERVE_SEQUENCE_MASK;
+
+	// the part every notification shares, from the first option to the end of the payload
+	if(_shared.resetHeader()||addObserveOption(resource,&_shared)) {
+		return -1;
+	}
+	if(prototype!=NULL) {
+		for(const CoapPDU::CoapOption &o : prototype->options()) {
+			if(o.optionNumber!=CoapPDU::COAP_OPTION_OBSERVE&&
+				_shared.addOption(o.optionNumber,o.optionValueLength,o.optionValuePointer)) {
+				return -1;
+			}
+		}
+	}
+	struct iovec shared[2];
+	shared[1].iov_base = NULL;
+	shared[1].iov_len = 0;
+	int numShared = 0;
+	if(_shared.setPayloadReference(payload,payloadLength)||_shared.getIOVec(shared,&numShared)) {
+		return -1;
+	}
+	struct iovec options;
+	options.iov_base = (uint8_t*)shared[0].iov_base+COAP_HDR_SIZE;
+	options.iov_len = shared[0].iov_len-COAP_HDR_SIZE;
+	uint8_t header0 = 0x40|type;
+	uint8_t code = prototype!=NULL ? prototype->getCode() : CoapPDU::COAP_CONTENT;
+
+	// what doesn't change from one notification to the next is filled in once
+	CoapNotifyBatch *batch = &_batch;
+	int batchSize = res->numObservers<COAP_NOTIFY_BATCH_SIZE ? res->numObservers : COAP_NOTIFY_BATCH_SIZE;
+	for(int b=0; b<batchSize; b++) {
+		batch->iov[b][1] = options;
+		batch->iov[b][2] = shared[1];
+		memset(&batch->msg[b],0x00,sizeof(batch->msg[b]));
+		batch->msg[b].msg_iov = batch->iov[b];
+		batch->msg[b].msg_iovlen = numShared+1;
+	}
+
+	int sent = 0;
+	int b = 0;
+	uint16_t id = *messageID;
+	for(int i=0; i<res->numObservers; i++) {
+		const CoapObserver *observer = &res->observers[i];
+		uint8_t *header = batch->header[b];
+		header[0] = header0|observer->tokenLength;
+		header[1] = code;
+		header[2] = id>>8;
+		header[3] = id&0xFF;
+		// tokens are zero padded to 8 bytes, copying all of them is cheaper than copying exactly
+		memcpy(&header[COAP_HDR_SIZE],observer->token,8);
+		batch->observer[b] = observer;
+		batch->messageID[b] = id++;
+		batch->iov[b][0].iov_base = header;
+		batch->iov[b][0].iov_len = COAP_HDR_SIZE+observer->tokenLength;
+		batch->msg[b].msg_name = (void*)&observer->endpoint.address;
+		batch->msg[b].msg_namelen = observer->endpoint.addressLength;
+		if(++b==COAP_NOTIFY_BATCH_SIZE) {
+			batch->count = b;
+			sent += b;
+			b = 0;
+			if(callback(batch,arg)) {
+				*messageID = id;
+				return sent;
+			}
+		}
+	}
+	*messageID = id;
+	if(b>0) {
+		batch->count = b;
+		sent += b;
+		callback(batch,arg);
+	}
+	return sent;
+}
+
+/// Returns the sequence number \b resource last sent, which a registration response should carry.
+uint32_t CoapObserveRegistry::getSequence(uint32_t resource) {
+	int r = findResource(resource);
+	return r<0 ? 0 : _resources[r].sequence;
+}
+
+/// Returns the number of observers of \b resource.
+int CoapObserveRegistry::getNumObservers(uint32_t resource) {
+	int r = findResource(resource);
+	return r<0 ? 0 : _resources[r].numObservers;
+}
+
+/// Returns the number of observers of all resources.
+int CoapObserveRegistry::getNumObservers() {
+	return _numObservers;
+}
+
+// index of resource id in _resources, or -1
+int CoapObserveRegistry::findResource(uint32_t id) {
+	if(_resourceSlots==NULL) {
+		return -1;
+	}
+	for(int slot=resourceSlot(id,_resourceSlotMask); _resourceSlots[slot]>=0; slot=(slot+1)&_resourceSlotMask) {
+		if(_resources[_resourceSlots[slot]].id==id) {
+			return _resourceSlots[slot];
+		}
+	}
+	return -1;
+}
+
+// adds resource id, which must not exist, returning its index or -1. Resources are never removed.
+int CoapObserveRegistry::addResource(uint32_t id) {
+	if(_numResources==_resourceCapacity) {
+		int capacity = _resourceCapacity<8 ? 8 : _resourceCapacity*2;
+		Resource *resources = (Resource*)realloc(_resources,sizeof(Resource)*capacity);
+		if(resources==NULL) {
+			DBG("Failed to allocate %d resources",capacity);
+			return -1;
+		}
+		_resources = resources;
+		_resourceCapacity = capacity;
+	}
+	// keep the table at most half full
+	if(2*(_numResources+1)>_resourceSlotMask+1) {
+		int numSlots = _resourceSlotMask<0 ? 16 : 2*(_resourceSlotMask+1);
+		int *slots = (int*)malloc(sizeof(int)*numSlots);
+		if(slots==NULL) {
+			DBG("Failed to allocate %d resource slots",numSlots);
+			return -1;
+		}
+		for(int i=0; i<numSlots; i++) {
+			slots[i] = -1;
+		}
+		for(int i=0; i<_numResources; i++) {
+			int slot = resourceSlot(_resources[i].id,numSlots-1);
+			while(slots[slot]>=0) {
+				slot = (slot+1)&(numSlots-1);
+			}
+			slots[slot] = i;
+		}
+		free(_resourceSlots);
+		_resourceSlots = slots;
+		_resourceSlotMask = numSlots-1;
+	}
+
+	int r = _numResources++;
+	_resources[r].id = id;
+	_resources[r].sequence = 0;
+	_resources[r].observers = NULL;
+	_resources[r].numObservers = 0;
+	_resources[r].capacity = 0;
+	int slot = resourceSlot(id,_resourceSlotMask);
+	while(_resourceSlots[slot]>=0) {
+		slot = (slot+1)&_resourceSlotMask;
+	}
+	_resourceSlots[slot] = r;
+	return r;
+}
+
+// slot of the observer with the same address and token as observer, or -1
+int CoapObserveRegistry::findObserver(const CoapObserver *observer, uint32_t hash) {
+	if(_slots==NULL) {
+		return -1;
+	}
+	for(int slot=hash&_slotMask; _slots[slot].resource>=0; slot=(slot+1)&_slotMask) {
+		if(_slots[slot].hash==hash&&
+			sameObserver(&_resources[_slots[slot].resource].observers[_slots[slot].position],observer)) {
+			return slot;
+		}
+	}
+	return -1;
+}
+
+// makes sure there is room for one more observer with the table at most half full
+int CoapObserveRegistry::growObserverSlots() {
+	if(2*(_numObservers+1)<=_slotMask+1) {
+		return 0;
+	}
+	int numSlots = _slotMask<0 ? 16 : 2*(_slotMask+1);
+	Slot *slots = (Slot*)malloc(sizeof(Slot)*numSlots);
+	if(slots==NULL) {
+		DBG("Failed to allocate %d observer slots",numSlots);
+		return 1;
+	}
+	for(int i=0; i<numSlots; i++) {
+		slots[i].resource = -1;
+	}
+	for(int i=0; i<=_slotMask; i++) {
+		if(_slots[i].resource<0) {
+			continue;
+		}
+		int slot = _slots[i].hash&(numSlots-1);
+		while(slots[slot].resource>=0) {
+			slot = (slot+1)&(numSlots-1);
+		}
+		slots[slot] = _slots[i];
+	}
+	free(_slots);
+	_slots = slots;
+	_slotMask = numSlots-1;
+	return 0;
+}
+
+// removes the observer in slot, keeping the resource's observers contiguous and every probe sequence unbroken
+void CoapObserveRegistry::removeObserver(int slot) {
+	Resource *res = &_resources[_slots[slot].resource];
+	int position = _slots[slot].position;
+	int last = res->numObservers-1;
+	if(position!=last) {
+		// the last observer fills the gap
+		const CoapObserver *moved = &res->observers[last];
+		_slots[findObserver(moved,observerHash(moved))].position = position;
+		res->observers[position] = res->observers[last];
+	}
+	res->numObservers--;
+	_numObservers--;
+
+	int gap = slot;
+	for(int next=(slot+1)&_slotMask; _slots[next].resource>=0; next=(next+1)&_slotMask) {
+		int home = _slots[next].hash&_slotMask;
+		if(((next-home)&_slotMask)>=((next-gap)&_slotMask)) {
+			_slots[gap] = _slots[next];
+			gap = next;
+		}
+	}
+	_slots[gap].resource = -1;
+}
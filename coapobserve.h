@@ -0,0 +1,121 @@
+#pragma once
+#include <sys/uio.h>
+#include "cantcoap.h"
+#include "coapendpoint.h"
+
+// number of notifications CoapObserveRegistry::notify() hands to its callback at once
+#ifndef COAP_NOTIFY_BATCH_SIZE
+#define COAP_NOTIFY_BATCH_SIZE 64
+#endif
+
+// Observe sequence numbers are 24 bits
+#define COAP_OBSERVE_SEQUENCE_MASK 0xFFFFFF
+
+/// An endpoint observing a resource, identified by its address and the token of its registration.
+struct CoapObserver {
+	CoapEndpoint endpoint;
+	uint8_t tokenLength;
+	uint8_t token[8];
+};
+
+/// Notifications built by CoapObserveRegistry::notify(), one per observer, as arrays indexed by notification.
+/**
+ * Each \b msg is ready for sendmsg(): it is addressed to \b observer[i] and its iovecs are the header and token of
+ * that notification, followed by the options and payload, which are shared by every notification in the batch
+ * and encoded once. For sendmmsg(), copy each \b msg into the msg_hdr of a struct mmsghdr.
+ */
+struct CoapNotifyBatch {
+	int count;
+	const CoapObserver *observer[COAP_NOTIFY_BATCH_SIZE];
+	uint16_t messageID[COAP_NOTIFY_BATCH_SIZE];
+	struct msghdr msg[COAP_NOTIFY_BATCH_SIZE];
+	struct iovec iov[COAP_NOTIFY_BATCH_SIZE][3];
+	uint8_t header[COAP_NOTIFY_BATCH_SIZE][COAP_HDR_SIZE+8];
+};
+
+/// Called by CoapObserveRegistry::notify() with each batch to send. Returns 0 to carry on, non-zero to stop.
+typedef int (*CoapNotifyCallback)(CoapNotifyBatch *batch, void *arg);
+
+/// Keeps track of who observes which resource (RFC 7641) and sends them notifications.
+/**
+ * Resources are identified by a number chosen by the caller, such as the index of a route. Each observer is an
+ * address and a token, a registration with the same address and token as an existing one replaces it.
+ *
+ * The observers of a resource are kept together in one array, so CoapObserveRegistry::notify() walks them in order.
+ * The options and payload of a notification are encoded once per call. For each observer, only the 4 byte header
+ * and the token are written. All observers of a resource get the same Observe sequence number, which goes up by
+ * one with each notification.
+ *
+ * ~~~{.cpp}
+ * CoapObserveRegistry observers;
+ * ...
+ * // on a GET for resource TEMPERATURE
+ * response.makeResponse(request,CoapPDU::COAP_CONTENT,nextMessageID++,64);
+ * if(observers.handleRequest(TEMPERATURE,request,&from,fromLength)) {
+ * 	observers.addObserveOption(TEMPERATURE,&response);
+ * }
+ * ...
+ * // when the temperature changes
+ * observers.notify(TEMPERATURE,&prototype,payload,payloadLength,CoapPDU::COAP_NON_CONFIRMABLE,&nextMessageID,
+ * 	sendBatch,&sockfd);
+ * ~~~
+ *
+ * A registry is not thread safe.
+ */
+class CoapObserveRegistry {
+	public:
+		CoapObserveRegistry();
+		~CoapObserveRegistry();
+		CoapObserveRegistry(const CoapObserveRegistry &other) = delete;
+		CoapObserveRegistry& operator=(const CoapObserveRegistry &other) = delete;
+
+		int handleRequest(uint32_t resource, CoapPDU *request, const struct sockaddr *address, socklen_t addressLength);
+		int add(uint32_t resource, const struct sockaddr *address, socklen_t addressLength, const uint8_t *token,
+			uint8_t tokenLength);
+		int remove(const struct sockaddr *address, socklen_t addressLength, const uint8_t *token, uint8_t tokenLength);
+		int removeResource(uint32_t resource);
+		int addObserveOption(uint32_t resource, CoapPDU *response);
+		int notify(uint32_t resource, CoapPDU *prototype, const uint8_t *payload, int payloadLength, CoapPDU::Type type,
+			uint16_t *messageID, CoapNotifyCallback callback, void *arg);
+
+		uint32_t getSequence(uint32_t resource);
+		int getNumObservers(uint32_t resource);
+		int getNumObservers();
+
+	private:
+		struct Resource {
+			uint32_t id;
+			uint32_t sequence;
+			CoapObserver *observers;
+			int numObservers;
+			int capacity;
+		};
+
+		// a slot in the hash table of all observers by address and token, empty slots have resource -1
+		struct Slot {
+			uint32_t hash;
+			int resource;
+			int position;
+		};
+
+		int findResource(uint32_t id);
+		int addResource(uint32_t id);
+		int findObserver(const CoapObserver *observer, uint32_t hash);
+		int growObserverSlots();
+		void removeObserver(int slot);
+
+		Resource *_resources;
+		int _numResources;
+		int _resourceCapacity;
+		// hash table of indexes into _resources by id, -1 is empty
+		int *_resourceSlots;
+		int _resourceSlotMask;
+
+		Slot *_slots;
+		int _slotMask;
+		int _numObservers;
+
+		// options shared by the notifications being sent, and the batch being filled
+		CoapPDU _shared;
+		CoapNotifyBatch _batch;
+};
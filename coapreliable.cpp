@@ -0,0 +1,538 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+#include "coapreliable.h"
+
+#define WHEEL_MASK (COAP_WHEEL_SLOTS-1)
+
+// furthest ahead a timer can be placed, later timers are placed here and moved on again when they come round
+#define WHEEL_SPAN ((uint64_t)1<<(COAP_WHEEL_SLOT_BITS*COAP_WHEEL_LEVELS))
+
+/// Constructs a layer that can have up to \b maxPending confirmable messages awaiting acknowledgement.
+/**
+ * \param maxPending Most confirmable messages in flight at once.
+ * \param send Called to send each message, the first time and for each retransmission.
+ * \param timeout Called for each message that was never acknowledged, may be NULL.
+ * \param arg Passed to \b send and \b timeout.
+ */
+CoapReliableLayer::CoapReliableLayer(int maxPending, CoapReliableSendCallback send, CoapReliableTimeoutCallback timeout,
+	void *arg) {
+	_send = send;
+	_timeout = timeout;
+	_arg = arg;
+	_allocator = CoapAllocator::getDefault();
+	setSeed((uint32_t)time(NULL)^(uint32_t)(uintptr_t)this);
+	_congestion = NULL;
+	_numPending = 0;
+	_firstFree = -1;
+	_queueHead = -1;
+	_queueTail = -1;
+	_tick = 0;
+	_lastNow = 0;
+	_started = 0;
+	for(int level=0; level<COAP_WHEEL_LEVELS; level++) {
+		for(int slot=0; slot<COAP_WHEEL_SLOTS; slot++) {
+			_wheel[level][slot] = -1;
+		}
+		_occupied[level] = 0;
+	}
+
+	int numSlots = 2;
+	while(numSlots<2*maxPending) {
+		numSlots *= 2;
+	}
+	_pending = (Pending*)malloc(sizeof(Pending)*(maxPending>0 ? maxPending : 1));
+	_slots = (int*)malloc(sizeof(int)*numSlots);
+	if(_pending==NULL||_slots==NULL) {
+		DBG("Failed to allocate %d pending messages",maxPending);
+		maxPending = 0;
+	}
+	_maxPending = maxPending;
+	_slotMask = numSlots-1;
+	if(_slots!=NULL) {
+		for(int i=0; i<numSlots; i++) {
+			_slots[i] = -1;
+		}
+	}
+	for(int i=_maxPending-1; i>=0; i--) {
+		_pending[i].pdu = NULL;
+		_pending[i].next = _firstFree;
+		_firstFree = i;
+	}
+}
+
+CoapReliableLayer::~CoapReliableLayer() {
+	if(_slots!=NULL) {
+		for(int i=0; i<=_slotMask; i++) {
+			if(_slots[i]>=0) {
+				Pending *p = &_pending[_slots[i]];
+				_allocator->deallocate(p->pdu,p->capacity);
+			}
+		}
+	}
+	free(_pending);
+	free(_slots);
+}
+
+/// Sends \b pdu to \b address, and if it is confirmable keeps a copy to retransmit until it is acknowledged.
+/**
+ * Messages of other types are just sent. A confirmable message is copied, including any payload reference, so
+ * \b pdu can be reused as soon as this returns. A failure of the first send is not reported, the message is
+ * retransmitted as if it had been lost.
+ *
+ * \param pdu The message to send.
+ * \param address Where to send it.
+ * \param addressLength The length of \b address.
+ * \param now The current time in milliseconds.
+ * \param context Returned by CoapReliableLayer::receive() when the message is acknowledged, and passed to the
+ * timeout callback if it never is.
+ * \return 0 on success, 1 if the address is invalid, the layer is full or a message with the same message ID is
+ * already pending for \b address.
+ */
+int CoapReliableLayer::send(CoapPDU *pdu, const struct sockaddr *address, socklen_t addressLength, uint32_t now,
+	void *context) {
+	CoapEndpoint endpoint;
+	if(endpoint.set(address,addressLength)) {
+		return 1;
+	}
+	struct iovec iov[2];
+	int iovcnt = 0;
+	if(pdu->getIOVec(iov,&iovcnt)) {
+		return 1;
+	}
+	int pduLength = iov[0].iov_len+(iovcnt>1 ? iov[1].iov_len : 0);
+	if(pdu->getType()!=CoapPDU::COAP_CONFIRMABLE) {
+		if(iovcnt==1) {
+			return _send((const uint8_t*)iov[0].iov_base,pduLength,&endpoint,_arg);
+		}
+		// a payload held elsewhere has to be joined up, only a confirmable message keeps the copy
+		uint8_t *buffer = (uint8_t*)malloc(pduLength);
+		if(buffer==NULL) {
+			return 1;
+		}
+		memcpy(buffer,iov[0].iov_base,iov[0].iov_len);
+		memcpy(buffer+iov[0].iov_len,iov[1].iov_base,iov[1].iov_len);
+		int result = _send(buffer,pduLength,&endpoint,_arg);
+		free(buffer);
+		return result;
+	}
+
+	uint16_t messageID = pdu->getMessageID();
+	uint32_t hash = endpoint.hashMessage(messageID);
+	if(findPending(&endpoint,messageID,hash)>=0) {
+		DBG("Message %d is already pending",messageID);
+		return 1;
+	}
+	if(_firstFree<0) {
+		DBG("All %d pending messages are in use",_maxPending);
+		return 1;
+	}
+	int capacity = 0;
+	uint8_t *buffer = _allocator->allocate(pduLength,&capacity);
+	if(buffer==NULL) {
+		return 1;
+	}
+	memcpy(buffer,iov[0].iov_base,iov[0].iov_len);
+	if(iovcnt>1) {
+		memcpy(buffer+iov[0].iov_len,iov[1].iov_base,iov[1].iov_len);
+	}
+
+	if(!_started) {
+		_lastNow = now;
+		_started = 1;
+	}
+	int index = _firstFree;
+	Pending *p = &_pending[index];
+	_firstFree = p->next;
+	p->endpoint = endpoint;
+	p->pdu = buffer;
+	p->pduLength = pduLength;
+	p->capacity = capacity;
+	p->context = context;
+	p->hash = hash;
+	p->messageID = messageID;
+	p->retransmissions = 0;
+	p->queued = 0;
+
+	int slot = hash&_slotMask;
+	while(_slots[slot]>=0) {
+		slot = (slot+1)&_slotMask;
+	}
+	_slots[slot] = index;
+	_numPending++;
+
+	// timed from the time of sending rather than the last time the wheel moved
+	uint64_t tick = _tick+(uint32_t)(now-_lastNow);
+	uint32_t rto = COAP_ACK_TIMEOUT_MS;
+	if(_congestion!=NULL&&_congestion->begin(&endpoint,now,&rto)) {
+		if(_congestion->getOutstanding(&endpoint)>0) {
+			// held back until an earlier message to the same peer ends
+			p->queued = 1;
+			p->wheelSlot = -1;
+			p->next = -1;
+			p->prev = _queueTail;
+			if(_queueTail>=0) {
+				_pending[_queueTail].next = index;
+			} else {
+				_queueHead = index;
+			}
+			_queueTail = index;
+			return 0;
+		}
+		rto = COAP_ACK_TIMEOUT_MS;
+	}
+	transmit(index,tick,rto);
+	return 0;
+}
+
+/// Matches a received ACK or RST to the confirmable message it answers, which is then no longer retransmitted.
+/**
+ * \param pdu The validated message received.
+ * \param address Where it came from.
+ * \param addressLength The length of \b address.
+ * \param context Set to the context the acknowledged message was sent with.
+ * \return 1 if \b pdu acknowledged or rejected a pending message, 0 if it is not an ACK or RST or matches nothing,
+ * for example because it is a duplicate.
+ */
+int CoapReliableLayer::receive(CoapPDU *pdu, const struct sockaddr *address, socklen_t addressLength, void **context) {
+	return receive(pdu,address,addressLength,_lastNow,context);
+}
+
+/// Matches a received ACK or RST to the confirmable message it answers, measuring the round trip time.
+/**
+ * Use this rather than the version without \b now when there is a CoapCongestionControl, so round trip times are
+ * measured to the millisecond rather than from the last call to send() or advance().
+ *
+ * \param now The current time in milliseconds.
+ */
+int CoapReliableLayer::receive(CoapPDU *pdu, const struct sockaddr *address, socklen_t addressLength, uint32_t now,
+	void **context) {
+	CoapPDU::Type type = pdu->getType();
+	if(type!=CoapPDU::COAP_ACKNOWLEDGEMENT&&type!=CoapPDU::COAP_RESET) {
+		return 0;
+	}
+	CoapEndpoint endpoint;
+	if(endpoint.set(address,addressLength)) {
+		return 0;
+	}
+	uint16_t messageID = pdu->getMessageID();
+	int slot = findPending(&endpoint,messageID,endpoint.hashMessage(messageID));
+	if(slot<0||_pending[_slots[slot]].queued) {
+		return 0;
+	}
+	Pending *p = &_pending[_slots[slot]];
+	if(context!=NULL) {
+		*context = p->context;
+	}
+	uint64_t tick = _tick+(uint32_t)(now-_lastNow);
+	int32_t rtt = tick>p->firstSent ? (int32_t)(tick-p->firstSent) : 0;
+	int retransmissions = p->retransmissions;
+	removePending(slot);
+	if(_congestion!=NULL) {
+		_congestion->end(&endpoint,now,rtt,retransmissions);
+		transmitQueued(&endpoint,now,tick);
+	}
+	return 1;
+}
+
+/// Stops retransmitting message \b messageID to \b address, without calling the timeout callback.
+/**
+ * \param context Set to the context the message was sent with, may be NULL.
+ * \return 1 if the message was pending, 0 if not.
+ */
+int CoapReliableLayer::cancel(uint16_t messageID, const struct sockaddr *address, socklen_t addressLength, void **context) {
+	CoapEndpoint endpoint;
+	if(endpoint.set(address,addressLength)) {
+		return 0;
+	}
+	int slot = findPending(&endpoint,messageID,endpoint.hashMessage(messageID));
+	if(slot<0) {
+		return 0;
+	}
+	Pending *p = &_pending[_slots[slot]];
+	if(context!=NULL) {
+		*context = p->context;
+	}
+	int queued = p->queued;
+	removePending(slot);
+	if(_congestion!=NULL&&!queued) {
+		_congestion->end(&endpoint,_lastNow,-1,0);
+		transmitQueued(&endpoint,_lastNow,_tick);
+	}
+	return 1;
+}
+
+/// Moves time on to \b now, retransmitting messages that are due and giving up on those retransmitted enough.
+/**
+ * \param now The current time in milliseconds.
+ * \return The number of messages retransmitted or given up on.
+ */
+int CoapReliableLayer::advance(uint32_t now) {
+	if(!_started) {
+		_lastNow = now;
+		_started = 1;
+		return 0;
+	}
+	uint64_t target = _tick+(uint32_t)(now-_lastNow);
+	_lastNow = now;
+	int handled = 0;
+	while(_tick<target) {
+		if(_numPending==0) {
+			_tick = target;
+			break;
+		}
+		// jump straight to the next level 0 slot with timers in it, or to where level 0 wraps round
+		uint64_t next = _tick+1;
+		int index = next&WHEEL_MASK;
+		if(index!=0) {
+			uint64_t ahead = _occupied[0]>>index;
+			next += ahead!=0 ? __builtin_ctzll(ahead) : COAP_WHEEL_SLOTS-index;
+			if(next>target) {
+				_tick = target;
+				break;
+			}
+		}
+		_tick = next;
+		index = _tick&WHEEL_MASK;
+		if(index==0) {
+			// each level moves down a slot when the level below wraps round
+			for(int level=1; level<COAP_WHEEL_LEVELS; level++) {
+				cascade(level);
+				if(((_tick>>(COAP_WHEEL_SLOT_BITS*level))&WHEEL_MASK)!=0) {
+					break;
+				}
+			}
+		}
+
+		int i;
+		while((i=_wheel[0][index])>=0) {
+			unschedule(i);
+			Pending *p = &_pending[i];
+			if(p->expires>_tick) {
+				// placed early because it was too far ahead for the wheel
+				schedule(i);
+				continue;
+			}
+			handled++;
+			if(p->retransmissions<COAP_MAX_RETRANSMIT) {
+				p->retransmissions++;
+				p->timeout = _congestion!=NULL ? _congestion->backoff(&p->endpoint,p->timeout) : 2*p->timeout;
+				p->expires = _tick+p->timeout;
+				schedule(i);
+				if(_send(p->pdu,p->pduLength,&p->endpoint,_arg)) {
+					DBG("Failed to retransmit message %d",p->messageID);
+				}
+				continue;
+			}
+			// the callback may send, so the entry is freed first
+			CoapEndpoint endpoint = p->endpoint;
+			uint16_t messageID = p->messageID;
+			void *context = p->context;
+			removePending(findPending(&p->endpoint,p->messageID,p->hash));
+			if(_congestion!=NULL) {
+				_congestion->end(&endpoint,now,-1,COAP_MAX_RETRANSMIT);
+				transmitQueued(&endpoint,now,_tick);
+			}
+			if(_timeout!=NULL) {
+				_timeout(messageID,&endpoint,context,_arg);
+			}
+		}
+	}
+	return handled;
+}
+
+/// Returns the time in milliseconds after which CoapReliableLayer::advance() may have something to do, or -1 if nothing is pending.
+/**
+ * This is a lower bound, suitable as the timeout of poll() or epoll_wait(). It is never more than 64 ms while
+ * anything is pending.
+ */
+int CoapReliableLayer::getTimeout() {
+	if(_numPending==0) {
+		return -1;
+	}
+	int index = (_tick+1)&WHEEL_MASK;
+	if(index==0) {
+		return 1;
+	}
+	uint64_t ahead = _occupied[0]>>index;
+	return 1+(ahead!=0 ? __builtin_ctzll(ahead) : COAP_WHEEL_SLOTS-index);
+}
+
+/// Uses \b congestion for NSTART and retransmission timeouts rather than the fixed ones of RFC 7252, or NULL to stop.
+/**
+ * Confirmable messages to a peer that already has COAP_NSTART outstanding are kept, in order, and sent as
+ * earlier ones end. Set this before sending anything, \b congestion must outlive the layer.
+ */
+void CoapReliableLayer::setCongestionControl(CoapCongestionControl *congestion) {
+	_congestion = congestion;
+}
+
+/// Returns the number of confirmable messages awaiting acknowledgement, including any held back by NSTART.
+int CoapReliableLayer::getNumPending() {
+	return _numPending;
+}
+
+/// Seeds the generator that picks the random part of the initial timeouts, for repeatable tests.
+void CoapReliableLayer::setSeed(uint32_t seed) {
+	_random = seed!=0 ? seed : 0x9E3779B9u;
+}
+
+// sends pending message index for the first time at tick, with a random initial timeout between rto and
+// rto*ACK_RANDOM_FACTOR
+void CoapReliableLayer::transmit(int index, uint64_t tick, uint32_t rto) {
+	Pending *p = &_pending[index];
+	uint32_t spread = rto*(COAP_ACK_RANDOM_FACTOR_PERCENT-100)/100;
+	p->timeout = rto+random()%(spread+1);
+	p->firstSent = tick;
+	p->expires = tick+p->timeout;
+	schedule(index);
+	if(_send(p->pdu,p->pduLength,&p->endpoint,_arg)) {
+		DBG("Failed to send message %d, will retransmit",p->messageID);
+	}
+}
+
+// sends the oldest message held back for endpoint, if the congestion control lets it go
+void CoapReliableLayer::transmitQueued(const CoapEndpoint *endpoint, uint32_t now, uint64_t tick) {
+	for(int i=_queueHead; i>=0; i=_pending[i].next) {
+		Pending *p = &_pending[i];
+		if(!p->endpoint.equals(*endpoint)) {
+			continue;
+		}
+		uint32_t rto;
+		if(_congestion->begin(endpoint,now,&rto)) {
+			return;
+		}
+		if(p->prev>=0) {
+			_pending[p->prev].next = p->next;
+		} else {
+			_queueHead = p->next;
+		}
+		if(p->next>=0) {
+			_pending[p->next].prev = p->prev;
+		} else {
+			_queueTail = p->prev;
+		}
+		p->queued = 0;
+		transmit(i,tick,rto);
+		return;
+	}
+}
+
+// slot of the pending message in _slots, or -1
+int CoapReliableLayer::findPending(const CoapEndpoint *endpoint, uint16_t messageID, uint32_t hash) {
+	if(_maxPending==0) {
+		return -1;
+	}
+	for(int slot=hash&_slotMask; _slots[slot]>=0; slot=(slot+1)&_slotMask) {
+		Pending *p = &_pending[_slots[slot]];
+		if(p->hash==hash&&p->messageID==messageID&&p->endpoint.equals(*endpoint)) {
+			return slot;
+		}
+	}
+	return -1;
+}
+
+// frees the pending message in slot and closes the gap it leaves in _slots
+void CoapReliableLayer::removePending(int slot) {
+	int index = _slots[slot];
+	Pending *p = &_pending[index];
+	if(p->queued) {
+		if(p->prev>=0) {
+			_pending[p->prev].next = p->next;
+		} else {
+			_queueHead = p->next;
+		}
+		if(p->next>=0) {
+			_pending[p->next].prev = p->prev;
+		} else {
+			_queueTail = p->prev;
+		}
+		p->queued = 0;
+	} else {
+		unschedule(index);
+	}
+	_allocator->deallocate(p->pdu,p->capacity);
+	p->pdu = NULL;
+	p->next = _firstFree;
+	_firstFree = index;
+	_numPending--;
+
+	int gap = slot;
+	for(int next=(slot+1)&_slotMask; _slots[next]>=0; next=(next+1)&_slotMask) {
+		int home = _pending[_slots[next]].hash&_slotMask;
+		if(((next-home)&_slotMask)>=((next-gap)&_slotMask)) {
+			_slots[gap] = _slots[next];
+			gap = next;
+		}
+	}
+	_slots[gap] = -1;
+}
+
+// puts the timer of pending message index in the wheel, at the lowest level whose span reaches its expiry
+void CoapReliableLayer::schedule(int index) {
+	Pending *p = &_pending[index];
+	uint64_t expires = p->expires>_tick ? p->expires : _tick+1;
+	if(expires-_tick>=WHEEL_SPAN) {
+		expires = _tick+WHEEL_SPAN-1;
+	}
+	uint64_t delta = expires-_tick;
+	int level = 0;
+	while(level<COAP_WHEEL_LEVELS-1&&delta>=((uint64_t)1<<(COAP_WHEEL_SLOT_BITS*(level+1)))) {
+		level++;
+	}
+	int slot = (expires>>(COAP_WHEEL_SLOT_BITS*level))&WHEEL_MASK;
+	int *head = &_wheel[level][slot];
+	p->wheelSlot = level*COAP_WHEEL_SLOTS+slot;
+	p->prev = -1;
+	p->next = *head;
+	if(*head>=0) {
+		_pending[*head].prev = index;
+	}
+	*head = index;
+	_occupied[level] |= (uint64_t)1<<slot;
+}
+
+// takes the timer of pending message index out of the wheel
+void CoapReliableLayer::unschedule(int index) {
+	Pending *p = &_pending[index];
+	if(p->wheelSlot<0) {
+		return;
+	}
+	int level = p->wheelSlot/COAP_WHEEL_SLOTS;
+	int slot = p->wheelSlot%COAP_WHEEL_SLOTS;
+	if(p->prev>=0) {
+		_pending[p->prev].next = p->next;
+	} else {
+		_wheel[level][slot] = p->next;
+	}
+	if(p->next>=0) {
+		_pending[p->next].prev = p->prev;
+	}
+	if(_wheel[level][slot]<0) {
+		_occupied[level] &= ~((uint64_t)1<<slot);
+	}
+	p->wheelSlot = -1;
+	p->next = -1;
+	p->prev = -1;
+}
+
+// moves the timers in the current slot of level down to the levels below
+void CoapReliableLayer::cascade(int level) {
+	int slot = (_tick>>(COAP_WHEEL_SLOT_BITS*level))&WHEEL_MASK;
+	int i;
+	while((i=_wheel[level][slot])>=0) {
+		unschedule(i);
+		schedule(i);
+	}
+}
+
+// xorshift32
+uint32_t CoapReliableLayer::random() {
+	uint32_t x = _random;
+	x ^= x<<13;
+	x ^= x>>17;
+	x ^= x<<5;
+	_random = x;
+	return x;
+}
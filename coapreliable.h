@@ -0,0 +1,135 @@
+#pragma once
+#include "cantcoap.h"
+#include "coapendpoint.h"
+#include "coapcongestion.h"
+
+// transmission parameters of RFC 7252 section 4.8
+#ifndef COAP_ACK_TIMEOUT_MS
+#define COAP_ACK_TIMEOUT_MS 2000
+#endif
+
+// ACK_RANDOM_FACTOR of 1.5, as a percentage
+#ifndef COAP_ACK_RANDOM_FACTOR_PERCENT
+#define COAP_ACK_RANDOM_FACTOR_PERCENT 150
+#endif
+
+#ifndef COAP_MAX_RETRANSMIT
+#define COAP_MAX_RETRANSMIT 4
+#endif
+
+// the timing wheel has this many levels of 64 slots, with 1 ms ticks 4 levels reach about 4.6 hours
+#define COAP_WHEEL_LEVELS 4
+#define COAP_WHEEL_SLOT_BITS 6
+#define COAP_WHEEL_SLOTS (1<<COAP_WHEEL_SLOT_BITS)
+
+/// Sends \b pdu to \b endpoint for a CoapReliableLayer, returning 0 on success.
+typedef int (*CoapReliableSendCallback)(const uint8_t *pdu, int pduLength, const CoapEndpoint *endpoint, void *arg);
+
+/// Called when a confirmable message has been retransmitted MAX_RETRANSMIT times without an acknowledgement.
+typedef void (*CoapReliableTimeoutCallback)(uint16_t messageID, const CoapEndpoint *endpoint, void *context, void *arg);
+
+/// Retransmits confirmable messages until they are acknowledged, as in RFC 7252 section 4.2.
+/**
+ * Each confirmable message passed to CoapReliableLayer::send() is copied and kept until an ACK or RST with its message
+ * ID arrives from the same endpoint, see CoapReliableLayer::receive(). Until then it is sent again after
+ * ACK_TIMEOUT to ACK_TIMEOUT*ACK_RANDOM_FACTOR, then twice that, and so on, MAX_RETRANSMIT times. If the last wait
+ * also ends without an acknowledgement, the timeout callback is called.
+ *
+ * Timers live in a hierarchical timing wheel: COAP_WHEEL_LEVELS levels of 64 slots each, with 1 ms per slot at the
+ * first level and 64 times as long at each level above. A timer goes into a slot according to how far away it
+ * is and moves down a level each time the level below wraps round. Adding and cancelling a timer are constant
+ * time whatever the number of messages pending, and CoapReliableLayer::advance() only ever looks at the timers
+ * that are due.
+ *
+ * Times are passed in by the caller in milliseconds from any fixed point, wrapping is handled.
+ *
+ * ~~~{.cpp}
+ * CoapReliableLayer reliable(100000,sendPDU,giveUp,&sockfd);
+ * reliable.send(&notification,(struct sockaddr*)&addr,addrLen,nowMs(),context);
+ * ...
+ * // on receiving an ACK or RST
+ * void *context;
+ * if(reliable.receive(recvPDU,(struct sockaddr*)&recvAddr,recvAddrLen,&context)) {
+ * 	// the message with this context was acknowledged, or rejected if recvPDU is a RST
+ * }
+ * ...
+ * // every few milliseconds, or after epoll_wait() for reliable.getTimeout() ms
+ * reliable.advance(nowMs());
+ * ~~~
+ *
+ * A layer is not thread safe.
+ */
+class CoapReliableLayer {
+	public:
+		CoapReliableLayer(int maxPending, CoapReliableSendCallback send, CoapReliableTimeoutCallback timeout, void *arg);
+		~CoapReliableLayer();
+		CoapReliableLayer(const CoapReliableLayer &other) = delete;
+		CoapReliableLayer& operator=(const CoapReliableLayer &other) = delete;
+
+		int send(CoapPDU *pdu, const struct sockaddr *address, socklen_t addressLength, uint32_t now, void *context);
+		int receive(CoapPDU *pdu, const struct sockaddr *address, socklen_t addressLength, void **context);
+		int receive(CoapPDU *pdu, const struct sockaddr *address, socklen_t addressLength, uint32_t now, void **context);
+		int cancel(uint16_t messageID, const struct sockaddr *address, socklen_t addressLength, void **context);
+		int advance(uint32_t now);
+		int getTimeout();
+		int getNumPending();
+		void setSeed(uint32_t seed);
+		void setCongestionControl(CoapCongestionControl *congestion);
+
+	private:
+		struct Pending {
+			CoapEndpoint endpoint;
+			uint8_t *pdu;
+			int pduLength;
+			int capacity;
+			void *context;
+			// tick of the first transmission, tick at which the timer fires, and the wait before it
+			uint64_t firstSent;
+			uint64_t expires;
+			uint32_t timeout;
+			uint32_t hash;
+			uint16_t messageID;
+			uint8_t retransmissions;
+			// held back by NSTART, and linked into the queue rather than the wheel
+			uint8_t queued;
+			// wheel slot holding the timer (level*COAP_WHEEL_SLOTS+slot), and its neighbours there, -1 at the ends.
+			// next also links free entries.
+			int16_t wheelSlot;
+			int next;
+			int prev;
+		};
+
+		int findPending(const CoapEndpoint *endpoint, uint16_t messageID, uint32_t hash);
+		void removePending(int slot);
+		void schedule(int index);
+		void unschedule(int index);
+		void cascade(int level);
+		void transmit(int index, uint64_t tick, uint32_t rto);
+		void transmitQueued(const CoapEndpoint *endpoint, uint32_t now, uint64_t tick);
+		uint32_t random();
+
+		CoapReliableSendCallback _send;
+		CoapReliableTimeoutCallback _timeout;
+		void *_arg;
+		CoapAllocator *_allocator;
+		CoapCongestionControl *_congestion;
+		uint32_t _random;
+
+		Pending *_pending;
+		int _maxPending;
+		int _numPending;
+		int _firstFree;
+		// messages held back by NSTART, oldest first
+		int _queueHead;
+		int _queueTail;
+		// hash table of indexes into _pending by endpoint and message ID, -1 is empty
+		int *_slots;
+		int _slotMask;
+
+		// the wheel: list heads, and a bit per slot saying whether it holds anything
+		int _wheel[COAP_WHEEL_LEVELS][COAP_WHEEL_SLOTS];
+		uint64_t _occupied[COAP_WHEEL_LEVELS];
+		uint64_t _tick;
+		uint32_t _lastNow;
+		int _started;
+};
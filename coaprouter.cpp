@@ -0,0 +1,522 @@
+#include <stdlib.h>
+#include <string.h>
+#include "coaprouter.h"
+
+// hash key of a segment, its length followed by its first 6 bytes, so most segments are told apart without
+// looking at the segment itself
+static inline uint64_t segmentKey(const uint8_t *segment, uint16_t segmentLength) {
+	uint64_t key = (uint64_t)segmentLength<<48;
+	int n = segmentLength<6 ? segmentLength : 6;
+	for(int i=0; i<n; i++) {
+		key |= (uint64_t)segment[i]<<(40-8*i);
+	}
+	return key;
+}
+
+static inline int childSlot(uint64_t key, int capacity) {
+	return (int)((key*0x9E3779B97F4A7C15ULL)>>40)&(capacity-1);
+}
+
+#define PATH_HASH_BASIS 0xCBF29CE484222325ULL
+#define PATH_HASH_PRIME 0x9E3779B97F4A7C15ULL
+
+// continues the hash of a path with a segment, its length then its bytes a word at a time
+static inline uint64_t hashSegment(uint64_t hash, const uint8_t *segment, int segmentLength) {
+	hash = (hash^(uint64_t)segmentLength)*PATH_HASH_PRIME;
+	int i = 0;
+	for(; i+8<=segmentLength; i+=8) {
+		uint64_t word;
+		memcpy(&word,&segment[i],8);
+		hash = (hash^word)*PATH_HASH_PRIME;
+		hash ^= hash>>32;
+	}
+	// the last 0 to 7 bytes in at most three loads, never reading past the segment
+	const uint8_t *tail = &segment[i];
+	uint64_t word = 0;
+	if(segmentLength&4) {
+		uint32_t bytes;
+		memcpy(&bytes,tail,4);
+		word = bytes;
+		tail += 4;
+	}
+	if(segmentLength&2) {
+		uint16_t bytes;
+		memcpy(&bytes,tail,2);
+		word = (word<<16)|bytes;
+		tail += 2;
+	}
+	if(segmentLength&1) {
+		word = (word<<8)|tail[0];
+	}
+	hash = (hash^word)*PATH_HASH_PRIME;
+	return hash^(hash>>32);
+}
+
+/// Constructs a router with no routes.
+CoapRouter::CoapRouter() {
+	_nodes = NULL;
+	_numNodes = 0;
+	_nodeCapacity = 0;
+	_paths = NULL;
+	_numPaths = 0;
+	_pathMask = -1;
+	// root node, for requests without a Uri-Path
+	newNode(NULL,0);
+}
+
+CoapRouter::~CoapRouter() {
+	for(int i=0; i<_numNodes; i++) {
+		free(_nodes[i].segment);
+		free(_nodes[i].children);
+		free(_nodes[i].path);
+	}
+	free(_nodes);
+	free(_paths);
+}
+
+/// Adds a handler for requests with method \b method to \b path.
+/**
+ * \b path is split on '/', a leading '/' is optional and "/" on its own is the root, matching requests without a
+ * Uri-Path. A segment of '*' matches any single segment and a final segment of '**' matches any remaining segments.
+ * Adding a handler for a method that already has one replaces it.
+ *
+ * \param path The path to route, for example "/sensors/temp".
+ * \param method The request code to handle, COAP_GET, COAP_POST, COAP_PUT, COAP_DELETE or COAP_FETCH (or 0.06 and 0.07).
+ * \param handler The function to call.
+ * \param context Passed to the handler in CoapRouteMatch::context.
+ * \return 0 on success, 1 on failure.
+ */
+int CoapRouter::addRoute(const char *path, CoapPDU::Code method, CoapRouteHandler handler, void *context) {
+	if(path==NULL||method<=CoapPDU::COAP_EMPTY||method>=COAP_ROUTER_NUM_METHODS||_numNodes==0) {
+		DBG("Invalid route");
+		return 1;
+	}
+
+	if(path[0]=='/') {
+		path++;
+	}
+	int node = 0;
+	int depth = 0;
+	int wildcards = 0;
+	uint64_t hash = PATH_HASH_BASIS;
+	if(path[0]!=0x00) {
+		const char *segment = path;
+		while(1) {
+			const char *end = strchr(segment,'/');
+			int segmentLength = end==NULL ? strlen(segment) : end-segment;
+			if(segmentLength>0xFFFF||++depth>COAP_ROUTER_MAX_DEPTH) {
+				DBG("Route is too long");
+				return 1;
+			}
+			if(segmentLength==2&&segment[0]=='*'&&segment[1]=='*'&&end!=NULL) {
+				DBG("'**' must be the last segment of a route");
+				return 1;
+			}
+			if(segment[0]=='*'&&(segmentLength==1||(segmentLength==2&&segment[1]=='*'))) {
+				wildcards = 1;
+			}
+			hash = hashSegment(hash,(const uint8_t*)segment,segmentLength);
+			node = addChild(node,(const uint8_t*)segment,segmentLength);
+			if(node<0) {
+				return 1;
+			}
+			if(end==NULL) {
+				break;
+			}
+			segment = end+1;
+		}
+	}
+	if(!wildcards&&addPath(node,path,hash)) {
+		return 1;
+	}
+
+	_nodes[node].handlers[method] = handler;
+	_nodes[node].contexts[method] = context;
+	if(handler!=NULL) {
+		_nodes[node].methods |= 1<<method;
+	} else {
+		_nodes[node].methods &= ~(1<<method);
+	}
+	return 0;
+}
+
+/// Matches \b request against the routes, using the Uri-Path option values in place.
+/**
+ * \param request A validated request.
+ * \param match Filled in with the handler, its context and the matched segments if the route is found.
+ * \return COAP_ROUTE_FOUND, COAP_ROUTE_NOT_FOUND (4.04), or COAP_ROUTE_METHOD_NOT_ALLOWED (4.05) if the path
+ * exists but has no handler for the request method.
+ */
+CoapRouter::RouteResult CoapRouter::route(CoapPDU *request, CoapRouteMatch *match) {
+	int numSegments = 0;
+	uint64_t hash = PATH_HASH_BASIS;
+
+	// a request which went through validate() has its option index, so the segments are found without decoding
+	const CoapPDU::CoapOptionIndexEntry *entry;
+	int numIndexed = request->findIndexedOptions(CoapPDU::COAP_OPTION_URI_PATH,&entry);
+	if(numIndexed>=0) {
+		if(numIndexed>COAP_ROUTER_MAX_DEPTH) {
+			DBG("Too many Uri-Path segments to route");
+			return COAP_ROUTE_NOT_FOUND;
+		}
+		const uint8_t *pdu = request->getPDUPointer();
+		for(; numSegments<numIndexed; numSegments++) {
+			match->segment[numSegments] = &pdu[entry[numSegments].valueOffset];
+			match->segmentLength[numSegments] = entry[numSegments].valueLength;
+			hash = hashSegment(hash,match->segment[numSegments],match->segmentLength[numSegments]);
+		}
+		match->numSegments = numSegments;
+		return routeSegments(request->getCode(),hash,match);
+	}
+
+	// otherwise options are in order, so stop as soon as the Uri-Path options have been passed
+	for(const CoapPDU::CoapOption &o : request->options()) {
+		if(o.optionNumber<CoapPDU::COAP_OPTION_URI_PATH) {
+			continue;
+		}
+		if(o.optionNumber>CoapPDU::COAP_OPTION_URI_PATH) {
+			break;
+		}
+		if(numSegments==COAP_ROUTER_MAX_DEPTH) {
+			DBG("Too many Uri-Path segments to route");
+			return COAP_ROUTE_NOT_FOUND;
+		}
+		match->segment[numSegments] = o.optionValuePointer;
+		match->segmentLength[numSegments] = o.optionValueLength;
+		hash = hashSegment(hash,o.optionValuePointer,o.optionValueLength);
+		numSegments++;
+	}
+	match->numSegments = numSegments;
+	return routeSegments(request->getCode(),hash,match);
+}
+
+/// Matches a path already split into segments, see CoapRouter::route(CoapPDU*,CoapRouteMatch*).
+CoapRouter::RouteResult CoapRouter::route(const uint8_t **segments, const uint16_t *segmentLengths, int numSegments,
+	CoapPDU::Code method, CoapRouteMatch *match) {
+	if(numSegments>COAP_ROUTER_MAX_DEPTH) {
+		return COAP_ROUTE_NOT_FOUND;
+	}
+	match->numSegments = numSegments;
+	uint64_t hash = PATH_HASH_BASIS;
+	for(int i=0; i<numSegments; i++) {
+		match->segment[i] = segments[i];
+		match->segmentLength[i] = segmentLengths[i];
+		hash = hashSegment(hash,segments[i],segmentLengths[i]);
+	}
+	return routeSegments(method,hash,match);
+}
+
+/// Matches the segments already in \b match, whose path hashes to \b hash, and looks up the handler for \b method.
+CoapRouter::RouteResult CoapRouter::routeSegments(CoapPDU::Code method, uint64_t hash, CoapRouteMatch *match) {
+	match->numWildcards = 0;
+	match->rest = -1;
+	match->handler = NULL;
+	match->context = NULL;
+
+	// a route of literals is the most specific match there can be, so look for one before walking the tree
+	int node = findPath(hash,match);
+	if(node<0||_nodes[node].methods==0) {
+		node = this->match(0,0,match);
+	}
+	if(node<0) {
+		return COAP_ROUTE_NOT_FOUND;
+	}
+	if(method<=CoapPDU::COAP_EMPTY||method>=COAP_ROUTER_NUM_METHODS||!(_nodes[node].methods&(1<<method))) {
+		return COAP_ROUTE_METHOD_NOT_ALLOWED;
+	}
+	match->handler = _nodes[node].handlers[method];
+	match->context = _nodes[node].contexts[method];
+	return COAP_ROUTE_FOUND;
+}
+
+/// Routes \b request and calls the handler if one is found.
+/**
+ * \param request A validated request.
+ * \param arg Passed to the handler, typically where the response should be sent.
+ * \param result Pointer into which the result of routing is placed, so the caller can answer 4.04 or 4.05.
+ * \return The return value of the handler, or 1 if no handler was called.
+ */
+int CoapRouter::dispatch(CoapPDU *request, void *arg, RouteResult *result) {
+	CoapRouteMatch match;
+	*result = route(request,&match);
+	if(*result!=COAP_ROUTE_FOUND) {
+		return 1;
+	}
+	return match.handler(request,&match,arg);
+}
+
+/// Returns the number of nodes in the routing tree, one for the root and one per distinct route segment.
+int CoapRouter::getNumNodes() {
+	return _numNodes;
+}
+
+// PRIVATE PRIVATE PRIVATE PRIVATE PRIVATE PRIVATE PRIVATE
+// PRIVATE PRIVATE PRIVATE PRIVATE PRIVATE PRIVATE PRIVATE
+
+/// Appends a node with a copy of \b segment, returning its index or -1 if memory couldn't be allocated.
+int CoapRouter::newNode(const uint8_t *segment, uint16_t segmentLength) {
+	if(_numNodes==_nodeCapacity) {
+		int capacity = _nodeCapacity==0 ? 16 : _nodeCapacity*2;
+		Node *nodes = (Node*)realloc(_nodes,capacity*sizeof(Node));
+		if(nodes==NULL) {
+			DBG("Failed to allocate router nodes");
+			return -1;
+		}
+		_nodes = nodes;
+		_nodeCapacity = capacity;
+	}
+	Node *node = &_nodes[_numNodes];
+	memset(node,0x00,sizeof(Node));
+	node->wildcardChild = -1;
+	node->restChild = -1;
+	if(segmentLength>0) {
+		node->segment = (uint8_t*)malloc(segmentLength);
+		if(node->segment==NULL) {
+			DBG("Failed to allocate route segment");
+			return -1;
+		}
+		memcpy(node->segment,segment,segmentLength);
+	}
+	node->segmentLength = segmentLength;
+	return _numNodes++;
+}
+
+/// Adds \b node, reached by the literal route \b path hashing to \b hash, to the path table. Returns 0 on success.
+int CoapRouter::addPath(int node, const char *path, uint64_t hash) {
+	for(int slot=hash&_pathMask; _pathMask>=0&&_paths[slot].node>=0; slot=(slot+1)&_pathMask) {
+		if(_paths[slot].node==node) {
+			return 0;
+		}
+	}
+
+	// the segments, each a 2 byte length then its bytes, to check a request against
+	int pathLength = 0;
+	int numSegments = 0;
+	int segmentLengths[COAP_ROUTER_MAX_DEPTH];
+	for(const char *segment=path; path[0]!=0x00; numSegments++) {
+		const char *end = strchr(segment,'/');
+		segmentLengths[numSegments] = end==NULL ? strlen(segment) : end-segment;
+		pathLength += 2+segmentLengths[numSegments];
+		if(end==NULL) {
+			numSegments++;
+			break;
+		}
+		segment = end+1;
+	}
+	uint8_t *encoded = NULL;
+	if(pathLength>0) {
+		encoded = (uint8_t*)malloc(pathLength);
+		if(encoded==NULL) {
+			DBG("Failed to allocate route path");
+			return 1;
+		}
+		uint8_t *to = encoded;
+		const char *segment = path;
+		for(int i=0; i<numSegments; i++) {
+			to[0] = segmentLengths[i]>>8;
+			to[1] = segmentLengths[i]&0xFF;
+			memcpy(&to[2],segment,segmentLengths[i]);
+			to += 2+segmentLengths[i];
+			segment += segmentLengths[i]+1;
+		}
+	}
+
+	// grow to keep the table at most half full
+	if(2*(_numPaths+1)>_pathMask+1) {
+		int numSlots = _pathMask<0 ? 16 : 2*(_pathMask+1);
+		Path *paths = (Path*)malloc(numSlots*sizeof(Path));
+		if(paths==NULL) {
+			DBG("Failed to allocate %d path slots",numSlots);
+			free(encoded);
+			return 1;
+		}
+		for(int i=0; i<numSlots; i++) {
+			paths[i].node = -1;
+		}
+		for(int i=0; i<=_pathMask; i++) {
+			if(_paths[i].node>=0) {
+				int slot = _paths[i].hash&(numSlots-1);
+				while(paths[slot].node>=0) {
+					slot = (slot+1)&(numSlots-1);
+				}
+				paths[slot] = _paths[i];
+			}
+		}
+		free(_paths);
+		_paths = paths;
+		_pathMask = numSlots-1;
+	}
+
+	_nodes[node].path = encoded;
+	_nodes[node].pathLength = pathLength;
+	int slot = hash&_pathMask;
+	while(_paths[slot].node>=0) {
+		slot = (slot+1)&_pathMask;
+	}
+	_paths[slot].hash = hash;
+	_paths[slot].node = node;
+	_numPaths++;
+	return 0;
+}
+
+/// Looks up the literal route with the segments in \b match, which hash to \b hash, returning its node or -1.
+int CoapRouter::findPath(uint64_t hash, CoapRouteMatch *match) {
+	if(_pathMask<0) {
+		return -1;
+	}
+	for(int slot=hash&_pathMask; _paths[slot].node>=0; slot=(slot+1)&_pathMask) {
+		if(_paths[slot].hash!=hash) {
+			continue;
+		}
+		// almost certainly the route, but check the segments
+		Node *node = &_nodes[_paths[slot].node];
+		const uint8_t *path = node->path;
+		const uint8_t *end = path+node->pathLength;
+		int i = 0;
+		for(; i<match->numSegments&&path<end; i++) {
+			int segmentLength = (path[0]<<8)|path[1];
+			if(segmentLength!=match->segmentLength[i]||memcmp(&path[2],match->segment[i],segmentLength)!=0) {
+				break;
+			}
+			path += 2+segmentLength;
+		}
+		if(i==match->numSegments&&path==end) {
+			return _paths[slot].node;
+		}
+	}
+	return -1;
+}
+
+/// Looks up a literal child of \b node, returning its index or -1.
+/**
+ * Each node hashes its children, so a segment is found in constant time however many siblings it has. Segments
+ * longer than 6 bytes can share a key, those are compared in full.
+ */
+int CoapRouter::findChild(Node *node, const uint8_t *segment, uint16_t segmentLength) {
+	if(node->numChildren==0) {
+		return -1;
+	}
+	uint64_t key = segmentKey(segment,segmentLength);
+	int mask = node->childCapacity-1;
+	for(int slot=childSlot(key,node->childCapacity); node->children[slot].node>=0; slot=(slot+1)&mask) {
+		Child *child = &node->children[slot];
+		if(child->key==key&&(segmentLength<=6||memcmp(_nodes[child->node].segment+6,segment+6,segmentLength-6)==0)) {
+			return child->node;
+		}
+	}
+	return -1;
+}
+
+/// Doubles the hash table of children of \b node, keeping it at most half full. Returns 0 on success.
+int CoapRouter::growChildren(Node *node) {
+	int capacity = node->childCapacity==0 ? 4 : node->childCapacity*2;
+	Child *children = (Child*)malloc(capacity*sizeof(Child));
+	if(children==NULL) {
+		DBG("Failed to allocate router children");
+		return 1;
+	}
+	for(int i=0; i<capacity; i++) {
+		children[i].node = -1;
+	}
+	for(int i=0; i<node->childCapacity; i++) {
+		if(node->children[i].node>=0) {
+			int slot = childSlot(node->children[i].key,capacity);
+			while(children[slot].node>=0) {
+				slot = (slot+1)&(capacity-1);
+			}
+			children[slot] = node->children[i];
+		}
+	}
+	free(node->children);
+	node->children = children;
+	node->childCapacity = capacity;
+	return 0;
+}
+
+/// Returns the child of \b parent for \b segment, adding it if it doesn't exist yet. Returns -1 on failure.
+int CoapRouter::addChild(int parent, const uint8_t *segment, uint16_t segmentLength) {
+	int wildcard = segmentLength==1&&segment[0]=='*';
+	int rest = segmentLength==2&&segment[0]=='*'&&segment[1]=='*';
+	if(wildcard||rest) {
+		int existing = wildcard ? _nodes[parent].wildcardChild : _nodes[parent].restChild;
+		if(existing>=0) {
+			return existing;
+		}
+		int child = newNode(segment,segmentLength);
+		if(child<0) {
+			return -1;
+		}
+		if(wildcard) {
+			_nodes[parent].wildcardChild = child;
+		} else {
+			_nodes[parent].restChild = child;
+		}
+		return child;
+	}
+
+	int existing = findChild(&_nodes[parent],segment,segmentLength);
+	if(existing>=0) {
+		return existing;
+	}
+	// newNode may move _nodes, so only take pointers afterwards
+	int child = newNode(segment,segmentLength);
+	if(child<0) {
+		return -1;
+	}
+	Node *node = &_nodes[parent];
+	if((node->numChildren+1)*2>node->childCapacity&&growChildren(node)) {
+		return -1;
+	}
+	uint64_t key = segmentKey(segment,segmentLength);
+	int slot = childSlot(key,node->childCapacity);
+	while(node->children[slot].node>=0) {
+		slot = (slot+1)&(node->childCapacity-1);
+	}
+	node->children[slot].key = key;
+	node->children[slot].node = child;
+	node->numChildren++;
+	return child;
+}
+
+/// Matches the segments from \b depth onwards below \b node, returning the node reached or -1.
+/**
+ * Literal children are tried first, then '*', then '**', backtracking if a more specific branch dead-ends.
+ * Nodes with no handler at all don't count as a match, so an intermediate segment of a longer route isn't
+ * reported as 4.05.
+ */
+int CoapRouter::match(int node, int depth, CoapRouteMatch *match) {
+	Node *n = &_nodes[node];
+	if(depth==match->numSegments) {
+		if(n->methods!=0) {
+			return node;
+		}
+		// '**' also matches nothing
+		if(n->restChild>=0) {
+			match->rest = depth;
+			return n->restChild;
+		}
+		return -1;
+	}
+
+	int child = findChild(n,match->segment[depth],match->segmentLength[depth]);
+	if(child>=0) {
+		int found = this->match(child,depth+1,match);
+		if(found>=0) {
+			return found;
+		}
+	}
+	if(n->wildcardChild>=0) {
+		int numWildcards = match->numWildcards;
+		match->wildcard[match->numWildcards++] = depth;
+		int found = this->match(n->wildcardChild,depth+1,match);
+		if(found>=0) {
+			return found;
+		}
+		match->numWildcards = numWildcards;
+	}
+	if(n->restChild>=0) {
+		match->rest = depth;
+		return n->restChild;
+	}
+	return -1;
+}
@@ -0,0 +1,140 @@
+#pragma once
+#include "cantcoap.h"
+
+// maximum number of Uri-Path segments a request can have and still be routed
+#ifndef COAP_ROUTER_MAX_DEPTH
+#define COAP_ROUTER_MAX_DEPTH 16
+#endif
+
+// request codes 0.00 to 0.07 have their own handler slot (GET, POST, PUT, DELETE, FETCH, PATCH, iPATCH)
+#define COAP_ROUTER_NUM_METHODS 8
+
+struct CoapRouteMatch;
+
+/// Called for a routed request, \b arg is whatever was passed to CoapRouter::dispatch().
+typedef int (*CoapRouteHandler)(CoapPDU *request, CoapRouteMatch *match, void *arg);
+
+/// Result of matching a request against a CoapRouter.
+/**
+ * The segments point straight at the Uri-Path option values in the request, so they are only valid while
+ * the request is. They are not NUL terminated.
+ */
+struct CoapRouteMatch {
+	CoapRouteHandler handler;
+	void *context;
+
+	// the Uri-Path segments of the request
+	int numSegments;
+	const uint8_t *segment[COAP_ROUTER_MAX_DEPTH];
+	uint16_t segmentLength[COAP_ROUTER_MAX_DEPTH];
+
+	// indexes into segment of the segments matched by '*', in order
+	int numWildcards;
+	uint8_t wildcard[COAP_ROUTER_MAX_DEPTH];
+
+	// index of the first segment matched by a trailing '**', or -1
+	int rest;
+};
+
+/// Routes requests to handlers by their Uri-Path options, without building a URI string.
+/**
+ * Routes without wildcards are also kept in a hash table keyed on the whole path. The path of a request is
+ * hashed a word at a time while its Uri-Path options are gathered, so a request for such a route costs one
+ * probe and one comparison of the segments, directly on the option values in the PDU. Nothing is copied, and a
+ * request which went through CoapPDU::validate() is routed from its option index without decoding the options.
+ *
+ * Otherwise routes are matched in a tree with one level per path segment, each node hashing its children on
+ * the segment length and first few bytes. A segment of '*' matches any one segment, and a final segment of '**'
+ * matches whatever segments remain (including none). Literal segments take priority over '*', which takes
+ * priority over '**'.
+ *
+ * Each route has a handler per method, so a path that exists but has no handler for the request method can be
+ * answered with 4.05 rather than 4.04.
+ *
+ * ~~~{.cpp}
+ * CoapRouter router;
+ * router.addRoute("/sensors/temp",CoapPDU::COAP_GET,getTemperature,NULL);
+ * router.addRoute("/sensors/temp",CoapPDU::COAP_PUT,putTemperature,NULL);
+ * ...
+ * CoapRouteMatch match;
+ * switch(router.route(request,&match)) {
+ * 	case CoapRouter::COAP_ROUTE_FOUND:
+ * 		match.handler(request,&match,connection);
+ * 	break;
+ * 	...
+ * }
+ * ~~~
+ *
+ * Routes are added at startup, lookups don't modify the router so any number of threads can route at once.
+ */
+class CoapRouter {
+	public:
+		/// Result of CoapRouter::route()
+		enum RouteResult {
+			COAP_ROUTE_FOUND=0,
+			COAP_ROUTE_NOT_FOUND,
+			COAP_ROUTE_METHOD_NOT_ALLOWED
+		};
+
+		CoapRouter();
+		~CoapRouter();
+		CoapRouter(const CoapRouter &other) = delete;
+		CoapRouter& operator=(const CoapRouter &other) = delete;
+
+		int addRoute(const char *path, CoapPDU::Code method, CoapRouteHandler handler, void *context);
+		RouteResult route(CoapPDU *request, CoapRouteMatch *match);
+		RouteResult route(const uint8_t **segments, const uint16_t *segmentLengths, int numSegments,
+			CoapPDU::Code method, CoapRouteMatch *match);
+		int dispatch(CoapPDU *request, void *arg, RouteResult *result);
+
+		int getNumNodes();
+
+	private:
+		// a slot in a node's hash table of literal children, key holds the segment length and its first 6 bytes so
+		// most comparisons are one integer compare. Empty slots have node -1.
+		struct Child {
+			uint64_t key;
+			int node;
+		};
+
+		struct Node {
+			uint8_t *segment;
+			uint16_t segmentLength;
+			// literal children, an open addressing hash table of childCapacity slots (a power of two, or 0)
+			Child *children;
+			int numChildren;
+			int childCapacity;
+			int wildcardChild;
+			int restChild;
+			// the segments from the root, each as a 2 byte length then its bytes, for nodes in the path table
+			uint8_t *path;
+			int pathLength;
+			// bit m set if there is a handler for method m
+			uint8_t methods;
+			CoapRouteHandler handlers[COAP_ROUTER_NUM_METHODS];
+			void *contexts[COAP_ROUTER_NUM_METHODS];
+		};
+
+		// a slot in the table of routes without wildcards, keyed on a hash of the whole path. Empty slots have node -1.
+		struct Path {
+			uint64_t hash;
+			int node;
+		};
+
+		int newNode(const uint8_t *segment, uint16_t segmentLength);
+		int addPath(int node, const char *path, uint64_t hash);
+		int findPath(uint64_t hash, CoapRouteMatch *match);
+		int findChild(Node *node, const uint8_t *segment, uint16_t segmentLength);
+		int growChildren(Node *node);
+		int addChild(int parent, const uint8_t *segment, uint16_t segmentLength);
+		RouteResult routeSegments(CoapPDU::Code method, uint64_t hash, CoapRouteMatch *match);
+		int match(int node, int depth, CoapRouteMatch *match);
+
+		Node *_nodes;
+		int _numNodes;
+		int _nodeCapacity;
+
+		Path *_paths;
+		int _numPaths;
+		int _pathMask;
+};
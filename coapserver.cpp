@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "coapserver.h"
+
+struct CoapServer::Batch {
+	uint8_t buffers[COAP_SERVER_BATCH_SIZE][COAP_SERVER_MAX_PDU_LENGTH];
+	struct sockaddr_storage addresses[COAP_SERVER_BATCH_SIZE];
+	struct iovec iov[COAP_SERVER_BATCH_SIZE];
+	struct mmsghdr messages[COAP_SERVER_BATCH_SIZE];
+};
+
+/// Constructs a server with no sockets, which calls \b handler with \b arg for each valid message received.
+CoapServer::CoapServer(CoapServerHandler handler, void *arg) {
+	_handler = handler;
+	_arg = arg;
+	_numSockets = 0;
+	_epollFD = epoll_create1(EPOLL_CLOEXEC);
+	if(_epollFD<0) {
+		DBG("Failed to create epoll instance: %s",strerror(errno));
+	}
+	_batch = (Batch*)calloc(1,sizeof(Batch));
+	if(_batch==NULL) {
+		DBG("Failed to allocate receive batch");
+		return;
+	}
+	for(int i=0; i<COAP_SERVER_BATCH_SIZE; i++) {
+		_batch->iov[i].iov_base = _batch->buffers[i];
+		_batch->iov[i].iov_len = COAP_SERVER_MAX_PDU_LENGTH;
+		_batch->messages[i].msg_hdr.msg_iov = &_batch->iov[i];
+		_batch->messages[i].msg_hdr.msg_iovlen = 1;
+		_batch->messages[i].msg_hdr.msg_name = &_batch->addresses[i];
+	}
+}
+
+/// Closes every socket of the server, including those passed to CoapServer::addSocket().
+CoapServer::~CoapServer() {
+	for(int i=0; i<_numSockets; i++) {
+		close(_sockets[i]);
+	}
+	if(_epollFD>=0) {
+		close(_epollFD);
+	}
+	free(_batch);
+}
+
+/// Opens a non-blocking UDP socket bound to \b address and receives on it.
+/**
+ * An IPv6 socket only receives IPv6, so an IPv4 and an IPv6 socket can listen on the same port.
+ *
+ * \param address The address and port to bind to, IPv4 or IPv6. Port 0 picks a free port, see getsockname() on
+ * CoapServer::getSocket().
+ * \param addressLength The length of \b address.
+ * \return 0 on success, 1 if the address is invalid, the server already has COAP_SERVER_MAX_SOCKETS sockets, or
+ * the socket could not be opened or bound.
+ */
+int CoapServer::listen(const struct sockaddr *address, socklen_t addressLength) {
+	CoapEndpoint endpoint;
+	if(endpoint.set(address,addressLength)) {
+		return 1;
+	}
+	if(_numSockets==COAP_SERVER_MAX_SOCKETS) {
+		DBG("Server already has %d sockets",COAP_SERVER_MAX_SOCKETS);
+		return 1;
+	}
+	int sockfd = socket(endpoint.address.sa.sa_family,SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+	if(sockfd<0) {
+		DBG("Failed to open socket: %s",strerror(errno));
+		return 1;
+	}
+	if(endpoint.address.sa.sa_family==AF_INET6) {
+		int on = 1;
+		if(setsockopt(sockfd,IPPROTO_IPV6,IPV6_V6ONLY,&on,sizeof(on))!=0) {
+			DBG("Failed to make socket IPv6 only: %s",strerror(errno));
+		}
+	}
+	if(bind(sockfd,&endpoint.address.sa,endpoint.addressLength)!=0) {
+		DBG("Failed to bind socket: %s",strerror(errno));
+		close(sockfd);
+		return 1;
+	}
+	if(addSocket(sockfd)) {
+		close(sockfd);
+		return 1;
+	}
+	return 0;
+}
+
+/// Receives on a UDP socket opened elsewhere, which is made non-blocking and closed with the server.
+/**
+ * \return 0 on success, 1 if the server already has COAP_SERVER_MAX_SOCKETS sockets or the socket could not be
+ * watched, in which case it is not closed.
+ */
+int CoapServer::addSocket(int sockfd) {
+	if(_epollFD<0||_batch==NULL) {
+		return 1;
+	}
+	if(_numSockets==COAP_SERVER_MAX_SOCKETS) {
+		DBG("Server already has %d sockets",COAP_SERVER_MAX_SOCKETS);
+		return 1;
+	}
+	int flags = fcntl(sockfd,F_GETFL);
+	if(flags<0||fcntl(sockfd,F_SETFL,flags|O_NONBLOCK)!=0) {
+		DBG("Failed to make socket non-blocking: %s",strerror(errno));
+		return 1;
+	}
+	struct epoll_event event;
+	memset(&event,0x00,sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = sockfd;
+	if(epoll_ctl(_epollFD,EPOLL_CTL_ADD,sockfd,&event)!=0) {
+		DBG("Failed to watch socket: %s",strerror(errno));
+		return 1;
+	}
+	_sockets[_numSockets++] = sockfd;
+	return 0;
+}
+
+/// Waits up to \b timeoutMs for messages and handles those that have arrived.
+/**
+ * Reads one batch of up to COAP_SERVER_BATCH_SIZE datagrams from each socket that is ready, so a busy socket
+ * cannot starve the others. Whatever is left is read by the next call, which then does not wait.
+ *
+ * \param timeoutMs The longest to wait in milliseconds, 0 to not wait, -1 to wait until something arrives.
+ * \return The number of valid messages handled, or -1 if waiting failed.
+ */
+int CoapServer::poll(int timeoutMs) {
+	if(_epollFD<0||_batch==NULL) {
+		return -1;
+	}
+	struct epoll_event events[COAP_SERVER_MAX_SOCKETS];
+	int ready = epoll_wait(_epollFD,events,COAP_SERVER_MAX_SOCKETS,timeoutMs);
+	if(ready<0) {
+		if(errno==EINTR) {
+			return 0;
+		}
+		DBG("Failed to wait for sockets: %s",strerror(errno));
+		return -1;
+	}
+	int handled = 0;
+	for(int i=0; i<ready; i++) {
+		handled += receiveBatch(events[i].data.fd);
+	}
+	return handled;
+}
+
+/// Sends \b pdu to \b peer from socket \b sockfd, normally the one a request arrived on.
+/**
+ * The payload may be set with CoapPDU::setPayloadReference(), it is sent without being copied.
+ *
+ * \return 0 on success, 1 if the datagram could not be sent whole.
+ */
+int CoapServer::send(int sockfd, CoapPDU *pdu, const CoapEndpoint *peer) {
+	struct iovec iov[2];
+	int iovcnt;
+	if(pdu->getIOVec(iov,&iovcnt)) {
+		return 1;
+	}
+	struct msghdr msg;
+	memset(&msg,0x00,sizeof(msg));
+	msg.msg_name = (void*)&peer->address;
+	msg.msg_namelen = peer->addressLength;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	ssize_t length = 0;
+	for(int i=0; i<iovcnt; i++) {
+		length += iov[i].iov_len;
+	}
+	ssize_t sent = sendmsg(sockfd,&msg,0);
+	if(sent!=length) {
+		DBG("Failed to send %d bytes: %s",(int)length,sent<0 ? strerror(errno) : "short send");
+		return 1;
+	}
+	return 0;
+}
+
+/// Returns the epoll descriptor, readable when any socket of the server is, or -1 if it could not be created.
+int CoapServer::getFD() {
+	return _epollFD;
+}
+
+/// Returns the number of sockets the server receives on.
+int CoapServer::getNumSockets() {
+	return _numSockets;
+}
+
+/// Returns the socket at \b index, in the order they were added, or -1.
+int CoapServer::getSocket(int index) {
+	if(index<0||index>=_numSockets) {
+		return -1;
+	}
+	return _sockets[index];
+}
+
+// reads a batch from sockfd, drops what does not validate and hands the rest on, returning how many were handled
+int CoapServer::receiveBatch(int sockfd) {
+	Batch *batch = _batch;
+	for(int i=0; i<COAP_SERVER_BATCH_SIZE; i++) {
+		batch->messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+		batch->messages[i].msg_hdr.msg_flags = 0;
+	}
+	int count = recvmmsg(sockfd,batch->messages,COAP_SERVER_BATCH_SIZE,MSG_DONTWAIT,NULL);
+	if(count<=0) {
+		// a pending ICMP error is reported once and cleared, nothing is lost
+		if(count<0&&errno!=EAGAIN&&errno!=EWOULDBLOCK) {
+			DBG("Failed to receive: %s",strerror(errno));
+		}
+		return 0;
+	}
+	int handled = 0;
+	for(int i=0; i<count; i++) {
+		if(batch->messages[i].msg_hdr.msg_flags&MSG_TRUNC) {
+			DBG("Dropping datagram longer than %d bytes",COAP_SERVER_MAX_PDU_LENGTH);
+			continue;
+		}
+		// the constructor writes a fresh header into an empty buffer, which would then validate
+		if(batch->messages[i].msg_len<COAP_HDR_SIZE) {
+			DBG("Dropping datagram of %d bytes",(int)batch->messages[i].msg_len);
+			continue;
+		}
+		// the only parse of the message, which also records the option index for the handler
+		CoapPDU pdu(batch->buffers[i],COAP_SERVER_MAX_PDU_LENGTH,batch->messages[i].msg_len);
+		if(pdu.validate()!=1) {
+			continue;
+		}
+		CoapEndpoint peer;
+		if(peer.set((struct sockaddr*)&batch->addresses[i],batch->messages[i].msg_hdr.msg_namelen)) {
+			continue;
+		}
+		_handler(&pdu,&peer,sockfd,_arg);
+		handled++;
+	}
+	return handled;
+}
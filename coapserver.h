@@ -0,0 +1,87 @@
+#pragma once
+#include "cantcoap.h"
+#include "coapendpoint.h"
+
+// datagrams read from a socket by one recvmmsg() call
+#ifndef COAP_SERVER_BATCH_SIZE
+#define COAP_SERVER_BATCH_SIZE 64
+#endif
+
+// largest datagram received, longer ones are dropped
+#ifndef COAP_SERVER_MAX_PDU_LENGTH
+#define COAP_SERVER_MAX_PDU_LENGTH 1152
+#endif
+
+#ifndef COAP_SERVER_MAX_SOCKETS
+#define COAP_SERVER_MAX_SOCKETS 16
+#endif
+
+/// Called by CoapServer for each valid message received.
+/**
+ * \param pdu The message, validated. It and its buffer are only valid until the handler returns.
+ * \param peer Where the message came from.
+ * \param sockfd The socket it arrived on, to answer with CoapServer::send().
+ * \param arg The argument passed to the CoapServer constructor.
+ */
+typedef void (*CoapServerHandler)(CoapPDU *pdu, const CoapEndpoint *peer, int sockfd, void *arg);
+
+/// Receives CoAP messages on any number of UDP sockets with epoll, and hands the valid ones to a handler.
+/**
+ * Sockets are opened with CoapServer::listen(), for as many IPv4 and IPv6 addresses and ports as needed, or
+ * handed over with CoapServer::addSocket(). All are non-blocking and watched by one epoll instance.
+ *
+ * CoapServer::poll() waits for datagrams, then reads up to COAP_SERVER_BATCH_SIZE of them from each ready socket
+ * with a single recvmmsg() call into buffers allocated once by the constructor. Each message is parsed once, by
+ * CoapPDU::validate() on a CoapPDU wrapping its buffer, so malformed traffic is dropped without any further work
+ * and the handler gets a PDU with its option index already built. The handler is called for each valid message
+ * in the order they arrived. Nothing is allocated per message.
+ *
+ * ~~~{.cpp}
+ * void handle(CoapPDU *request, const CoapEndpoint *peer, int sockfd, void *arg) {
+ * 	CoapInlinePDU<256> response;
+ * 	if(response.makeResponse(request,CoapPDU::COAP_CONTENT,nextMessageID++,16)==0) {
+ * 		((CoapServer*)arg)->send(sockfd,&response,peer);
+ * 	}
+ * }
+ *
+ * CoapServer server(handle,&server);
+ * server.listen((struct sockaddr*)&any4,sizeof(any4));
+ * server.listen((struct sockaddr*)&any6,sizeof(any6));
+ * while(running) {
+ * 	server.poll(reliable.getTimeout());
+ * 	reliable.advance(nowMs());
+ * }
+ * ~~~
+ *
+ * The epoll descriptor from CoapServer::getFD() becomes readable when a socket is, so a server can also sit
+ * inside another event loop. Linux only. A server is not thread safe.
+ */
+class CoapServer {
+	public:
+		CoapServer(CoapServerHandler handler, void *arg);
+		~CoapServer();
+		CoapServer(const CoapServer &other) = delete;
+		CoapServer& operator=(const CoapServer &other) = delete;
+
+		int listen(const struct sockaddr *address, socklen_t addressLength);
+		int addSocket(int sockfd);
+		int poll(int timeoutMs);
+		int send(int sockfd, CoapPDU *pdu, const CoapEndpoint *peer);
+		int getFD();
+		int getNumSockets();
+		int getSocket(int index);
+
+	private:
+		struct Batch;
+
+		int receiveBatch(int sockfd);
+
+		CoapServerHandler _handler;
+		void *_arg;
+		int _epollFD;
+		int _sockets[COAP_SERVER_MAX_SOCKETS];
+		int _numSockets;
+
+		// buffers, addresses and recvmmsg() headers for one batch, allocated once
+		Batch *_batch;
+};
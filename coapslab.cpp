@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include "coapslab.h"
+
+static const int gBlockSizes[COAP_SLAB_NUM_CLASSES] = { 64, 128, 256, 512, COAP_SLAB_MAX_BLOCK };
+
+// a free block, blocks are chained through next into batches and batches are chained through nextBatch
+// in the shared pool, count is only meaningful for the first block of a batch
+struct FreeBlock {
+	FreeBlock *next;
+	FreeBlock *nextBatch;
+	int count;
+};
+
+// shared pool, one stack of batches per size class. Batches are pushed with compare-and-swap and only ever
+// removed all at once with an exchange, so the stack can't suffer from ABA.
+static std::atomic<FreeBlock*> gPool[COAP_SLAB_NUM_CLASSES];
+
+static void pushBatches(int sizeClass, FreeBlock *first, FreeBlock *last) {
+	FreeBlock *top = gPool[sizeClass].load(std::memory_order_relaxed);
+	do {
+		last->nextBatch = top;
+	} while(!gPool[sizeClass].compare_exchange_weak(top,first,std::memory_order_release,std::memory_order_relaxed));
+}
+
+// takes one batch from the shared pool, returning the rest
+static FreeBlock* popBatch(int sizeClass) {
+	FreeBlock *batch = gPool[sizeClass].exchange(NULL,std::memory_order_acquire);
+	if(batch==NULL) {
+		return NULL;
+	}
+	FreeBlock *rest = batch->nextBatch;
+	if(rest!=NULL) {
+		FreeBlock *last = rest;
+		while(last->nextBatch!=NULL) {
+			last = last->nextBatch;
+		}
+		pushBatches(sizeClass,rest,last);
+	}
+	return batch;
+}
+
+// free blocks held by one thread, handed back to the shared pool when the thread exits
+struct ThreadCache {
+	FreeBlock *head[COAP_SLAB_NUM_CLASSES];
+	int count[COAP_SLAB_NUM_CLASSES];
+
+	void flush() {
+		for(int i=0; i<COAP_SLAB_NUM_CLASSES; i++) {
+			if(head[i]!=NULL) {
+				head[i]->count = count[i];
+				pushBatches(i,head[i],head[i]);
+				head[i] = NULL;
+				count[i] = 0;
+			}
+		}
+	}
+
+	~ThreadCache() {
+		flush();
+	}
+};
+
+static thread_local ThreadCache gThreadCache;
+
+// carves a new batch of blocks out of a single malloc()
+static FreeBlock* newBatch(int sizeClass) {
+	int blockSize = gBlockSizes[sizeClass];
+	uint8_t *slab = (uint8_t*)malloc(blockSize*COAP_SLAB_CACHE_BLOCKS);
+	if(slab==NULL) {
+		DBG("Failed to allocate slab of %d byte blocks",blockSize);
+		return NULL;
+	}
+	FreeBlock *first = (FreeBlock*)slab;
+	for(int i=0; i<COAP_SLAB_CACHE_BLOCKS; i++) {
+		FreeBlock *block = (FreeBlock*)(slab+i*blockSize);
+		block->next = i==COAP_SLAB_CACHE_BLOCKS-1 ? NULL : (FreeBlock*)(slab+(i+1)*blockSize);
+	}
+	first->count = COAP_SLAB_CACHE_BLOCKS;
+	return first;
+}
+
+/// Returns the size class used for a request of \b bytes, or -1 if it is too big for the pool.
+int CoapSlabAllocator::getSizeClass(int bytes) {
+	for(int i=0; i<COAP_SLAB_NUM_CLASSES; i++) {
+		if(bytes<=gBlockSizes[i]) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/// Returns the block size of \b sizeClass.
+int CoapSlabAllocator::getBlockSize(int sizeClass) {
+	return gBlockSizes[sizeClass];
+}
+
+/// Allocates a block of at least \b bytes from the calling thread's cache, see CoapAllocator::allocate().
+uint8_t* CoapSlabAllocator::allocate(int bytes, int *capacity) {
+	int sizeClass = getSizeClass(bytes);
+	if(sizeClass<0) {
+		uint8_t *buffer = (uint8_t*)malloc(bytes);
+		*capacity = buffer==NULL ? 0 : bytes;
+		return buffer;
+	}
+
+	ThreadCache *cache = &gThreadCache;
+	FreeBlock *block = cache->head[sizeClass];
+	if(block==NULL) {
+		block = popBatch(sizeClass);
+		if(block==NULL) {
+			block = newBatch(sizeClass);
+			if(block==NULL) {
+				*capacity = 0;
+				return NULL;
+			}
+		}
+		cache->count[sizeClass] = block->count;
+	}
+	cache->head[sizeClass] = block->next;
+	cache->count[sizeClass]--;
+	*capacity = gBlockSizes[sizeClass];
+	return (uint8_t*)block;
+}
+
+/// Moves \b buffer to a block of a different size if \b bytes needs one, see CoapAllocator::reallocate().
+uint8_t* CoapSlabAllocator::reallocate(uint8_t *buffer, int oldCapacity, int bytes, int *capacity) {
+	int oldClass = getSizeClass(oldCapacity);
+	int newClass = getSizeClass(bytes);
+	if(oldClass>=0 && oldClass==newClass) {
+		*capacity = oldCapacity;
+		return buffer;
+	}
+	if(oldClass<0 && newClass<0) {
+		uint8_t *newBuffer = (uint8_t*)realloc(buffer,bytes);
+		if(newBuffer!=NULL) {
+			*capacity = bytes;
+		}
+		return newBuffer;
+	}
+	int newCapacity = 0;
+	uint8_t *newBuffer = allocate(bytes,&newCapacity);
+	if(newBuffer==NULL) {
+		return NULL;
+	}
+	memcpy(newBuffer,buffer,oldCapacity<bytes ? oldCapacity : bytes);
+	deallocate(buffer,oldCapacity);
+	*capacity = newCapacity;
+	return newBuffer;
+}
+
+/// Returns \b buffer to the calling thread's cache, handing a batch to the shared pool if the cache is full.
+void CoapSlabAllocator::deallocate(uint8_t *buffer, int capacity) {
+	if(buffer==NULL) {
+		return;
+	}
+	int sizeClass = getSizeClass(capacity);
+	if(sizeClass<0) {
+		free(buffer);
+		return;
+	}
+
+	ThreadCache *cache = &gThreadCache;
+	FreeBlock *block = (FreeBlock*)buffer;
+	block->next = cache->head[sizeClass];
+	cache->head[sizeClass] = block;
+	cache->count[sizeClass]++;
+	if(cache->count[sizeClass]<2*COAP_SLAB_CACHE_BLOCKS) {
+		return;
+	}
+
+	// give the most recently freed blocks back, keeping the rest cached
+	FreeBlock *last = block;
+	for(int i=1; i<COAP_SLAB_CACHE_BLOCKS; i++) {
+		last = last->next;
+	}
+	cache->head[sizeClass] = last->next;
+	cache->count[sizeClass] -= COAP_SLAB_CACHE_BLOCKS;
+	last->next = NULL;
+	block->count = COAP_SLAB_CACHE_BLOCKS;
+	pushBatches(sizeClass,block,block);
+}
+
+/// Hands every block cached by the calling thread back to the shared pool.
+/**
+ * This happens automatically when a thread exits, call it directly before a thread that has freed many buffers
+ * goes idle for a long time.
+ */
+void CoapSlabAllocator::flushThreadCache() {
+	gThreadCache.flush();
+}
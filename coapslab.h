@@ -0,0 +1,40 @@
+#pragma once
+#include "cantcoap.h"
+
+// block sizes of the slab pool, chosen around typical CoAP message sizes (1152 fits a 1024 byte block plus headers)
+#define COAP_SLAB_NUM_CLASSES 5
+#define COAP_SLAB_MAX_BLOCK 1152
+
+// number of free blocks of each size a thread keeps before handing a batch back to the shared pool
+#ifndef COAP_SLAB_CACHE_BLOCKS
+#define COAP_SLAB_CACHE_BLOCKS 32
+#endif
+
+/// Size-class slab allocator for CoapPDU buffers.
+/**
+ * Requests are rounded up to 64, 128, 256, 512 or 1152 bytes. Each thread keeps a cache of free blocks of every
+ * size, so allocating and freeing normally touches no shared state at all. When a thread's cache runs dry it takes
+ * a batch of blocks from a shared lock-free pool, and when it has too many it gives a batch back, so buffers freed
+ * by a different thread from the one that allocated them are recycled. The shared pool is refilled from malloc()
+ * a whole slab of blocks at a time.
+ *
+ * Blocks are never returned to malloc(), memory use stays at its high-water mark. Requests above
+ * COAP_SLAB_MAX_BLOCK go straight to malloc().
+ *
+ * All CoapSlabAllocator objects share the same pool, so a buffer may be freed through any of them.
+ *
+ * ~~~{.cpp}
+ * static CoapSlabAllocator slab;
+ * CoapAllocator::setDefault(&slab); // on each thread
+ * ~~~
+ */
+class CoapSlabAllocator : public CoapAllocator {
+	public:
+		uint8_t* allocate(int bytes, int *capacity);
+		uint8_t* reallocate(uint8_t *buffer, int oldCapacity, int bytes, int *capacity);
+		void deallocate(uint8_t *buffer, int capacity);
+
+		static int getSizeClass(int bytes);
+		static int getBlockSize(int sizeClass);
+		static void flushThreadCache();
+};
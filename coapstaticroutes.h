@@ -0,0 +1,243 @@
+#pragma once
+#include <string.h>
+#include "cantcoap.h"
+
+// maximum number of Uri-Path segments a request can have and still be looked up
+#ifndef COAP_STATIC_ROUTE_MAX_DEPTH
+#define COAP_STATIC_ROUTE_MAX_DEPTH 16
+#endif
+
+#define COAP_STATIC_ROUTE_HASH_BASIS 2166136261u
+#define COAP_STATIC_ROUTE_HASH_PRIME 16777619u
+
+// FNV-1a, one byte at a time. The same function hashes the URI strings at compile time and the Uri-Path
+// options at run time, so the two must stay in step.
+constexpr uint32_t coapStaticRouteHashByte(uint32_t hash, uint8_t byte) {
+	return (hash^byte)*COAP_STATIC_ROUTE_HASH_PRIME;
+}
+
+constexpr uint32_t coapStaticRouteHashString(const char *s, uint32_t hash) {
+	return *s==0x00 ? hash : coapStaticRouteHashString(s+1,coapStaticRouteHashByte(hash,(uint8_t)*s));
+}
+
+/// Hash of \b uri as it would be computed from its Uri-Path options, each segment preceded by a '/'.
+constexpr uint32_t coapStaticRouteHash(const char *uri) {
+	return (uri[0]==0x00||(uri[0]=='/'&&uri[1]==0x00)) ? COAP_STATIC_ROUTE_HASH_BASIS :
+		uri[0]=='/' ? coapStaticRouteHashString(uri,COAP_STATIC_ROUTE_HASH_BASIS) :
+		coapStaticRouteHashString(uri,coapStaticRouteHashByte(COAP_STATIC_ROUTE_HASH_BASIS,'/'));
+}
+
+constexpr uint16_t coapStaticRouteLength(const char *s) {
+	return *s==0x00 ? 0 : 1+coapStaticRouteLength(s+1);
+}
+
+constexpr uint8_t coapStaticRouteCount(const char *s, char c) {
+	return *s==0x00 ? 0 : (*s==c)+coapStaticRouteCount(s+1,c);
+}
+
+/// Number of segments in \b uri.
+constexpr uint8_t coapStaticRouteNumSegments(const char *uri) {
+	return (uri[0]==0x00||(uri[0]=='/'&&uri[1]==0x00)) ? 0 :
+		uri[0]=='/' ? coapStaticRouteCount(uri+1,'/')+1 : coapStaticRouteCount(uri,'/')+1;
+}
+
+constexpr int coapStaticRouteBuckets(int n, int buckets) {
+	return buckets>=2*n ? buckets : coapStaticRouteBuckets(n,buckets*2);
+}
+
+// bucket of a hash in a table of numBuckets buckets, a power of two
+constexpr int coapStaticRouteBucket(uint32_t hash, int numBuckets) {
+	return (int)((hash^(hash>>16))&(uint32_t)(numBuckets-1));
+}
+
+/// One entry of a CoapStaticRouteTable, a URI and whatever should handle it.
+/**
+ * URIs are written as for CoapPDU::setURI(), with or without a leading '/' and without a trailing one. "/" on its
+ * own matches a request without a Uri-Path. The hash is worked out by the compiler when the route is constexpr.
+ */
+template<typename Handler>
+struct CoapStaticRoute {
+	const char *uri;
+	uint16_t uriLength;
+	uint8_t numSegments;
+	uint32_t hash;
+	Handler handler;
+
+	constexpr CoapStaticRoute(const char *uri, Handler handler) :
+		uri(uri), uriLength(coapStaticRouteLength(uri)), numSegments(coapStaticRouteNumSegments(uri)),
+		hash(coapStaticRouteHash(uri)), handler(handler) {}
+};
+
+/// Returns 1 if the segments are exactly those of \b route.
+template<typename Handler>
+inline int coapStaticRouteEquals(const CoapStaticRoute<Handler> *route, const uint8_t **segments,
+	const uint16_t *segmentLengths, int numSegments) {
+	// also stops a segment containing '/' matching two segments of the route
+	if(numSegments!=route->numSegments) {
+		return 0;
+	}
+	const char *uri = route->uri;
+	const char *end = uri+route->uriLength;
+	if(uri<end&&*uri=='/') {
+		uri++;
+	}
+	for(int i=0; i<numSegments; i++) {
+		if(i>0) {
+			if(uri==end||*uri!='/') {
+				return 0;
+			}
+			uri++;
+		}
+		if(end-uri<segmentLengths[i]||memcmp(uri,segments[i],segmentLengths[i])!=0) {
+			return 0;
+		}
+		uri += segmentLengths[i];
+	}
+	return uri==end;
+}
+
+/// Collects and hashes the Uri-Path options of \b request, returning the number of segments or -1 if there are too many.
+inline int coapStaticRouteSegments(CoapPDU *request, const uint8_t **segments, uint16_t *segmentLengths, uint32_t *hash) {
+	int numSegments = 0;
+	uint32_t h = COAP_STATIC_ROUTE_HASH_BASIS;
+	for(const CoapPDU::CoapOption &o : request->options()) {
+		if(o.optionNumber<CoapPDU::COAP_OPTION_URI_PATH) {
+			continue;
+		}
+		if(o.optionNumber>CoapPDU::COAP_OPTION_URI_PATH) {
+			break;
+		}
+		if(numSegments==COAP_STATIC_ROUTE_MAX_DEPTH) {
+			DBG("Too many Uri-Path segments to look up");
+			return -1;
+		}
+		segments[numSegments] = o.optionValuePointer;
+		segmentLengths[numSegments] = o.optionValueLength;
+		numSegments++;
+		h = coapStaticRouteHashByte(h,'/');
+		for(int i=0; i<o.optionValueLength; i++) {
+			h = coapStaticRouteHashByte(h,o.optionValuePointer[i]);
+		}
+	}
+	*hash = h;
+	return numSegments;
+}
+
+// compile time integer sequences, std::index_sequence is C++14. Halving keeps the template depth logarithmic.
+template<int... I>
+struct CoapStaticRouteIndexes {};
+
+template<typename A, typename B>
+struct CoapStaticRouteConcat;
+
+template<int... A, int... B>
+struct CoapStaticRouteConcat<CoapStaticRouteIndexes<A...>,CoapStaticRouteIndexes<B...> > {
+	typedef CoapStaticRouteIndexes<A...,(int)sizeof...(A)+B...> type;
+};
+
+template<int N>
+struct CoapStaticRouteMakeIndexes {
+	typedef typename CoapStaticRouteConcat<typename CoapStaticRouteMakeIndexes<N/2>::type,
+		typename CoapStaticRouteMakeIndexes<N-N/2>::type>::type type;
+};
+
+template<>
+struct CoapStaticRouteMakeIndexes<0> {
+	typedef CoapStaticRouteIndexes<> type;
+};
+
+template<>
+struct CoapStaticRouteMakeIndexes<1> {
+	typedef CoapStaticRouteIndexes<0> type;
+};
+
+/// A fixed set of routes hashed by the compiler, see coapMakeStaticRouteTable().
+/**
+ * \b first holds, for each of the \b B buckets, the first route whose hash falls in it, and \b next chains the
+ * routes sharing a bucket. With at least twice as many buckets as routes most buckets hold one route, so a lookup
+ * is one hash of the Uri-Path options, one bucket load, and one comparison to confirm.
+ */
+template<typename Handler, int N, int B>
+struct CoapStaticRouteTable {
+	static_assert(N>0&&N<32768, "CoapStaticRouteTable needs between 1 and 32767 routes");
+
+	CoapStaticRoute<Handler> routes[N];
+	int16_t first[B];
+	int16_t next[N];
+
+	/// Returns the route for \b request, or NULL if there isn't one.
+	const CoapStaticRoute<Handler>* find(CoapPDU *request) const {
+		const uint8_t *segments[COAP_STATIC_ROUTE_MAX_DEPTH];
+		uint16_t segmentLengths[COAP_STATIC_ROUTE_MAX_DEPTH];
+		uint32_t hash;
+		int numSegments = coapStaticRouteSegments(request,segments,segmentLengths,&hash);
+		if(numSegments<0) {
+			return NULL;
+		}
+		return find(segments,segmentLengths,numSegments,hash);
+	}
+
+	/// Returns the route for the given segments, with \b hash as computed by coapStaticRouteSegments(), or NULL.
+	const CoapStaticRoute<Handler>* find(const uint8_t **segments, const uint16_t *segmentLengths, int numSegments,
+		uint32_t hash) const {
+		for(int i=first[coapStaticRouteBucket(hash,B)]; i>=0; i=next[i]) {
+			if(routes[i].hash==hash&&coapStaticRouteEquals(&routes[i],segments,segmentLengths,numSegments)) {
+				return &routes[i];
+			}
+		}
+		return NULL;
+	}
+};
+
+constexpr int16_t coapStaticRouteEither(int16_t a, int16_t b) {
+	return a>=0 ? a : b;
+}
+
+// the lowest route index in [lo,hi) that falls in bucket b, or -1. Divides in two so that recursion stays shallow.
+template<typename Handler, int B>
+constexpr int16_t coapStaticRouteFirstIn(const CoapStaticRoute<Handler> *routes, int b, int lo, int hi) {
+	return hi-lo==0 ? -1 :
+		hi-lo==1 ? (coapStaticRouteBucket(routes[lo].hash,B)==b ? lo : -1) :
+		coapStaticRouteEither(coapStaticRouteFirstIn<Handler,B>(routes,b,lo,lo+(hi-lo)/2),
+			coapStaticRouteFirstIn<Handler,B>(routes,b,lo+(hi-lo)/2,hi));
+}
+
+template<typename Handler, int N, int B, int... R, int... K>
+constexpr CoapStaticRouteTable<Handler,N,B> coapMakeStaticRouteTable(const CoapStaticRoute<Handler> (&routes)[N],
+	CoapStaticRouteIndexes<R...>, CoapStaticRouteIndexes<K...>) {
+	return CoapStaticRouteTable<Handler,N,B>{
+		{routes[R]...},
+		{coapStaticRouteFirstIn<Handler,B>(routes,K,0,N)...},
+		{coapStaticRouteFirstIn<Handler,B>(routes,coapStaticRouteBucket(routes[R].hash,B),R+1,N)...}
+	};
+}
+
+/// Builds a CoapStaticRouteTable from a constexpr array of routes.
+/**
+ * When the result is constexpr the whole table is worked out by the compiler and lives in read-only memory, so
+ * startup does no allocation and nothing has to be inserted:
+ *
+ * ~~~{.cpp}
+ * constexpr CoapStaticRoute<ResourceCallback> gRoutes[] = {
+ * 	{"/test",gTestCallback},
+ * 	{"/sensors/temp",gTemperatureCallback},
+ * };
+ * constexpr auto gRouteTable = coapMakeStaticRouteTable(gRoutes);
+ * ...
+ * const CoapStaticRoute<ResourceCallback> *route = gRouteTable.find(request);
+ * if(route) {
+ * 	route->handler(request,sockfd,&recvFrom);
+ * }
+ * ~~~
+ *
+ * Building the table costs the compiler time in proportion to the square of the number of routes, which is fine
+ * for the tens or hundreds of resources a device or fixed API has: about 300 routes fit within GCC's default
+ * -fconstexpr-ops-limit. Use CoapRouter for larger or changing sets.
+ */
+template<typename Handler, int N>
+constexpr CoapStaticRouteTable<Handler,N,coapStaticRouteBuckets(N,1)> coapMakeStaticRouteTable(
+	const CoapStaticRoute<Handler> (&routes)[N]) {
+	return coapMakeStaticRouteTable<Handler,N,coapStaticRouteBuckets(N,1)>(routes,
+		typename CoapStaticRouteMakeIndexes<N>::type(),
+		typename CoapStaticRouteMakeIndexes<coapStaticRouteBuckets(N,1)>::type());
+}
@@ -1,6 +1,6 @@
 /// Server example for cantcoap that responds to the ETSI IoT CoAP Plugtests.
 /**
- * This example waits for CoAP packets and responds accordingly.It is designed to work with 
+ * This example waits for CoAP packets with a CoapServer and responds accordingly. It is designed to work with 
  * the ETSI IoT CoAP Plugtests (http://www.etsi.org/plugtests/coap/coap.htm). Put this on
  * A public IP somewhere, and use the website http://coap.me to drive the tests.
  *
@@ -21,42 +21,32 @@
 #include <math.h>
 #include "nethelper.h"
 #include "cantcoap.h"
-#include "uthash.h"
+#include "coapserver.h"
+#include "coapstaticroutes.h"
 
 //void callback(char *uri, method);
 
 ///////////// Begin Resource Stuff ///////////////
 // call backs and some other crap for mapping URIs
-// you might be thinking, huh, why not make a dynamic
-// way to construct this, and that might make sense
-// for a high performance machine, but on an embedded
-// device you really don't want all these strings in RAM
+// the resources are fixed, so the table mapping URIs to
+// callbacks is built by the compiler and sits in read-only
+// memory, on an embedded device you really don't want all
+// these strings in RAM
 
-typedef int (*ResourceCallback)(CoapPDU *pdu, int sockfd, struct sockaddr_storage *recvFrom);
+typedef int (*ResourceCallback)(CoapPDU *pdu, CoapServer *server, int sockfd, const CoapEndpoint *recvFrom);
 
-// using uthash for the URI hash table. Each entry contains a callback handler.
-struct URIHashEntry {
-    const char *uri; 
-	 ResourceCallback callback;
-    int id;
-    UT_hash_handle hh;
-};
+// message IDs for responses that aren't piggybacked
+uint16_t gNextMessageID = 0;
 
 // callback functions defined here
-int gTestCallback(CoapPDU *request, int sockfd, struct sockaddr_storage *recvFrom) {
-	socklen_t addrLen = sizeof(struct sockaddr_in);
-	if(recvFrom->ss_family==AF_INET6) {
-		addrLen = sizeof(struct sockaddr_in6);
-	}
+int gTestCallback(CoapPDU *request, CoapServer *server, int sockfd, const CoapEndpoint *recvFrom) {
 	DBG("gTestCallback function called");
 
 	//  prepare appropriate response
-	CoapPDU *response = new CoapPDU();
-	response->setVersion(1);
-	response->setMessageID(request->getMessageID());
-	response->setToken(request->getTokenPointer(),request->getTokenLength());
-	//response->setToken((uint8_t*)"\1\16",2);
 	char *payload = (char*)"This is a mundanely worded test payload.";
+	CoapPDU::Code code = CoapPDU::COAP_EMPTY;
+	uint8_t *responsePayload = NULL;
+	int responsePayloadLength = 0;
 
 	// respond differently, depending on method code
 	switch(request->getCode()) {
@@ -64,214 +54,146 @@ int gTestCallback(CoapPDU *request, int sockfd, struct sockaddr_storage *recvFro
 			// makes no sense, send RST
 		break;
 		case CoapPDU::COAP_GET:
-			response->setCode(CoapPDU::COAP_CONTENT);
-			response->setContentFormat(CoapPDU::COAP_CONTENT_FORMAT_TEXT_PLAIN);
-			response->setPayload((uint8_t*)payload,strlen(payload));
+			code = CoapPDU::COAP_CONTENT;
+			responsePayload = (uint8_t*)payload;
+			responsePayloadLength = strlen(payload);
 		break;
 		case CoapPDU::COAP_POST:
-			response->setCode(CoapPDU::COAP_CREATED);
+			code = CoapPDU::COAP_CREATED;
 		break;
 		case CoapPDU::COAP_PUT:
-			response->setCode(CoapPDU::COAP_CHANGED);
+			code = CoapPDU::COAP_CHANGED;
 		break;
 		case CoapPDU::COAP_DELETE:
-			response->setCode(CoapPDU::COAP_DELETED);
-			response->setPayload((uint8_t*)"DELETE OK",9);
+			code = CoapPDU::COAP_DELETED;
+			responsePayload = (uint8_t*)"DELETE OK";
+			responsePayloadLength = 9;
 		break;
 		default: 
 		break;
 	}
 
-	// type
-	switch(request->getType()) {
-		case CoapPDU::COAP_CONFIRMABLE:
-			response->setType(CoapPDU::COAP_ACKNOWLEDGEMENT);
-		break;
-		case CoapPDU::COAP_NON_CONFIRMABLE:
-			response->setType(CoapPDU::COAP_ACKNOWLEDGEMENT);
-		break;
-		case CoapPDU::COAP_ACKNOWLEDGEMENT:
-		break;
-		case CoapPDU::COAP_RESET:
-		break;
-		default:
-			return 1;
-		break;
-	};
+	// header, token and type (ACK for CON requests, NON for NON requests) in one go, the response lives on the stack
+	CoapInlinePDU<256> responsePDU;
+	CoapPDU *response = &responsePDU;
+	if(response->makeResponse(request,code,gNextMessageID++,8+responsePayloadLength)!=0) {
+		DBG("Not responding to message type %d",request->getType());
+		return 1;
+	}
+	if(code==CoapPDU::COAP_CONTENT) {
+		response->setContentFormat(CoapPDU::COAP_CONTENT_FORMAT_TEXT_PLAIN);
+	}
+	if(responsePayloadLength>0) {
+		response->setPayload(responsePayload,responsePayloadLength);
+	}
 
-	// send the packet
- 	ssize_t sent = sendto(
-		sockfd,
-		response->getPDUPointer(),
-		response->getPDULength(),
-		0,
-		(sockaddr*)recvFrom,
-		addrLen
-	);
-	if(sent<0) {
-		DBG("Error sending packet: %ld.",sent);
-		perror(NULL);
+	// send the packet, from the socket the request came in on
+	if(server->send(sockfd,response,recvFrom)) {
+		DBG("Error sending packet");
 		return 1;
-	} else {
-		DBG("Sent: %ld",sent);
 	}
+	DBG("Sent: %d",response->getPDULength());
 	
 	return 0;
 }
 
-// resource URIs here
-const char *gURIA = "/test";
-
-const char *gURIList[] = {
-	gURIA,
+// resource URIs mapped to callback functions here
+constexpr CoapStaticRoute<ResourceCallback> gRoutes[] = {
+	{"/test",gTestCallback},
 };
 
-// URIs mapped to callback functions here
-const ResourceCallback gCallbacks[] = {
-	gTestCallback	
-};
-
-const int gNumResources = 1;
+constexpr auto gRouteTable = coapMakeStaticRouteTable(gRoutes);
 
 ///////////// End Resource Stuff //////////////
 
 // for mbed compatibility
 #define failGracefully exit
 
-int main(int argc, char **argv) {
-
-	// parse options	
-	if(argc!=3) {
-		printf("USAGE\r\n   %s listenAddress listenPort\r\n",argv[0]);
-		return 0;
-	}
+// called by the server for each valid CoAP packet
+void handlePDU(CoapPDU *recvPDU, const CoapEndpoint *recvFrom, int sockfd, void *arg) {
+	CoapServer *server = (CoapServer*)arg;
+	char straddr[INET6_ADDRSTRLEN];
 
-	char *listenAddressString = argv[1];
-	char *listenPortString    = argv[2];
+	// print src address
+	switch(recvFrom->address.sa.sa_family) {
+		case AF_INET:
+			INFO("Got packet from %s:%d",inet_ntoa(recvFrom->address.in.sin_addr),ntohs(recvFrom->address.in.sin_port));
+		break;
 
-	// setup bind address
-	struct addrinfo *bindAddr;
-	INFO("Setting up bind address");
-	int ret = setupAddress(listenAddressString,listenPortString,&bindAddr,SOCK_DGRAM,AF_INET);
-	if(ret!=0) {
-		INFO("Error setting up bind address, exiting.");
-		return -1;
+		case AF_INET6:
+			INFO("Got packet from %s:%d",inet_ntop(AF_INET6,&recvFrom->address.in6.sin6_addr,straddr,sizeof(straddr)),
+				ntohs(recvFrom->address.in6.sin6_port));
+		break;
 	}
+	INFO("Valid CoAP PDU received");
+	recvPDU->printHuman();
 
-	// iterate through returned structure to see what we got
-	printAddressStructures(bindAddr);
-
-	// setup socket
-	int sockfd = socket(bindAddr->ai_family,bindAddr->ai_socktype,bindAddr->ai_protocol);
-
-	// call bind
-	DBG("Binding socket.");
-	if(bind(sockfd,bindAddr->ai_addr,bindAddr->ai_addrlen)!=0) {
-		DBG("Error binding socket");
-		perror(NULL);
-		failGracefully(5);
+	// depending on what this is, maybe call callback function
+	if(!recvPDU->hasOption(CoapPDU::COAP_OPTION_URI_PATH)) {
+		INFO("There is no URI associated with this Coap PDU");
+	} else {
+		const CoapStaticRoute<ResourceCallback> *route = gRouteTable.find(recvPDU);
+		if(route) {
+			DBG("Route is %s.", route->uri);
+			route->handler(recvPDU,server,sockfd,recvFrom);
+			return;
+		} else {
+			DBG("Route not found.");
+			return;
+		}
 	}
-	printAddress(bindAddr);
 
-	// setup URI callbacks using uthash hash table
-	struct URIHashEntry *entry = NULL, *directory = NULL, *hash = NULL;
-	for(int i=0; i<gNumResources; i++) {
-		// create new hash structure to bind URI and callback
-   	entry = (struct URIHashEntry*)malloc(sizeof(struct URIHashEntry));
-		entry->uri = gURIList[i];
-		entry->callback = gCallbacks[i];
-		// add hash structure to hash table, note that key is the URI
-   	HASH_ADD_KEYPTR(hh, directory, entry->uri, strlen(entry->uri), entry);
-	}
+	// no URI, handle cases
 
-	// buffers for UDP and URIs
-	#define BUF_LEN 500
-	#define URI_BUF_LEN 32
-	char buffer[BUF_LEN];
-	char uriBuffer[URI_BUF_LEN];
-	int recvURILen = 0;
+	// code==0, no payload, this is a ping request, send RST
+	if(recvPDU->getPDULength()==0&&recvPDU->getCode()==0) {
+		INFO("CoAP ping request");
+	}
+}
 
-	// storage for handling receive address
-	struct sockaddr_storage recvAddr;
-	socklen_t recvAddrLen = sizeof(struct sockaddr_storage);
-	struct sockaddr_in *v4Addr;
-	struct sockaddr_in6 *v6Addr;
-	char straddr[INET6_ADDRSTRLEN];
+int main(int argc, char **argv) {
 
-	// reuse the same PDU
-	CoapPDU *recvPDU = new CoapPDU((uint8_t*)buffer,BUF_LEN,BUF_LEN);
+	// parse options	
+	if(argc<3||argc%2!=1) {
+		printf("USAGE\r\n   %s listenAddress listenPort [listenAddress listenPort ...]\r\n",argv[0]);
+		return 0;
+	}
 
-	// just block and handle one packet at a time in a single thread
-	// you're not going to use this code for a production system are you ;)
-	while(1) {
-		// receive packet
-		ret = recvfrom(sockfd,&buffer,BUF_LEN,0,(sockaddr*)&recvAddr,&recvAddrLen);
-		if(ret==-1) {
-			INFO("Error receiving data");
+	// one server receives on every address, IPv4 or IPv6
+	CoapServer server(handlePDU,&server);
+	for(int i=1; i<argc; i+=2) {
+		char *listenAddressString = argv[i];
+		char *listenPortString    = argv[i+1];
+
+		// setup bind address
+		struct addrinfo *bindAddr;
+		INFO("Setting up bind address");
+		int ret = setupAddress(listenAddressString,listenPortString,&bindAddr,SOCK_DGRAM,AF_UNSPEC);
+		if(ret!=0) {
+			INFO("Error setting up bind address, exiting.");
 			return -1;
 		}
 
-		// print src address
-		switch(recvAddr.ss_family) {
-			case AF_INET:
-				v4Addr = (struct sockaddr_in*)&recvAddr;
-				INFO("Got packet from %s:%d",inet_ntoa(v4Addr->sin_addr),ntohs(v4Addr->sin_port));
-			break;
+		// iterate through returned structure to see what we got
+		printAddressStructures(bindAddr);
 
-			case AF_INET6:
-				v6Addr = (struct sockaddr_in6*)&recvAddr;
-				INFO("Got packet from %s:%d",inet_ntop(AF_INET6,&v6Addr->sin6_addr,straddr,sizeof(straddr)),ntohs(v6Addr->sin6_port));
-			break;
+		// open a non-blocking socket, bind it, and watch it
+		DBG("Binding socket.");
+		if(server.listen(bindAddr->ai_addr,bindAddr->ai_addrlen)!=0) {
+			DBG("Error binding socket");
+			failGracefully(5);
 		}
+		printAddress(bindAddr);
+		freeaddrinfo(bindAddr);
+	}
 
-		// validate packet
-		if(ret>BUF_LEN) {
-			INFO("PDU too large to fit in pre-allocated buffer");
-			continue;
-		}
-		recvPDU->setPDULength(ret);
-		if(recvPDU->validate()!=1) {
-			INFO("Malformed CoAP packet");
-			continue;
-		}
-		INFO("Valid CoAP PDU received");
-		recvPDU->printHuman();
-
-		// depending on what this is, maybe call callback function
-		if(recvPDU->getURI(uriBuffer,URI_BUF_LEN,&recvURILen)!=0) {
-			INFO("Error retrieving URI");
-			continue;
-		}
-		if(recvURILen==0) {
-			INFO("There is no URI associated with this Coap PDU");
-		} else {
-			HASH_FIND_STR(directory,uriBuffer,hash);
-			if(hash) {
-				DBG("Hash id is %d.", hash->id);
-				hash->callback(recvPDU,sockfd,&recvAddr);
-				continue;
-			} else {
-				DBG("Hash not found.");
-				continue;
-			}
-		}
-		
-		// no URI, handle cases
-
-		// code==0, no payload, this is a ping request, send RST
-		if(recvPDU->getPDULength()==0&&recvPDU->getCode()==0) {
-			INFO("CoAP ping request");
+	// handle packets in batches as they arrive on any socket
+	while(1) {
+		if(server.poll(-1)<0) {
+			INFO("Error receiving data");
+			return -1;
 		}
-
 	}
 
-    // free the hash table contents
-	 /*
-    HASH_ITER(hh, users, s, tmp) {
-      HASH_DEL(users, s);
-      free(s);
-    }
-	 */
-	
 	return 0;
 }
@@ -1,8 +1,25 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <atomic>
 #include <stdint.h>
 #include <unistd.h>
 #include "cantcoap.h"
+#include "coapslab.h"
+#include "coaprouter.h"
+#include "coapstaticroutes.h"
+#include "coapblock.h"
+#include "coapobserve.h"
+#include "coapreliable.h"
+#include "coapdedup.h"
+#include "coapexchange.h"
+#include "coapmid.h"
+#include "coapcongestion.h"
+#include "coapserver.h"
+#include <pthread.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 
 #include "CUnit/Basic.h"
@@ -13,6 +30,31 @@ void testHeaderFirstByteConstruction();
 void testMethodCodes();
 void testOptionInsertion();
 void testTokenInsertion();
+void testOptionIteration();
+void testOptionIndex();
+void testOptionValidation();
+void testValidateBatch();
+void testReserve();
+void testBuilder();
+void testMove();
+void testSlabAllocator();
+void testInlinePDU();
+void testBufferReuse();
+void testPayloadReference();
+void testTemplate();
+void testMakeResponse();
+void testOptionBitmap();
+void testRouter();
+void testStaticRoutes();
+void testURIParsing();
+void testBlockTransfer();
+void testObserve();
+void testReliable();
+void testDedup();
+void testExchange();
+void testMessageIDs();
+void testCongestion();
+void testServer();
 void testAgainstServer(CoapPDU *pdu);
 
 // some macros for portability with mbed code
@@ -27,18 +69,20 @@ static CoapPDU::Type coapTypeVector[COAP_NUM_MESSAGE_TYPES] = {
 };
 
 //< Possible CoAP message codes
-#define COAP_NUM_MESSAGE_CODES 26
+#define COAP_NUM_MESSAGE_CODES 29
 static CoapPDU::Code coapCodeVector[COAP_NUM_MESSAGE_CODES] = {
 	CoapPDU::COAP_EMPTY,
 	CoapPDU::COAP_GET,
 	CoapPDU::COAP_POST,
 	CoapPDU::COAP_PUT,
 	CoapPDU::COAP_DELETE,
+	CoapPDU::COAP_FETCH,
 	CoapPDU::COAP_CREATED,
 	CoapPDU::COAP_DELETED,
 	CoapPDU::COAP_VALID,
 	CoapPDU::COAP_CHANGED,
 	CoapPDU::COAP_CONTENT,
+	CoapPDU::COAP_CONTINUE,
 	CoapPDU::COAP_BAD_REQUEST,
 	CoapPDU::COAP_UNAUTHORIZED,
 	CoapPDU::COAP_BAD_OPTION,
@@ -46,6 +90,7 @@ static CoapPDU::Code coapCodeVector[COAP_NUM_MESSAGE_CODES] = {
 	CoapPDU::COAP_NOT_FOUND,
 	CoapPDU::COAP_METHOD_NOT_ALLOWED,
 	CoapPDU::COAP_NOT_ACCEPTABLE,
+	CoapPDU::COAP_REQUEST_ENTITY_INCOMPLETE,
 	CoapPDU::COAP_PRECONDITION_FAILED,
 	CoapPDU::COAP_REQUEST_ENTITY_TOO_LARGE,
 	CoapPDU::COAP_UNSUPPORTED_CONTENT_FORMAT,
@@ -138,6 +183,196 @@ void testOptionInsertion(void) {
 	}
 }
 
+// option iteration
+
+const uint8_t optionIterationTestA[] = {
+	0x40, 0x44, 0x00, 0x00, 0x73, 0xf7, 0xf7, 0xf7, 0x43, 0x55, 0x55, 0x55, 0x03, 0xff, 0xff, 0xff, 0xd3, 0xa6, 0x03, 0x02, 0x01, 0x53, 0x03, 0x02, 0x01, 0x53, 0x01, 0x02, 0x03, 0xd3, 0x57, 0x01, 0x02, 0x03, 0xe3, 0x05, 0x65, 0x03, 0x02, 0x01, 0xff, 0x01, 0x02
+};
+const uint16_t optionIterationNumbersA[] = { 7, 11, 11, 190, 195, 200, 300, 1950 };
+
+void testOptionIteration(void) {
+	uint8_t buffer[sizeof(optionIterationTestA)];
+	memcpy(buffer,optionIterationTestA,sizeof(optionIterationTestA));
+	CoapPDU *pdu = new CoapPDU(buffer,sizeof(buffer));
+	CU_ASSERT_FATAL(pdu->validate()==1);
+	CU_ASSERT_EQUAL_FATAL(pdu->getNumOptions(),8);
+
+	// iterator agrees with the allocated option list
+	CoapPDU::CoapOption *options = pdu->getOptions();
+	CU_ASSERT_FATAL(options!=NULL);
+	int i = 0;
+	for(const CoapPDU::CoapOption &o : pdu->options()) {
+		CU_ASSERT_FATAL(i<8);
+		CU_ASSERT_EQUAL_FATAL(o.optionNumber,optionIterationNumbersA[i]);
+		CU_ASSERT_EQUAL_FATAL(o.optionNumber,options[i].optionNumber);
+		CU_ASSERT_EQUAL_FATAL(o.optionDelta,options[i].optionDelta);
+		CU_ASSERT_EQUAL_FATAL(o.optionValueLength,3);
+		CU_ASSERT_EQUAL_FATAL(o.totalLength,options[i].totalLength);
+		CU_ASSERT_FATAL(o.optionPointer==options[i].optionPointer);
+		CU_ASSERT_FATAL(o.optionValuePointer==options[i].optionValuePointer);
+		i++;
+	}
+	CU_ASSERT_EQUAL_FATAL(i,8);
+	free(options);
+	delete pdu;
+
+	// no options yields an empty range
+	pdu = new CoapPDU();
+	CU_ASSERT_FATAL(pdu->options().begin()==pdu->options().end());
+	pdu->setPayload((uint8_t*)"\1\2",2);
+	CU_ASSERT_FATAL(pdu->options().begin()==pdu->options().end());
+	delete pdu;
+}
+
+void testOptionIndex(void) {
+	uint8_t buffer[sizeof(optionIterationTestA)];
+	memcpy(buffer,optionIterationTestA,sizeof(optionIterationTestA));
+	CoapPDU *pdu = new CoapPDU(buffer,sizeof(buffer));
+	int numEntries = 0;
+	CU_ASSERT_FATAL(pdu->getOptionIndex(&numEntries)==NULL);
+	CU_ASSERT_FATAL(pdu->validate()==1);
+
+	// index matches the options
+	const CoapPDU::CoapOptionIndexEntry *index = pdu->getOptionIndex(&numEntries);
+	CU_ASSERT_FATAL(index!=NULL);
+	CU_ASSERT_EQUAL_FATAL(numEntries,8);
+	int i = 0;
+	for(const CoapPDU::CoapOption &o : pdu->options()) {
+		CU_ASSERT_EQUAL_FATAL(index[i].optionNumber,o.optionNumber);
+		CU_ASSERT_EQUAL_FATAL(index[i].valueLength,o.optionValueLength);
+		CU_ASSERT_FATAL(pdu->getPDUPointer()+index[i].valueOffset==o.optionValuePointer);
+		i++;
+	}
+
+	// lookups
+	const CoapPDU::CoapOptionIndexEntry *first = NULL;
+	CU_ASSERT_EQUAL_FATAL(pdu->findIndexedOptions(11,&first),2);
+	CU_ASSERT_FATAL(first==&index[1]);
+	CU_ASSERT_EQUAL_FATAL(pdu->findIndexedOptions(1950,&first),1);
+	CU_ASSERT_FATAL(first==&index[7]);
+	CU_ASSERT_EQUAL_FATAL(pdu->findIndexedOptions(6,&first),0);
+	CU_ASSERT_FATAL(first==NULL);
+	CU_ASSERT_EQUAL_FATAL(pdu->findIndexedOptions(2000,&first),0);
+
+	// storage too small means no index
+	CoapPDU::CoapOptionIndexEntry smallIndex[4];
+	pdu->setOptionIndexStorage(smallIndex,4);
+	CU_ASSERT_FATAL(pdu->validate()==1);
+	CU_ASSERT_FATAL(pdu->getOptionIndex(&numEntries)==NULL);
+	CU_ASSERT_EQUAL_FATAL(pdu->findIndexedOptions(11,&first),-1);
+
+	// and disabled indexing
+	pdu->setOptionIndexStorage(NULL,0);
+	CU_ASSERT_FATAL(pdu->validate()==1);
+	CU_ASSERT_FATAL(pdu->getOptionIndex(&numEntries)==NULL);
+	delete pdu;
+
+	// modifying the PDU discards the index
+	pdu = new CoapPDU();
+	pdu->setURI((char*)"/a/b",4);
+	CU_ASSERT_FATAL(pdu->validate()==1);
+	CU_ASSERT_EQUAL_FATAL(pdu->findIndexedOptions(CoapPDU::COAP_OPTION_URI_PATH,&first),2);
+	CU_ASSERT_NSTRING_EQUAL_FATAL(pdu->getPDUPointer()+first[1].valueOffset,"b",1);
+	pdu->addOption(CoapPDU::COAP_OPTION_URI_QUERY,3,(uint8_t*)"x=1");
+	CU_ASSERT_EQUAL_FATAL(pdu->findIndexedOptions(CoapPDU::COAP_OPTION_URI_PATH,&first),-1);
+	delete pdu;
+}
+
+// option validation, each PDU has a message header then options which validate() must reject
+#define NUM_MALFORMED_OPTION_VECTORS 7
+static const uint8_t malformedOptionVectors[NUM_MALFORMED_OPTION_VECTORS][8] = {
+	{ 0x40, 0x01, 0x00, 0x01, 0xF0 },             // reserved delta nibble
+	{ 0x40, 0x01, 0x00, 0x01, 0x1F },             // reserved length nibble
+	{ 0x40, 0x01, 0x00, 0x01, 0xD0 },             // extended delta byte missing
+	{ 0x40, 0x01, 0x00, 0x01, 0x0E, 0x00 },       // one of two extended length bytes missing
+	{ 0x40, 0x01, 0x00, 0x01, 0x03, 'a', 'b' },   // value runs past end of PDU
+	{ 0x40, 0x01, 0x00, 0x01, 0xE0, 0xFF, 0x00 }, // delta doesn't fit in 16 bits
+	{ 0x40, 0x01, 0x00, 0x01, 0xFF }              // payload marker without payload
+};
+static const int malformedOptionVectorLengths[NUM_MALFORMED_OPTION_VECTORS] = { 5, 5, 5, 6, 7, 7, 5 };
+
+void testOptionValidation(void) {
+	uint8_t buffer[16];
+	for(int i=0; i<NUM_MALFORMED_OPTION_VECTORS; i++) {
+		memcpy(buffer,malformedOptionVectors[i],malformedOptionVectorLengths[i]);
+		CoapPDU *pdu = new CoapPDU(buffer,malformedOptionVectorLengths[i]);
+		CU_ASSERT_FATAL(pdu->validate()==0);
+		delete pdu;
+	}
+
+	// extended delta, then a payload
+	const uint8_t valid[] = { 0x40, 0x01, 0x00, 0x01, 0xD1, 0x00, 'a', 0xFF, 'p' };
+	memcpy(buffer,valid,sizeof(valid));
+	CoapPDU *pdu = new CoapPDU(buffer,sizeof(valid));
+	CU_ASSERT_FATAL(pdu->validate()==1);
+	CU_ASSERT_FATAL(pdu->getNumOptions()==1);
+	CU_ASSERT_FATAL(pdu->getPayloadLength()==1);
+	CoapPDU::OptionRange range = pdu->options();
+	CoapPDU::OptionIterator it = range.begin();
+	CU_ASSERT_FATAL(it!=range.end());
+	CU_ASSERT_FATAL(it->optionNumber==13);
+	CU_ASSERT_FATAL(it->optionValueLength==1);
+	delete pdu;
+}
+
+void testValidateBatch(void) {
+	const uint8_t *pdus[COAP_VALIDATE_BATCH_SIZE];
+	int lengths[COAP_VALIDATE_BATCH_SIZE];
+	uint8_t copies[COAP_VALIDATE_BATCH_SIZE][64];
+	int count = 0;
+
+	// the malformed vectors, valid and invalid headers, and one with options and a payload
+	for(int i=0; i<NUM_MALFORMED_OPTION_VECTORS; i++) {
+		pdus[count] = malformedOptionVectors[i];
+		lengths[count++] = malformedOptionVectorLengths[i];
+	}
+	const uint8_t headers[][4] = {
+		{ 0x40, 0x01, 0x12, 0x34 }, // valid
+		{ 0x80, 0x01, 0x12, 0x34 }, // version 2
+		{ 0x49, 0x01, 0x12, 0x34 }, // token length 9
+		{ 0x41, 0x01, 0x12, 0x34 }, // token longer than PDU
+		{ 0x50, 0xC0, 0x12, 0x34 }, // code class 6
+		{ 0x70, 0x00, 0x00, 0x00 }  // reset
+	};
+	for(unsigned i=0; i<sizeof(headers)/sizeof(headers[0]); i++) {
+		pdus[count] = headers[i];
+		lengths[count++] = 4;
+	}
+	pdus[count] = headers[0];
+	lengths[count++] = 3;
+	pdus[count] = optionIterationTestA;
+	lengths[count++] = sizeof(optionIterationTestA);
+
+	CoapPDU::ValidateBatchResult result;
+	int numValid = CoapPDU::validateBatch(pdus,lengths,count,&result);
+
+	// each result must agree with validate()
+	int expectedValid = 0;
+	for(int i=0; i<count; i++) {
+		memcpy(copies[i],pdus[i],lengths[i]);
+		CoapPDU *pdu = new CoapPDU(copies[i],lengths[i]);
+		int valid = pdu->validate();
+		CU_ASSERT_EQUAL_FATAL(result.valid[i],valid);
+		if(valid) {
+			expectedValid++;
+			CU_ASSERT_EQUAL_FATAL(result.type[i],pdu->getType());
+			CU_ASSERT_EQUAL_FATAL(result.code[i],pdu->getCode());
+			CU_ASSERT_EQUAL_FATAL(result.messageID[i],pdu->getMessageID());
+			CU_ASSERT_EQUAL_FATAL(result.tokenLength[i],pdu->getTokenLength());
+			CU_ASSERT_EQUAL_FATAL(result.numOptions[i],pdu->getNumOptions());
+			CU_ASSERT_EQUAL_FATAL(result.payloadLength[i],pdu->getPayloadLength());
+			if(pdu->getPayloadLength()) {
+				CU_ASSERT_EQUAL_FATAL(copies[i]+result.payloadOffset[i],pdu->getPayloadPointer());
+			}
+		}
+		delete pdu;
+	}
+	CU_ASSERT_EQUAL_FATAL(numValid,expectedValid);
+	CU_ASSERT_EQUAL_FATAL(numValid,3);
+
+	CU_ASSERT_EQUAL_FATAL(CoapPDU::validateBatch(pdus,lengths,COAP_VALIDATE_BATCH_SIZE+1,&result),-1);
+}
+
 void testHeaderFirstByteConstruction(void) {
 	CoapPDU *pdu = NULL;
 	uint8_t *buffer[64];
@@ -547,6 +782,127 @@ void testURISizes()
     delete pdu;
 }
 
+// writes the options of pdu as "number=value;" to out
+static void describeOptions(CoapPDU *pdu, char *out) {
+	*out = 0x00;
+	for(const CoapPDU::CoapOption &o : pdu->options()) {
+		out += sprintf(out,"%d=%.*s;",o.optionNumber,o.optionValueLength,o.optionValuePointer);
+	}
+}
+
+void testURIParsing() {
+	char options[256];
+	struct {
+		const char *uri;
+		const char *options;
+	} cases[] = {
+		{"/a%20b/c%2Fd?x=%26&y", "11=a b;11=c/d;15=x=&;15=y;"},
+		{"/a//b/", "11=a;11=;11=b;"},
+		{"/a?x", "11=a;15=x;"},
+		{"?q=1", "15=q=1;"},
+		{"/a?b=c?d&&e", "11=a;15=b=c?d;15=;15=e;"},
+		{"coap://Example.COM/s%41", "3=example.com;11=sA;"},
+		{"COAP://example.com:5683", "3=example.com;"},
+		{"coap://192.168.0.1/x", "11=x;"},
+		{"coap://[::1]:5683/", ""},
+		{"coaps://host:5684/%7e", "3=host;11=~;"},
+		{"coap://h%41st/", "3=hAst;"},
+	};
+	for(unsigned i=0; i<sizeof(cases)/sizeof(cases[0]); i++) {
+		CoapPDU pdu;
+		CU_ASSERT_EQUAL_FATAL(pdu.setURI((char*)cases[i].uri,strlen(cases[i].uri)),0);
+		describeOptions(&pdu,options);
+		CU_ASSERT_STRING_EQUAL_FATAL(options,cases[i].options);
+		CU_ASSERT_EQUAL_FATAL(pdu.validate(),1);
+	}
+
+	// ports other than the default are sent
+	CoapPDU pdu;
+	CoapPDU::CoapOption port;
+	CU_ASSERT_EQUAL_FATAL(pdu.setURI((char*)"coap://host:61616/a",19),0);
+	CU_ASSERT_FATAL(pdu.findOption(CoapPDU::COAP_OPTION_URI_PORT,&port));
+	CU_ASSERT_EQUAL_FATAL(port.optionValueLength,2);
+	CU_ASSERT_EQUAL_FATAL(port.optionValuePointer[0]<<8|port.optionValuePointer[1],61616);
+	pdu.reset();
+	CU_ASSERT_EQUAL_FATAL(pdu.setURI((char*)"coaps://host:5683",17),0);
+	CU_ASSERT_FATAL(pdu.findOption(CoapPDU::COAP_OPTION_URI_PORT,&port));
+	CU_ASSERT_EQUAL_FATAL(port.optionValueLength,2);
+
+	// only urilen bytes are read
+	pdu.reset();
+	char unterminated[8] = {'/','a','/','b','/','c','/','d'};
+	CU_ASSERT_EQUAL_FATAL(pdu.setURI(unterminated,4),0);
+	describeOptions(&pdu,options);
+	CU_ASSERT_STRING_EQUAL_FATAL(options,"11=a;11=b;");
+
+	// malformed
+	const char *bad[] = {"/a%2", "/a%zz", "/a#frag", "coap://[::1/", "coap://host:70000/", "coap://host:12a/"};
+	for(unsigned i=0; i<sizeof(bad)/sizeof(bad[0]); i++) {
+		pdu.reset();
+		CU_ASSERT_EQUAL_FATAL(pdu.setURI((char*)bad[i],strlen(bad[i])),1);
+	}
+
+	// a malformed URI leaves the PDU as it was
+	pdu.reset();
+	pdu.setVersion(1);
+	CU_ASSERT_EQUAL_FATAL(pdu.setURI((char*)"/a/b/c%zz",9),1);
+	CU_ASSERT_EQUAL_FATAL(pdu.getPDULength(),4);
+	CU_ASSERT_EQUAL_FATAL(pdu.getNumOptions(),0);
+	CU_ASSERT_EQUAL_FATAL(pdu.setURI((char*)"/a",2),0);
+	CU_ASSERT_EQUAL_FATAL(pdu.validate(),1);
+
+	// an external buffer only needs to fit the decoded options
+	uint8_t exact[11];
+	CoapPDU fixed(exact,sizeof(exact),0);
+	CU_ASSERT_EQUAL_FATAL(fixed.setURI((char*)"/abc/d%65",9),0);
+	CU_ASSERT_EQUAL_FATAL(fixed.getPDULength(),11);
+	describeOptions(&fixed,options);
+	CU_ASSERT_STRING_EQUAL_FATAL(options,"11=abc;11=de;");
+	CoapPDU tooSmall(exact,sizeof(exact)-1,0);
+	CU_ASSERT_EQUAL_FATAL(tooSmall.setURI((char*)"/abc/d%65",9),1);
+	CU_ASSERT_EQUAL_FATAL(tooSmall.getPDULength(),4);
+
+	// options with higher numbers already present are kept in order, including when decoding
+	pdu.reset();
+	pdu.setVersion(1);
+	pdu.addOption(CoapPDU::COAP_OPTION_ACCEPT,1,(uint8_t*)"\x32");
+	CU_ASSERT_EQUAL_FATAL(pdu.setURI((char*)"coap://Host/a%62/c?d",20),0);
+	describeOptions(&pdu,options);
+	CU_ASSERT_STRING_EQUAL_FATAL(options,"3=host;11=ab;11=c;15=d;17=2;");
+	CU_ASSERT_EQUAL_FATAL(pdu.validate(),1);
+
+	// and when inserting them doesn't fit, none are added
+	uint8_t small[13];
+	CoapPDU inserted(small,sizeof(small),0);
+	inserted.setVersion(1);
+	inserted.addOption(CoapPDU::COAP_OPTION_ACCEPT,1,(uint8_t*)"\x32");
+	CU_ASSERT_EQUAL_FATAL(inserted.setURI((char*)"/abc/def",8),1);
+	CU_ASSERT_EQUAL_FATAL(inserted.getPDULength(),7);
+	CU_ASSERT_EQUAL_FATAL(inserted.getNumOptions(),1);
+	CU_ASSERT_FATAL(inserted.getOptionBitmap()==CoapPDU::getOptionBit(CoapPDU::COAP_OPTION_ACCEPT));
+	describeOptions(&inserted,options);
+	CU_ASSERT_STRING_EQUAL_FATAL(options,"17=2;");
+	CU_ASSERT_EQUAL_FATAL(inserted.setURI((char*)"/abc/de",7),0);
+	CU_ASSERT_EQUAL_FATAL(inserted.getPDULength(),13);
+	describeOptions(&inserted,options);
+	CU_ASSERT_STRING_EQUAL_FATAL(options,"11=abc;11=de;17=2;");
+	CU_ASSERT_EQUAL_FATAL(inserted.validate(),1);
+
+	// many components
+	pdu.reset();
+	pdu.setVersion(1);
+	char longURI[201] = {0};
+	for(int i=0; i<100; i++) {
+		sprintf(longURI+2*i,"/%c",'a'+i%26);
+	}
+	CU_ASSERT_EQUAL_FATAL(pdu.setURI(longURI,strlen(longURI)),0);
+	char uriOut[sizeof(longURI)+8];
+	int uriOutLength = 0;
+	CU_ASSERT_EQUAL_FATAL(pdu.getURI(uriOut,sizeof(uriOut),&uriOutLength),0);
+	CU_ASSERT_STRING_EQUAL_FATAL(uriOut,longURI);
+	CU_ASSERT_EQUAL_FATAL(pdu.validate(),1);
+}
+
 void testBigRealloc() {
 	// big payload
 	size_t testPayloadLen = 1000000;
@@ -581,6 +937,2047 @@ void testBigRealloc() {
 	delete pdu;
 }
 
+void testReserve() {
+	uint8_t payload[100];
+	memset(payload,'p',sizeof(payload));
+
+	// managed memory grows geometrically
+	CoapPDU *pdu = new CoapPDU();
+	CU_ASSERT_EQUAL_FATAL(pdu->getBufferLength(),4);
+	pdu->setToken((uint8_t*)"\1\2\3\4",4);
+	CU_ASSERT_EQUAL_FATAL(pdu->getBufferLength(),COAP_PDU_MIN_CAPACITY);
+	pdu->setURI((char*)"/a/b",4);
+	CU_ASSERT_EQUAL_FATAL(pdu->getBufferLength(),COAP_PDU_MIN_CAPACITY);
+	pdu->setPayload(payload,sizeof(payload));
+	CU_ASSERT_EQUAL_FATAL(pdu->getBufferLength(),2*COAP_PDU_MIN_CAPACITY);
+	CU_ASSERT_FATAL(memcmp(pdu->getPayloadPointer(),payload,sizeof(payload))==0);
+
+	// shrinking the payload keeps the capacity, until asked to give it back
+	pdu->setPayload(payload,10);
+	CU_ASSERT_EQUAL_FATAL(pdu->getBufferLength(),2*COAP_PDU_MIN_CAPACITY);
+	CU_ASSERT_EQUAL_FATAL(pdu->shrinkToFit(),0);
+	CU_ASSERT_EQUAL_FATAL(pdu->getBufferLength(),pdu->getPDULength());
+	CU_ASSERT_FATAL(memcmp(pdu->getPayloadPointer(),payload,10)==0);
+	CU_ASSERT_FATAL(pdu->validate()==1);
+	delete pdu;
+
+	// nothing moves once enough has been reserved
+	pdu = new CoapPDU();
+	CU_ASSERT_EQUAL_FATAL(pdu->reserve(200),0);
+	CU_ASSERT_EQUAL_FATAL(pdu->getBufferLength(),200);
+	uint8_t *buffer = pdu->getPDUPointer();
+	pdu->setToken((uint8_t*)"\1\2\3\4",4);
+	pdu->setURI((char*)"/sensors/temperature",20);
+	pdu->setContentFormat(CoapPDU::COAP_CONTENT_FORMAT_APP_JSON);
+	pdu->setPayload(payload,sizeof(payload));
+	CU_ASSERT_FATAL(pdu->getPDUPointer()==buffer);
+	CU_ASSERT_EQUAL_FATAL(pdu->getBufferLength(),200);
+	CU_ASSERT_FATAL(pdu->validate()==1);
+	delete pdu;
+
+	// external buffers can't grow
+	uint8_t external[32];
+	pdu = new CoapPDU(external,sizeof(external),0);
+	CU_ASSERT_EQUAL_FATAL(pdu->reserve(32),0);
+	CU_ASSERT_EQUAL_FATAL(pdu->reserve(33),1);
+	CU_ASSERT_EQUAL_FATAL(pdu->shrinkToFit(),0);
+	CU_ASSERT_EQUAL_FATAL(pdu->getBufferLength(),32);
+	delete pdu;
+}
+
+void testBuilder() {
+	const char *paths[3] = { "sensors", "outdoor", "temperature" };
+	uint8_t etag[4] = { 1, 2, 3, 4 };
+	uint8_t longValue[300];
+	memset(longValue,'v',sizeof(longValue));
+
+	// reference, options added in order with CoapPDU::addOption()
+	CoapPDU *expected = new CoapPDU();
+	expected->setType(CoapPDU::COAP_CONFIRMABLE);
+	expected->setCode(CoapPDU::COAP_POST);
+	expected->setMessageID(0xBEEF);
+	expected->setToken((uint8_t*)"\1\2\3",3);
+	expected->addOption(CoapPDU::COAP_OPTION_ETAG,4,etag);
+	for(int i=0; i<3; i++) {
+		expected->addOption(CoapPDU::COAP_OPTION_URI_PATH,strlen(paths[i]),(uint8_t*)paths[i]);
+	}
+	expected->addOption(CoapPDU::COAP_OPTION_PROXY_URI,sizeof(longValue),longValue);
+	expected->addOption(2000,0,NULL);
+	expected->setPayload((uint8_t*)"payload",7);
+
+	// builder, options added in reverse order apart from the repeated Uri-Path
+	CoapPDUBuilder builder;
+	builder.setType(CoapPDU::COAP_CONFIRMABLE);
+	builder.setCode(CoapPDU::COAP_POST);
+	builder.setMessageID(0xBEEF);
+	CU_ASSERT_EQUAL_FATAL(builder.setToken((uint8_t*)"\1\2\3",3),0);
+	CU_ASSERT_EQUAL_FATAL(builder.addOption(2000,0,NULL),0);
+	CU_ASSERT_EQUAL_FATAL(builder.addOption(CoapPDU::COAP_OPTION_PROXY_URI,sizeof(longValue),longValue),0);
+	for(int i=0; i<3; i++) {
+		CU_ASSERT_EQUAL_FATAL(builder.addOption(CoapPDU::COAP_OPTION_URI_PATH,strlen(paths[i]),(uint8_t*)paths[i]),0);
+	}
+	CU_ASSERT_EQUAL_FATAL(builder.addOption(CoapPDU::COAP_OPTION_ETAG,4,etag),0);
+	builder.setPayload((uint8_t*)"payload",7);
+	CU_ASSERT_EQUAL_FATAL(builder.getPDULength(),expected->getPDULength());
+
+	CoapPDU *built = new CoapPDU();
+	CU_ASSERT_EQUAL_FATAL(builder.build(built),0);
+	CU_ASSERT_EQUAL_FATAL(built->getPDULength(),expected->getPDULength());
+	CU_ASSERT_FATAL(memcmp(built->getPDUPointer(),expected->getPDUPointer(),expected->getPDULength())==0);
+	CU_ASSERT_EQUAL_FATAL(built->getNumOptions(),6);
+	CU_ASSERT_EQUAL_FATAL(built->getPayloadLength(),7);
+	CU_ASSERT_NSTRING_EQUAL_FATAL(built->getPayloadPointer(),"payload",7);
+	// the built PDU can be extended as normal
+	CU_ASSERT_EQUAL_FATAL(built->addOption(CoapPDU::COAP_OPTION_URI_HOST,1,(uint8_t*)"h"),0);
+	CU_ASSERT_FATAL(built->validate()==1);
+
+	// proxy style, copy options from a received PDU and drop one
+	uint8_t buffer[512];
+	memcpy(buffer,expected->getPDUPointer(),expected->getPDULength());
+	CoapPDU *received = new CoapPDU(buffer,expected->getPDULength());
+	CU_ASSERT_FATAL(received->validate()==1);
+	CoapPDUBuilder forward;
+	CU_ASSERT_EQUAL_FATAL(forward.addOptions(received),0);
+	CU_ASSERT_EQUAL_FATAL(forward.getNumOptions(),6);
+	CU_ASSERT_EQUAL_FATAL(forward.removeOption(CoapPDU::COAP_OPTION_URI_PATH),3);
+	CU_ASSERT_EQUAL_FATAL(forward.getNumOptions(),3);
+	uint8_t small[16];
+	CoapPDU *tooSmall = new CoapPDU(small,sizeof(small),0);
+	CU_ASSERT_EQUAL_FATAL(forward.build(tooSmall),1);
+	uint8_t large[512];
+	CoapPDU *fits = new CoapPDU(large,sizeof(large),0);
+	CU_ASSERT_EQUAL_FATAL(forward.build(fits),0);
+	CU_ASSERT_FATAL(fits->validate()==1);
+	CU_ASSERT_EQUAL_FATAL(fits->getNumOptions(),3);
+	CU_ASSERT_EQUAL_FATAL(fits->getPayloadLength(),0);
+	// clearing the token, which takes no pointer
+	CU_ASSERT_EQUAL_FATAL(forward.setToken(NULL,0),0);
+	CU_ASSERT_EQUAL_FATAL(forward.setToken(NULL,2),1);
+	CU_ASSERT_EQUAL_FATAL(forward.build(fits),0);
+	CU_ASSERT_EQUAL_FATAL(fits->getTokenLength(),0);
+	CU_ASSERT_FATAL(fits->validate()==1);
+	int numOptions = 0;
+	for(const CoapPDU::CoapOption &o : fits->options()) {
+		CU_ASSERT_FATAL(o.optionNumber!=CoapPDU::COAP_OPTION_URI_PATH);
+		numOptions++;
+	}
+	CU_ASSERT_EQUAL_FATAL(numOptions,3);
+
+	delete fits;
+	delete tooSmall;
+	delete received;
+	delete built;
+	delete expected;
+}
+
+static int deletedBuffers = 0;
+static void countingDeleter(uint8_t *buffer) {
+	deletedBuffers++;
+	free(buffer);
+}
+
+void testMove() {
+	// moving keeps the PDU, including its option index, and empties the source
+	CoapPDU a;
+	a.setCode(CoapPDU::COAP_GET);
+	a.setMessageID(0x1234);
+	a.setURI((char*)"/x/y",4);
+	a.setPayload((uint8_t*)"abc",3);
+	CU_ASSERT_FATAL(a.validate()==1);
+	uint8_t *buffer = a.getPDUPointer();
+	CoapPDU b(std::move(a));
+	CU_ASSERT_FATAL(b.getPDUPointer()==buffer);
+	CU_ASSERT_FATAL(a.getPDUPointer()==NULL);
+	CU_ASSERT_EQUAL_FATAL(b.getMessageID(),0x1234);
+	CU_ASSERT_NSTRING_EQUAL_FATAL(b.getPayloadPointer(),"abc",3);
+	const CoapPDU::CoapOptionIndexEntry *first = NULL;
+	CU_ASSERT_EQUAL_FATAL(b.findIndexedOptions(CoapPDU::COAP_OPTION_URI_PATH,&first),2);
+	CU_ASSERT_NSTRING_EQUAL_FATAL(b.getPDUPointer()+first[1].valueOffset,"y",1);
+
+	// move assignment frees the old buffer
+	CoapPDU c;
+	c.setCode(CoapPDU::COAP_POST);
+	c = std::move(b);
+	CU_ASSERT_FATAL(c.getPDUPointer()==buffer);
+	CU_ASSERT_EQUAL_FATAL(c.getCode(),CoapPDU::COAP_GET);
+
+	// PDUs can live by value in containers
+	std::vector<CoapPDU> pdus;
+	for(int i=0; i<20; i++) {
+		CoapPDU p;
+		p.setMessageID(i);
+		pdus.push_back(std::move(p));
+	}
+	pdus.push_back(std::move(c));
+	for(int i=0; i<20; i++) {
+		CU_ASSERT_EQUAL_FATAL(pdus[i].getMessageID(),i);
+	}
+	CU_ASSERT_FATAL(pdus[20].getPDUPointer()==buffer);
+
+	// release hands the buffer over, adopt takes it back without copying
+	int length = pdus[20].getPDULength();
+	uint8_t *released = pdus[20].release();
+	CU_ASSERT_FATAL(released==buffer);
+	CoapPDU d;
+	CU_ASSERT_EQUAL_FATAL(d.adopt(released,length,length,NULL),0);
+	CU_ASSERT_FATAL(d.validate()==1);
+	CU_ASSERT_NSTRING_EQUAL_FATAL(d.getPayloadPointer(),"abc",3);
+	// a malloc'd buffer adopted without a deleter can grow
+	CU_ASSERT_EQUAL_FATAL(d.addOption(CoapPDU::COAP_OPTION_URI_QUERY,3,(uint8_t*)"a=1"),0);
+	CU_ASSERT_FATAL(d.validate()==1);
+
+	// a buffer with a deleter has a fixed size and is deleted exactly once
+	deletedBuffers = 0;
+	{
+		CoapPDU e;
+		CU_ASSERT_EQUAL_FATAL(e.adopt((uint8_t*)malloc(16),0,16,countingDeleter),0);
+		CU_ASSERT_EQUAL_FATAL(e.getPDULength(),4);
+		CU_ASSERT_EQUAL_FATAL(e.setPayload((uint8_t*)"0123456789",10),0);
+		CU_ASSERT_EQUAL_FATAL(e.addOption(CoapPDU::COAP_OPTION_URI_PATH,4,(uint8_t*)"long"),1);
+		CoapPDU f(std::move(e));
+		CU_ASSERT_EQUAL_FATAL(deletedBuffers,0);
+		CU_ASSERT_EQUAL_FATAL(f.adopt((uint8_t*)malloc(16),0,16,countingDeleter),0);
+		CU_ASSERT_EQUAL_FATAL(deletedBuffers,1);
+		CU_ASSERT_EQUAL_FATAL(f.adopt(NULL,0,16,countingDeleter),1);
+	}
+	CU_ASSERT_EQUAL_FATAL(deletedBuffers,2);
+}
+
+#define SLAB_TEST_BLOCKS 200
+static uint8_t *slabTestBlocks[SLAB_TEST_BLOCKS];
+
+static void* slabTestFree(void *arg) {
+	CoapSlabAllocator *slab = (CoapSlabAllocator*)arg;
+	for(int i=0; i<SLAB_TEST_BLOCKS; i++) {
+		CU_ASSERT_EQUAL_FATAL(slabTestBlocks[i][0],i%256);
+		slab->deallocate(slabTestBlocks[i],128);
+	}
+	return NULL;
+}
+
+void testSlabAllocator() {
+	CoapSlabAllocator slab;
+	int capacity = 0;
+
+	// requests are rounded up to the size classes, anything bigger goes to malloc()
+	const int sizes[][2] = { {1,64}, {64,64}, {65,128}, {300,512}, {1024,1152}, {1152,1152}, {1153,1153} };
+	for(unsigned i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+		uint8_t *buffer = slab.allocate(sizes[i][0],&capacity);
+		CU_ASSERT_FATAL(buffer!=NULL);
+		CU_ASSERT_EQUAL_FATAL(capacity,sizes[i][1]);
+		memset(buffer,0xAA,capacity);
+		slab.deallocate(buffer,capacity);
+	}
+
+	// a freed block is reused straight away, growing within a class doesn't move
+	uint8_t *a = slab.allocate(100,&capacity);
+	slab.deallocate(a,capacity);
+	uint8_t *b = slab.allocate(120,&capacity);
+	CU_ASSERT_FATAL(a==b);
+	CU_ASSERT_FATAL(slab.reallocate(b,capacity,128,&capacity)==b);
+	memcpy(b,"contents",8);
+	b = slab.reallocate(b,capacity,1000,&capacity);
+	CU_ASSERT_EQUAL_FATAL(capacity,1152);
+	CU_ASSERT_NSTRING_EQUAL_FATAL(b,"contents",8);
+	b = slab.reallocate(b,capacity,5000,&capacity);
+	CU_ASSERT_EQUAL_FATAL(capacity,5000);
+	CU_ASSERT_NSTRING_EQUAL_FATAL(b,"contents",8);
+	b = slab.reallocate(b,capacity,10,&capacity);
+	CU_ASSERT_EQUAL_FATAL(capacity,64);
+	CU_ASSERT_NSTRING_EQUAL_FATAL(b,"contents",8);
+	slab.deallocate(b,capacity);
+
+	// blocks freed by another thread find their way back through the shared pool
+	for(int i=0; i<SLAB_TEST_BLOCKS; i++) {
+		slabTestBlocks[i] = slab.allocate(128,&capacity);
+		slabTestBlocks[i][0] = i%256;
+	}
+	pthread_t thread;
+	CU_ASSERT_EQUAL_FATAL(pthread_create(&thread,NULL,slabTestFree,&slab),0);
+	pthread_join(thread,NULL);
+	CoapSlabAllocator::flushThreadCache();
+	uint8_t *again[SLAB_TEST_BLOCKS];
+	int reused = 0;
+	for(int i=0; i<SLAB_TEST_BLOCKS; i++) {
+		again[i] = slab.allocate(128,&capacity);
+		for(int j=0; j<SLAB_TEST_BLOCKS; j++) {
+			if(again[i]==slabTestBlocks[j]) {
+				reused++;
+				break;
+			}
+		}
+	}
+	// only blocks this thread still had cached can come before them
+	CU_ASSERT_FATAL(reused>=SLAB_TEST_BLOCKS-COAP_SLAB_CACHE_BLOCKS);
+	for(int i=0; i<SLAB_TEST_BLOCKS; i++) {
+		slab.deallocate(again[i],128);
+	}
+
+	// PDUs use the thread default, or an allocator passed in
+	CoapAllocator::setDefault(&slab);
+	CoapPDU *pdu = new CoapPDU();
+	CU_ASSERT_FATAL(pdu->getAllocator()==&slab);
+	CU_ASSERT_EQUAL_FATAL(pdu->getBufferLength(),64);
+	pdu->setURI((char*)"/a/b/c",6);
+	uint8_t payload[200];
+	memset(payload,'p',sizeof(payload));
+	pdu->setPayload(payload,sizeof(payload));
+	CU_ASSERT_EQUAL_FATAL(pdu->getBufferLength(),256);
+	CU_ASSERT_FATAL(pdu->validate()==1);
+	CU_ASSERT_FATAL(memcmp(pdu->getPayloadPointer(),payload,sizeof(payload))==0);
+	delete pdu;
+	CoapAllocator::setDefault(NULL);
+	pdu = new CoapPDU();
+	CU_ASSERT_FATAL(pdu->getAllocator()==CoapAllocator::getMallocAllocator());
+	delete pdu;
+	pdu = new CoapPDU(&slab);
+	CU_ASSERT_FATAL(pdu->getAllocator()==&slab);
+	delete pdu;
+}
+
+// an inline PDU returned as a CoapPDU, whose buffer would otherwise point into the finished stack frame
+static CoapPDU inlinePDUCopy(CoapPDU *pdu) {
+	CoapInlinePDU<64> copy;
+	memcpy(copy.getPDUPointer(),pdu->getPDUPointer(),pdu->getPDULength());
+	copy.setPDULength(pdu->getPDULength());
+	CU_ASSERT_FATAL(copy.validate()==1);
+	return std::move(copy);
+}
+
+void testInlinePDU() {
+	CoapInlinePDU<32> pdu;
+	CU_ASSERT_FATAL(sizeof(pdu)>=sizeof(CoapPDU)+32);
+	CU_ASSERT_FATAL(pdu.getPDUPointer()>=(uint8_t*)&pdu && pdu.getPDUPointer()<(uint8_t*)&pdu+sizeof(pdu));
+	CU_ASSERT_EQUAL_FATAL(pdu.getBufferLength(),32);
+	CU_ASSERT_EQUAL_FATAL(pdu.getPDULength(),4);
+	CU_ASSERT_EQUAL_FATAL(pdu.getVersion(),1);
+
+	// fails just like an external buffer once full
+	pdu.setCode(CoapPDU::COAP_GET);
+	CU_ASSERT_EQUAL_FATAL(pdu.setToken((uint8_t*)"\1\2\3\4",4),0);
+	CU_ASSERT_EQUAL_FATAL(pdu.setURI((char*)"/abc/def",8),0);
+	CU_ASSERT_EQUAL_FATAL(pdu.reserve(33),1);
+	CU_ASSERT_FATAL(pdu.setPayload((uint8_t*)"0123456789abcdef",16)==1);
+	CU_ASSERT_EQUAL_FATAL(pdu.setPayload((uint8_t*)"0123456789abcde",15),0);
+	CU_ASSERT_EQUAL_FATAL(pdu.getPDULength(),32);
+	CU_ASSERT_FATAL(pdu.validate()==1);
+
+	// receiving into the inline buffer
+	CoapInlinePDU<64> received;
+	memcpy(received.getPDUPointer(),pdu.getPDUPointer(),pdu.getPDULength());
+	received.setPDULength(pdu.getPDULength());
+	CU_ASSERT_FATAL(received.validate()==1);
+	CU_ASSERT_EQUAL_FATAL(received.getNumOptions(),2);
+	CU_ASSERT_NSTRING_EQUAL_FATAL(received.getPayloadPointer(),"0123456789abcde",15);
+
+	// reset keeps the inline buffer
+	uint8_t *buffer = received.getPDUPointer();
+	received.reset();
+	CU_ASSERT_FATAL(received.getPDUPointer()==buffer);
+	CU_ASSERT_EQUAL_FATAL(received.getPDULength(),4);
+
+	// moving out copies the PDU, as the inline buffer goes away with the object
+	CoapPDU moved = inlinePDUCopy(&pdu);
+	CU_ASSERT_FATAL(moved.getPDUPointer()<(uint8_t*)&pdu||moved.getPDUPointer()>=(uint8_t*)&pdu+sizeof(pdu));
+	CU_ASSERT_EQUAL_FATAL(moved.getPDULength(),32);
+	CU_ASSERT_FATAL(memcmp(moved.getPDUPointer(),pdu.getPDUPointer(),32)==0);
+	CU_ASSERT_EQUAL_FATAL(moved.getNumOptions(),2);
+	CU_ASSERT_NSTRING_EQUAL_FATAL(moved.getPayloadPointer(),"0123456789abcde",15);
+	// and it is memory managed from then on
+	CU_ASSERT_EQUAL_FATAL(moved.reserve(256),0);
+	CoapPDU assigned;
+	assigned = std::move(pdu);
+	CU_ASSERT_EQUAL_FATAL(assigned.getPDULength(),32);
+	CU_ASSERT_FATAL(assigned.validate()==1);
+	CU_ASSERT_EQUAL_FATAL(assigned.getNumOptions(),2);
+	CU_ASSERT_FATAL(pdu.getPDUPointer()==NULL);
+}
+
+void testBufferReuse() {
+	uint8_t buffer[64];
+	memset(buffer,0xAA,sizeof(buffer));
+	CoapPDU pdu(buffer,sizeof(buffer),0);
+
+	// resetHeader leaves everything after the header alone
+	pdu.setToken((uint8_t*)"\1\2",2);
+	CU_ASSERT_EQUAL_FATAL(pdu.resetHeader(),0);
+	CU_ASSERT_EQUAL_FATAL(pdu.getPDULength(),4);
+	CU_ASSERT_EQUAL_FATAL(pdu.getTokenLength(),0);
+	CU_ASSERT_EQUAL_FATAL(buffer[4],1);
+	CU_ASSERT_EQUAL_FATAL(buffer[10],0xAA);
+
+	// building over stale bytes gives the same PDU as a zeroed buffer
+	uint8_t zeroed[64];
+	memset(zeroed,0x00,sizeof(zeroed));
+	CoapPDU expected(zeroed,sizeof(zeroed),0);
+	CoapPDU *pdus[2] = { &pdu, &expected };
+	for(int i=0; i<2; i++) {
+		pdus[i]->setVersion(1);
+		pdus[i]->setType(CoapPDU::COAP_CONFIRMABLE);
+		pdus[i]->setCode(CoapPDU::COAP_GET);
+		pdus[i]->setToken((uint8_t*)"\3\4\5",3);
+		pdus[i]->setURI((char*)"/a/b?c=1",8);
+		pdus[i]->addOption(CoapPDU::COAP_OPTION_SIZE1,2,(uint8_t*)"\1\2");
+		pdus[i]->setPayload((uint8_t*)"xyz",3);
+	}
+	CU_ASSERT_EQUAL_FATAL(pdu.getPDULength(),expected.getPDULength());
+	CU_ASSERT_FATAL(memcmp(buffer,zeroed,pdu.getPDULength())==0);
+
+	// receiving a smaller PDU into the same object needs no reset
+	uint8_t small[] = { 0x41, 0x01, 0x00, 0x07, 0x09, 0xB1, 'x' };
+	memcpy(buffer,small,sizeof(small));
+	pdu.setPDULength(sizeof(small));
+	CU_ASSERT_FATAL(pdu.validate()==1);
+	CU_ASSERT_EQUAL_FATAL(pdu.getNumOptions(),1);
+	CU_ASSERT_FATAL(pdu.getPayloadPointer()==NULL);
+	CU_ASSERT_EQUAL_FATAL(pdu.getPayloadLength(),0);
+
+	// options added after validating are still ordered correctly
+	CU_ASSERT_EQUAL_FATAL(pdu.addOption(CoapPDU::COAP_OPTION_IF_MATCH,1,(uint8_t*)"m"),0);
+	CU_ASSERT_EQUAL_FATAL(pdu.addOption(CoapPDU::COAP_OPTION_URI_QUERY,1,(uint8_t*)"q"),0);
+	CU_ASSERT_FATAL(pdu.validate()==1);
+	CU_ASSERT_EQUAL_FATAL(pdu.getNumOptions(),3);
+	CoapPDU::CoapOption *options = pdu.getOptions();
+	CU_ASSERT_EQUAL_FATAL(options[0].optionNumber,CoapPDU::COAP_OPTION_IF_MATCH);
+	CU_ASSERT_EQUAL_FATAL(options[1].optionNumber,CoapPDU::COAP_OPTION_URI_PATH);
+	CU_ASSERT_EQUAL_FATAL(options[2].optionNumber,CoapPDU::COAP_OPTION_URI_QUERY);
+	CU_ASSERT_EQUAL_FATAL(options[1].optionValuePointer[0],'x');
+	free(options);
+}
+
+// concatenates a scatter-gather list
+static int flattenIOVec(struct iovec *iov, int iovcnt, uint8_t *out) {
+	int length = 0;
+	for(int i=0; i<iovcnt; i++) {
+		memcpy(&out[length],iov[i].iov_base,iov[i].iov_len);
+		length += iov[i].iov_len;
+	}
+	return length;
+}
+
+void testPayloadReference() {
+	uint8_t payload[300];
+	for(int i=0; i<300; i++) {
+		payload[i] = i;
+	}
+	struct iovec iov[2];
+	int iovcnt = 0;
+	uint8_t wire[512];
+
+	// same bytes on the wire as a copied payload
+	CoapPDU copied, referenced;
+	CoapPDU *pdus[2] = { &copied, &referenced };
+	for(int i=0; i<2; i++) {
+		pdus[i]->setType(CoapPDU::COAP_ACKNOWLEDGEMENT);
+		pdus[i]->setCode(CoapPDU::COAP_CONTENT);
+		pdus[i]->setToken((uint8_t*)"\1\2",2);
+		pdus[i]->setContentFormat(CoapPDU::COAP_CONTENT_FORMAT_APP_OCTET_STREAM);
+	}
+	CU_ASSERT_EQUAL_FATAL(copied.setPayload(payload,300),0);
+	CU_ASSERT_EQUAL_FATAL(referenced.setPayloadReference(payload,300),0);
+	CU_ASSERT_EQUAL_FATAL(referenced.hasPayloadReference(),1);
+	CU_ASSERT_FATAL(referenced.getPayloadPointer()==payload);
+	CU_ASSERT_EQUAL_FATAL(referenced.getPayloadLength(),300);
+	CU_ASSERT_FATAL(referenced.getPDULength()<10);
+
+	// options can still be added in front of it
+	copied.addOption(CoapPDU::COAP_OPTION_ETAG,1,(uint8_t*)"e");
+	referenced.addOption(CoapPDU::COAP_OPTION_ETAG,1,(uint8_t*)"e");
+
+	CU_ASSERT_EQUAL_FATAL(copied.getIOVec(iov,&iovcnt),0);
+	CU_ASSERT_EQUAL_FATAL(iovcnt,1);
+	CU_ASSERT_EQUAL_FATAL(iov[0].iov_len,copied.getPDULength());
+
+	CU_ASSERT_EQUAL_FATAL(referenced.getIOVec(iov,&iovcnt),0);
+	CU_ASSERT_EQUAL_FATAL(iovcnt,2);
+	CU_ASSERT_FATAL(iov[1].iov_base==payload);
+	int length = flattenIOVec(iov,iovcnt,wire);
+	CU_ASSERT_EQUAL_FATAL(length,copied.getPDULength());
+	CU_ASSERT_FATAL(memcmp(wire,copied.getPDUPointer(),length)==0);
+
+	CoapPDU received(wire,length);
+	CU_ASSERT_FATAL(received.validate()==1);
+	CU_ASSERT_EQUAL_FATAL(received.getPayloadLength(),300);
+
+	// switching back to a copied payload, and replacing a copied payload with a reference
+	CU_ASSERT_EQUAL_FATAL(referenced.setPayload((uint8_t*)"abc",3),0);
+	CU_ASSERT_EQUAL_FATAL(referenced.hasPayloadReference(),0);
+	CU_ASSERT_EQUAL_FATAL(referenced.getIOVec(iov,&iovcnt),0);
+	CU_ASSERT_EQUAL_FATAL(iovcnt,1);
+	CU_ASSERT_EQUAL_FATAL(copied.setPayloadReference(payload,10),0);
+	CU_ASSERT_EQUAL_FATAL(copied.getPDULength(),length-301);
+	CU_ASSERT_EQUAL_FATAL(copied.getIOVec(iov,&iovcnt),0);
+	CU_ASSERT_EQUAL_FATAL(flattenIOVec(iov,iovcnt,wire),length-290);
+
+	// a full external buffer has no room for the marker
+	uint8_t buffer[6];
+	CoapPDU fixed(buffer,sizeof(buffer),0);
+	fixed.setToken((uint8_t*)"\1\2",2);
+	CU_ASSERT_EQUAL_FATAL(fixed.setPayloadReference(payload,10),1);
+	CU_ASSERT_EQUAL_FATAL(fixed.hasPayloadReference(),0);
+
+	// reset drops the reference
+	referenced.setPayloadReference(payload,10);
+	referenced.reset();
+	CU_ASSERT_EQUAL_FATAL(referenced.hasPayloadReference(),0);
+	CU_ASSERT_EQUAL_FATAL(referenced.getPayloadLength(),0);
+}
+
+void testTemplate() {
+	CoapPDU prototype;
+	prototype.setType(CoapPDU::COAP_ACKNOWLEDGEMENT);
+	prototype.setCode(CoapPDU::COAP_CONTENT);
+	prototype.setToken((uint8_t*)"\7\7\7\7\7\7",6);
+	prototype.setContentFormat(CoapPDU::COAP_CONTENT_FORMAT_APP_JSON);
+	prototype.addOption(CoapPDU::COAP_OPTION_ETAG,4,(uint8_t*)"0000");
+	prototype.addOption(CoapPDU::COAP_OPTION_MAX_AGE,1,(uint8_t*)"\74");
+	prototype.setPayload((uint8_t*)"ignored",7);
+
+	CoapPDUTemplate json;
+	CU_ASSERT_EQUAL_FATAL(json.freeze(&prototype),0);
+	CU_ASSERT_EQUAL_FATAL(json.getNumOptions(),3);
+	CU_ASSERT_EQUAL_FATAL(json.getOptionsLength(),prototype.getPDULength()-4-6-8);
+
+	// stamped PDUs match ones built option by option, for any token length
+	const char *payloads[3] = { "{\"t\":21}", "", "{\"temperature\":21.5}" };
+	uint8_t tokenLengths[3] = { 0, 8, 3 };
+	CoapPDU stamped;
+	for(int i=0; i<3; i++) {
+		int payloadLength = strlen(payloads[i]);
+		CU_ASSERT_EQUAL_FATAL(json.stamp(&stamped,0x100+i,(uint8_t*)"\1\2\3\4\5\6\7\10",tokenLengths[i],
+			(uint8_t*)payloads[i],payloadLength),0);
+
+		CoapPDU expected;
+		expected.setType(CoapPDU::COAP_ACKNOWLEDGEMENT);
+		expected.setCode(CoapPDU::COAP_CONTENT);
+		expected.setMessageID(0x100+i);
+		expected.setToken((uint8_t*)"\1\2\3\4\5\6\7\10",tokenLengths[i]);
+		expected.setContentFormat(CoapPDU::COAP_CONTENT_FORMAT_APP_JSON);
+		expected.addOption(CoapPDU::COAP_OPTION_ETAG,4,(uint8_t*)"0000");
+		expected.addOption(CoapPDU::COAP_OPTION_MAX_AGE,1,(uint8_t*)"\74");
+		if(payloadLength>0) {
+			expected.setPayload((uint8_t*)payloads[i],payloadLength);
+		}
+
+		CU_ASSERT_EQUAL_FATAL(stamped.getPDULength(),expected.getPDULength());
+		CU_ASSERT_EQUAL_FATAL(stamped.getPDULength(),json.getPDULength(tokenLengths[i],payloadLength));
+		CU_ASSERT_FATAL(memcmp(stamped.getPDUPointer(),expected.getPDUPointer(),expected.getPDULength())==0);
+		CU_ASSERT_EQUAL_FATAL(stamped.getNumOptions(),3);
+		CU_ASSERT_EQUAL_FATAL(stamped.getPayloadLength(),payloadLength);
+		CU_ASSERT_FATAL(stamped.validate()==1);
+	}
+
+	// patching the etag in place
+	CU_ASSERT_EQUAL_FATAL(json.patchOption(&stamped,CoapPDU::COAP_OPTION_ETAG,(uint8_t*)"abcd",4),0);
+	CU_ASSERT_EQUAL_FATAL(json.patchOption(&stamped,CoapPDU::COAP_OPTION_ETAG,(uint8_t*)"abc",3),1);
+	CU_ASSERT_EQUAL_FATAL(json.patchOption(&stamped,CoapPDU::COAP_OPTION_LOCATION_PATH,(uint8_t*)"a",1),1);
+	int found = 0;
+	for(const CoapPDU::CoapOption &o : stamped.options()) {
+		if(o.optionNumber==CoapPDU::COAP_OPTION_ETAG) {
+			CU_ASSERT_FATAL(memcmp(o.optionValuePointer,"abcd",4)==0);
+			found = 1;
+		}
+	}
+	CU_ASSERT_EQUAL_FATAL(found,1);
+
+	// options added after stamping go in the right place
+	CU_ASSERT_EQUAL_FATAL(json.stamp(&stamped,7,(uint8_t*)"\1\2",2,NULL,0),0);
+	CU_ASSERT_EQUAL_FATAL(stamped.addOption(CoapPDU::COAP_OPTION_SIZE2,1,(uint8_t*)"\1"),0);
+	CU_ASSERT_EQUAL_FATAL(stamped.addOption(CoapPDU::COAP_OPTION_IF_MATCH,1,(uint8_t*)"\2"),0);
+	CU_ASSERT_FATAL(stamped.validate()==1);
+	CU_ASSERT_EQUAL_FATAL(stamped.getNumOptions(),5);
+	CoapPDU::CoapOption *options = stamped.getOptions();
+	CU_ASSERT_EQUAL_FATAL(options[0].optionNumber,CoapPDU::COAP_OPTION_IF_MATCH);
+	CU_ASSERT_EQUAL_FATAL(options[4].optionNumber,CoapPDU::COAP_OPTION_SIZE2);
+	free(options);
+
+	// an external buffer must be big enough
+	uint8_t small[16];
+	CoapPDU fixed(small,sizeof(small),0);
+	CU_ASSERT_EQUAL_FATAL(json.stamp(&fixed,1,NULL,0,NULL,0),0);
+	CU_ASSERT_EQUAL_FATAL(json.stamp(&fixed,1,(uint8_t*)"\1\2\3\4",4,NULL,0),1);
+	CU_ASSERT_EQUAL_FATAL(json.stamp(&fixed,1,NULL,9,NULL,0),1);
+
+	// a template with no options, stamped without a token, is just a header
+	CoapPDU bare;
+	bare.setType(CoapPDU::COAP_ACKNOWLEDGEMENT);
+	CoapPDUTemplate empty;
+	CU_ASSERT_EQUAL_FATAL(empty.freeze(&bare),0);
+	CU_ASSERT_EQUAL_FATAL(empty.getNumOptions(),0);
+	CU_ASSERT_EQUAL_FATAL(empty.stamp(&fixed,9,NULL,0,NULL,0),0);
+	CU_ASSERT_EQUAL_FATAL(fixed.getPDULength(),COAP_HDR_SIZE);
+	CU_ASSERT_FATAL(fixed.validate()==1);
+	CU_ASSERT_EQUAL_FATAL(fixed.getMessageID(),9);
+}
+
+void testMakeResponse() {
+	CoapPDU request;
+	request.setType(CoapPDU::COAP_CONFIRMABLE);
+	request.setCode(CoapPDU::COAP_GET);
+	request.setMessageID(0xBEEF);
+	request.setToken((uint8_t*)"\1\2\3\4\5",5);
+	request.setURI((char*)"/test",5);
+
+	// piggybacked ack, same as building it field by field
+	CoapPDU response;
+	CU_ASSERT_EQUAL_FATAL(response.makeResponse(&request,CoapPDU::COAP_CONTENT,0x1111,64),0);
+	CU_ASSERT_FATAL(response.getBufferLength()>=4+5+64);
+	CU_ASSERT_EQUAL_FATAL(response.setContentFormat(CoapPDU::COAP_CONTENT_FORMAT_TEXT_PLAIN),0);
+	CU_ASSERT_EQUAL_FATAL(response.setPayload((uint8_t*)"hello",5),0);
+	CoapPDU expected;
+	expected.setVersion(1);
+	expected.setType(CoapPDU::COAP_ACKNOWLEDGEMENT);
+	expected.setCode(CoapPDU::COAP_CONTENT);
+	expected.setMessageID(0xBEEF);
+	expected.setToken((uint8_t*)"\1\2\3\4\5",5);
+	expected.setContentFormat(CoapPDU::COAP_CONTENT_FORMAT_TEXT_PLAIN);
+	expected.setPayload((uint8_t*)"hello",5);
+	CU_ASSERT_EQUAL_FATAL(response.getPDULength(),expected.getPDULength());
+	CU_ASSERT_FATAL(memcmp(response.getPDUPointer(),expected.getPDUPointer(),expected.getPDULength())==0);
+
+	// reusing the response for a NON request with a different token length
+	request.setType(CoapPDU::COAP_NON_CONFIRMABLE);
+	request.setToken((uint8_t*)"\7",1);
+	CU_ASSERT_EQUAL_FATAL(response.makeResponse(&request,CoapPDU::COAP_CHANGED,0x1111,0),0);
+	CU_ASSERT_EQUAL_FATAL(response.getPDULength(),5);
+	CU_ASSERT_EQUAL_FATAL(response.getType(),CoapPDU::COAP_NON_CONFIRMABLE);
+	CU_ASSERT_EQUAL_FATAL(response.getCode(),CoapPDU::COAP_CHANGED);
+	CU_ASSERT_EQUAL_FATAL(response.getMessageID(),0x1111);
+	CU_ASSERT_EQUAL_FATAL(response.getVersion(),1);
+	CU_ASSERT_EQUAL_FATAL(response.getNumOptions(),0);
+	CU_ASSERT_EQUAL_FATAL(response.getPayloadLength(),0);
+	CU_ASSERT_EQUAL_FATAL(response.getTokenPointer()[0],7);
+	CU_ASSERT_FATAL(response.validate()==1);
+
+	// separate responses keep the reliability of the request
+	request.setType(CoapPDU::COAP_CONFIRMABLE);
+	CU_ASSERT_EQUAL_FATAL(response.makeSeparateResponse(&request,CoapPDU::COAP_CONTENT,0x2222,0),0);
+	CU_ASSERT_EQUAL_FATAL(response.getType(),CoapPDU::COAP_CONFIRMABLE);
+	CU_ASSERT_EQUAL_FATAL(response.getMessageID(),0x2222);
+	request.setType(CoapPDU::COAP_NON_CONFIRMABLE);
+	CU_ASSERT_EQUAL_FATAL(response.makeSeparateResponse(&request,CoapPDU::COAP_CONTENT,0x2223,0),0);
+	CU_ASSERT_EQUAL_FATAL(response.getType(),CoapPDU::COAP_NON_CONFIRMABLE);
+
+	// nothing to respond to
+	request.setType(CoapPDU::COAP_ACKNOWLEDGEMENT);
+	CU_ASSERT_EQUAL_FATAL(response.makeResponse(&request,CoapPDU::COAP_CONTENT,0,0),1);
+	CU_ASSERT_EQUAL_FATAL(response.makeSeparateResponse(&request,CoapPDU::COAP_CONTENT,0,0),1);
+	request.setType(CoapPDU::COAP_CONFIRMABLE);
+	CU_ASSERT_EQUAL_FATAL(request.makeResponse(&request,CoapPDU::COAP_CONTENT,0,0),1);
+
+	// into a caller buffer, which must be big enough for the reservation
+	uint8_t buffer[16];
+	CoapPDU fixed(buffer,sizeof(buffer),0);
+	CU_ASSERT_EQUAL_FATAL(fixed.makeResponse(&request,CoapPDU::COAP_CONTENT,0,8),0);
+	CU_ASSERT_EQUAL_FATAL(fixed.getPDULength(),5);
+	CU_ASSERT_EQUAL_FATAL(fixed.makeResponse(&request,CoapPDU::COAP_CONTENT,0,12),1);
+}
+
+void testOptionBitmap() {
+	CoapPDU built;
+	built.setType(CoapPDU::COAP_CONFIRMABLE);
+	built.setCode(CoapPDU::COAP_GET);
+	built.setURI((char*)"/a/b/c",6);
+	built.addOption(CoapPDU::COAP_OPTION_OBSERVE,0,NULL);
+	built.addOption(CoapPDU::COAP_OPTION_BLOCK2,1,(uint8_t*)"\x06");
+	built.addOption(258,1,(uint8_t*)"\x02");
+	built.addOption(CoapPDU::COAP_OPTION_IF_MATCH,1,(uint8_t*)"m");
+
+	uint64_t expected = CoapPDU::getOptionBit(CoapPDU::COAP_OPTION_IF_MATCH)|CoapPDU::getOptionBit(CoapPDU::COAP_OPTION_OBSERVE)|
+		CoapPDU::getOptionBit(CoapPDU::COAP_OPTION_URI_PATH)|CoapPDU::getOptionBit(CoapPDU::COAP_OPTION_BLOCK2)|(1ULL<<63);
+	CU_ASSERT_FATAL(built.getOptionBitmap()==expected);
+
+	// recorded by validate, and computed on demand for an unvalidated buffer
+	uint8_t buffer[64];
+	memcpy(buffer,built.getPDUPointer(),built.getPDULength());
+	CoapPDU lazy(buffer,built.getPDULength());
+	CU_ASSERT_FATAL(lazy.getOptionBitmap()==expected);
+	CoapPDU received(buffer,sizeof(buffer),built.getPDULength());
+	CU_ASSERT_FATAL(received.validate()==1);
+	CU_ASSERT_FATAL(received.getOptionBitmap()==expected);
+
+	CU_ASSERT_EQUAL_FATAL(received.hasOption(CoapPDU::COAP_OPTION_OBSERVE),1);
+	CU_ASSERT_EQUAL_FATAL(received.hasOption(CoapPDU::COAP_OPTION_BLOCK1),0);
+	CU_ASSERT_EQUAL_FATAL(received.hasOption(CoapPDU::COAP_OPTION_ACCEPT),0);
+	CU_ASSERT_EQUAL_FATAL(received.hasOption(258),1);
+	CU_ASSERT_EQUAL_FATAL(received.hasOption(259),0);
+	CU_ASSERT_EQUAL_FATAL(received.hasOption(63),0);
+
+	CoapPDU::CoapOption option;
+	CU_ASSERT_EQUAL_FATAL(received.findOption(CoapPDU::COAP_OPTION_BLOCK2,&option),1);
+	CU_ASSERT_EQUAL_FATAL(option.optionNumber,CoapPDU::COAP_OPTION_BLOCK2);
+	CU_ASSERT_EQUAL_FATAL(option.optionValueLength,1);
+	CU_ASSERT_EQUAL_FATAL(option.optionValuePointer[0],6);
+	CU_ASSERT_EQUAL_FATAL(received.findOption(CoapPDU::COAP_OPTION_SIZE2,&option),0);
+	CU_ASSERT_EQUAL_FATAL(received.findOption(258,&option),1);
+	CU_ASSERT_EQUAL_FATAL(option.optionValuePointer[0],2);
+
+	CoapPDU::CoapOption segments[4];
+	CU_ASSERT_EQUAL_FATAL(received.findOptions(CoapPDU::COAP_OPTION_URI_PATH,segments,4),3);
+	CU_ASSERT_EQUAL_FATAL(segments[0].optionValuePointer[0],'a');
+	CU_ASSERT_EQUAL_FATAL(segments[2].optionValuePointer[0],'c');
+	CU_ASSERT_EQUAL_FATAL(received.findOptions(CoapPDU::COAP_OPTION_URI_PATH,segments,2),2);
+	CU_ASSERT_EQUAL_FATAL(received.findOptions(CoapPDU::COAP_OPTION_URI_PATH,NULL,0),3);
+
+	// kept up to date as options are added, and cleared by reset
+	CU_ASSERT_EQUAL_FATAL(received.addOption(CoapPDU::COAP_OPTION_ACCEPT,1,(uint8_t*)"\x32"),0);
+	CU_ASSERT_EQUAL_FATAL(received.hasOption(CoapPDU::COAP_OPTION_ACCEPT),1);
+	CU_ASSERT_FATAL(received.getOptionBitmap()==(expected|CoapPDU::getOptionBit(CoapPDU::COAP_OPTION_ACCEPT)));
+	received.resetHeader();
+	CU_ASSERT_FATAL(received.getOptionBitmap()==0);
+
+	// and set by the builder and templates
+	CoapPDUBuilder builder;
+	builder.addOption(CoapPDU::COAP_OPTION_BLOCK1,1,(uint8_t*)"\x01");
+	builder.addOption(CoapPDU::COAP_OPTION_CONTENT_FORMAT,0,NULL);
+	CoapPDU fromBuilder;
+	CU_ASSERT_EQUAL_FATAL(builder.build(&fromBuilder),0);
+	CU_ASSERT_FATAL(fromBuilder.getOptionBitmap()==(CoapPDU::getOptionBit(CoapPDU::COAP_OPTION_BLOCK1)|
+		CoapPDU::getOptionBit(CoapPDU::COAP_OPTION_CONTENT_FORMAT)));
+	CoapPDUTemplate responseTemplate;
+	CU_ASSERT_EQUAL_FATAL(responseTemplate.freeze(&built),0);
+	CU_ASSERT_EQUAL_FATAL(responseTemplate.stamp(&fromBuilder,1,NULL,0,NULL,0),0);
+	CU_ASSERT_FATAL(fromBuilder.getOptionBitmap()==expected);
+}
+
+static int routeA(CoapPDU *request, CoapRouteMatch *match, void *arg) {
+	*(int*)arg = 1;
+	return 0;
+}
+
+static int routeB(CoapPDU *request, CoapRouteMatch *match, void *arg) {
+	*(int*)arg = 2;
+	return 0;
+}
+
+// routes a request for uri, returning the result. The request stays valid until the next call, as the match points into it
+static CoapRouter::RouteResult routeURI(CoapRouter *router, const char *uri, CoapPDU::Code code, CoapRouteMatch *match) {
+	static CoapPDU request;
+	request.reset();
+	request.setVersion(1);
+	request.setType(CoapPDU::COAP_CONFIRMABLE);
+	request.setCode(code);
+	request.addOption(CoapPDU::COAP_OPTION_URI_HOST,4,(uint8_t*)"host");
+	if(uri[0]!=0x00) {
+		request.setURI((char*)uri,strlen(uri));
+	}
+	request.addOption(CoapPDU::COAP_OPTION_ACCEPT,1,(uint8_t*)"\x32");
+	return router->route(&request,match);
+}
+
+void testRouter() {
+	CoapRouter router;
+	int context = 42;
+	CU_ASSERT_EQUAL_FATAL(router.addRoute("/",CoapPDU::COAP_GET,routeA,NULL),0);
+	CU_ASSERT_EQUAL_FATAL(router.addRoute("/sensors/temp",CoapPDU::COAP_GET,routeA,&context),0);
+	CU_ASSERT_EQUAL_FATAL(router.addRoute("/sensors/temp",CoapPDU::COAP_PUT,routeB,NULL),0);
+	CU_ASSERT_EQUAL_FATAL(router.addRoute("sensors/*",CoapPDU::COAP_GET,routeB,NULL),0);
+	CU_ASSERT_EQUAL_FATAL(router.addRoute("/sensors/*/history",CoapPDU::COAP_GET,routeA,NULL),0);
+	CU_ASSERT_EQUAL_FATAL(router.addRoute("/x/lit/end",CoapPDU::COAP_GET,routeA,NULL),0);
+	CU_ASSERT_EQUAL_FATAL(router.addRoute("/x/*/other",CoapPDU::COAP_GET,routeB,NULL),0);
+	CU_ASSERT_EQUAL_FATAL(router.addRoute("/fw/**",CoapPDU::COAP_GET,routeB,NULL),0);
+	CU_ASSERT_EQUAL_FATAL(router.addRoute("/fw/**/more",CoapPDU::COAP_GET,routeB,NULL),1);
+	CU_ASSERT_EQUAL_FATAL(router.addRoute("/bad",CoapPDU::COAP_EMPTY,routeB,NULL),1);
+	// thousands of siblings, enough to grow the child table many times
+	char path[32];
+	for(int i=0; i<2000; i++) {
+		sprintf(path,"/dev/%d/state",i*7919%10007);
+		CU_ASSERT_EQUAL_FATAL(router.addRoute(path,CoapPDU::COAP_POST,routeA,(void*)(intptr_t)i),0);
+	}
+
+	CoapRouteMatch match;
+	CU_ASSERT_EQUAL_FATAL(routeURI(&router,"",CoapPDU::COAP_GET,&match),CoapRouter::COAP_ROUTE_FOUND);
+	CU_ASSERT_EQUAL_FATAL(match.numSegments,0);
+
+	CU_ASSERT_EQUAL_FATAL(routeURI(&router,"/sensors/temp",CoapPDU::COAP_GET,&match),CoapRouter::COAP_ROUTE_FOUND);
+	CU_ASSERT_FATAL(match.handler==routeA);
+	CU_ASSERT_FATAL(match.context==&context);
+	CU_ASSERT_EQUAL_FATAL(match.numSegments,2);
+	CU_ASSERT_EQUAL_FATAL(match.numWildcards,0);
+	CU_ASSERT_EQUAL_FATAL(routeURI(&router,"/sensors/temp",CoapPDU::COAP_PUT,&match),CoapRouter::COAP_ROUTE_FOUND);
+	CU_ASSERT_FATAL(match.handler==routeB);
+	CU_ASSERT_EQUAL_FATAL(routeURI(&router,"/sensors/temp",CoapPDU::COAP_DELETE,&match),CoapRouter::COAP_ROUTE_METHOD_NOT_ALLOWED);
+
+	// wildcards
+	CU_ASSERT_EQUAL_FATAL(routeURI(&router,"/sensors/humidity",CoapPDU::COAP_GET,&match),CoapRouter::COAP_ROUTE_FOUND);
+	CU_ASSERT_FATAL(match.handler==routeB);
+	CU_ASSERT_EQUAL_FATAL(match.numWildcards,1);
+	CU_ASSERT_EQUAL_FATAL(match.segmentLength[match.wildcard[0]],8);
+	CU_ASSERT_FATAL(memcmp(match.segment[match.wildcard[0]],"humidity",8)==0);
+	CU_ASSERT_EQUAL_FATAL(routeURI(&router,"/sensors/temp/history",CoapPDU::COAP_GET,&match),CoapRouter::COAP_ROUTE_FOUND);
+	CU_ASSERT_EQUAL_FATAL(match.numWildcards,1);
+	CU_ASSERT_EQUAL_FATAL(match.wildcard[0],1);
+	CU_ASSERT_EQUAL_FATAL(routeURI(&router,"/x/lit/other",CoapPDU::COAP_GET,&match),CoapRouter::COAP_ROUTE_FOUND);
+	CU_ASSERT_FATAL(match.handler==routeB);
+	CU_ASSERT_EQUAL_FATAL(routeURI(&router,"/x/lit/end",CoapPDU::COAP_GET,&match),CoapRouter::COAP_ROUTE_FOUND);
+	CU_ASSERT_FATAL(match.handler==routeA);
+	CU_ASSERT_EQUAL_FATAL(match.numWildcards,0);
+	CU_ASSERT_EQUAL_FATAL(routeURI(&router,"/fw/a/b/c",CoapPDU::COAP_GET,&match),CoapRouter::COAP_ROUTE_FOUND);
+	CU_ASSERT_EQUAL_FATAL(match.rest,1);
+	CU_ASSERT_EQUAL_FATAL(routeURI(&router,"/fw",CoapPDU::COAP_GET,&match),CoapRouter::COAP_ROUTE_FOUND);
+	CU_ASSERT_EQUAL_FATAL(match.rest,1);
+
+	// intermediate segments and unknown paths
+	CU_ASSERT_EQUAL_FATAL(routeURI(&router,"/sensors",CoapPDU::COAP_GET,&match),CoapRouter::COAP_ROUTE_NOT_FOUND);
+	CU_ASSERT_EQUAL_FATAL(routeURI(&router,"/x/lit",CoapPDU::COAP_GET,&match),CoapRouter::COAP_ROUTE_NOT_FOUND);
+	CU_ASSERT_EQUAL_FATAL(routeURI(&router,"/nothing/here",CoapPDU::COAP_GET,&match),CoapRouter::COAP_ROUTE_NOT_FOUND);
+
+	for(int i=0; i<2000; i+=97) {
+		sprintf(path,"/dev/%d/state",i*7919%10007);
+		CU_ASSERT_EQUAL_FATAL(routeURI(&router,path,CoapPDU::COAP_POST,&match),CoapRouter::COAP_ROUTE_FOUND);
+		CU_ASSERT_FATAL(match.context==(void*)(intptr_t)i);
+	}
+	CU_ASSERT_EQUAL_FATAL(routeURI(&router,"/dev/10008/state",CoapPDU::COAP_POST,&match),CoapRouter::COAP_ROUTE_NOT_FOUND);
+
+	// segments longer than 6 bytes with the same length and prefix share a hash key
+	CU_ASSERT_EQUAL_FATAL(router.addRoute("/long/abcdef-one",CoapPDU::COAP_GET,routeA,NULL),0);
+	CU_ASSERT_EQUAL_FATAL(router.addRoute("/long/abcdef-two",CoapPDU::COAP_GET,routeB,NULL),0);
+	CU_ASSERT_EQUAL_FATAL(routeURI(&router,"/long/abcdef-two",CoapPDU::COAP_GET,&match),CoapRouter::COAP_ROUTE_FOUND);
+	CU_ASSERT_FATAL(match.handler==routeB);
+	CU_ASSERT_EQUAL_FATAL(routeURI(&router,"/long/abcdef-one",CoapPDU::COAP_GET,&match),CoapRouter::COAP_ROUTE_FOUND);
+	CU_ASSERT_FATAL(match.handler==routeA);
+	CU_ASSERT_EQUAL_FATAL(routeURI(&router,"/long/abcdef-six",CoapPDU::COAP_GET,&match),CoapRouter::COAP_ROUTE_NOT_FOUND);
+
+	// validated requests are routed from the option index, with the same results
+	CoapPDU validated;
+	validated.setVersion(1);
+	validated.setType(CoapPDU::COAP_CONFIRMABLE);
+	validated.setCode(CoapPDU::COAP_GET);
+	validated.setURI((char*)"/long/abcdef-two",16);
+	validated.addOption(CoapPDU::COAP_OPTION_ACCEPT,1,(uint8_t*)"\x32");
+	CU_ASSERT_EQUAL_FATAL(validated.validate(),1);
+	CU_ASSERT_EQUAL_FATAL(router.route(&validated,&match),CoapRouter::COAP_ROUTE_FOUND);
+	CU_ASSERT_FATAL(match.handler==routeB);
+	CU_ASSERT_EQUAL_FATAL(match.numSegments,2);
+	CU_ASSERT_FATAL(memcmp(match.segment[1],"abcdef-two",10)==0);
+	validated.reset();
+	validated.setVersion(1);
+	validated.setType(CoapPDU::COAP_CONFIRMABLE);
+	validated.setCode(CoapPDU::COAP_GET);
+	validated.setURI((char*)"/sensors/pressure",17);
+	CU_ASSERT_EQUAL_FATAL(validated.validate(),1);
+	CU_ASSERT_EQUAL_FATAL(router.route(&validated,&match),CoapRouter::COAP_ROUTE_FOUND);
+	CU_ASSERT_FATAL(match.handler==routeB);
+	CU_ASSERT_EQUAL_FATAL(match.numWildcards,1);
+
+	// a literal route with no handlers left falls back to the wildcards
+	CU_ASSERT_EQUAL_FATAL(router.addRoute("/x/lit/other",CoapPDU::COAP_GET,routeA,NULL),0);
+	CU_ASSERT_EQUAL_FATAL(routeURI(&router,"/x/lit/other",CoapPDU::COAP_GET,&match),CoapRouter::COAP_ROUTE_FOUND);
+	CU_ASSERT_FATAL(match.handler==routeA);
+	CU_ASSERT_EQUAL_FATAL(router.addRoute("/x/lit/other",CoapPDU::COAP_GET,NULL,NULL),0);
+	CU_ASSERT_EQUAL_FATAL(routeURI(&router,"/x/lit/other",CoapPDU::COAP_GET,&match),CoapRouter::COAP_ROUTE_FOUND);
+	CU_ASSERT_FATAL(match.handler==routeB);
+
+	// dispatch calls the handler
+	CoapPDU request;
+	request.setCode(CoapPDU::COAP_PUT);
+	request.setURI((char*)"/sensors/temp",13);
+	int called = 0;
+	CoapRouter::RouteResult result;
+	CU_ASSERT_EQUAL_FATAL(router.dispatch(&request,&called,&result),0);
+	CU_ASSERT_EQUAL_FATAL(result,CoapRouter::COAP_ROUTE_FOUND);
+	CU_ASSERT_EQUAL_FATAL(called,2);
+}
+
+// the handler is the route's index, the device routes are enough to put more than one route in some buckets
+#define TEST_DEVICE_ROUTES(d) \
+	{"/dev/" #d "/a",4+d*4}, {"/dev/" #d "/b",5+d*4}, {"/dev/" #d "/temperature-1",6+d*4}, {"/dev/" #d "/temperature-2",7+d*4}
+
+static constexpr CoapStaticRoute<int> gTestStaticRoutes[] = {
+	{"/",0},
+	{"/sensors/temp",1},
+	{"sensors/humidity",2},
+	{"/sensors",3},
+	TEST_DEVICE_ROUTES(0), TEST_DEVICE_ROUTES(1), TEST_DEVICE_ROUTES(2), TEST_DEVICE_ROUTES(3),
+	TEST_DEVICE_ROUTES(4), TEST_DEVICE_ROUTES(5), TEST_DEVICE_ROUTES(6), TEST_DEVICE_ROUTES(7)
+};
+static constexpr auto gTestStaticRouteTable = coapMakeStaticRouteTable(gTestStaticRoutes);
+static_assert(gTestStaticRouteTable.routes[2].hash==coapStaticRouteHash("/sensors/humidity"), "leading '/' is optional");
+
+// looks up uri in gTestStaticRouteTable, returning the handler or -1
+static int findStaticRoute(const char *uri) {
+	CoapPDU request;
+	request.setVersion(1);
+	request.setType(CoapPDU::COAP_CONFIRMABLE);
+	request.setCode(CoapPDU::COAP_GET);
+	request.addOption(CoapPDU::COAP_OPTION_URI_HOST,4,(uint8_t*)"host");
+	if(uri[0]!=0x00) {
+		request.setURI((char*)uri,strlen(uri));
+	}
+	request.addOption(CoapPDU::COAP_OPTION_ACCEPT,1,(uint8_t*)"\x32");
+	const CoapStaticRoute<int> *route = gTestStaticRouteTable.find(&request);
+	return route ? route->handler : -1;
+}
+
+void testStaticRoutes() {
+	const int numRoutes = sizeof(gTestStaticRoutes)/sizeof(gTestStaticRoutes[0]);
+	int chained = 0;
+	// route 0 is "/", which is a request with no Uri-Path, but setURI("/") sends a Uri-Path of "/"
+	for(int i=1; i<numRoutes; i++) {
+		CU_ASSERT_EQUAL_FATAL(findStaticRoute(gTestStaticRoutes[i].uri),i);
+		chained += gTestStaticRouteTable.next[i]>=0;
+	}
+	CU_ASSERT_FATAL(chained>0);
+
+	CU_ASSERT_EQUAL_FATAL(findStaticRoute(""),0);
+	CU_ASSERT_EQUAL_FATAL(findStaticRoute("/sensors/humidity"),2);
+	CU_ASSERT_EQUAL_FATAL(findStaticRoute("sensors/temp"),1);
+	CU_ASSERT_EQUAL_FATAL(findStaticRoute("/sensors/temp/history"),-1);
+	CU_ASSERT_EQUAL_FATAL(findStaticRoute("/sensors/tem"),-1);
+	CU_ASSERT_EQUAL_FATAL(findStaticRoute("/sensorstemp"),-1);
+	CU_ASSERT_EQUAL_FATAL(findStaticRoute("/dev/3/temperature-3"),-1);
+	CU_ASSERT_EQUAL_FATAL(findStaticRoute("/dev/8/a"),-1);
+
+	// a segment containing '/' hashes like two segments, it must not match them
+	const uint8_t *segments[1] = {(const uint8_t*)"sensors/temp"};
+	uint16_t segmentLengths[1] = {12};
+	uint32_t hash = coapStaticRouteHash("/sensors/temp");
+	CU_ASSERT_FATAL(gTestStaticRouteTable.find(segments,segmentLengths,1,hash)==NULL);
+}
+
+// produces bytes 0, 1, 2 ... up to the length in arg, without saying how long the body is
+static int generateBlock(uint32_t offset, uint8_t *dst, int length, int *more, void *arg) {
+	int total = *(int*)arg;
+	int n = total-(int)offset<length ? total-(int)offset : length;
+	for(int i=0; i<n; i++) {
+		dst[i] = offset+i;
+	}
+	// a body ending exactly on a block boundary still says so
+	*more = (int)offset+n<total;
+	return n;
+}
+
+// fetches the whole of source with Block2 requests asking for 16<<szx byte blocks, returns the number of requests
+static int fetchBlock2(CoapBlockSource *source, int maxSZX, int szx, std::vector<uint8_t> *body) {
+	CoapBlockAssembler assembler(CoapPDU::COAP_OPTION_BLOCK2,4,4096,1000);
+	CoapBlockOption block = {0,0,(uint8_t)szx};
+	for(int requests=1; requests<100; requests++) {
+		CoapPDU request;
+		request.setVersion(1);
+		request.setType(CoapPDU::COAP_CONFIRMABLE);
+		request.setCode(CoapPDU::COAP_GET);
+		request.setMessageID(requests);
+		request.setToken((uint8_t*)"\1\2",2);
+		CU_ASSERT_EQUAL_FATAL(block.add(&request,CoapPDU::COAP_OPTION_BLOCK2),0);
+
+		CoapBlockOption served;
+		CU_ASSERT_EQUAL_FATAL(coapGetBlock2(&request,source,maxSZX,&served),0);
+		CoapPDU response;
+		CU_ASSERT_EQUAL_FATAL(response.makeResponse(&request,CoapPDU::COAP_CONTENT,0,64),0);
+		CU_ASSERT_EQUAL_FATAL(response.setContentFormat(CoapPDU::COAP_CONTENT_FORMAT_APP_OCTET_STREAM),0);
+		CU_ASSERT_EQUAL_FATAL(coapWriteBlock(&response,CoapPDU::COAP_OPTION_BLOCK2,source,&served,served.num==0),0);
+
+		// what goes over the wire decodes to the same thing
+		CoapPDU received(response.getPDUPointer(),response.getPDULength());
+		CU_ASSERT_EQUAL_FATAL(received.validate(),1);
+		CU_ASSERT_EQUAL_FATAL(received.hasOption(CoapPDU::COAP_OPTION_CONTENT_FORMAT),1);
+		CU_ASSERT_EQUAL_FATAL(received.hasOption(CoapPDU::COAP_OPTION_SIZE2),served.num==0&&source->getLength()>=0);
+		CoapBlockOption got;
+		CU_ASSERT_EQUAL_FATAL(got.find(&received,CoapPDU::COAP_OPTION_BLOCK2),1);
+		CU_ASSERT_EQUAL_FATAL(got.num,served.num);
+		CU_ASSERT_EQUAL_FATAL(got.szx,served.szx);
+		CU_ASSERT_EQUAL_FATAL(got.more,served.more);
+
+		const uint8_t *data;
+		int dataLength;
+		CoapBlockAssembler::Result result = assembler.receive(1,&received,0,&data,&dataLength);
+		if(result==CoapBlockAssembler::COAP_BLOCK_COMPLETE) {
+			body->assign(data,data+dataLength);
+			return requests;
+		}
+		CU_ASSERT_EQUAL_FATAL(result,CoapBlockAssembler::COAP_BLOCK_CONTINUE);
+		block = got;
+		block.next(szx);
+	}
+	CU_FAIL_FATAL("transfer did not finish");
+	return 0;
+}
+
+// sends body to assembler with Block1, checking each response, returns the final result
+static CoapBlockAssembler::Result sendBlock1(CoapBlockAssembler *assembler, uint64_t key, const uint8_t *body, int length,
+	int szx, uint32_t now, std::vector<uint8_t> *received) {
+	CoapMemoryBlockSource source(body,length);
+	CoapBlockOption block = {0,0,(uint8_t)szx};
+	while(1) {
+		CoapPDU request;
+		request.setVersion(1);
+		request.setType(CoapPDU::COAP_CONFIRMABLE);
+		request.setCode(CoapPDU::COAP_PUT);
+		request.setMessageID(block.num);
+		request.setURI((char*)"/firmware");
+		CU_ASSERT_EQUAL_FATAL(coapWriteBlock(&request,CoapPDU::COAP_OPTION_BLOCK1,&source,&block,block.num==0),0);
+
+		const uint8_t *data;
+		int dataLength;
+		CoapBlockAssembler::Result result = assembler->receive(key,&request,now,&data,&dataLength);
+		CoapPDU response;
+		CU_ASSERT_EQUAL_FATAL(assembler->respond(result,&request,&response,CoapPDU::COAP_CHANGED,0),0);
+		CoapBlockOption echo;
+		switch(result) {
+			case CoapBlockAssembler::COAP_BLOCK_CONTINUE:
+				CU_ASSERT_EQUAL_FATAL(response.getCode(),CoapPDU::COAP_CONTINUE);
+				CU_ASSERT_EQUAL_FATAL(echo.find(&response,CoapPDU::COAP_OPTION_BLOCK1),1);
+				CU_ASSERT_EQUAL_FATAL(echo.num,block.num);
+				CU_ASSERT_EQUAL_FATAL(echo.more,1);
+				block.next(szx);
+			break;
+			case CoapBlockAssembler::COAP_BLOCK_COMPLETE:
+				CU_ASSERT_EQUAL_FATAL(response.getCode(),CoapPDU::COAP_CHANGED);
+				CU_ASSERT_EQUAL_FATAL(echo.find(&response,CoapPDU::COAP_OPTION_BLOCK1),1);
+				CU_ASSERT_EQUAL_FATAL(echo.more,0);
+				received->assign(data,data+dataLength);
+				return result;
+			default:
+				return result;
+		}
+	}
+}
+
+void testBlockTransfer() {
+	// option values
+	uint8_t value[3];
+	CoapBlockOption block = {5,1,6};
+	CU_ASSERT_EQUAL_FATAL(block.encode(value),1);
+	CU_ASSERT_EQUAL_FATAL(value[0],0x5E);
+	block.num = 0xFFFFF;
+	CU_ASSERT_EQUAL_FATAL(block.encode(value),3);
+	CoapBlockOption decoded;
+	CU_ASSERT_EQUAL_FATAL(decoded.decode(value,3),0);
+	CU_ASSERT_EQUAL_FATAL(decoded.num,0xFFFFF);
+	CU_ASSERT_EQUAL_FATAL(decoded.more,1);
+	CU_ASSERT_EQUAL_FATAL(decoded.szx,6);
+	CU_ASSERT_EQUAL_FATAL(decoded.getSize(),1024);
+	CU_ASSERT_EQUAL_FATAL(decoded.decode(NULL,0),0);
+	CU_ASSERT_EQUAL_FATAL(decoded.num,0);
+	CU_ASSERT_EQUAL_FATAL(decoded.getSize(),16);
+	value[0] = 0x07;
+	CU_ASSERT_EQUAL_FATAL(decoded.decode(value,1),1);
+	// moving to smaller blocks keeps the offset
+	block.num = 2;
+	block.szx = 6;
+	block.next(4);
+	CU_ASSERT_EQUAL_FATAL(block.szx,4);
+	CU_ASSERT_EQUAL_FATAL(block.getOffset(),3072);
+	CU_ASSERT_EQUAL_FATAL(block.num,12);
+
+	// Block2 from memory, including a client asking for bigger blocks than the server sends
+	std::vector<uint8_t> data(2500);
+	for(size_t i=0; i<data.size(); i++) {
+		data[i] = i*7;
+	}
+	CoapMemoryBlockSource memory(&data[0],data.size());
+	std::vector<uint8_t> body;
+	CU_ASSERT_EQUAL_FATAL(fetchBlock2(&memory,6,6,&body),3);
+	CU_ASSERT_FATAL(body==data);
+	CU_ASSERT_EQUAL_FATAL(fetchBlock2(&memory,5,6,&body),5);
+	CU_ASSERT_FATAL(body==data);
+	CU_ASSERT_EQUAL_FATAL(fetchBlock2(&memory,6,2,&body),40);
+	CU_ASSERT_FATAL(body==data);
+
+	// an empty body is one empty block
+	CoapMemoryBlockSource empty(NULL,0);
+	CU_ASSERT_EQUAL_FATAL(fetchBlock2(&empty,6,6,&body),1);
+	CU_ASSERT_EQUAL_FATAL(body.size(),0);
+
+	// a generator which doesn't know its length, ending part way through a block and on a block boundary
+	int generatedLength = 100;
+	CoapGeneratorBlockSource generator(generateBlock,&generatedLength,-1);
+	CU_ASSERT_EQUAL_FATAL(fetchBlock2(&generator,2,2,&body),2);
+	CU_ASSERT_EQUAL_FATAL(body.size(),100);
+	CU_ASSERT_EQUAL_FATAL(body[99],99);
+	generatedLength = 128;
+	CU_ASSERT_EQUAL_FATAL(fetchBlock2(&generator,2,2,&body),2);
+	CU_ASSERT_EQUAL_FATAL(body.size(),128);
+
+	// a block past the end
+	CoapPDU request;
+	request.setVersion(1);
+	request.setCode(CoapPDU::COAP_GET);
+	CoapBlockOption past = {3,0,6};
+	past.add(&request,CoapPDU::COAP_OPTION_BLOCK2);
+	CoapBlockOption served;
+	CU_ASSERT_EQUAL_FATAL(coapGetBlock2(&request,&memory,6,&served),1);
+
+	// a mapped file
+	char path[] = "/tmp/cantcoapXXXXXX";
+	int fd = mkstemp(path);
+	CU_ASSERT_FATAL(fd>=0);
+	CU_ASSERT_EQUAL_FATAL(write(fd,&data[0],data.size()),(ssize_t)data.size());
+	close(fd);
+	CoapFileBlockSource file;
+	CU_ASSERT_EQUAL_FATAL(file.open("/nonexistent/cantcoap"),1);
+	CU_ASSERT_EQUAL_FATAL(file.open(path),0);
+	unlink(path);
+	CU_ASSERT_EQUAL_FATAL(file.getLength(),2500);
+	CU_ASSERT_EQUAL_FATAL(fetchBlock2(&file,6,6,&body),3);
+	CU_ASSERT_FATAL(body==data);
+	file.close();
+	CU_ASSERT_EQUAL_FATAL(file.getLength(),0);
+
+	// Block1 reassembly
+	CoapBlockAssembler uploads(CoapPDU::COAP_OPTION_BLOCK1,2,2048,1000);
+	std::vector<uint8_t> received;
+	CU_ASSERT_EQUAL_FATAL(sendBlock1(&uploads,1,&data[0],2000,6,0,&received),CoapBlockAssembler::COAP_BLOCK_COMPLETE);
+	CU_ASSERT_EQUAL_FATAL(received.size(),2000);
+	CU_ASSERT_FATAL(memcmp(&received[0],&data[0],2000)==0);
+	CU_ASSERT_EQUAL_FATAL(uploads.getNumTransfers(),1);
+	uploads.release(1);
+	CU_ASSERT_EQUAL_FATAL(uploads.getNumTransfers(),0);
+	// one block doesn't take a transfer
+	CU_ASSERT_EQUAL_FATAL(sendBlock1(&uploads,1,&data[0],50,6,0,&received),CoapBlockAssembler::COAP_BLOCK_COMPLETE);
+	CU_ASSERT_EQUAL_FATAL(received.size(),50);
+	CU_ASSERT_EQUAL_FATAL(uploads.getNumTransfers(),0);
+	// too large, refused on the first block because of Size1
+	CU_ASSERT_EQUAL_FATAL(sendBlock1(&uploads,1,&data[0],2500,6,0,&received),CoapBlockAssembler::COAP_BLOCK_TOO_LARGE);
+	CU_ASSERT_EQUAL_FATAL(uploads.getNumTransfers(),0);
+
+	// a block arriving before block 0, and the 4.13 response carrying Size1
+	CoapPDU put;
+	put.setVersion(1);
+	put.setType(CoapPDU::COAP_CONFIRMABLE);
+	put.setCode(CoapPDU::COAP_PUT);
+	CoapBlockOption second = {1,1,0};
+	CU_ASSERT_EQUAL_FATAL(coapWriteBlock(&put,CoapPDU::COAP_OPTION_BLOCK1,&memory,&second,0),0);
+	const uint8_t *out;
+	int outLength;
+	CU_ASSERT_EQUAL_FATAL(uploads.receive(2,&put,0,&out,&outLength),CoapBlockAssembler::COAP_BLOCK_INCOMPLETE);
+	CoapPDU response;
+	CU_ASSERT_EQUAL_FATAL(uploads.respond(CoapBlockAssembler::COAP_BLOCK_TOO_LARGE,&put,&response,CoapPDU::COAP_CHANGED,0),0);
+	CU_ASSERT_EQUAL_FATAL(response.getCode(),CoapPDU::COAP_REQUEST_ENTITY_TOO_LARGE);
+	CoapPDU::CoapOption size1;
+	CU_ASSERT_EQUAL_FATAL(response.findOption(CoapPDU::COAP_OPTION_SIZE1,&size1),1);
+	CU_ASSERT_EQUAL_FATAL(size1.optionValueLength,2);
+	CU_ASSERT_EQUAL_FATAL((size1.optionValuePointer[0]<<8)|size1.optionValuePointer[1],2048);
+	// a non-final block must be full
+	CoapPDU shortBlock;
+	shortBlock.setVersion(1);
+	shortBlock.setCode(CoapPDU::COAP_PUT);
+	CoapBlockOption first = {0,1,0};
+	first.add(&shortBlock,CoapPDU::COAP_OPTION_BLOCK1);
+	shortBlock.setPayload((uint8_t*)"short",5);
+	CU_ASSERT_EQUAL_FATAL(uploads.receive(2,&shortBlock,0,&out,&outLength),CoapBlockAssembler::COAP_BLOCK_BAD_BLOCK);
+	// no block option at all
+	CoapPDU plain;
+	plain.setVersion(1);
+	plain.setCode(CoapPDU::COAP_PUT);
+	CU_ASSERT_EQUAL_FATAL(uploads.receive(2,&plain,0,&out,&outLength),CoapBlockAssembler::COAP_BLOCK_NOT_BLOCKWISE);
+
+	// transfers are bounded and time out
+	CoapPDU start;
+	start.setVersion(1);
+	start.setCode(CoapPDU::COAP_PUT);
+	CoapBlockOption zero = {0,0,0};
+	CU_ASSERT_EQUAL_FATAL(coapWriteBlock(&start,CoapPDU::COAP_OPTION_BLOCK1,&memory,&zero,0),0);
+	for(uint64_t key=10; key<12; key++) {
+		CU_ASSERT_EQUAL_FATAL(uploads.receive(key,&start,0,&out,&outLength),CoapBlockAssembler::COAP_BLOCK_CONTINUE);
+	}
+	CU_ASSERT_EQUAL_FATAL(uploads.receive(12,&start,999,&out,&outLength),CoapBlockAssembler::COAP_BLOCK_NO_SLOT);
+	CU_ASSERT_EQUAL_FATAL(uploads.receive(10,&put,999,&out,&outLength),CoapBlockAssembler::COAP_BLOCK_CONTINUE);
+	// key 11 has now been idle for the timeout, so its slot can be taken
+	CU_ASSERT_EQUAL_FATAL(uploads.receive(12,&start,1000,&out,&outLength),CoapBlockAssembler::COAP_BLOCK_CONTINUE);
+	CU_ASSERT_EQUAL_FATAL(uploads.receive(11,&put,1000,&out,&outLength),CoapBlockAssembler::COAP_BLOCK_INCOMPLETE);
+	CU_ASSERT_EQUAL_FATAL(uploads.expire(1998),0);
+	CU_ASSERT_EQUAL_FATAL(uploads.expire(1999),1);
+	CU_ASSERT_EQUAL_FATAL(uploads.expire(2000),1);
+	CU_ASSERT_EQUAL_FATAL(uploads.getNumTransfers(),0);
+
+	// many transfers sharing a small table, released in an order that moves entries around
+	CoapBlockAssembler many(CoapPDU::COAP_OPTION_BLOCK1,64,1024,1000);
+	for(uint64_t key=0; key<64; key++) {
+		CU_ASSERT_EQUAL_FATAL(many.receive(key*0x100000000ULL,&start,0,&out,&outLength),CoapBlockAssembler::COAP_BLOCK_CONTINUE);
+	}
+	for(uint64_t key=0; key<64; key+=3) {
+		many.release(key*0x100000000ULL);
+	}
+	for(uint64_t key=0; key<64; key++) {
+		CU_ASSERT_EQUAL_FATAL(many.receive(key*0x100000000ULL,&put,0,&out,&outLength),
+			key%3==0 ? CoapBlockAssembler::COAP_BLOCK_INCOMPLETE : CoapBlockAssembler::COAP_BLOCK_CONTINUE);
+	}
+	CU_ASSERT_EQUAL_FATAL(many.getNumTransfers(),42);
+}
+
+// collects notifications as the PDUs that would go on the wire
+struct NotifyCapture {
+	std::vector<std::vector<uint8_t> > pdus;
+	std::vector<uint16_t> ports;
+	int stopAfter;
+};
+
+static int captureNotifications(CoapNotifyBatch *batch, void *arg) {
+	NotifyCapture *capture = (NotifyCapture*)arg;
+	for(int i=0; i<batch->count; i++) {
+		std::vector<uint8_t> pdu;
+		for(size_t j=0; j<batch->msg[i].msg_iovlen; j++) {
+			const uint8_t *base = (const uint8_t*)batch->msg[i].msg_iov[j].iov_base;
+			pdu.insert(pdu.end(),base,base+batch->msg[i].msg_iov[j].iov_len);
+		}
+		capture->pdus.push_back(pdu);
+		CU_ASSERT_FATAL(batch->msg[i].msg_name==&batch->observer[i]->endpoint.address);
+		capture->ports.push_back(ntohs(((struct sockaddr_in*)batch->msg[i].msg_name)->sin_port));
+	}
+	return capture->stopAfter>0&&(int)capture->pdus.size()>=capture->stopAfter;
+}
+
+static struct sockaddr_in observerAddress(uint16_t port) {
+	struct sockaddr_in address;
+	memset(&address,0xAB,sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(0x7F000001);
+	return address;
+}
+
+void testObserve() {
+	CoapObserveRegistry registry;
+	struct sockaddr_in address = observerAddress(5000);
+
+	// registration through a request
+	CoapPDU request;
+	request.setVersion(1);
+	request.setType(CoapPDU::COAP_CONFIRMABLE);
+	request.setCode(CoapPDU::COAP_GET);
+	request.setToken((uint8_t*)"\x10\x20\x30",3);
+	request.addOption(CoapPDU::COAP_OPTION_OBSERVE,0,NULL);
+	request.setURI((char*)"/temp");
+	CU_ASSERT_EQUAL_FATAL(registry.handleRequest(7,&request,(struct sockaddr*)&address,sizeof(address)),1);
+	CU_ASSERT_EQUAL_FATAL(registry.getNumObservers(7),1);
+	CoapPDU response;
+	CU_ASSERT_EQUAL_FATAL(response.makeResponse(&request,CoapPDU::COAP_CONTENT,0,32),0);
+	CU_ASSERT_EQUAL_FATAL(registry.addObserveOption(7,&response),0);
+	CU_ASSERT_EQUAL_FATAL(response.hasOption(CoapPDU::COAP_OPTION_OBSERVE),1);
+	// the same address and token again, with different padding, is the same observer
+	address = observerAddress(5000);
+	memset(address.sin_zero,0x00,sizeof(address.sin_zero));
+	CU_ASSERT_EQUAL_FATAL(registry.handleRequest(7,&request,(struct sockaddr*)&address,sizeof(address)),1);
+	CU_ASSERT_EQUAL_FATAL(registry.getNumObservers(),1);
+
+	// more observers, one on another resource
+	for(int i=1; i<3; i++) {
+		address = observerAddress(5000+i);
+		CU_ASSERT_EQUAL_FATAL(registry.add(7,(struct sockaddr*)&address,sizeof(address),(uint8_t*)"\x10\x20\x30",3),0);
+	}
+	struct sockaddr_in6 address6;
+	memset(&address6,0x00,sizeof(address6));
+	address6.sin6_family = AF_INET6;
+	address6.sin6_port = htons(6000);
+	address6.sin6_addr.s6_addr[15] = 1;
+	CU_ASSERT_EQUAL_FATAL(registry.add(8,(struct sockaddr*)&address6,sizeof(address6),(uint8_t*)"\x01",1),0);
+	CU_ASSERT_EQUAL_FATAL(registry.getNumObservers(7),3);
+	CU_ASSERT_EQUAL_FATAL(registry.getNumObservers(),4);
+
+	// notifications differ only in message ID and token
+	CoapPDU prototype;
+	prototype.setCode(CoapPDU::COAP_CONTENT);
+	prototype.setContentFormat(CoapPDU::COAP_CONTENT_FORMAT_TEXT_PLAIN);
+	prototype.addOption(CoapPDU::COAP_OPTION_ETAG,2,(uint8_t*)"\xE1\xE2");
+	NotifyCapture capture;
+	capture.stopAfter = 0;
+	uint16_t messageID = 100;
+	CU_ASSERT_EQUAL_FATAL(registry.notify(7,&prototype,(uint8_t*)"22.5",4,CoapPDU::COAP_NON_CONFIRMABLE,&messageID,
+		captureNotifications,&capture),3);
+	CU_ASSERT_EQUAL_FATAL(messageID,103);
+	CU_ASSERT_EQUAL_FATAL(registry.getSequence(7),1);
+	for(int i=0; i<3; i++) {
+		CoapPDU notification(&capture.pdus[i][0],capture.pdus[i].size());
+		CU_ASSERT_EQUAL_FATAL(notification.validate(),1);
+		CU_ASSERT_EQUAL_FATAL(notification.getType(),CoapPDU::COAP_NON_CONFIRMABLE);
+		CU_ASSERT_EQUAL_FATAL(notification.getCode(),CoapPDU::COAP_CONTENT);
+		CU_ASSERT_EQUAL_FATAL(notification.getMessageID(),100+i);
+		CU_ASSERT_EQUAL_FATAL(notification.getTokenLength(),3);
+		CU_ASSERT_NSTRING_EQUAL_FATAL(notification.getTokenPointer(),"\x10\x20\x30",3);
+		CU_ASSERT_EQUAL_FATAL(notification.getNumOptions(),3);
+		CoapPDU::CoapOption options[3];
+		int i2 = 0;
+		for(const CoapPDU::CoapOption &o : notification.options()) {
+			options[i2++] = o;
+		}
+		CU_ASSERT_EQUAL_FATAL(options[0].optionNumber,CoapPDU::COAP_OPTION_ETAG);
+		CU_ASSERT_EQUAL_FATAL(options[1].optionNumber,CoapPDU::COAP_OPTION_OBSERVE);
+		CU_ASSERT_EQUAL_FATAL(options[1].optionValueLength,1);
+		CU_ASSERT_EQUAL_FATAL(options[1].optionValuePointer[0],1);
+		CU_ASSERT_EQUAL_FATAL(options[2].optionNumber,CoapPDU::COAP_OPTION_CONTENT_FORMAT);
+		CU_ASSERT_EQUAL_FATAL(notification.getPayloadLength(),4);
+		CU_ASSERT_NSTRING_EQUAL_FATAL(notification.getPayloadPointer(),"22.5",4);
+		CU_ASSERT_EQUAL_FATAL(capture.ports[i],5000+i);
+	}
+
+	// the sequence number goes up with each notification, and a resource nobody observes sends nothing
+	capture.pdus.clear();
+	CU_ASSERT_EQUAL_FATAL(registry.notify(8,NULL,NULL,0,CoapPDU::COAP_CONFIRMABLE,&messageID,captureNotifications,&capture),1);
+	CU_ASSERT_EQUAL_FATAL(registry.notify(8,NULL,NULL,0,CoapPDU::COAP_CONFIRMABLE,&messageID,captureNotifications,&capture),1);
+	CoapPDU second(&capture.pdus[1][0],capture.pdus[1].size());
+	CU_ASSERT_EQUAL_FATAL(second.validate(),1);
+	CU_ASSERT_EQUAL_FATAL(second.getType(),CoapPDU::COAP_CONFIRMABLE);
+	CU_ASSERT_EQUAL_FATAL(second.getPayloadLength(),0);
+	CoapPDU::CoapOption observe;
+	CU_ASSERT_EQUAL_FATAL(second.findOption(CoapPDU::COAP_OPTION_OBSERVE,&observe),1);
+	CU_ASSERT_EQUAL_FATAL(observe.optionValuePointer[0],2);
+	CU_ASSERT_EQUAL_FATAL(registry.notify(9,NULL,NULL,0,CoapPDU::COAP_CONFIRMABLE,&messageID,captureNotifications,&capture),0);
+
+	// deregistration through a request
+	address = observerAddress(5000);
+	uint8_t one = 1;
+	CoapPDU cancel;
+	cancel.setVersion(1);
+	cancel.setCode(CoapPDU::COAP_GET);
+	cancel.setToken((uint8_t*)"\x10\x20\x30",3);
+	cancel.addOption(CoapPDU::COAP_OPTION_OBSERVE,1,&one);
+	CU_ASSERT_EQUAL_FATAL(registry.handleRequest(7,&cancel,(struct sockaddr*)&address,sizeof(address)),0);
+	CU_ASSERT_EQUAL_FATAL(registry.getNumObservers(7),2);
+	CU_ASSERT_EQUAL_FATAL(registry.remove((struct sockaddr*)&address,sizeof(address),(uint8_t*)"\x10\x20\x30",3),1);
+
+	// many observers, in several batches, with removals moving observers around
+	for(int i=0; i<1000; i++) {
+		address = observerAddress(10000+i);
+		uint8_t token[2] = {(uint8_t)(i>>8),(uint8_t)i};
+		CU_ASSERT_EQUAL_FATAL(registry.add(9,(struct sockaddr*)&address,sizeof(address),token,2),0);
+	}
+	for(int i=0; i<1000; i+=7) {
+		address = observerAddress(10000+i);
+		uint8_t token[2] = {(uint8_t)(i>>8),(uint8_t)i};
+		CU_ASSERT_EQUAL_FATAL(registry.remove((struct sockaddr*)&address,sizeof(address),token,2),0);
+	}
+	CU_ASSERT_EQUAL_FATAL(registry.getNumObservers(9),857);
+	capture.pdus.clear();
+	capture.ports.clear();
+	CU_ASSERT_EQUAL_FATAL(registry.notify(9,&prototype,(uint8_t*)"x",1,CoapPDU::COAP_NON_CONFIRMABLE,&messageID,
+		captureNotifications,&capture),857);
+	std::vector<int> seen(1000,0);
+	for(size_t i=0; i<capture.pdus.size(); i++) {
+		CoapPDU notification(&capture.pdus[i][0],capture.pdus[i].size());
+		CU_ASSERT_EQUAL_FATAL(notification.validate(),1);
+		int port = capture.ports[i]-10000;
+		CU_ASSERT_EQUAL_FATAL((notification.getTokenPointer()[0]<<8)|notification.getTokenPointer()[1],port);
+		seen[port]++;
+	}
+	for(int i=0; i<1000; i++) {
+		CU_ASSERT_EQUAL_FATAL(seen[i],i%7==0 ? 0 : 1);
+	}
+	// the callback can stop the notifications
+	capture.pdus.clear();
+	capture.stopAfter = 100;
+	CU_ASSERT_EQUAL_FATAL(registry.notify(9,NULL,NULL,0,CoapPDU::COAP_NON_CONFIRMABLE,&messageID,captureNotifications,
+		&capture),2*COAP_NOTIFY_BATCH_SIZE);
+
+	CU_ASSERT_EQUAL_FATAL(registry.removeResource(9),0);
+	CU_ASSERT_EQUAL_FATAL(registry.getNumObservers(9),0);
+	CU_ASSERT_EQUAL_FATAL(registry.getNumObservers(),3);
+	CU_ASSERT_EQUAL_FATAL(registry.getNumObservers(8),1);
+}
+
+struct ReliableCapture {
+	std::vector<std::vector<uint8_t> > pdus;
+	std::vector<uint16_t> ports;
+	std::vector<uint16_t> timedOut;
+	std::vector<void*> contexts;
+};
+
+static int captureReliableSend(const uint8_t *pdu, int pduLength, const CoapEndpoint *endpoint, void *arg) {
+	ReliableCapture *capture = (ReliableCapture*)arg;
+	capture->pdus.push_back(std::vector<uint8_t>(pdu,pdu+pduLength));
+	capture->ports.push_back(ntohs(endpoint->address.in.sin_port));
+	return 0;
+}
+
+static void captureReliableTimeout(uint16_t messageID, const CoapEndpoint *endpoint, void *context, void *arg) {
+	(void)endpoint;
+	ReliableCapture *capture = (ReliableCapture*)arg;
+	capture->timedOut.push_back(messageID);
+	capture->contexts.push_back(context);
+}
+
+static void reliableMessage(CoapPDU *pdu, CoapPDU::Type type, uint16_t messageID) {
+	pdu->reset();
+	pdu->setVersion(1);
+	pdu->setType(type);
+	pdu->setCode(type==CoapPDU::COAP_CONFIRMABLE||type==CoapPDU::COAP_NON_CONFIRMABLE ? CoapPDU::COAP_CONTENT
+		: CoapPDU::COAP_EMPTY);
+	pdu->setMessageID(messageID);
+}
+
+void testReliable() {
+	ReliableCapture capture;
+	CoapReliableLayer reliable(1000,captureReliableSend,captureReliableTimeout,&capture);
+	reliable.setSeed(1);
+	CU_ASSERT_EQUAL_FATAL(reliable.getTimeout(),-1);
+	struct sockaddr_in address = observerAddress(5000);
+	int context = 0;
+
+	// a confirmable message is copied, payload reference included, and retransmitted with exponential backoff,
+	// across the wrap of the clock
+	uint32_t start = 0xFFFFFFFF-5000;
+	CoapPDU pdu;
+	reliableMessage(&pdu,CoapPDU::COAP_CONFIRMABLE,1);
+	uint8_t payload[4] = {'a','b','c','d'};
+	CU_ASSERT_EQUAL_FATAL(pdu.setPayloadReference(payload,4),0);
+	CU_ASSERT_EQUAL_FATAL(reliable.send(&pdu,(struct sockaddr*)&address,sizeof(address),start,&context),0);
+	CU_ASSERT_EQUAL_FATAL(reliable.getNumPending(),1);
+	CU_ASSERT_EQUAL_FATAL(capture.pdus.size(),1);
+	payload[0] = 'x';
+	// the same message ID to the same endpoint is already pending
+	CU_ASSERT_EQUAL_FATAL(reliable.send(&pdu,(struct sockaddr*)&address,sizeof(address),start,NULL),1);
+	// other types are only sent
+	reliableMessage(&pdu,CoapPDU::COAP_NON_CONFIRMABLE,1);
+	CU_ASSERT_EQUAL_FATAL(reliable.send(&pdu,(struct sockaddr*)&address,sizeof(address),start,NULL),0);
+	CU_ASSERT_EQUAL_FATAL(capture.pdus.size(),2);
+	CU_ASSERT_EQUAL_FATAL(reliable.getNumPending(),1);
+
+	std::vector<uint32_t> sentAt;
+	for(uint32_t t=1; t<=100000&&capture.timedOut.empty(); t++) {
+		size_t before = capture.pdus.size();
+		reliable.advance(start+t);
+		if(capture.pdus.size()!=before) {
+			CU_ASSERT_EQUAL_FATAL(capture.pdus.size(),before+1);
+			sentAt.push_back(t);
+			CU_ASSERT_FATAL(capture.pdus.back()==capture.pdus[0]);
+		}
+		if(!capture.timedOut.empty()) {
+			sentAt.push_back(t);
+		}
+	}
+	CU_ASSERT_EQUAL_FATAL(sentAt.size(),COAP_MAX_RETRANSMIT+1);
+	uint32_t first = sentAt[0];
+	CU_ASSERT_FATAL(first>=COAP_ACK_TIMEOUT_MS&&first<=COAP_ACK_TIMEOUT_MS*COAP_ACK_RANDOM_FACTOR_PERCENT/100);
+	for(size_t i=1; i<sentAt.size(); i++) {
+		CU_ASSERT_EQUAL_FATAL(sentAt[i]-sentAt[i-1],first<<i);
+	}
+	CoapPDU copy(&capture.pdus[0][0],capture.pdus[0].size());
+	CU_ASSERT_EQUAL_FATAL(copy.validate(),1);
+	CU_ASSERT_NSTRING_EQUAL_FATAL(copy.getPayloadPointer(),"abcd",4);
+	CU_ASSERT_EQUAL_FATAL(capture.timedOut.size(),1);
+	CU_ASSERT_EQUAL_FATAL(capture.timedOut[0],1);
+	CU_ASSERT_FATAL(capture.contexts[0]==&context);
+	CU_ASSERT_EQUAL_FATAL(reliable.getNumPending(),0);
+	CU_ASSERT_EQUAL_FATAL(reliable.getTimeout(),-1);
+
+	// an ACK or RST from the same endpoint with the same message ID ends the retransmissions
+	uint32_t now = 1000;
+	reliable.advance(now);
+	capture.pdus.clear();
+	reliableMessage(&pdu,CoapPDU::COAP_CONFIRMABLE,2);
+	CU_ASSERT_EQUAL_FATAL(reliable.send(&pdu,(struct sockaddr*)&address,sizeof(address),now,&context),0);
+	reliableMessage(&pdu,CoapPDU::COAP_CONFIRMABLE,3);
+	CU_ASSERT_EQUAL_FATAL(reliable.send(&pdu,(struct sockaddr*)&address,sizeof(address),now,NULL),0);
+	CU_ASSERT_FATAL(reliable.getTimeout()>0);
+	CoapPDU reply;
+	void *acked = NULL;
+	reliableMessage(&reply,CoapPDU::COAP_CONFIRMABLE,2);
+	CU_ASSERT_EQUAL_FATAL(reliable.receive(&reply,(struct sockaddr*)&address,sizeof(address),&acked),0);
+	reliableMessage(&reply,CoapPDU::COAP_ACKNOWLEDGEMENT,2);
+	struct sockaddr_in other = observerAddress(5001);
+	CU_ASSERT_EQUAL_FATAL(reliable.receive(&reply,(struct sockaddr*)&other,sizeof(other),&acked),0);
+	address = observerAddress(5000);
+	memset(address.sin_zero,0x00,sizeof(address.sin_zero));
+	CU_ASSERT_EQUAL_FATAL(reliable.receive(&reply,(struct sockaddr*)&address,sizeof(address),&acked),1);
+	CU_ASSERT_FATAL(acked==&context);
+	CU_ASSERT_EQUAL_FATAL(reliable.receive(&reply,(struct sockaddr*)&address,sizeof(address),&acked),0);
+	reliableMessage(&reply,CoapPDU::COAP_RESET,3);
+	CU_ASSERT_EQUAL_FATAL(reliable.receive(&reply,(struct sockaddr*)&address,sizeof(address),&acked),1);
+	CU_ASSERT_EQUAL_FATAL(reliable.getNumPending(),0);
+	CU_ASSERT_EQUAL_FATAL(reliable.advance(now+100000),0);
+	CU_ASSERT_EQUAL_FATAL(capture.pdus.size(),2);
+
+	// a full layer, half cancelled, then left to time out in one step
+	now += 100000;
+	capture.pdus.clear();
+	capture.timedOut.clear();
+	for(int i=0; i<1000; i++) {
+		address = observerAddress(10000+i%10);
+		reliableMessage(&pdu,CoapPDU::COAP_CONFIRMABLE,i);
+		CU_ASSERT_EQUAL_FATAL(reliable.send(&pdu,(struct sockaddr*)&address,sizeof(address),now+i,NULL),0);
+	}
+	reliableMessage(&pdu,CoapPDU::COAP_CONFIRMABLE,1000);
+	CU_ASSERT_EQUAL_FATAL(reliable.send(&pdu,(struct sockaddr*)&address,sizeof(address),now,NULL),1);
+	for(int i=0; i<1000; i+=2) {
+		address = observerAddress(10000+i%10);
+		CU_ASSERT_EQUAL_FATAL(reliable.cancel(i,(struct sockaddr*)&address,sizeof(address),NULL),1);
+	}
+	CU_ASSERT_EQUAL_FATAL(reliable.getNumPending(),500);
+	CU_ASSERT_EQUAL_FATAL(reliable.advance(now+1000000),500*(COAP_MAX_RETRANSMIT+1));
+	CU_ASSERT_EQUAL_FATAL(capture.timedOut.size(),500);
+	CU_ASSERT_EQUAL_FATAL(capture.pdus.size(),1000+500*COAP_MAX_RETRANSMIT);
+	CU_ASSERT_EQUAL_FATAL(reliable.getNumPending(),0);
+}
+
+void testDedup() {
+	// one bucket's worth of memory gives one bucket
+	CoapDedupCache small(1,64);
+	CU_ASSERT_EQUAL_FATAL(small.getCapacity(),COAP_DEDUP_WAYS);
+
+	CoapDedupCache dedup(1024*1024,64);
+	CU_ASSERT_FATAL(dedup.getCapacity()>=1000);
+	struct sockaddr_in address = observerAddress(5000);
+	const uint8_t *cached;
+	int cachedLength;
+
+	// the first copy is new, later ones are duplicates, with the response once it is stored
+	uint32_t now = 0xFFFFFFFF-1000;
+	CoapPDU request;
+	reliableMessage(&request,CoapPDU::COAP_CONFIRMABLE,0x1234);
+	CU_ASSERT_EQUAL_FATAL(dedup.check(&request,(struct sockaddr*)&address,sizeof(address),now,&cached,&cachedLength),0);
+	CU_ASSERT_EQUAL_FATAL(dedup.check(&request,(struct sockaddr*)&address,sizeof(address),now,&cached,&cachedLength),1);
+	CU_ASSERT_FATAL(cached==NULL);
+	CoapPDU response;
+	CU_ASSERT_EQUAL_FATAL(response.makeResponse(&request,CoapPDU::COAP_CONTENT,0x1234,32),0);
+	response.setType(CoapPDU::COAP_ACKNOWLEDGEMENT);
+	CU_ASSERT_EQUAL_FATAL(response.setPayloadReference((uint8_t*)"21.5",4),0);
+	CU_ASSERT_EQUAL_FATAL(dedup.store(0x1234,(struct sockaddr*)&address,sizeof(address),&response),0);
+	address = observerAddress(5000);
+	memset(address.sin_zero,0x00,sizeof(address.sin_zero));
+	CU_ASSERT_EQUAL_FATAL(dedup.check(&request,(struct sockaddr*)&address,sizeof(address),now+2000,&cached,&cachedLength),1);
+	CU_ASSERT_FATAL(cached!=NULL);
+	CoapPDU replay((uint8_t*)cached,cachedLength);
+	CU_ASSERT_EQUAL_FATAL(replay.validate(),1);
+	CU_ASSERT_EQUAL_FATAL(replay.getMessageID(),0x1234);
+	CU_ASSERT_NSTRING_EQUAL_FATAL(replay.getPayloadPointer(),"21.5",4);
+
+	// the same message ID from elsewhere is new, and acknowledgements are never remembered
+	struct sockaddr_in other = observerAddress(5001);
+	CU_ASSERT_EQUAL_FATAL(dedup.check(&request,(struct sockaddr*)&other,sizeof(other),now,&cached,&cachedLength),0);
+	CoapPDU ack;
+	reliableMessage(&ack,CoapPDU::COAP_ACKNOWLEDGEMENT,0x1234);
+	CU_ASSERT_EQUAL_FATAL(dedup.check(&ack,(struct sockaddr*)&other,sizeof(other),now,&cached,&cachedLength),0);
+	CU_ASSERT_EQUAL_FATAL(dedup.check(&ack,(struct sockaddr*)&other,sizeof(other),now,&cached,&cachedLength),0);
+	CU_ASSERT_EQUAL_FATAL(dedup.getHits(),2);
+	CU_ASSERT_EQUAL_FATAL(dedup.getMisses(),2);
+	CU_ASSERT_EQUAL_FATAL(dedup.getNumEntries(now),2);
+
+	// a response too long to keep, duplicates are still detected
+	CoapPDU non;
+	reliableMessage(&non,CoapPDU::COAP_NON_CONFIRMABLE,7);
+	CU_ASSERT_EQUAL_FATAL(dedup.check(&non,(struct sockaddr*)&address,sizeof(address),now,&cached,&cachedLength),0);
+	uint8_t big[100];
+	memset(big,'b',sizeof(big));
+	CU_ASSERT_EQUAL_FATAL(response.setPayloadReference(big,sizeof(big)),0);
+	CU_ASSERT_EQUAL_FATAL(dedup.store(7,(struct sockaddr*)&address,sizeof(address),&response),1);
+	CU_ASSERT_EQUAL_FATAL(dedup.check(&non,(struct sockaddr*)&address,sizeof(address),now,&cached,&cachedLength),1);
+	CU_ASSERT_FATAL(cached==NULL);
+	CU_ASSERT_EQUAL_FATAL(dedup.store(8,(struct sockaddr*)&address,sizeof(address),&response),1);
+
+	// non-confirmable messages are forgotten after NON_LIFETIME, confirmable ones after EXCHANGE_LIFETIME
+	CU_ASSERT_EQUAL_FATAL(dedup.check(&non,(struct sockaddr*)&address,sizeof(address),now+COAP_NON_LIFETIME_MS-1,
+		&cached,&cachedLength),1);
+	CU_ASSERT_EQUAL_FATAL(dedup.check(&non,(struct sockaddr*)&address,sizeof(address),now+COAP_NON_LIFETIME_MS,
+		&cached,&cachedLength),0);
+	CU_ASSERT_EQUAL_FATAL(dedup.check(&request,(struct sockaddr*)&address,sizeof(address),now+COAP_NON_LIFETIME_MS,
+		&cached,&cachedLength),1);
+	CU_ASSERT_FATAL(cached!=NULL);
+	now += COAP_EXCHANGE_LIFETIME_MS;
+	CU_ASSERT_EQUAL_FATAL(dedup.check(&request,(struct sockaddr*)&address,sizeof(address),now,&cached,&cachedLength),0);
+	CU_ASSERT_FATAL(cached==NULL);
+	CU_ASSERT_EQUAL_FATAL(dedup.getEvictions(),0);
+
+	// a full bucket forgets the message closest to expiring
+	for(int i=0; i<COAP_DEDUP_WAYS; i++) {
+		reliableMessage(&request,CoapPDU::COAP_CONFIRMABLE,i);
+		CU_ASSERT_EQUAL_FATAL(small.check(&request,(struct sockaddr*)&address,sizeof(address),now+i,&cached,&cachedLength),0);
+	}
+	reliableMessage(&request,CoapPDU::COAP_CONFIRMABLE,100);
+	CU_ASSERT_EQUAL_FATAL(small.check(&request,(struct sockaddr*)&address,sizeof(address),now+10,&cached,&cachedLength),0);
+	CU_ASSERT_EQUAL_FATAL(small.getEvictions(),1);
+	for(int i=COAP_DEDUP_WAYS-1; i>0; i--) {
+		reliableMessage(&request,CoapPDU::COAP_CONFIRMABLE,i);
+		CU_ASSERT_EQUAL_FATAL(small.check(&request,(struct sockaddr*)&address,sizeof(address),now+10,&cached,&cachedLength),1);
+	}
+	reliableMessage(&request,CoapPDU::COAP_CONFIRMABLE,0);
+	CU_ASSERT_EQUAL_FATAL(small.check(&request,(struct sockaddr*)&address,sizeof(address),now+10,&cached,&cachedLength),0);
+	CU_ASSERT_EQUAL_FATAL(small.getEvictions(),2);
+	CU_ASSERT_EQUAL_FATAL(small.getNumEntries(now+10),COAP_DEDUP_WAYS);
+
+	// a storm of distinct messages stays within the budget
+	for(int i=0; i<100000; i++) {
+		address = observerAddress(10000+i%1000);
+		reliableMessage(&request,CoapPDU::COAP_CONFIRMABLE,i);
+		dedup.check(&request,(struct sockaddr*)&address,sizeof(address),now,&cached,&cachedLength);
+	}
+	CU_ASSERT_EQUAL_FATAL(dedup.getNumEntries(now),dedup.getCapacity());
+	CU_ASSERT_FATAL(dedup.getEvictions()>=(uint64_t)(100000-dedup.getCapacity()));
+}
+
+struct ExchangeResult {
+	std::atomic<int> responses;
+	std::atomic<int> timeouts;
+};
+
+static void exchangeEnded(CoapPDU *response, const CoapEndpoint *endpoint, void *context) {
+	(void)endpoint;
+	ExchangeResult *result = (ExchangeResult*)context;
+	if(response!=NULL) {
+		result->responses++;
+	} else {
+		result->timeouts++;
+	}
+}
+
+struct ExchangeThread {
+	CoapExchangeTable *table;
+	std::vector<std::vector<uint8_t> > *tokens;
+	int first;
+	int step;
+	int completed;
+};
+
+static void* exchangeComplete(void *arg) {
+	ExchangeThread *thread = (ExchangeThread*)arg;
+	struct sockaddr_in address = observerAddress(5683);
+	CoapPDU response;
+	for(size_t i=thread->first; i<thread->tokens->size(); i+=thread->step) {
+		reliableMessage(&response,CoapPDU::COAP_ACKNOWLEDGEMENT,i);
+		response.setCode(CoapPDU::COAP_CONTENT);
+		response.setToken(&(*thread->tokens)[i][0],COAP_EXCHANGE_TOKEN_LENGTH);
+		// every response arrives twice, only the first completes the exchange
+		thread->completed += thread->table->complete(&response,(struct sockaddr*)&address,sizeof(address));
+		thread->completed += thread->table->complete(&response,(struct sockaddr*)&address,sizeof(address));
+	}
+	return NULL;
+}
+
+void testExchange() {
+	CoapExchangeTable table(20000,1000);
+	ExchangeResult result;
+	result.responses = 0;
+	result.timeouts = 0;
+	struct sockaddr_in address = observerAddress(5683);
+
+	// tokens are set on the request, and a response must come back from where the request went
+	CoapPDU request;
+	reliableMessage(&request,CoapPDU::COAP_CONFIRMABLE,1);
+	request.setCode(CoapPDU::COAP_GET);
+	CU_ASSERT_EQUAL_FATAL(table.begin(&request,(struct sockaddr*)&address,sizeof(address),0,exchangeEnded,&result),0);
+	CU_ASSERT_EQUAL_FATAL(request.getTokenLength(),COAP_EXCHANGE_TOKEN_LENGTH);
+	CU_ASSERT_EQUAL_FATAL(request.validate(),1);
+	CU_ASSERT_EQUAL_FATAL(table.getNumExchanges(),1);
+	CoapPDU response;
+	CU_ASSERT_EQUAL_FATAL(response.makeResponse(&request,CoapPDU::COAP_CONTENT,1,32),0);
+	struct sockaddr_in other = observerAddress(5684);
+	CU_ASSERT_EQUAL_FATAL(table.complete(&response,(struct sockaddr*)&other,sizeof(other)),0);
+	CU_ASSERT_EQUAL_FATAL(table.complete(&response,(struct sockaddr*)&address,sizeof(address)),1);
+	CU_ASSERT_EQUAL_FATAL(table.complete(&response,(struct sockaddr*)&address,sizeof(address)),0);
+	CU_ASSERT_EQUAL_FATAL(result.responses,1);
+	CU_ASSERT_EQUAL_FATAL(table.getNumExchanges(),0);
+	// an empty ACK for a separate response carries no token
+	CoapPDU empty;
+	reliableMessage(&empty,CoapPDU::COAP_ACKNOWLEDGEMENT,1);
+	CU_ASSERT_EQUAL_FATAL(table.complete(&empty,(struct sockaddr*)&address,sizeof(address)),0);
+	// each table has its own random key, so two tables do not hand out the same tokens
+	CoapExchangeTable otherTable(16,1000);
+	CoapPDU otherRequest;
+	reliableMessage(&otherRequest,CoapPDU::COAP_CONFIRMABLE,1);
+	CU_ASSERT_EQUAL_FATAL(otherTable.begin(&otherRequest,(struct sockaddr*)&address,sizeof(address),0,NULL,NULL),0);
+	CU_ASSERT_FATAL(memcmp(otherRequest.getTokenPointer(),request.getTokenPointer(),COAP_EXCHANGE_TOKEN_LENGTH)!=0);
+
+	// cancelling, and expiring at the timeout
+	void *context = NULL;
+	CU_ASSERT_EQUAL_FATAL(table.begin(&request,(struct sockaddr*)&address,sizeof(address),0,exchangeEnded,&result),0);
+	CU_ASSERT_EQUAL_FATAL(table.cancel(request.getTokenPointer(),request.getTokenLength(),&context),1);
+	CU_ASSERT_FATAL(context==&result);
+	CU_ASSERT_EQUAL_FATAL(table.cancel(request.getTokenPointer(),request.getTokenLength(),&context),0);
+	for(int i=0; i<100; i++) {
+		CU_ASSERT_EQUAL_FATAL(table.begin(&request,(struct sockaddr*)&address,sizeof(address),0xFFFFFF00+i,exchangeEnded,
+			&result),0);
+	}
+	CU_ASSERT_EQUAL_FATAL(table.expire(0xFFFFFF00+999),0);
+	CU_ASSERT_EQUAL_FATAL(table.expire(0xFFFFFF00+1049),50);
+	CU_ASSERT_EQUAL_FATAL(table.expire(0xFFFFFF00+2000),50);
+	CU_ASSERT_EQUAL_FATAL(result.timeouts,100);
+	CU_ASSERT_EQUAL_FATAL(result.responses,1);
+
+	// unique tokens, completed by several threads at once
+	const int numExchanges = 16000;
+	std::vector<std::vector<uint8_t> > tokens;
+	for(int i=0; i<numExchanges; i++) {
+		CU_ASSERT_EQUAL_FATAL(table.begin(&request,(struct sockaddr*)&address,sizeof(address),0,exchangeEnded,&result),0);
+		tokens.push_back(std::vector<uint8_t>(request.getTokenPointer(),request.getTokenPointer()+COAP_EXCHANGE_TOKEN_LENGTH));
+	}
+	CU_ASSERT_EQUAL_FATAL(table.getNumExchanges(),numExchanges);
+	std::vector<std::vector<uint8_t> > sorted(tokens);
+	std::sort(sorted.begin(),sorted.end());
+	CU_ASSERT_FATAL(std::adjacent_find(sorted.begin(),sorted.end())==sorted.end());
+	pthread_t threads[4];
+	ExchangeThread work[4];
+	for(int t=0; t<4; t++) {
+		work[t].table = &table;
+		work[t].tokens = &tokens;
+		work[t].first = t;
+		work[t].step = 4;
+		work[t].completed = 0;
+		CU_ASSERT_EQUAL_FATAL(pthread_create(&threads[t],NULL,exchangeComplete,&work[t]),0);
+	}
+	int completed = 0;
+	for(int t=0; t<4; t++) {
+		pthread_join(threads[t],NULL);
+		completed += work[t].completed;
+	}
+	CU_ASSERT_EQUAL_FATAL(completed,numExchanges);
+	CU_ASSERT_EQUAL_FATAL(result.responses,numExchanges+1);
+	CU_ASSERT_EQUAL_FATAL(table.getNumExchanges(),0);
+}
+
+void testMessageIDs() {
+	CoapMessageIDAllocator messageIDs(8000);
+	messageIDs.setSeed(1);
+	uint32_t now = 0xFFFFFFFF-3000;
+
+	// each peer counts up from its own random start
+	struct sockaddr_in a = observerAddress(5000);
+	struct sockaddr_in b = observerAddress(5001);
+	uint16_t firstA, firstB, messageID;
+	CU_ASSERT_EQUAL_FATAL(messageIDs.next((struct sockaddr*)&a,sizeof(a),now,&firstA),0);
+	CU_ASSERT_EQUAL_FATAL(messageIDs.next((struct sockaddr*)&b,sizeof(b),now,&firstB),0);
+	CU_ASSERT_FATAL(firstA!=firstB);
+	for(int i=1; i<100; i++) {
+		CU_ASSERT_EQUAL_FATAL(messageIDs.next((struct sockaddr*)&a,sizeof(a),now,&messageID),0);
+		CU_ASSERT_EQUAL_FATAL(messageID,(uint16_t)(firstA+i));
+	}
+	CU_ASSERT_EQUAL_FATAL(messageIDs.next((struct sockaddr*)&b,sizeof(b),now,&messageID),0);
+	CU_ASSERT_EQUAL_FATAL(messageID,(uint16_t)(firstB+1));
+	CU_ASSERT_EQUAL_FATAL(messageIDs.getNumPeers(),2);
+
+	// a peer that uses up the space is refused until the block it started in is older than the lifetime,
+	// across the wrap of the clock
+	int given = 2;
+	while(messageIDs.next((struct sockaddr*)&b,sizeof(b),now+given/30,&messageID)==0) {
+		CU_ASSERT_EQUAL_FATAL(messageID,(uint16_t)(firstB+given));
+		given++;
+	}
+	CU_ASSERT_EQUAL_FATAL(given,65536-(firstB&0xFFF));
+	CU_ASSERT_EQUAL_FATAL(messageIDs.next((struct sockaddr*)&b,sizeof(b),now+8999,&messageID),1);
+	CU_ASSERT_EQUAL_FATAL(messageIDs.next((struct sockaddr*)&b,sizeof(b),now+9000,&messageID),0);
+	CU_ASSERT_EQUAL_FATAL(messageID,(uint16_t)(firstB+given));
+	CU_ASSERT_EQUAL_FATAL(messageID&0xFFF,0);
+	now += 9000;
+
+	// idle peers are forgotten
+	CU_ASSERT_EQUAL_FATAL(messageIDs.expire(now),1);
+	CU_ASSERT_EQUAL_FATAL(messageIDs.getNumPeers(),1);
+	CU_ASSERT_EQUAL_FATAL(messageIDs.expire(now+9000),1);
+	CU_ASSERT_EQUAL_FATAL(messageIDs.getNumPeers(),0);
+
+	// many peers
+	now += 9000;
+	std::vector<uint16_t> first(5000);
+	for(int i=0; i<5000; i++) {
+		struct sockaddr_in address = observerAddress(10000+i);
+		CU_ASSERT_EQUAL_FATAL(messageIDs.next((struct sockaddr*)&address,sizeof(address),now,&first[i]),0);
+	}
+	CU_ASSERT_EQUAL_FATAL(messageIDs.getNumPeers(),5000);
+	for(int i=0; i<5000; i++) {
+		struct sockaddr_in address = observerAddress(10000+i);
+		CU_ASSERT_EQUAL_FATAL(messageIDs.next((struct sockaddr*)&address,sizeof(address),now,&messageID),0);
+		CU_ASSERT_EQUAL_FATAL(messageID,(uint16_t)(first[i]+1));
+	}
+	CU_ASSERT_EQUAL_FATAL(messageIDs.expire(now+9000),5000);
+}
+
+// a link between a client and a server with a fixed delay each way and random loss, in simulated milliseconds
+// that the layer sees as a 32 bit clock
+struct SimulatedLink {
+	uint64_t now;
+	uint32_t delay;
+	int lossPercent;
+	uint32_t random;
+	// delivery time, and whether the message is going to the server
+	std::multimap<uint64_t,std::pair<int,std::vector<uint8_t> > > inFlight;
+	struct sockaddr_in server;
+	CoapCongestionControl *congestion;
+	int transmissions;
+	int maxOutstanding;
+	int completed;
+	int timedOut;
+	uint16_t nextMessageID;
+};
+
+static void simulatedLinkSend(SimulatedLink *link, int toServer, const uint8_t *pdu, int pduLength) {
+	link->random ^= link->random<<13;
+	link->random ^= link->random>>17;
+	link->random ^= link->random<<5;
+	if((int)(link->random%100)<link->lossPercent) {
+		return;
+	}
+	link->inFlight.insert(std::make_pair(link->now+link->delay,std::make_pair(toServer,std::vector<uint8_t>(pdu,pdu+pduLength))));
+}
+
+static int simulatedClientSend(const uint8_t *pdu, int pduLength, const CoapEndpoint *endpoint, void *arg) {
+	SimulatedLink *link = (SimulatedLink*)arg;
+	int outstanding = link->congestion->getOutstanding(endpoint);
+	if(outstanding>link->maxOutstanding) {
+		link->maxOutstanding = outstanding;
+	}
+	link->transmissions++;
+	simulatedLinkSend(link,1,pdu,pduLength);
+	return 0;
+}
+
+static void simulatedClientTimeout(uint16_t messageID, const CoapEndpoint *endpoint, void *context, void *arg) {
+	(void)messageID;
+	(void)endpoint;
+	(void)context;
+	((SimulatedLink*)arg)->timedOut++;
+}
+
+// sends numMessages confirmable requests at once and runs the link until each has been answered or given up on
+static void runSimulatedLink(SimulatedLink *link, CoapReliableLayer *reliable, int numMessages) {
+	link->transmissions = 0;
+	link->maxOutstanding = 0;
+	link->completed = 0;
+	link->timedOut = 0;
+	CoapPDU pdu;
+	for(int i=0; i<numMessages; i++) {
+		reliableMessage(&pdu,CoapPDU::COAP_CONFIRMABLE,link->nextMessageID++);
+		pdu.setCode(CoapPDU::COAP_GET);
+		CU_ASSERT_EQUAL_FATAL(reliable->send(&pdu,(struct sockaddr*)&link->server,sizeof(link->server),(uint32_t)link->now,NULL),0);
+	}
+	uint64_t start = link->now;
+	while(link->completed+link->timedOut<numMessages&&link->now-start<10000000) {
+		link->now++;
+		while(!link->inFlight.empty()&&link->inFlight.begin()->first<=link->now) {
+			std::pair<int,std::vector<uint8_t> > message = link->inFlight.begin()->second;
+			link->inFlight.erase(link->inFlight.begin());
+			CoapPDU received(&message.second[0],message.second.size());
+			CU_ASSERT_EQUAL_FATAL(received.validate(),1);
+			if(message.first) {
+				// the server answers every copy with a piggybacked response
+				CoapPDU response;
+				CU_ASSERT_EQUAL_FATAL(response.makeResponse(&received,CoapPDU::COAP_CONTENT,received.getMessageID(),16),0);
+				response.setType(CoapPDU::COAP_ACKNOWLEDGEMENT);
+				simulatedLinkSend(link,0,response.getPDUPointer(),response.getPDULength());
+			} else {
+				void *context;
+				link->completed += reliable->receive(&received,(struct sockaddr*)&link->server,sizeof(link->server),
+					(uint32_t)link->now,&context);
+			}
+		}
+		reliable->advance((uint32_t)link->now);
+	}
+	CU_ASSERT_EQUAL_FATAL(link->completed+link->timedOut,numMessages);
+	CU_ASSERT_EQUAL_FATAL(reliable->getNumPending(),0);
+	CU_ASSERT_FATAL(link->maxOutstanding<=COAP_NSTART);
+}
+
+void testCongestion() {
+	CoapCongestionControl congestion;
+	struct sockaddr_in address = observerAddress(5683);
+	CoapEndpoint peer;
+	CU_ASSERT_EQUAL_FATAL(peer.set((struct sockaddr*)&address,sizeof(address)),0);
+
+	// NSTART, and the estimators
+	uint32_t rto;
+	CU_ASSERT_EQUAL_FATAL(congestion.getRTO(&peer),COAP_INITIAL_RTO_MS);
+	CU_ASSERT_EQUAL_FATAL(congestion.begin(&peer,0,&rto),0);
+	CU_ASSERT_EQUAL_FATAL(rto,COAP_INITIAL_RTO_MS);
+	CU_ASSERT_EQUAL_FATAL(congestion.begin(&peer,0,&rto),1);
+	CU_ASSERT_EQUAL_FATAL(congestion.getOutstanding(&peer),1);
+	// a strong estimate of 100+4*50, averaged with 2000
+	congestion.end(&peer,100,100,0);
+	CU_ASSERT_EQUAL_FATAL(congestion.getOutstanding(&peer),0);
+	CU_ASSERT_EQUAL_FATAL(congestion.getRTO(&peer),1150);
+	CU_ASSERT_EQUAL_FATAL(congestion.backoff(&peer,1150),2300);
+	// too many retransmissions to tell which transmission was answered
+	CU_ASSERT_EQUAL_FATAL(congestion.begin(&peer,100,&rto),0);
+	congestion.end(&peer,200,100,3);
+	CU_ASSERT_EQUAL_FATAL(congestion.getRTO(&peer),1150);
+	CU_ASSERT_EQUAL_FATAL(congestion.begin(&peer,200,&rto),0);
+	congestion.end(&peer,300,100,0);
+	CU_ASSERT_EQUAL_FATAL(congestion.getRTO(&peer),(100+4*37+1150)/2);
+	CU_ASSERT_EQUAL_FATAL(congestion.backoff(&peer,699),3*699);
+	// a weak estimate of 3000+1*1500 counts for a quarter
+	CU_ASSERT_EQUAL_FATAL(congestion.begin(&peer,300,&rto),0);
+	congestion.end(&peer,3300,3000,1);
+	CU_ASSERT_EQUAL_FATAL(congestion.getRTO(&peer),(4500+3*699)/4);
+	// an RTO below 1 s left alone for 16 times as long doubles, one above 3 s left for 4 times as long is pulled back
+	struct sockaddr_in other = observerAddress(5684);
+	CoapEndpoint fast;
+	CU_ASSERT_EQUAL_FATAL(fast.set((struct sockaddr*)&other,sizeof(other)),0);
+	for(int i=0; i<10; i++) {
+		CU_ASSERT_EQUAL_FATAL(congestion.begin(&fast,i,&rto),0);
+		congestion.end(&fast,i,10,0);
+	}
+	uint32_t fastRTO = congestion.getRTO(&fast);
+	CU_ASSERT_FATAL(fastRTO<100);
+	CU_ASSERT_EQUAL_FATAL(congestion.begin(&fast,9+16*fastRTO,&rto),0);
+	CU_ASSERT_EQUAL_FATAL(rto,fastRTO);
+	congestion.end(&fast,9+16*fastRTO,-1,COAP_MAX_RETRANSMIT);
+	CU_ASSERT_EQUAL_FATAL(congestion.begin(&fast,10+16*fastRTO,&rto),0);
+	CU_ASSERT_EQUAL_FATAL(rto,2*fastRTO);
+	CU_ASSERT_EQUAL_FATAL(congestion.getNumPeers(),2);
+	CU_ASSERT_EQUAL_FATAL(congestion.expire(20000,1000),1);
+	CU_ASSERT_EQUAL_FATAL(congestion.getNumPeers(),1);
+
+	// a good link: messages go one at a time, never retransmitted, and the RTO comes down to the round trip
+	SimulatedLink link;
+	link.now = 0xFFFFFFFF-10000;
+	link.delay = 25;
+	link.lossPercent = 0;
+	link.random = 1;
+	link.nextMessageID = 0;
+	link.server = observerAddress(6000);
+	CoapEndpoint server;
+	CU_ASSERT_EQUAL_FATAL(server.set((struct sockaddr*)&link.server,sizeof(link.server)),0);
+	CoapCongestionControl linkCongestion;
+	link.congestion = &linkCongestion;
+	CoapReliableLayer reliable(1000,simulatedClientSend,simulatedClientTimeout,&link);
+	reliable.setSeed(1);
+	reliable.setCongestionControl(&linkCongestion);
+	uint64_t start = link.now;
+	runSimulatedLink(&link,&reliable,30);
+	CU_ASSERT_EQUAL_FATAL(link.completed,30);
+	CU_ASSERT_EQUAL_FATAL(link.transmissions,30);
+	CU_ASSERT_EQUAL_FATAL(link.now-start,30*2*link.delay);
+	CU_ASSERT_FATAL(linkCongestion.getRTO(&server)<4*2*link.delay);
+
+	// a slow link: the first messages are retransmitted needlessly, until the RTO grows past the round trip
+	link.delay = 1600;
+	runSimulatedLink(&link,&reliable,10);
+	CU_ASSERT_EQUAL_FATAL(link.completed,10);
+	CU_ASSERT_FATAL(link.transmissions>10);
+	CU_ASSERT_FATAL(linkCongestion.getRTO(&server)>2*link.delay);
+	runSimulatedLink(&link,&reliable,10);
+	CU_ASSERT_EQUAL_FATAL(link.completed,10);
+	CU_ASSERT_EQUAL_FATAL(link.transmissions,10);
+
+	// a lossy link: everything is answered or given up on, still one message at a time
+	link.delay = 50;
+	link.lossPercent = 20;
+	runSimulatedLink(&link,&reliable,100);
+	CU_ASSERT_EQUAL_FATAL(link.completed+link.timedOut,100);
+	CU_ASSERT_FATAL(link.completed>=90);
+	CU_ASSERT_FATAL(link.transmissions>100);
+	CU_ASSERT_FATAL(linkCongestion.getRTO(&server)<COAP_INITIAL_RTO_MS);
+}
+
+struct ServerCapture {
+	CoapServer *server;
+	int handled;
+	int lastSocket;
+};
+
+// answers every request with a piggybacked 2.05
+static void serverHandler(CoapPDU *request, const CoapEndpoint *peer, int sockfd, void *arg) {
+	ServerCapture *capture = (ServerCapture*)arg;
+	capture->handled++;
+	capture->lastSocket = sockfd;
+	CoapInlinePDU<64> response;
+	CU_ASSERT_EQUAL_FATAL(response.makeResponse(request,CoapPDU::COAP_CONTENT,0,8),0);
+	CU_ASSERT_EQUAL_FATAL(response.setPayload((uint8_t*)"pong",4),0);
+	CU_ASSERT_EQUAL_FATAL(capture->server->send(sockfd,&response,peer),0);
+}
+
+// the port a socket was bound to
+static uint16_t boundPort(int sockfd) {
+	struct sockaddr_storage address;
+	socklen_t addressLength = sizeof(address);
+	CU_ASSERT_EQUAL_FATAL(getsockname(sockfd,(struct sockaddr*)&address,&addressLength),0);
+	if(address.ss_family==AF_INET6) {
+		return ntohs(((struct sockaddr_in6*)&address)->sin6_port);
+	}
+	return ntohs(((struct sockaddr_in*)&address)->sin_port);
+}
+
+// polls until the server has handled count messages, or a second passes without any
+static void pollServer(CoapServer *server, ServerCapture *capture, int count) {
+	while(capture->handled<count) {
+		CU_ASSERT_FATAL(server->poll(1000)>0);
+	}
+	CU_ASSERT_EQUAL_FATAL(server->poll(0),0);
+}
+
+void testServer() {
+	ServerCapture capture;
+	capture.handled = 0;
+	capture.lastSocket = -1;
+	CoapServer server(serverHandler,&capture);
+	capture.server = &server;
+	CU_ASSERT_FATAL(server.getFD()>=0);
+
+	// two ports on the IPv4 loopback, picked by the kernel
+	struct sockaddr_in address = observerAddress(0);
+	CU_ASSERT_EQUAL_FATAL(server.listen((struct sockaddr*)&address,sizeof(address)),0);
+	CU_ASSERT_EQUAL_FATAL(server.listen((struct sockaddr*)&address,sizeof(address)),0);
+	CU_ASSERT_EQUAL_FATAL(server.listen((struct sockaddr*)&address,sizeof(address)-1),1);
+	// and a socket opened elsewhere
+	int other = socket(AF_INET,SOCK_DGRAM,0);
+	CU_ASSERT_FATAL(other>=0);
+	CU_ASSERT_EQUAL_FATAL(bind(other,(struct sockaddr*)&address,sizeof(address)),0);
+	CU_ASSERT_EQUAL_FATAL(server.addSocket(other),0);
+	CU_ASSERT_EQUAL_FATAL(server.getNumSockets(),3);
+	CU_ASSERT_EQUAL_FATAL(server.getSocket(2),other);
+	CU_ASSERT_EQUAL_FATAL(server.getSocket(3),-1);
+	// IPv6 on the same port as the first, where the host has it
+	struct sockaddr_in6 address6;
+	memset(&address6,0x00,sizeof(address6));
+	address6.sin6_family = AF_INET6;
+	address6.sin6_port = htons(boundPort(server.getSocket(0)));
+	address6.sin6_addr = in6addr_loopback;
+	int numSockets = server.listen((struct sockaddr*)&address6,sizeof(address6))==0 ? 4 : 3;
+	CU_ASSERT_EQUAL_FATAL(server.getNumSockets(),numSockets);
+	CU_ASSERT_EQUAL_FATAL(server.poll(0),0);
+
+	CoapPDU request;
+	uint8_t token[2] = {0xCA,0xFE};
+	request.setVersion(1);
+	request.setType(CoapPDU::COAP_CONFIRMABLE);
+	request.setCode(CoapPDU::COAP_GET);
+	request.setToken(token,2);
+	request.setURI((char*)"/ping",5);
+	struct timeval timeout = {1,0};
+	uint8_t buffer[COAP_SERVER_MAX_PDU_LENGTH+1];
+	for(int i=0; i<numSockets; i++) {
+		int sockfd = server.getSocket(i);
+		uint16_t port = boundPort(sockfd);
+		int family = i<3 ? AF_INET : AF_INET6;
+		int client = socket(family,SOCK_DGRAM,0);
+		CU_ASSERT_FATAL(client>=0);
+		CU_ASSERT_EQUAL_FATAL(setsockopt(client,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout)),0);
+		struct sockaddr_storage to;
+		socklen_t toLength;
+		if(family==AF_INET) {
+			address.sin_port = htons(port);
+			memcpy(&to,&address,sizeof(address));
+			toLength = sizeof(address);
+		} else {
+			address6.sin6_port = htons(port);
+			memcpy(&to,&address6,sizeof(address6));
+			toLength = sizeof(address6);
+		}
+
+		// an empty datagram, garbage, and a datagram too long to receive whole, are dropped before the handler
+		int handled = capture.handled;
+		CU_ASSERT_EQUAL_FATAL(sendto(client,NULL,0,0,(struct sockaddr*)&to,toLength),0);
+		uint8_t garbage[3] = {0x00,0x01,0x02};
+		CU_ASSERT_EQUAL_FATAL(sendto(client,garbage,sizeof(garbage),0,(struct sockaddr*)&to,toLength),3);
+		memset(buffer,0x00,sizeof(buffer));
+		memcpy(buffer,request.getPDUPointer(),request.getPDULength());
+		buffer[request.getPDULength()] = 0xFF;
+		CU_ASSERT_EQUAL_FATAL(sendto(client,buffer,sizeof(buffer),0,(struct sockaddr*)&to,toLength),(ssize_t)sizeof(buffer));
+		pollServer(&server,&capture,handled);
+		CU_ASSERT_EQUAL_FATAL(capture.handled,handled);
+
+		// three requests in one batch, answered in order on the socket they came in on
+		for(int m=0; m<3; m++) {
+			request.setMessageID(0x1000*i+m);
+			CU_ASSERT_EQUAL_FATAL(sendto(client,request.getPDUPointer(),request.getPDULength(),0,(struct sockaddr*)&to,
+				toLength),request.getPDULength());
+		}
+		pollServer(&server,&capture,handled+3);
+		CU_ASSERT_EQUAL_FATAL(capture.handled,handled+3);
+		CU_ASSERT_EQUAL_FATAL(capture.lastSocket,sockfd);
+		for(int m=0; m<3; m++) {
+			ssize_t received = recv(client,buffer,sizeof(buffer),0);
+			CU_ASSERT_FATAL(received>0);
+			CoapPDU response(buffer,sizeof(buffer),received);
+			CU_ASSERT_EQUAL_FATAL(response.validate(),1);
+			CU_ASSERT_EQUAL_FATAL(response.getType(),CoapPDU::COAP_ACKNOWLEDGEMENT);
+			CU_ASSERT_EQUAL_FATAL(response.getCode(),CoapPDU::COAP_CONTENT);
+			CU_ASSERT_EQUAL_FATAL(response.getMessageID(),0x1000*i+m);
+			CU_ASSERT_EQUAL_FATAL(response.getTokenLength(),2);
+			CU_ASSERT_EQUAL_FATAL(memcmp(response.getTokenPointer(),token,2),0);
+			CU_ASSERT_EQUAL_FATAL(response.getPayloadLength(),4);
+			CU_ASSERT_EQUAL_FATAL(memcmp(response.getPayloadPointer(),"pong",4),0);
+		}
+		close(client);
+	}
+}
+
 int main(int argc, char **argv) {
 	#define DEBUG
 	//testBigRealloc();
@@ -628,6 +3025,26 @@ int main(int argc, char **argv) {
       return CU_get_error();
    }
 
+   if(!CU_add_test(pSuite, "Option iteration", testOptionIteration)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Option index", testOptionIndex)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Option validation", testOptionValidation)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Batch validation", testValidateBatch)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
    if(!CU_add_test(pSuite, "URI setting", testURISetting)) {
       CU_cleanup_registry();
       return CU_get_error();
@@ -638,12 +3055,117 @@ int main(int argc, char **argv) {
       return CU_get_error();
    }
 
+   if(!CU_add_test(pSuite, "URI parsing", testURIParsing)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
 	CU_pTest payloadTest = CU_add_test(pSuite, "Payload setting", testPayload);
    if(!payloadTest) {
       CU_cleanup_registry();
       return CU_get_error();
    }
 
+   if(!CU_add_test(pSuite, "Reserve", testReserve)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Builder", testBuilder)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Move and ownership transfer", testMove)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Slab allocator", testSlabAllocator)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Inline PDU", testInlinePDU)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Buffer reuse", testBufferReuse)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Payload reference", testPayloadReference)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Template", testTemplate)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Make response", testMakeResponse)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Option bitmap", testOptionBitmap)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Router", testRouter)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Static routes", testStaticRoutes)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Block transfer", testBlockTransfer)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Observe", testObserve)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Reliable messaging", testReliable)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Duplicate detection", testDedup)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Exchanges", testExchange)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Message ID allocation", testMessageIDs)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Congestion control", testCongestion)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if(!CU_add_test(pSuite, "Server", testServer)) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
 	CU_pTest bigReallocTest = CU_add_test(pSuite, "Big realloc", testBigRealloc);
    if(!payloadTest) {
       CU_cleanup_registry();